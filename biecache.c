@@ -0,0 +1,346 @@
+/*
+ * A cache of compressed planes, shared by the foo2* drivers for the -C
+ * option.
+ *
+ * The hash runs four independent 64 bit lanes over the rows, 32 bytes at
+ * a time, and the key keeps all four of them, along with the size and
+ * options as they are.  Two bitmaps are taken to be the same when all of
+ * that matches: with 256 bits of hash, that is far less likely to be
+ * wrong than the printer is.  Each row is hashed on its own, so the
+ * stride and the padding past it don't matter.  Blank bitmaps have keys
+ * of their own, with no hash at all.
+ *
+ * An entry holds the encoder output as it came, byte for byte and call
+ * for call, so replaying it gives output_jbig() exactly what it got the
+ * first time, whatever it does with it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "biecache.h"
+
+#define	NBUCKETS	1024
+
+#define	PRIME1		0x9E3779B185EBCA87ULL
+#define	PRIME2		0xC2B2AE3D27D4EB4FULL
+
+struct _BIECACHE_ENTRY
+{
+    BIECACHE_ENTRY	*hnext;		/* in the bucket */
+    BIECACHE_ENTRY	*prev, *next;	/* most recently used first */
+    BIECACHE_KEY	key;
+    unsigned char	*data;
+    size_t		len, size;
+    size_t		*calls;		/* bytes in each output call */
+    int			ncalls, maxcalls;
+    int			failed;		/* out of memory or too big */
+};
+
+struct _BIECACHE
+{
+    pthread_mutex_t	lock;
+    BIECACHE_ENTRY	*bucket[NBUCKETS];
+    BIECACHE_ENTRY	*first, *last;
+    size_t		bytes, maxbytes;
+};
+
+BIECACHE *
+biecache_create(size_t maxbytes)
+{
+    BIECACHE	*c;
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+	return NULL;
+    pthread_mutex_init(&c->lock, NULL);
+    c->maxbytes = maxbytes;
+    return c;
+}
+
+static void
+free_entry(BIECACHE_ENTRY *e)
+{
+    free(e->data);
+    free(e->calls);
+    free(e);
+}
+
+void
+biecache_destroy(BIECACHE *c)
+{
+    BIECACHE_ENTRY	*e, *next;
+
+    if (!c)
+	return;
+    for (e = c->first; e; e = next)
+    {
+	next = e->next;
+	free_entry(e);
+    }
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+static inline uint64_t
+rotl(uint64_t x, int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+static inline uint64_t
+round64(uint64_t acc, const unsigned char *p)
+{
+    uint64_t	v;
+
+    memcpy(&v, p, sizeof(v));
+    acc += v * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+}
+
+static void
+make_key(BIECACHE_KEY *key, const unsigned char *bitmap, size_t bpl,
+		int w, int h, const long *options, int noptions)
+{
+    size_t		rowlen = ((size_t) w + 7) / 8;
+    size_t		full = rowlen & ~(size_t) 31;
+    uint64_t		a = PRIME1, b = PRIME2, c = 0, d = -PRIME1;
+    unsigned char	tail[32];
+    int			y, i;
+    size_t		x;
+
+    for (y = 0; bitmap && y < h; ++y, bitmap += bpl)
+    {
+	for (x = 0; x < full; x += 32)
+	{
+	    a = round64(a, bitmap + x);
+	    b = round64(b, bitmap + x + 8);
+	    c = round64(c, bitmap + x + 16);
+	    d = round64(d, bitmap + x + 24);
+	}
+	if (x < rowlen)
+	{
+	    memset(tail, 0, sizeof(tail));
+	    memcpy(tail, bitmap + x, rowlen - x);
+	    a = round64(a, tail);
+	    b = round64(b, tail + 8);
+	    c = round64(c, tail + 16);
+	    d = round64(d, tail + 24);
+	}
+    }
+
+    memset(key, 0, sizeof(*key));
+    key->hash[0] = a;
+    key->hash[1] = b;
+    key->hash[2] = c;
+    key->hash[3] = d;
+    key->blank = !bitmap;
+    key->w = w;
+    key->h = h;
+    if (noptions > BIECACHE_MAXOPTIONS)
+	noptions = BIECACHE_MAXOPTIONS;
+    key->noptions = noptions;
+    for (i = 0; i < noptions; ++i)
+	key->options[i] = options[i];
+}
+
+static int
+same_key(const BIECACHE_KEY *k1, const BIECACHE_KEY *k2)
+{
+    int		i;
+
+    if (k1->hash[0] != k2->hash[0] || k1->hash[1] != k2->hash[1]
+	    || k1->hash[2] != k2->hash[2] || k1->hash[3] != k2->hash[3]
+	    || k1->blank != k2->blank
+	    || k1->w != k2->w || k1->h != k2->h
+	    || k1->noptions != k2->noptions)
+	return 0;
+    for (i = 0; i < k1->noptions; ++i)
+	if (k1->options[i] != k2->options[i])
+	    return 0;
+    return 1;
+}
+
+static BIECACHE_ENTRY **
+bucket(BIECACHE *c, const BIECACHE_KEY *key)
+{
+    return &c->bucket[(key->hash[0] ^ key->hash[2]) % NBUCKETS];
+}
+
+static BIECACHE_ENTRY *
+find(BIECACHE *c, const BIECACHE_KEY *key)
+{
+    BIECACHE_ENTRY	*e;
+
+    for (e = *bucket(c, key); e; e = e->hnext)
+	if (same_key(&e->key, key))
+	    return e;
+    return NULL;
+}
+
+static void
+unlink_lru(BIECACHE *c, BIECACHE_ENTRY *e)
+{
+    if (e->prev)
+	e->prev->next = e->next;
+    else
+	c->first = e->next;
+    if (e->next)
+	e->next->prev = e->prev;
+    else
+	c->last = e->prev;
+}
+
+static void
+link_lru(BIECACHE *c, BIECACHE_ENTRY *e)
+{
+    e->prev = NULL;
+    e->next = c->first;
+    if (c->first)
+	c->first->prev = e;
+    else
+	c->last = e;
+    c->first = e;
+}
+
+static void
+evict(BIECACHE *c, BIECACHE_ENTRY *e)
+{
+    BIECACHE_ENTRY	**pe;
+
+    for (pe = bucket(c, &e->key); *pe != e; pe = &(*pe)->hnext)
+	;
+    *pe = e->hnext;
+    unlink_lru(c, e);
+    c->bytes -= e->len;
+    free_entry(e);
+}
+
+/*
+ * The encoder output callback while recording a miss.
+ */
+static void
+record(unsigned char *start, size_t len, void *arg)
+{
+    BIECACHE_REC	*rec = arg;
+    BIECACHE_ENTRY	*e = rec->e;
+
+    if (e && !e->failed)
+    {
+	if (e->len + len > rec->c->maxbytes)
+	    e->failed = 1;
+	else if (e->len + len > e->size)
+	{
+	    size_t		size = (e->size + len) * 2;
+	    unsigned char	*p;
+
+	    if (size > rec->c->maxbytes)
+		size = rec->c->maxbytes;
+	    p = realloc(e->data, size);
+	    if (p)
+	    {
+		e->data = p;
+		e->size = size;
+	    }
+	    else
+		e->failed = 1;
+	}
+	if (!e->failed && e->ncalls == e->maxcalls)
+	{
+	    int		maxcalls = e->maxcalls ? e->maxcalls * 2 : 16;
+	    size_t	*p = realloc(e->calls, maxcalls * sizeof(*p));
+
+	    if (p)
+	    {
+		e->calls = p;
+		e->maxcalls = maxcalls;
+	    }
+	    else
+		e->failed = 1;
+	}
+	if (!e->failed)
+	{
+	    memcpy(e->data + e->len, start, len);
+	    e->len += len;
+	    e->calls[e->ncalls++] = len;
+	}
+    }
+    (*rec->out)(start, len, rec->arg);
+}
+
+int
+biecache_lookup(BIECACHE *c, BIECACHE_REC *rec,
+		const unsigned char *bitmap, size_t bpl, int w, int h,
+		const long *options, int noptions,
+		BIECACHE_OUT *out, void **arg)
+{
+    BIECACHE_ENTRY	*e;
+
+    rec->c = c;
+    rec->e = NULL;
+    if (!c)
+	return 0;
+
+    make_key(&rec->key, bitmap, bpl, w, h, options, noptions);
+
+    // Replay under the lock, so the entry can't be dropped meanwhile
+    pthread_mutex_lock(&c->lock);
+    e = find(c, &rec->key);
+    if (e)
+    {
+	unsigned char	*p = e->data;
+	int		i;
+
+	unlink_lru(c, e);
+	link_lru(c, e);
+	for (i = 0; i < e->ncalls; ++i)
+	{
+	    (**out)(p, e->calls[i], *arg);
+	    p += e->calls[i];
+	}
+	pthread_mutex_unlock(&c->lock);
+	return 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    rec->out = *out;
+    rec->arg = *arg;
+    rec->e = calloc(1, sizeof(*rec->e));
+    *out = record;
+    *arg = rec;
+    return 0;
+}
+
+void
+biecache_done(BIECACHE_REC *rec)
+{
+    BIECACHE		*c = rec->c;
+    BIECACHE_ENTRY	*e = rec->e, **pe;
+
+    if (!e)
+	return;
+    rec->e = NULL;
+    e->key = rec->key;
+
+    pthread_mutex_lock(&c->lock);
+    // Another thread may have put the same bitmap in meanwhile
+    if (e->failed || find(c, &e->key))
+    {
+	pthread_mutex_unlock(&c->lock);
+	free_entry(e);
+	return;
+    }
+    while (c->last && c->bytes + e->len > c->maxbytes)
+	evict(c, c->last);
+    pe = bucket(c, &e->key);
+    e->hnext = *pe;
+    *pe = e;
+    link_lru(c, e);
+    c->bytes += e->len;
+    pthread_mutex_unlock(&c->lock);
+}
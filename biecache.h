@@ -0,0 +1,90 @@
+/*
+ * A cache of compressed planes, shared by the foo2* drivers for the -C
+ * option.
+ *
+ * Forms, letterheads and multiple copies come out of Ghostscript as the
+ * very same raster, page after page.  Instead of running the JBIG encoder
+ * on each of them, the encoder output for a bitmap is kept, keyed by a
+ * hash of the bitmap together with its size and the encoder options,
+ * and handed to the driver's output_jbig() again when the same bitmap
+ * comes back.  The driver builds its BIE_CHAIN from that just as if the
+ * encoder had produced it, in the same pieces.
+ *
+ * A driver wraps each encode like this; with a NULL cache, lookup always
+ * misses and leaves out and arg alone, so the code is the same either way:
+ *
+ *	BIECACHE_OUT	out = output_jbig;
+ *	void		*arg = &chain;
+ *	BIECACHE_REC	rec;
+ *
+ *	if (!biecache_lookup(Cache, &rec, bitmap, bpl, w, h,
+ *				JbgOptions, 5, &out, &arg))
+ *	{
+ *	    jbg_enc_init(&se, w, h, 1, bitmaps, out, arg);
+ *	    ...
+ *	    biecache_done(&rec);
+ *	}
+ *
+ * The least recently used entries are dropped to stay within the size
+ * given.  All of this is thread-safe.
+ */
+
+#ifndef BIECACHE_H
+#define BIECACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define	BIECACHE_MAXOPTIONS	5
+
+typedef void (*BIECACHE_OUT)(unsigned char *start, size_t len, void *arg);
+
+typedef struct _BIECACHE BIECACHE;
+typedef struct _BIECACHE_ENTRY BIECACHE_ENTRY;
+
+typedef struct
+{
+    uint64_t		hash[4];
+    int			blank;
+    int			w, h;
+    int			noptions;
+    long		options[BIECACHE_MAXOPTIONS];
+} BIECACHE_KEY;
+
+/*
+ * What biecache_lookup() needs to remember about a miss, while the
+ * encoder runs.  Its contents are private.
+ */
+typedef struct
+{
+    BIECACHE		*c;
+    BIECACHE_KEY	key;
+    BIECACHE_OUT	out;
+    void		*arg;
+    BIECACHE_ENTRY	*e;
+} BIECACHE_REC;
+
+/*
+ * Create a cache of up to maxbytes of compressed data.  Returns NULL if
+ * out of memory.
+ */
+BIECACHE	*biecache_create(size_t maxbytes);
+void		biecache_destroy(BIECACHE *c);
+
+/*
+ * Look up the bitmap of h rows of w pixels, bpl bytes apart, as encoded
+ * with the noptions options.  On a hit, the encoder output is replayed
+ * to (*out)(..., *arg) and 1 is returned.  On a miss, *out and *arg are
+ * changed to record the output on its way to the old ones, and 0 is
+ * returned; biecache_done() then puts it into the cache.
+ *
+ * A NULL bitmap stands for a blank one, which the caller already knows
+ * to be blank, having found no dots in it; it is not looked at at all.
+ */
+int		biecache_lookup(BIECACHE *c, BIECACHE_REC *rec,
+			const unsigned char *bitmap, size_t bpl, int w, int h,
+			const long *options, int noptions,
+			BIECACHE_OUT *out, void **arg);
+void		biecache_done(BIECACHE_REC *rec);
+
+#endif
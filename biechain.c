@@ -0,0 +1,203 @@
+/*
+ * A linked list of compressed data, as built by the output_jbig()
+ * callbacks of the foo2* drivers.
+ *
+ * Freed nodes go on one free list.  Freed data blocks go on a free list
+ * per block size; each driver only ever uses two or three sizes (the
+ * 20 byte BIH and its fixed chunk size).  At most POOLMAX bytes of
+ * blocks are kept, anything beyond that goes back to malloc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "biechain.h"
+#include "stats.h"
+
+#define	NCLASS	8
+#define	POOLMAX	(64 * 1024 * 1024)
+#define	NIOV	64
+
+typedef struct _FREEBLOCK
+{
+    struct _FREEBLOCK	*next;
+} FREEBLOCK;
+
+static pthread_mutex_t	Lock = PTHREAD_MUTEX_INITIALIZER;
+static BIE_CHAIN	*FreeNodes;
+static struct
+{
+    size_t		size;
+    FREEBLOCK		*head;
+} FreeBlocks[NCLASS];
+static size_t		PoolBytes;
+
+BIE_CHAIN *
+bie_alloc(void)
+{
+    BIE_CHAIN	*node;
+
+    pthread_mutex_lock(&Lock);
+    node = FreeNodes;
+    if (node)
+	FreeNodes = node->next;
+    pthread_mutex_unlock(&Lock);
+
+    if (!node)
+    {
+	node = malloc(sizeof(BIE_CHAIN));
+	stats_alloc();
+    }
+    if (node)
+    {
+	node->data = NULL;
+	node->len = 0;
+	node->next = NULL;
+	node->size = 0;
+    }
+    return node;
+}
+
+unsigned char *
+bie_block(size_t size)
+{
+    FREEBLOCK	*blk = NULL;
+    int		i;
+
+    pthread_mutex_lock(&Lock);
+    for (i = 0; i < NCLASS; ++i)
+	if (FreeBlocks[i].size == size && FreeBlocks[i].head)
+	{
+	    blk = FreeBlocks[i].head;
+	    FreeBlocks[i].head = blk->next;
+	    PoolBytes -= size;
+	    break;
+	}
+    pthread_mutex_unlock(&Lock);
+
+    if (blk)
+	return (unsigned char *) blk;
+    stats_alloc();
+    return malloc(size < sizeof(FREEBLOCK) ? sizeof(FREEBLOCK) : size);
+}
+
+/*
+ * Put a data block on the free list for its size.  Called with the lock
+ * held.  Returns 0 if the block should be freed instead.
+ */
+static int
+keep_block(unsigned char *data, size_t size)
+{
+    FREEBLOCK	*blk = (FREEBLOCK *) data;
+    int		i;
+
+    if (size < sizeof(FREEBLOCK) || PoolBytes + size > POOLMAX)
+	return 0;
+    for (i = 0; i < NCLASS; ++i)
+	if (FreeBlocks[i].size == size || FreeBlocks[i].head == NULL)
+	    break;
+    if (i == NCLASS)
+	return 0;
+
+    FreeBlocks[i].size = size;
+    blk->next = FreeBlocks[i].head;
+    FreeBlocks[i].head = blk;
+    PoolBytes += size;
+    return 1;
+}
+
+void
+free_chain(BIE_CHAIN *chain)
+{
+    BIE_CHAIN	*next;
+
+    pthread_mutex_lock(&Lock);
+    next = chain;
+    while ((chain = next))
+    {
+	next = chain->next;
+	if (chain->data && !keep_block(chain->data, chain->size))
+	    free(chain->data);
+	chain->next = FreeNodes;
+	FreeNodes = chain;
+    }
+    pthread_mutex_unlock(&Lock);
+}
+
+/*
+ * writev() all of iov, retrying after partial writes.
+ */
+static int
+writev_all(int fd, struct iovec *iov, int n)
+{
+    while (n > 0)
+    {
+	ssize_t	rc = writev(fd, iov, n);
+
+	if (rc < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return EOF;
+	}
+	while (n > 0 && (size_t) rc >= iov->iov_len)
+	{
+	    rc -= iov->iov_len;
+	    ++iov;
+	    --n;
+	}
+	if (n > 0)
+	{
+	    iov->iov_base = (char *) iov->iov_base + rc;
+	    iov->iov_len -= rc;
+	}
+    }
+    return 0;
+}
+
+int
+bie_write(BIE_CHAIN *chain, FILE *fp)
+{
+    struct iovec	iov[NIOV];
+    int			n = 0;
+    int			fd = fileno(fp);
+
+    /*
+     * Only bypass stdio when fp can't seek: on a regular file, writing
+     * behind its back would confuse a later ftell().
+     */
+    if (fd < 0 || lseek(fd, 0, SEEK_CUR) != -1 || errno != ESPIPE)
+    {
+	for (; chain; chain = chain->next)
+	    if (chain->len
+		&& fwrite(chain->data, 1, chain->len, fp) != chain->len)
+		return EOF;
+	return 0;
+    }
+
+    if (fflush(fp) == EOF)
+	return EOF;
+    for (; chain; chain = chain->next)
+    {
+	if (!chain->len)
+	    continue;
+	iov[n].iov_base = chain->data;
+	iov[n].iov_len = chain->len;
+	if (++n == NIOV)
+	{
+	    if (writev_all(fd, iov, n) == EOF)
+		return EOF;
+	    n = 0;
+	}
+    }
+    if (n && writev_all(fd, iov, n) == EOF)
+	return EOF;
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * A linked list of compressed data, as built by the output_jbig()
+ * callbacks of the foo2* drivers.
+ *
+ * The nodes and data blocks of a freed chain are kept for the next plane
+ * or page, instead of being returned to malloc, so a long job settles
+ * into reusing the same few megabytes.  All of this is thread-safe.
+ */
+
+#ifndef BIECHAIN_H
+#define BIECHAIN_H
+
+#include <stdio.h>
+
+typedef struct _BIE_CHAIN{
+    unsigned char	*data;
+    size_t		len;
+    struct _BIE_CHAIN	*next;
+    size_t		size;		/* bytes allocated at data */
+} BIE_CHAIN;
+
+/*
+ * bie_alloc() returns an empty node (no data, len 0, no next), and
+ * bie_block() a data block of size bytes.  Both return NULL when out of
+ * memory.  free_chain() gives back a whole chain, nodes and blocks.
+ */
+BIE_CHAIN	*bie_alloc(void);
+unsigned char	*bie_block(size_t size);
+void		free_chain(BIE_CHAIN *chain);
+
+/*
+ * Write the data of every node of chain to fp, back to back.  When fp is
+ * a pipe or device, the blocks go out with writev() straight from the
+ * chain.  Returns 0, or EOF on a write error.
+ */
+int		bie_write(BIE_CHAIN *chain, FILE *fp);
+
+#endif
@@ -0,0 +1,319 @@
+/*
+ * Parallel decoding of the JBIG images in a printer stream, shared by
+ * the *decode tools for the -d option.
+ *
+ * The compressed data is copied as it is queued, since the input it
+ * comes from may be gone by the time it is decoded.  That is all that is
+ * kept for a batch: each job decodes one BIE at a time, so the images in
+ * memory are at most one per thread.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jbig.h"
+#include "biedec.h"
+
+#define	FILES_PER_JOB	4	/* queue this many files per job, at least */
+
+struct _BIEDEC_BIE
+{
+    BIEDEC_BIE		*next;		/* of the same file */
+    unsigned char	bih[20];
+    size_t		bihlen;
+    unsigned char	*data;
+    size_t		len, size;
+    int			format;
+    int			incr;
+    int			stripe;		/* -1 to append */
+    int			wb;
+    int			setheight;
+};
+
+typedef struct
+{
+    char		*name;
+    BIEDEC_BIE		*first, *last;
+} OUTFILE;
+
+struct _BIEDEC
+{
+    WORKPOOL		*pool;
+    int			njobs;
+    OUTFILE		*file;
+    int			nfiles;
+    int			size;		/* of file */
+};
+
+BIEDEC *
+biedec_create(WORKPOOL *pool, int njobs)
+{
+    BIEDEC	*q;
+
+    q = calloc(1, sizeof(*q));
+    if (!q)
+	return NULL;
+    q->pool = pool;
+    q->njobs = (njobs < 1) ? 1 : njobs;
+    return q;
+}
+
+void
+biedec_destroy(BIEDEC *q)
+{
+    if (!q)
+	return;
+    biedec_sync(q, 1);
+    free(q->file);
+    free(q);
+}
+
+static OUTFILE *
+outfile(BIEDEC *q, const char *name)
+{
+    OUTFILE	*f;
+    int		i;
+
+    // The file wanted is nearly always one of the last few
+    for (i = q->nfiles - 1; i >= 0; --i)
+	if (strcmp(q->file[i].name, name) == 0)
+	    return &q->file[i];
+
+    if (q->nfiles == q->size)
+    {
+	int	size = q->size ? q->size * 2 : 64;
+
+	f = realloc(q->file, size * sizeof(*f));
+	if (!f)
+	    return NULL;
+	q->file = f;
+	q->size = size;
+    }
+    f = &q->file[q->nfiles];
+    f->name = strdup(name);
+    if (!f->name)
+	return NULL;
+    f->first = f->last = NULL;
+    ++q->nfiles;
+    return f;
+}
+
+BIEDEC_BIE *
+biedec_start(BIEDEC *q, const char *name, int format, int incr,
+		const unsigned char *bih, size_t bihlen, int *rc)
+{
+    struct jbg_dec_state	s;
+    OUTFILE			*f;
+    BIEDEC_BIE			*b;
+    size_t			cnt;
+
+    // Only the verdict on the BIH is wanted now; the rest is for later
+    jbg_dec_init(&s);
+    *rc = jbg_dec_in(&s, bih, bihlen, &cnt);
+    jbg_dec_free(&s);
+
+    if (bihlen > sizeof(b->bih))
+	bihlen = sizeof(b->bih);
+    f = outfile(q, name);
+    if (!f)
+	return NULL;
+    b = calloc(1, sizeof(*b));
+    if (!b)
+	return NULL;
+    memcpy(b->bih, bih, bihlen);
+    b->bihlen = bihlen;
+    b->format = format;
+    b->incr = incr;
+    b->stripe = -1;
+
+    if (f->last)
+	f->last->next = b;
+    else
+	f->first = b;
+    f->last = b;
+    return b;
+}
+
+int
+biedec_data(BIEDEC_BIE *b, const unsigned char *data, size_t len)
+{
+    if (b->len + len > b->size)
+    {
+	size_t		size = (b->size + len) * 2;
+	unsigned char	*p = realloc(b->data, size);
+
+	if (!p)
+	    return -1;
+	b->data = p;
+	b->size = size;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+void
+biedec_stripe(BIEDEC_BIE *b, int stripe, int wb)
+{
+    b->stripe = stripe;
+    b->wb = wb;
+}
+
+void
+biedec_setheight(BIEDEC_BIE *b)
+{
+    b->setheight = 1;
+}
+
+/*
+ * Write the image of 2 bit pixels as one byte per pixel, black as 0.
+ */
+static void
+write_gray(FILE *fp, const unsigned char *image, size_t len)
+{
+    unsigned char	gray[4 * 1024];
+    size_t		i, n = 0;
+    int			g;
+
+    for (i = 0; i < len; ++i)
+    {
+	g = image[i];
+	gray[n++] = ~(g >> 6) & 3;
+	gray[n++] = ~(g >> 4) & 3;
+	gray[n++] = ~(g >> 2) & 3;
+	gray[n++] = ~(g >> 0) & 3;
+	if (n == sizeof(gray))
+	{
+	    fwrite(gray, 1, n, fp);
+	    n = 0;
+	}
+    }
+    fwrite(gray, 1, n, fp);
+}
+
+/*
+ * Decode one BIE and put it into the file.
+ */
+static void
+decode_bie(OUTFILE *f, BIEDEC_BIE *b, FILE **fpp, int *count)
+{
+    struct jbg_dec_state	s;
+    FILE			*fp = *fpp;
+    unsigned char		*image;
+    size_t			cnt, len;
+    int				rc, w, h;
+
+    if (b->len == 0)
+	return;
+    jbg_dec_init(&s);
+    rc = jbg_dec_in(&s, b->bih, b->bihlen, &cnt);
+    if (rc == JBG_EAGAIN)
+	rc = jbg_dec_in(&s, b->data, b->len, &cnt);
+    if (rc != JBG_EOK)
+    {
+	jbg_dec_free(&s);
+	return;
+    }
+
+    h = jbg_dec_getheight(&s);
+    w = jbg_dec_getwidth(&s);
+    image = jbg_dec_getimage(&s, 0);
+    len = jbg_dec_getsize(&s);
+    if (!image)
+    {
+	fprintf(stderr, "Missing image %dx%d!\n", h, w);
+	jbg_dec_free(&s);
+	return;
+    }
+
+    // A count of 0 starts the file over
+    if (*count == 0 && fp)
+    {
+	fclose(fp);
+	fp = NULL;
+    }
+    if (!fp)
+	fp = fopen(f->name, "w");
+    if (fp)
+    {
+	if (b->stripe >= 0)
+	{
+	    fseek(fp, 0, SEEK_SET);
+	    fprintf(fp, "P4\n%8d %8d\n", w, h * b->stripe);
+	    fseek(fp, (long) b->stripe * h * b->wb, SEEK_CUR);
+	    fwrite(image, 1, len, fp);
+	    *count += 1;
+	}
+	else
+	{
+	    fseek(fp, 0, SEEK_END);
+	    if (*count == 0)
+	    {
+		if (b->format == BIEDEC_PGM)
+		    fprintf(fp, "P5\n%8d %8d 3\n", w/2, h);
+		else
+		    fprintf(fp, "P4\n%8d %8d\n", w, h);
+	    }
+	    if (b->format == BIEDEC_PGM)
+		write_gray(fp, image, len);
+	    else
+		fwrite(image, 1, len, fp);
+	    *count += b->incr;
+	}
+    }
+    *fpp = fp;
+    jbg_dec_free(&s);
+}
+
+static void
+decode_file(void *arg, int job)
+{
+    OUTFILE	*f = (OUTFILE *) arg + job;
+    BIEDEC_BIE	*b;
+    FILE	*fp = NULL;
+    int		count = 0;
+
+    for (b = f->first; b; b = b->next)
+    {
+	decode_bie(f, b, &fp, &count);
+	if (b->setheight && fp)
+	{
+	    fseek(fp, 12, SEEK_SET);
+	    fprintf(fp, "%8d", count);
+	}
+    }
+    if (fp)
+	fclose(fp);
+}
+
+void
+biedec_sync(BIEDEC *q, int force)
+{
+    BIEDEC_BIE	*b, *next;
+    int		i;
+
+    if (q->nfiles == 0)
+	return;
+    if (!force && q->nfiles < FILES_PER_JOB * q->njobs)
+	return;
+
+    workpool_run((q->njobs > 1) ? q->pool : NULL, q->nfiles,
+		decode_file, q->file);
+
+    for (i = 0; i < q->nfiles; ++i)
+    {
+	for (b = q->file[i].first; b; b = next)
+	{
+	    next = b->next;
+	    free(b->data);
+	    free(b);
+	}
+	free(q->file[i].name);
+    }
+    q->nfiles = 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Parallel decoding of the JBIG images in a printer stream, shared by
+ * the *decode tools for the -d option.
+ *
+ * While a decoder walks the stream and prints its records, it only
+ * queues the BIEs it finds: biedec_start() with the BIH and the name of
+ * the output file, then biedec_data() with each piece of compressed data
+ * as it comes along.  At each page boundary it calls biedec_sync(); once
+ * enough output files are queued, they are decoded on a WORKPOOL, one
+ * file per job, each written from start to end in one go.
+ *
+ * The BIEs of one file are decoded in the order they were queued, so the
+ * bands and stripes of a plane are put together as they always were.
+ * Files do not depend on each other, so the output is the same for any
+ * number of threads.
+ */
+
+#ifndef BIEDEC_H
+#define BIEDEC_H
+
+#include <stddef.h>
+#include "workpool.h"
+
+#define	BIEDEC_PBM	0	/* 1 bit black and white, as P4 */
+#define	BIEDEC_PGM	1	/* 2 bit black, as P5 with maxval 3 */
+
+typedef struct _BIEDEC BIEDEC;
+typedef struct _BIEDEC_BIE BIEDEC_BIE;
+
+/*
+ * Create a queue that decodes on njobs jobs of pool.  biedec_destroy()
+ * first decodes whatever is still queued.
+ */
+BIEDEC		*biedec_create(WORKPOOL *pool, int njobs);
+void		biedec_destroy(BIEDEC *q);
+
+/*
+ * Queue a BIE with the bihlen bytes of header at bih, to be written to
+ * the file name in format.  *rc is what jbg_dec_in() makes of the BIH,
+ * so that a decoder can give up on JBG_EIMPL right away.  Returns NULL
+ * if out of memory.  A BIE stays valid until the next biedec_sync().
+ *
+ * Each file keeps a count of rows, which starts at 0.  By default a BIE
+ * is appended to its file, after a header with its own size if the
+ * count is 0 (otherwise the file is started over), and the count then
+ * goes up by incr.
+ */
+BIEDEC_BIE	*biedec_start(BIEDEC *q, const char *name, int format,
+			int incr, const unsigned char *bih, size_t bihlen,
+			int *rc);
+
+/*
+ * Add len bytes of compressed data to the BIE.  Anything after the end
+ * of the BIE is ignored.  Returns 0, or -1 if out of memory.
+ */
+int		biedec_data(BIEDEC_BIE *b, const unsigned char *data,
+			size_t len);
+
+/*
+ * Write the BIE as stripe number stripe, of rows wb bytes wide, in place
+ * instead: the header is rewritten for stripe stripes and the count goes
+ * up by one.
+ */
+void		biedec_stripe(BIEDEC_BIE *b, int stripe, int wb);
+
+/*
+ * Once the BIE is written, put the count of rows into the file header.
+ */
+void		biedec_setheight(BIEDEC_BIE *b);
+
+/*
+ * Mark a page boundary: no BIE queued so far gets more data.  Decode the
+ * queued files if there are enough of them to keep the threads busy, or
+ * in any case if force is set.
+ */
+void		biedec_sync(BIEDEC *q, int force);
+
+#endif
@@ -0,0 +1,282 @@
+/*
+ * Splitter for Ghostscript bitcmyk rasters, shared by the foo2* drivers.
+ *
+ * The scalar path uses a 256 entry table that maps one bitcmyk byte
+ * (two pixels) to two bits in each of the four output planes, so that
+ * four input bytes (eight pixels) become one output byte per plane with
+ * four lookups.  AllIsBlack and BlackClears are folded into the table.
+ *
+ * When the compiler targets SSE2 or AVX2, 16 or 32 input bytes at a time
+ * are expanded to one pixel per byte, the -A/-B rules are applied with
+ * compares, and each plane is gathered with a single movemask.  Build with
+ * CFLAGS="-O2 -march=native" to get the AVX2 path on capable machines.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <string.h>
+#include "bitcmyk.h"
+#include "dots.h"
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+/*
+ * SplitLut[byte]: plane p (0=C, 1=M, 2=Y, 3=K) gets the left pixel in
+ * bit 8*p+1 and the right pixel in bit 8*p.
+ *
+ * ColorLut[byte]: surviving C/M/Y bits of either pixel, in both nibbles.
+ */
+static unsigned int	SplitLut[256];
+static unsigned char	ColorLut[256];
+static int		LutAib = -1;
+static int		LutBc = -1;
+
+static int
+normalize(int nibble, int aib, int bc)
+{
+    if (aib && (nibble & 0xE) == 0xE)
+	return 0x1;
+    if (bc && (nibble & 0x1))
+	return 0x1;
+    return nibble;
+}
+
+static void
+build_luts(int aib, int bc)
+{
+    int		b, p;
+
+    for (b = 0; b < 256; ++b)
+    {
+	int		left = normalize(b >> 4, aib, bc);
+	int		right = normalize(b & 15, aib, bc);
+	unsigned int	v = 0;
+	int		c;
+
+	for (p = 0; p < 4; ++p)
+	{
+	    int	bit = 8 >> p;
+
+	    if (left & bit)
+		v |= 2U << (8*p);
+	    if (right & bit)
+		v |= 1U << (8*p);
+	}
+	SplitLut[b] = v;
+
+	c = (left | right) & 0xE;
+	ColorLut[b] = c | (c << 4);
+    }
+    LutAib = aib;
+    LutBc = bc;
+}
+
+#if defined(__AVX2__)
+/*
+ * Apply -A/-B to 32 pixels (one per byte), accumulate the surviving color,
+ * and reverse each group of 8 pixels so that movemask yields MSB-first bytes.
+ */
+static __m256i
+split_pixels(__m256i p, __m256i aibv, __m256i bcv, __m256i *any)
+{
+    const __m256i	revmask = _mm256_setr_epi8(
+				7, 6, 5, 4, 3, 2, 1, 0,
+				15, 14, 13, 12, 11, 10, 9, 8,
+				7, 6, 5, 4, 3, 2, 1, 0,
+				15, 14, 13, 12, 11, 10, 9, 8);
+    __m256i		one = _mm256_set1_epi8(0x01);
+    __m256i		cmy = _mm256_set1_epi8(0x0E);
+    __m256i		clr;
+
+    clr = _mm256_or_si256(
+	    _mm256_and_si256(_mm256_cmpeq_epi8(
+				_mm256_and_si256(p, cmy), cmy), aibv),
+	    _mm256_and_si256(_mm256_cmpeq_epi8(
+				_mm256_and_si256(p, one), one), bcv));
+    p = _mm256_or_si256(_mm256_andnot_si256(clr, p),
+			_mm256_and_si256(clr, one));
+    *any = _mm256_or_si256(*any, _mm256_and_si256(p, cmy));
+    return _mm256_shuffle_epi8(p, revmask);
+}
+#elif defined(__SSE2__)
+/*
+ * Apply -A/-B to 16 pixels (one per byte), accumulate the surviving color,
+ * and reverse each group of 8 pixels so that movemask yields MSB-first bytes.
+ */
+static __m128i
+split_pixels(__m128i p, __m128i aibv, __m128i bcv, __m128i *any)
+{
+    __m128i		one = _mm_set1_epi8(0x01);
+    __m128i		cmy = _mm_set1_epi8(0x0E);
+    __m128i		clr;
+
+    clr = _mm_or_si128(
+	    _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(p, cmy), cmy), aibv),
+	    _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(p, one), one), bcv));
+    p = _mm_or_si128(_mm_andnot_si128(clr, p), _mm_and_si128(clr, one));
+    *any = _mm_or_si128(*any, _mm_and_si128(p, cmy));
+    p = _mm_shufflelo_epi16(p, _MM_SHUFFLE(0, 1, 2, 3));
+    p = _mm_shufflehi_epi16(p, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_or_si128(_mm_slli_epi16(p, 8), _mm_srli_epi16(p, 8));
+}
+#endif
+
+int
+bitcmyk_split(unsigned char *plane[4], int bpl,
+		unsigned char *raw, int rawbpl, int h,
+		int allIsBlack, int blackClears, unsigned long dots[4])
+{
+    return bitcmyk_split_stride(plane, bpl, raw, rawbpl, rawbpl, h,
+				allIsBlack, blackClears, dots);
+}
+
+int
+bitcmyk_split_stride(unsigned char *plane[4], int bpl,
+		unsigned char *raw, int rawbpl, int rawstride, int h,
+		int allIsBlack, int blackClears, unsigned long dots[4])
+{
+    int			y;
+    int			anyColor = 0;
+    unsigned char	*row[4];
+    int			i;
+#if defined(__SSE2__)
+    unsigned char	anyv[32];
+#endif
+#if defined(__AVX2__)
+    __m256i		any = _mm256_setzero_si256();
+    __m256i		aibv = _mm256_set1_epi8(allIsBlack ? -1 : 0);
+    __m256i		bcv = _mm256_set1_epi8(blackClears ? -1 : 0);
+#elif defined(__SSE2__)
+    __m128i		any = _mm_setzero_si128();
+    __m128i		aibv = _mm_set1_epi8(allIsBlack ? -1 : 0);
+    __m128i		bcv = _mm_set1_epi8(blackClears ? -1 : 0);
+#endif
+
+    allIsBlack = !!allIsBlack;
+    blackClears = !!blackClears;
+    if (LutAib != allIsBlack || LutBc != blackClears)
+	build_luts(allIsBlack, blackClears);
+
+    for (i = 0; i < 4; ++i)
+	row[i] = plane[i];
+
+    for (y = 0; y < h; ++y)
+    {
+	unsigned char	*r = raw + (size_t) y * rawstride;
+	int		x = 0;
+	int		o = 0;
+	unsigned int	v;
+
+#if defined(__AVX2__)
+	for (; x + 32 <= rawbpl; x += 32, o += 8)
+	{
+	    __m256i	in = _mm256_loadu_si256((__m256i *) (r + x));
+	    __m256i	hi = _mm256_and_si256(_mm256_srli_epi16(in, 4),
+					_mm256_set1_epi8(0x0F));
+	    __m256i	lo = _mm256_and_si256(in, _mm256_set1_epi8(0x0F));
+	    __m256i	a = _mm256_unpacklo_epi8(hi, lo);
+	    __m256i	b = _mm256_unpackhi_epi8(hi, lo);
+	    __m256i	p[2];
+	    int		j, s;
+
+	    p[0] = _mm256_permute2x128_si256(a, b, 0x20);
+	    p[1] = _mm256_permute2x128_si256(a, b, 0x31);
+	    for (j = 0; j < 2; ++j)
+	    {
+		p[j] = split_pixels(p[j], aibv, bcv, &any);
+		for (s = 0; s < 4; ++s)
+		{
+		    unsigned int bits = (unsigned int) _mm256_movemask_epi8(
+					_mm256_slli_epi16(p[j], 4 + s));
+		    unsigned char *d = row[s] + o + 4*j;
+
+		    d[0] = bits;
+		    d[1] = bits >> 8;
+		    d[2] = bits >> 16;
+		    d[3] = bits >> 24;
+		}
+	    }
+	}
+#elif defined(__SSE2__)
+	for (; x + 16 <= rawbpl; x += 16, o += 4)
+	{
+	    __m128i	in = _mm_loadu_si128((__m128i *) (r + x));
+	    __m128i	hi = _mm_and_si128(_mm_srli_epi16(in, 4),
+					_mm_set1_epi8(0x0F));
+	    __m128i	lo = _mm_and_si128(in, _mm_set1_epi8(0x0F));
+	    __m128i	p[2];
+	    int		j, s;
+
+	    p[0] = _mm_unpacklo_epi8(hi, lo);
+	    p[1] = _mm_unpackhi_epi8(hi, lo);
+	    for (j = 0; j < 2; ++j)
+	    {
+		p[j] = split_pixels(p[j], aibv, bcv, &any);
+		for (s = 0; s < 4; ++s)
+		{
+		    unsigned int bits = (unsigned int) _mm_movemask_epi8(
+					_mm_slli_epi16(p[j], 4 + s));
+		    unsigned char *d = row[s] + o + 2*j;
+
+		    d[0] = bits;
+		    d[1] = bits >> 8;
+		}
+	    }
+	}
+#endif
+
+	for (; x + 4 <= rawbpl; x += 4, ++o)
+	{
+	    v = (SplitLut[r[x]] << 6) | (SplitLut[r[x+1]] << 4)
+		| (SplitLut[r[x+2]] << 2) | SplitLut[r[x+3]];
+	    anyColor |= ColorLut[r[x]] | ColorLut[r[x+1]]
+			| ColorLut[r[x+2]] | ColorLut[r[x+3]];
+	    row[0][o] = v;
+	    row[1][o] = v >> 8;
+	    row[2][o] = v >> 16;
+	    row[3][o] = v >> 24;
+	}
+	if (x < rawbpl)
+	{
+	    int		shift;
+
+	    for (v = 0, shift = 6; x < rawbpl; ++x, shift -= 2)
+	    {
+		v |= SplitLut[r[x]] << shift;
+		anyColor |= ColorLut[r[x]];
+	    }
+	    row[0][o] = v;
+	    row[1][o] = v >> 8;
+	    row[2][o] = v >> 16;
+	    row[3][o] = v >> 24;
+	    ++o;
+	}
+
+	for (i = 0; i < 4; ++i)
+	{
+	    if (dots)
+		dots[i] += dots_count(row[i], o);
+	    if (o < bpl)
+		memset(row[i] + o, 0, bpl - o);
+	    row[i] += bpl;
+	}
+    }
+
+#if defined(__AVX2__)
+    _mm256_storeu_si256((__m256i *) anyv, any);
+    for (i = 0; i < 32; ++i)
+	anyColor |= anyv[i] | (anyv[i] << 4);
+#elif defined(__SSE2__)
+    _mm_storeu_si128((__m128i *) anyv, any);
+    for (i = 0; i < 16; ++i)
+	anyColor |= anyv[i] | (anyv[i] << 4);
+#endif
+    return anyColor;
+}
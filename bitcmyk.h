@@ -0,0 +1,38 @@
+/*
+ * Splitter for Ghostscript bitcmyk rasters, shared by the foo2* drivers.
+ *
+ * A bitcmyk raster has 4 bits per pixel, CMYK from the most significant
+ * bit down, two pixels per byte.  bitcmyk_split() turns it into four
+ * 1-bit-per-pixel planes, in the order C, M, Y, K.
+ */
+
+#ifndef BITCMYK_H
+#define BITCMYK_H
+
+/*
+ * Split h rows of raw (rawbpl bytes per row) into plane[0..3], each with
+ * bpl bytes per row.  Bytes of a plane row past the converted pixels are
+ * cleared, so the planes need not be zeroed beforehand.
+ *
+ * allIsBlack converts C=1,M=1,Y=1 to just K=1; blackClears makes K=1
+ * force C, M and Y to 0.
+ *
+ * If dots isn't NULL, the dots of each plane are added to dots[0..3],
+ * each row being counted as soon as it is split.
+ *
+ * Returns the colorants that survive, as 0x88 (C), 0x44 (M) and 0x22 (Y)
+ * bits.  The result is 0 for a page that can be printed monochrome.
+ */
+int	bitcmyk_split(unsigned char *plane[4], int bpl,
+			unsigned char *raw, int rawbpl, int h,
+			int allIsBlack, int blackClears, unsigned long dots[4]);
+
+/*
+ * The same, for a raster whose rows are rawstride bytes apart, of which
+ * only the first rawbpl are split, e.g. a clipped view of a mapped file.
+ */
+int	bitcmyk_split_stride(unsigned char *plane[4], int bpl,
+			unsigned char *raw, int rawbpl, int rawstride, int h,
+			int allIsBlack, int blackClears, unsigned long dots[4]);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Finding blank bitmaps, shared by the foo2* drivers.
+ *
+ * The bytes are ORed together 128 at a time, with AVX2 or SSE2 when the
+ * compiler targets them and in 64 bit words otherwise, and the scan stops
+ * at the first block that isn't zero.  A page with anything on it near
+ * the top is thus found out after a few rows.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include "blank.h"
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+#define	BLOCK	128
+
+static int
+block_blank(const unsigned char *p)
+{
+#if defined(__AVX2__)
+    __m256i	v;
+
+    v = _mm256_or_si256(
+	    _mm256_or_si256(_mm256_loadu_si256((const __m256i *) p),
+			    _mm256_loadu_si256((const __m256i *) (p + 32))),
+	    _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (p + 64)),
+			    _mm256_loadu_si256((const __m256i *) (p + 96))));
+    return _mm256_testz_si256(v, v);
+#elif defined(__SSE2__)
+    __m128i	v;
+    int		i;
+
+    v = _mm_loadu_si128((const __m128i *) p);
+    for (i = 16; i < BLOCK; i += 16)
+	v = _mm_or_si128(v, _mm_loadu_si128((const __m128i *) (p + i)));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()))
+		== 0xffff;
+#else
+    uint64_t	v = 0, w;
+    int		i;
+
+    for (i = 0; i < BLOCK; i += 8)
+    {
+	memcpy(&w, p + i, sizeof(w));
+	v |= w;
+    }
+    return v == 0;
+#endif
+}
+
+int
+blank_region(const unsigned char *p, size_t len)
+{
+    const unsigned char	*e = p + len;
+
+    for (; e - p >= BLOCK; p += BLOCK)
+	if (!block_blank(p))
+	    return 0;
+    for (; p < e; ++p)
+	if (*p)
+	    return 0;
+    return 1;
+}
+
@@ -0,0 +1,21 @@
+/*
+ * Finding blank bitmaps, shared by the foo2* drivers.
+ *
+ * Blank planes are everywhere: the C, M and Y planes of a black and white
+ * page, the backs of duplex jobs, the margins of a page.  The drivers
+ * count the dots of each row as it is read or split, so a plane with no
+ * dots is known to be blank without a scan of its own.  foo2hp notes
+ * which rows had any, and scans those flags for its bands.
+ */
+
+#ifndef BLANK_H
+#define BLANK_H
+
+#include <stddef.h>
+
+/*
+ * Return 1 if all len bytes at p are zero, 0 as soon as one is not.
+ */
+int	blank_region(const unsigned char *p, size_t len);
+
+#endif
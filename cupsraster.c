@@ -0,0 +1,393 @@
+/*
+ * Streaming reader for CUPS raster input, shared by the foo2* drivers.
+ *
+ * The format is described in the CUPS "Raster File Format" spec.  In
+ * short: a sync word, then for each page a header (420 bytes in version
+ * 1, 1796 bytes since) followed by cupsHeight lines of cupsBytesPerLine
+ * bytes (times the number of colors, for planar order).  Version 2
+ * compresses each line: a line repeat count, then runs of "pixels" (one
+ * byte, or one whole pixel for chunked order of 8 or more bits per pixel)
+ * in a PackBits-like code.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cupsraster.h"
+#include "dots.h"
+
+#define	HDR1SIZE	sizeof(cups_page_header_t)
+#define	HDR2SIZE	(sizeof(cups_page_header_t) + sizeof(cups_page_header2_t))
+
+struct _CUPSRASTER
+{
+    FILE		*fp;
+    int			version;
+    int			swapped;	/* header is in the other byte order */
+    cups_page_header_t	h;
+    int			nc;		/* colors in the stream */
+    int			map[4];		/* plane[] index of each color */
+    int			invert;		/* W: 0 is black */
+    int			nplanes;	/* 1 (K) or 4 (CMYK), 0 if unusable */
+    unsigned char	*line;		/* the current line */
+    size_t		linesize;
+    int			repeat;		/* times line is to be repeated */
+    int			rlebpp;		/* bytes per compressed "pixel" */
+};
+
+static const unsigned char Bayer[4][4] =
+{
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+static unsigned
+swap32(unsigned v)
+{
+    return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+CUPSRASTER *
+cupsraster_open(FILE *fp)
+{
+    CUPSRASTER	*r;
+    unsigned	magic;
+    int		version, swapped;
+
+    if (fread(&magic, sizeof(magic), 1, fp) != 1)
+	return NULL;
+    switch (magic)
+    {
+    case CUPS_RASTER_SYNCv1:	version = 1; swapped = 0; break;
+    case CUPS_RASTER_REVSYNCv1:	version = 1; swapped = 1; break;
+    case CUPS_RASTER_SYNCv2:	version = 2; swapped = 0; break;
+    case CUPS_RASTER_REVSYNCv2:	version = 2; swapped = 1; break;
+    case CUPS_RASTER_SYNC:	version = 3; swapped = 0; break;
+    case CUPS_RASTER_REVSYNC:	version = 3; swapped = 1; break;
+    default:			return NULL;
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (!r)
+	return NULL;
+    r->fp = fp;
+    r->version = version;
+    r->swapped = swapped;
+    return r;
+}
+
+void
+cupsraster_close(CUPSRASTER *r)
+{
+    if (!r)
+	return;
+    free(r->line);
+    free(r);
+}
+
+const cups_page_header_t *
+cupsraster_header(CUPSRASTER *r)
+{
+    return &r->h;
+}
+
+int
+cupsraster_planes(CUPSRASTER *r)
+{
+    return r->nplanes;
+}
+
+/*
+ * Work out how the colors of the page map onto our planes, and whether
+ * the layout of a line makes sense.  Leaves nplanes 0 if it doesn't.
+ */
+static void
+setup_page(CUPSRASTER *r)
+{
+    cups_page_header_t	*h = &r->h;
+    unsigned		bpc = h->cupsBitsPerColor;
+    unsigned long	need;
+    static const struct
+    {
+	cups_cspace_t	cs;
+	int		nc, invert, map[4];
+    } spaces[] =
+    {
+	{ CUPS_CSPACE_K,	1, 0, { 3 } },
+	{ CUPS_CSPACE_W,	1, 1, { 3 } },
+	{ CUPS_CSPACE_CMY,	3, 0, { 0, 1, 2 } },
+	{ CUPS_CSPACE_YMC,	3, 0, { 2, 1, 0 } },
+	{ CUPS_CSPACE_CMYK,	4, 0, { 0, 1, 2, 3 } },
+	{ CUPS_CSPACE_YMCK,	4, 0, { 2, 1, 0, 3 } },
+	{ CUPS_CSPACE_KCMY,	4, 0, { 3, 0, 1, 2 } },
+    };
+    int			i;
+
+    r->nplanes = 0;
+    r->repeat = 0;
+    if (bpc != 1 && bpc != 2 && bpc != 4 && bpc != 8)
+	return;
+    if (h->cupsWidth == 0 || h->cupsBytesPerLine == 0)
+	return;
+
+    for (i = 0; i < (int) (sizeof(spaces) / sizeof(spaces[0])); ++i)
+	if (spaces[i].cs == h->cupsColorSpace)
+	    break;
+    if (i == (int) (sizeof(spaces) / sizeof(spaces[0])))
+	return;
+    r->nc = spaces[i].nc;
+    r->invert = spaces[i].invert;
+    memcpy(r->map, spaces[i].map, sizeof(r->map));
+
+    switch (h->cupsColorOrder)
+    {
+    case CUPS_ORDER_CHUNKED:
+	if (h->cupsBitsPerPixel % bpc || h->cupsBitsPerPixel < r->nc * bpc)
+	    return;
+	need = ((unsigned long) h->cupsWidth * h->cupsBitsPerPixel + 7) / 8;
+	r->rlebpp = (h->cupsBitsPerPixel + 7) / 8;
+	break;
+    case CUPS_ORDER_BANDED:
+	need = r->nc * (((unsigned long) h->cupsWidth * bpc + 7) / 8);
+	r->rlebpp = (bpc + 7) / 8;
+	break;
+    case CUPS_ORDER_PLANAR:
+	need = ((unsigned long) h->cupsWidth * bpc + 7) / 8;
+	r->rlebpp = (bpc + 7) / 8;
+	break;
+    default:
+	return;
+    }
+    if (h->cupsBytesPerLine < need)
+	return;
+
+    if (r->linesize < h->cupsBytesPerLine)
+    {
+	free(r->line);
+	r->line = malloc(h->cupsBytesPerLine);
+	if (!r->line)
+	{
+	    r->linesize = 0;
+	    return;
+	}
+	r->linesize = h->cupsBytesPerLine;
+    }
+    r->nplanes = (r->nc == 1) ? 1 : 4;
+}
+
+int
+cupsraster_next_page(CUPSRASTER *r)
+{
+    unsigned char	hdr[HDR2SIZE];
+    size_t		size, n;
+    unsigned		*word;
+
+    size = (r->version == 1) ? HDR1SIZE : HDR2SIZE;
+    n = fread(hdr, 1, size, r->fp);
+    if (n == 0)
+	return 0;
+    if (n != size)
+	return EOF;
+
+    // Only the integer part of the version 1 header is needed
+    memcpy(&r->h, hdr, sizeof(r->h));
+    if (r->swapped)
+	for (word = (unsigned *) &r->h.AdvanceDistance;
+		word <= (unsigned *) &r->h.cupsRowStep; ++word)
+	    *word = swap32(*word);
+
+    setup_page(r);
+    return 1;
+}
+
+/*
+ * Read the next line of the raster into r->line.  Returns 0 or EOF.
+ */
+static int
+read_line(CUPSRASTER *r)
+{
+    unsigned char	*p = r->line;
+    size_t		bytes = r->h.cupsBytesPerLine;
+    size_t		count;
+    int			c;
+
+    if (r->version != 2)
+	return (fread(p, bytes, 1, r->fp) == 1) ? 0 : EOF;
+
+    if (r->repeat > 0)
+    {
+	--r->repeat;
+	return 0;
+    }
+    if ((c = getc(r->fp)) == EOF)
+	return EOF;
+    r->repeat = c;
+
+    while (bytes > 0)
+    {
+	if ((c = getc(r->fp)) == EOF)
+	    return EOF;
+	if (c == 128)
+	{
+	    // Clear to end of line
+	    memset(p, (r->h.cupsColorSpace == CUPS_CSPACE_W) ? 0xff : 0, bytes);
+	    break;
+	}
+	else if (c & 128)
+	{
+	    // 257 - c literal pixels
+	    count = (257 - c) * r->rlebpp;
+	    if (count > bytes)
+		count = bytes;
+	    if (fread(p, count, 1, r->fp) != 1)
+		return EOF;
+	}
+	else
+	{
+	    // c + 1 copies of the next pixel
+	    count = (c + 1) * r->rlebpp;
+	    if (count > bytes)
+		count = bytes;
+	    if (count < (size_t) r->rlebpp)
+		return EOF;
+	    if (fread(p, r->rlebpp, 1, r->fp) != 1)
+		return EOF;
+	    for (c = r->rlebpp; c < (int) count; ++c)
+		p[c] = p[c - r->rlebpp];
+	}
+	p += count;
+	bytes -= count;
+    }
+    return 0;
+}
+
+/*
+ * Convert w samples of sbpc bits, the first at sample index start of src
+ * and step samples apart, into a row of dbpc bit pixels at dst.
+ */
+static void
+convert_row(unsigned char *dst, int bpl, const unsigned char *src,
+	    unsigned long start, int step, int w, int sbpc, int dbpc,
+	    int invert, int x0, int y)
+{
+    unsigned	smax = (1 << sbpc) - 1;
+    unsigned	dmax = (1 << dbpc) - 1;
+    unsigned	v;
+    unsigned long idx;
+    int		x, n;
+
+    // Fast path: the same depth, byte aligned, one color after another
+    if (step == 1 && sbpc == dbpc && !invert && (start * sbpc) % 8 == 0)
+    {
+	n = (w * dbpc + 7) / 8;
+	memcpy(dst, src + start * sbpc / 8, n);
+	if ((w * dbpc) & 7)
+	    dst[n - 1] &= 0xff << (8 - ((w * dbpc) & 7));
+	memset(dst + n, 0, bpl - n);
+	return;
+    }
+
+    memset(dst, 0, bpl);
+    for (x = 0, idx = start; x < w; ++x, idx += step)
+    {
+	switch (sbpc)
+	{
+	case 1:	v = (src[idx >> 3] >> (7 - (idx & 7))) & 1; break;
+	case 2:	v = (src[idx >> 2] >> (6 - 2 * (idx & 3))) & 3; break;
+	case 4:	v = (src[idx >> 1] >> (4 - 4 * (idx & 1))) & 15; break;
+	default: v = src[idx]; break;
+	}
+	if (invert)
+	    v = smax - v;
+
+	if (sbpc < dbpc)
+	    v = v * dmax / smax;
+	else if (sbpc > dbpc)
+	{
+	    v = v * 255 / smax;
+	    v = (v * dmax + Bayer[y & 3][(x0 + x) & 3] * 16 + 8) >> 8;
+	}
+
+	if (dbpc == 1)
+	    dst[x >> 3] |= v << (7 - (x & 7));
+	else
+	    dst[x >> 2] |= v << (6 - 2 * (x & 3));
+    }
+}
+
+int
+cupsraster_read_page(CUPSRASTER *r, unsigned char *plane[4],
+			int bpl, int x0, int y0, int w, int h, int bpc,
+			unsigned long dots[4], unsigned char *inked[4])
+{
+    cups_page_header_t	*hdr = &r->h;
+    int			sbpc = hdr->cupsBitsPerColor;
+    int			passes, pass;
+    int			y, c, p;
+    unsigned long	band = 0;
+    unsigned long	n;
+
+    for (p = 0; p < r->nplanes; ++p)
+    {
+	memset(plane[p], 0, (size_t) bpl * h);
+	if (inked)
+	    memset(inked[p], 0, h);
+    }
+    if (hdr->cupsColorOrder == CUPS_ORDER_BANDED)
+	band = hdr->cupsBytesPerLine / r->nc;
+
+    // Planar order sends each color as a separate "page" of lines
+    passes = (hdr->cupsColorOrder == CUPS_ORDER_PLANAR) ? r->nc : 1;
+    for (pass = 0; pass < passes; ++pass)
+	for (y = 0; y < (int) hdr->cupsHeight; ++y)
+	{
+	    if (read_line(r) == EOF)
+		return EOF;
+	    if (y < y0 || y >= y0 + h)
+		continue;
+
+	    for (c = 0; c < r->nc; ++c)
+	    {
+		unsigned char	*dst;
+
+		if (passes > 1 && c != pass)
+		    continue;
+		p = (r->nplanes == 1) ? 0 : r->map[c];
+		dst = plane[p] + (size_t) bpl * (y - y0);
+
+		switch (hdr->cupsColorOrder)
+		{
+		case CUPS_ORDER_CHUNKED:
+		    convert_row(dst, bpl, r->line,
+			(unsigned long) x0 * (hdr->cupsBitsPerPixel / sbpc) + c,
+			hdr->cupsBitsPerPixel / sbpc, w, sbpc, bpc,
+			r->invert, x0, y);
+		    break;
+		case CUPS_ORDER_BANDED:
+		    convert_row(dst, bpl, r->line + band * c, x0, 1,
+			w, sbpc, bpc, r->invert, x0, y);
+		    break;
+		default:
+		    convert_row(dst, bpl, r->line, x0, 1,
+			w, sbpc, bpc, r->invert, x0, y);
+		    break;
+		}
+		if (dots || inked)
+		{
+		    n = dots_count(dst, bpl);
+		    if (dots)
+			dots[p] += n;
+		    if (inked && n)
+			inked[p][y - y0] = 1;
+		}
+	    }
+	}
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Streaming reader for CUPS raster input, shared by the foo2* drivers.
+ *
+ * Handles version 1 ("RaSt"), 2 ("RaS2", run length compressed) and 3
+ * ("RaS3") streams, in either byte order; chunked, banded and planar
+ * color order; 1, 2, 4 and 8 bits per color; and the K, W, CMY, YMC,
+ * CMYK, YMCK and KCMY color spaces.
+ *
+ * The page is decompressed one line at a time and converted straight
+ * into the driver's bit planes, so the raster is never held in memory
+ * in its original form.
+ */
+
+#ifndef CUPSRASTER_H
+#define CUPSRASTER_H
+
+#include <stdio.h>
+#include "cups.h"
+
+typedef struct _CUPSRASTER CUPSRASTER;
+
+/*
+ * Start reading a raster stream from fp.  Returns NULL if fp does not
+ * begin with a CUPS raster sync word, or if out of memory.
+ */
+CUPSRASTER	*cupsraster_open(FILE *fp);
+void		cupsraster_close(CUPSRASTER *r);
+
+/*
+ * Read the header of the next page.  Returns 1, 0 at the end of the
+ * stream, or EOF if the header is cut short.  The header is in host
+ * byte order.
+ */
+int		cupsraster_next_page(CUPSRASTER *r);
+const cups_page_header_t *cupsraster_header(CUPSRASTER *r);
+
+/*
+ * The number of planes cupsraster_read_page() produces for this page:
+ * 1 (K) or 4 (C, M, Y, K).  Returns 0 if the page's color space, color
+ * order or bits per color are not supported.
+ */
+int		cupsraster_planes(CUPSRASTER *r);
+
+/*
+ * Read the whole raster of the current page, and store the w x h pixel
+ * rectangle at (x0, y0) of it into plane[], with bpc bits (1 or 2) per
+ * pixel and bpl bytes per row.  Bytes of a row past the w pixels are
+ * cleared.  Colors with more bits than bpc are ordered dithered down,
+ * colors with fewer are scaled up.  If dots isn't NULL, the bits set in
+ * each row of plane[p] are added to dots[p] as soon as it is stored.  If
+ * inked isn't NULL, inked[p][y] is set to whether row y of plane[p] has
+ * any bits set, in the same pass.
+ *
+ * Returns 0, or EOF if the page data is cut short.
+ */
+int		cupsraster_read_page(CUPSRASTER *r, unsigned char *plane[4],
+			int bpl, int x0, int y0, int w, int h, int bpc,
+			unsigned long dots[4], unsigned char *inked[4]);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * Fixed point Floyd-Steinberg error diffusion of 8 bit gray into a few
+ * levels, shared by the foo2* drivers.
+ *
+ * Ink and error are kept as integers in units of 1/DITHER_ONE of a gray
+ * step.  Each pixel's error is split 7/16, 3/16, 5/16 and whatever is
+ * left for the last neighbour, so no error is lost to rounding.
+ *
+ * For the wavefront, a row may work on column x once the row above has
+ * finished column x + 1: that is the last pixel which adds to the carry
+ * of x.  Rows are claimed in order by the jobs of the pool, so the row a
+ * job waits for is always being worked on by another job; a job never
+ * waits for a row that has not been claimed.  The rows in progress are
+ * therefore at most njobs consecutive ones, and njobs + 1 carry rows are
+ * enough.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include "dither.h"
+
+#define	BLOCK	256		/* columns between progress reports */
+
+struct _DITHER
+{
+    DITHER_LEVEL	level[DITHER_MAXLEVELS];
+    int			value[DITHER_MAXLEVELS];	/* ink, scaled */
+    int			nlevels;
+    int			solid;
+    int			nplanes;
+
+    // Scratch, kept from page to page
+    int			w, h, njobs;	/* sizes the scratch was made for */
+    int			*carry;		/* njobs + 1 rows of w + 2 carries */
+    unsigned char	*codes;		/* a row of level codes per job */
+    int			*progress;	/* columns finished, per row */
+};
+
+typedef struct
+{
+    DITHER		*d;
+    unsigned char	**plane;
+    int			bpl;
+    const unsigned char	*gray;
+    int			stride;
+    int			w, h;
+    int			nslots;
+    int			solidgray;	/* gray value of full ink */
+    int			ink[256];	/* gray value to ink, scaled */
+    int			nextrow;	/* next row to be claimed */
+} PAGE;
+
+DITHER *
+dither_create(const DITHER_LEVEL *level, int nlevels, int solid,
+		int nplanes)
+{
+    DITHER	*d;
+    int		i;
+
+    if (nlevels < 1 || nlevels > DITHER_MAXLEVELS
+	    || solid >= nlevels || nplanes < 1 || nplanes > 8)
+	return NULL;
+    d = calloc(1, sizeof(*d));
+    if (!d)
+	return NULL;
+    for (i = 0; i < nlevels; ++i)
+    {
+	d->level[i] = level[i];
+	d->value[i] = level[i].value * DITHER_ONE;
+    }
+    d->nlevels = nlevels;
+    d->solid = solid;
+    d->nplanes = nplanes;
+    return d;
+}
+
+void
+dither_destroy(DITHER *d)
+{
+    if (!d)
+	return;
+    free(d->carry);
+    free(d->codes);
+    free(d->progress);
+    free(d);
+}
+
+/*
+ * Make the scratch big enough for this page.
+ */
+static int
+grow(DITHER *d, int w, int h, int njobs)
+{
+    if (w > d->w || njobs > d->njobs)
+    {
+	int	nw = (w > d->w) ? w : d->w;
+	int	nj = (njobs > d->njobs) ? njobs : d->njobs;
+
+	free(d->carry);
+	free(d->codes);
+	d->carry = malloc((size_t) (nj + 1) * (nw + 2) * sizeof(*d->carry));
+	d->codes = malloc((size_t) nj * nw);
+	if (!d->carry || !d->codes)
+	{
+	    free(d->carry); d->carry = NULL;
+	    free(d->codes); d->codes = NULL;
+	    d->w = d->njobs = 0;
+	    return -1;
+	}
+	d->w = nw;
+	d->njobs = nj;
+    }
+    if (h > d->h)
+    {
+	free(d->progress);
+	d->progress = malloc((size_t) h * sizeof(*d->progress));
+	if (!d->progress)
+	{
+	    d->h = 0;
+	    return -1;
+	}
+	d->h = h;
+    }
+    return 0;
+}
+
+/*
+ * Wait until row has finished n columns.
+ */
+static void
+wait_for(int *progress, int n)
+{
+    while (__atomic_load_n(progress, __ATOMIC_ACQUIRE) < n)
+	sched_yield();
+}
+
+/*
+ * Pack the codes of a row into the bit planes, clearing the pad.
+ *
+ * Eight codes are loaded as one word; after masking off bit p of each,
+ * one multiply gathers the eight bits into the top byte, first pixel
+ * first.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    #define	GATHER	0x0102040810204080ULL
+#else
+    #define	GATHER	0x8040201008040201ULL
+#endif
+
+static void
+pack_row(PAGE *pg, int y, const unsigned char *codes)
+{
+    int			w = pg->w;
+    int			p, x, i;
+    unsigned char	byte;
+
+    for (p = 0; p < pg->d->nplanes; ++p)
+    {
+	unsigned char	*out = pg->plane[p] + (size_t) y * pg->bpl;
+
+	for (x = 0; x + 8 <= w; x += 8)
+	{
+	    uint64_t	v;
+
+	    memcpy(&v, codes + x, sizeof(v));
+	    *out++ = (((v >> p) & 0x0101010101010101ULL) * GATHER) >> 56;
+	}
+	if (x < w)
+	{
+	    byte = 0;
+	    for (i = 0; x + i < w; ++i)
+		byte |= ((codes[x + i] >> p) & 1) << (7 - i);
+	    *out++ = byte;
+	}
+	memset(out, 0, pg->bpl - (w + 7) / 8);
+    }
+}
+
+static void
+dither_row(PAGE *pg, int y, unsigned char *codes)
+{
+    DITHER		*d = pg->d;
+    int			w = pg->w;
+    const unsigned char	*src = pg->gray + (size_t) y * pg->stride;
+    int			*cur = d->carry + (y % pg->nslots) * (w + 2) + 1;
+    int			*next = d->carry + ((y + 1) % pg->nslots) * (w + 2) + 1;
+    const int		*ink = pg->ink;
+    int			last = d->nlevels - 1;
+    int			solid = d->solid, solidgray = pg->solidgray;
+    int			thresh[DITHER_MAXLEVELS];
+    int			value[DITHER_MAXLEVELS];
+    unsigned char	code[DITHER_MAXLEVELS];
+    int			x, x0, x1, l, i;
+    int			g, sum, err, e7, e5, e3;
+
+    // Keep the table where stores to the carries can't touch it
+    for (i = 0; i <= last; ++i)
+    {
+	thresh[i] = d->level[i].thresh;
+	value[i] = d->value[i];
+	code[i] = d->level[i].code;
+    }
+
+    err = 0;
+    for (x0 = 0; x0 < w; x0 = x1)
+    {
+	x1 = (w - x0 > BLOCK) ? x0 + BLOCK : w;
+	if (y > 0)
+	    wait_for(&d->progress[y - 1], (x1 < w) ? x1 + 1 : w);
+
+	// The carries of the next row are stored as they are finished,
+	// except for the first two, which get added to right away.  The
+	// wait above makes sure the row that last used them is done.
+	if (x0 == 0)
+	    next[0] = next[-1] = 0;
+
+	for (x = x0; x < x1; ++x)
+	{
+	    g = src[x];
+	    sum = ink[g] + cur[x] + err;
+
+	    // Count the thresholds not reached, without branching on them
+	    l = 0;
+	    for (i = 0; i < last; ++i)
+		l += sum < thresh[i];
+	    if (g == solidgray)
+		l = solid;
+	    codes[x] = code[l];
+
+	    // Compute the carry that must be distributed
+	    sum -= value[l];
+	    e7 = (sum * 7) >> 4;
+	    e5 = (sum * 5) >> 4;
+	    e3 = (sum * 3) >> 4;
+	    err = e7;
+	    next[x - 1] += e3;
+	    next[x] += e5;
+	    next[x + 1] = sum - e7 - e5 - e3;
+	}
+
+	__atomic_store_n(&d->progress[y], x1, __ATOMIC_RELEASE);
+    }
+
+    pack_row(pg, y, codes);
+}
+
+static void
+dither_job(void *arg, int job)
+{
+    PAGE		*pg = arg;
+    unsigned char	*codes = pg->d->codes + (size_t) job * pg->w;
+    int			y;
+
+    while ((y = __atomic_fetch_add(&pg->nextrow, 1, __ATOMIC_RELAXED))
+		< pg->h)
+	dither_row(pg, y, codes);
+}
+
+int
+dither_page(DITHER *d, unsigned char **plane, int bpl,
+		const unsigned char *gray, int stride, int w, int h,
+		int invert, WORKPOOL *pool, int njobs)
+{
+    PAGE	pg;
+    int		g;
+
+    if (w <= 0 || h <= 0)
+	return 0;
+    if (njobs < 1 || h < 2)
+	njobs = 1;
+    if (grow(d, w, h, njobs) < 0)
+	return -1;
+
+    pg.d = d;
+    pg.plane = plane;
+    pg.bpl = bpl;
+    pg.gray = gray;
+    pg.stride = stride;
+    pg.w = w;
+    pg.h = h;
+    pg.nslots = njobs + 1;
+    pg.solidgray = (d->solid < 0) ? -1 : (invert ? 0 : 255);
+    for (g = 0; g < 256; ++g)
+	pg.ink[g] = (invert ? 255 - g : g) * DITHER_ONE;
+    pg.nextrow = 0;
+
+    // The first row starts without any carry
+    memset(d->carry, 0, (w + 2) * sizeof(*d->carry));
+    memset(d->progress, 0, h * sizeof(*d->progress));
+
+    workpool_run((njobs > 1) ? pool : NULL, njobs, dither_job, &pg);
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Fixed point Floyd-Steinberg error diffusion of 8 bit gray into a few
+ * levels, shared by the foo2* drivers.
+ *
+ * The output levels are given as a table: each level has the threshold
+ * at which it is chosen, the amount of ink it puts down, and the code
+ * whose bits are stored into the 1 bit output planes.  foo2oak's 2 bit
+ * gray is one such table; a driver with another set of levels just
+ * brings its own.
+ *
+ * Rows are scanned left to right and diffused as a wavefront: each row
+ * runs as soon as the row above is a little ahead of it, so the rows of
+ * a page spread over the threads of a WORKPOOL.  The output does not
+ * depend on the number of threads.
+ */
+
+#ifndef DITHER_H
+#define DITHER_H
+
+#include "workpool.h"
+
+#define	DITHER_ONE		256	/* fixed point scale of ink and error */
+#define	DITHER_MAXLEVELS	16
+
+typedef struct
+{
+    int		thresh;		/* chosen when ink + error >= thresh */
+    int		value;		/* ink put down, 0..255 */
+    int		code;		/* bit i goes to plane[i] */
+} DITHER_LEVEL;
+
+typedef struct _DITHER DITHER;
+
+/*
+ * Create an engine for nlevels levels, ordered by descending thresh;
+ * the last level is taken when no threshold is reached.  Full ink input
+ * always takes level solid, whatever the error, unless solid is -1.
+ * The codes are written into nplanes planes.  Returns NULL if out of
+ * memory or if the table is unusable.
+ */
+DITHER	*dither_create(const DITHER_LEVEL *level, int nlevels, int solid,
+			int nplanes);
+void	dither_destroy(DITHER *d);
+
+/*
+ * Diffuse the w x h page of 8 bit gray at gray (rows stride bytes apart;
+ * 0 is no ink, or full ink if invert is set) into the planes, rows bpl
+ * bytes apart.  Pad bits at the end of each row are cleared.  The rows
+ * are spread over njobs jobs of pool.  Returns 0, or -1 if out of memory.
+ */
+int	dither_page(DITHER *d, unsigned char **plane, int bpl,
+			const unsigned char *gray, int stride, int w, int h,
+			int invert, WORKPOOL *pool, int njobs);
+
+#endif
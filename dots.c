@@ -0,0 +1,109 @@
+/*
+ * Counting dots, shared by the foo2* drivers.
+ *
+ * With AVX2, the bits of 32 bytes at a time are counted by looking up
+ * each nibble in a 16 entry table with a shuffle, and the byte counts
+ * summed with psadbw.  Otherwise 64 bit words are counted with the POPCNT
+ * instruction if the compiler targets it, and with shifts and masks if
+ * not: 16 bytes at a time with SSE2, 8 without.  Build with
+ * CFLAGS="-O2 -march=native" to get AVX2 or POPCNT on capable machines.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include "dots.h"
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+static inline unsigned long
+word_dots(uint64_t v)
+{
+#if defined(__POPCNT__)
+    return __builtin_popcountll(v);
+#else
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (v * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+unsigned long
+dots_count(const unsigned char *p, size_t len)
+{
+    const unsigned char	*e = p + len;
+    unsigned long	n = 0;
+    uint64_t		w;
+#if defined(__AVX2__)
+    uint64_t		s[4];
+    const __m256i	lut = _mm256_setr_epi8(
+				0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+				0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i	low = _mm256_set1_epi8(0x0f);
+    __m256i		sum = _mm256_setzero_si256();
+    __m256i		v, c;
+
+    for (; e - p >= 32; p += 32)
+    {
+	v = _mm256_loadu_si256((const __m256i *) p);
+	c = _mm256_add_epi8(
+		_mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)),
+		_mm256_shuffle_epi8(lut,
+			_mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+	sum = _mm256_add_epi64(sum,
+			_mm256_sad_epu8(c, _mm256_setzero_si256()));
+    }
+    _mm256_storeu_si256((__m256i *) s, sum);
+    n = s[0] + s[1] + s[2] + s[3];
+#elif defined(__SSE2__) && !defined(__POPCNT__)
+    const __m128i	m1 = _mm_set1_epi8(0x55);
+    const __m128i	m2 = _mm_set1_epi8(0x33);
+    const __m128i	m4 = _mm_set1_epi8(0x0f);
+    __m128i		sum = _mm_setzero_si128();
+    __m128i		v;
+    uint64_t		s[2];
+
+    for (; e - p >= 16; p += 16)
+    {
+	v = _mm_loadu_si128((const __m128i *) p);
+	v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi16(v, 1), m1));
+	v = _mm_add_epi8(_mm_and_si128(v, m2),
+			    _mm_and_si128(_mm_srli_epi16(v, 2), m2));
+	v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi16(v, 4)), m4);
+	sum = _mm_add_epi64(sum, _mm_sad_epu8(v, _mm_setzero_si128()));
+    }
+    _mm_storeu_si128((__m128i *) s, sum);
+    n = s[0] + s[1];
+#endif
+
+    for (; e - p >= 8; p += 8)
+    {
+	memcpy(&w, p, sizeof(w));
+	n += word_dots(w);
+    }
+    for (; p < e; ++p)
+	n += word_dots(*p);
+    return n;
+}
+
+unsigned long
+dots_rows(const unsigned char *p, size_t stride, size_t len, int h)
+{
+    unsigned long	n = 0;
+    int			y;
+
+    if (stride == len)
+	return dots_count(p, len * h);
+    for (y = 0; y < h; ++y, p += stride)
+	n += dots_count(p, len);
+    return n;
+}
@@ -0,0 +1,27 @@
+/*
+ * Counting dots, shared by the foo2* drivers.
+ *
+ * Some printers want the number of dots of each color on a page, to keep
+ * track of their toner; the others get the numbers in the per page stats.
+ * The drivers count the dots of a row as it is read or split into planes,
+ * while it is still in the cache, rather than going over the planes again
+ * once they are finished.
+ */
+
+#ifndef DOTS_H
+#define DOTS_H
+
+#include <stddef.h>
+
+/*
+ * Return the number of bits set in the len bytes at p.
+ */
+unsigned long	dots_count(const unsigned char *p, size_t len);
+
+/*
+ * The same for h rows of len bytes, stride bytes apart.
+ */
+unsigned long	dots_rows(const unsigned char *p, size_t stride, size_t len,
+			int h);
+
+#endif
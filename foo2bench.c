@@ -0,0 +1,828 @@
+/*
+ * foo2bench: time the foo2* drivers and decoders, and the JBIG and bitcmyk
+ * code they share, on synthetic pages and on stored rasters.
+ *
+ * Nothing here needs ghostscript.  The synthetic pages are made up on the
+ * spot, the same every time: blank, text, halftone and photo, each as a
+ * pbmraw file and as a bitcmyk file.  Rasters given on the command line
+ * (pbmraw, or raw bitcmyk of the -g size) are run the same way.
+ *
+ * For each raster, the kernels are timed in-process: splitting bitcmyk
+ * into planes, JBIG compressing each plane as foo2zjs does, and
+ * decompressing it again.  Then each driver is run on the raster, and the
+ * matching decoder on what the driver wrote.  Each test runs in its own
+ * process, so its peak RSS is its own.  MB/s is always raster megabytes,
+ * so the figures for a driver and its decoder can be put side by side.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "jbig.h"
+#include "bitcmyk.h"
+
+/*
+ * Global option flags
+ */
+int	Debug = 0;
+int	Pages = 1;
+int	PageWidth = 5100;
+int	PageHeight = 6600;
+char	*Res = "600x600";
+char	*BinDir = ".";
+int	KernelsOnly = 0;
+
+char	TmpDir[256];
+
+/*
+ * The same options foo2zjs uses
+ */
+long JbgOptions[5] =
+{
+    /* Order */
+    JBG_ILEAVE | JBG_SMID,
+    /* Options */
+    JBG_DELAY_AT | JBG_LRLTWO | JBG_TPDON | JBG_TPBON | JBG_DPON,
+    /* L0 */
+    128,
+    /* MX */
+    16,
+    /* MY */
+    0
+};
+
+/*
+ * Each driver, an option it needs to compress, and the decoder for what
+ * it writes
+ */
+struct
+{
+    char	*driver;
+    char	*option;
+    char	*decoder;
+} Langs[] =
+{
+    { "foo2zjs",	NULL,	"zjsdecode" },
+    { "foo2hp",		NULL,	"zjsdecode" },
+    { "foo2xqx",	NULL,	"xqxdecode" },
+    { "foo2lava",	NULL,	"lavadecode" },
+    { "foo2qpdl",	NULL,	"qpdldecode" },
+    { "foo2slx",	NULL,	"slxdecode" },
+    { "foo2hiperc",	"-Z1",	"hipercdecode" },
+    { "foo2hbpl2",	NULL,	"hbpldecode" },
+    { "foo2oak",	NULL,	"oakdecode" },
+};
+#define	NLANGS	(sizeof(Langs) / sizeof(Langs[0]))
+
+#define	KIND_BLANK	0
+#define	KIND_TEXT	1
+#define	KIND_HALFTONE	2
+#define	KIND_PHOTO	3
+char	*KindName[] = { "blank", "text", "halftone", "photo" };
+#define	NKINDS	4
+
+/*
+ * A raster to run the tests on
+ */
+typedef struct
+{
+    char	*path;
+    char	*name;
+    int		cmyk;		/* bitcmyk, else pbmraw */
+    int		w, h;		/* of the first page */
+    int		pages;
+    double	mbytes;		/* of raster, headers aside */
+} RASTER;
+
+/*
+ * What one test did
+ */
+typedef struct
+{
+    int		pages;
+    double	secs;
+    double	mbytes;
+    int		failed;
+} RESULT;
+
+void
+debug(int level, char *fmt, ...)
+{
+	va_list ap;
+
+	if (Debug < level)
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+int
+error(int fatal, char *fmt, ...)
+{
+	va_list ap;
+
+	if (fatal)
+	    fprintf(stderr, "Error: ");
+	else
+	    fprintf(stderr, "Warning: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+
+	if (fatal > 0)
+	    exit(fatal);
+	else
+	    return (fatal);
+}
+
+void
+usage(void)
+{
+	fprintf(stderr,
+"Usage:\n"
+"	foo2bench [options] [raster-file ...]\n"
+"\n"
+"	Time the foo2* drivers and decoders, and the bitcmyk splitter and\n"
+"	JBIG codec they share, on synthetic blank, text, halftone and photo\n"
+"	pages, and on the given pbmraw or bitcmyk files.  Prints pages/sec,\n"
+"	raster MB/sec and the peak RSS of each test.  Run it from the build\n"
+"	directory, or use -b.\n"
+"\n"
+"Options:\n"
+"       -b dir      Directory of the drivers and decoders [%s]\n"
+"       -g WxH      Size of synthetic pages, and of bitcmyk files [%dx%d]\n"
+"       -k          Time the kernels only, not the drivers\n"
+"       -n pages    Synthetic pages of each kind [%d]\n"
+"       -r XxY      Resolution to give the drivers [%s]\n"
+"       -D lvl      Set Debug level [%d]\n"
+	, BinDir
+	, PageWidth, PageHeight
+	, Pages
+	, Res
+	, Debug
+	);
+
+	exit(1);
+}
+
+double
+now(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Synthetic pages.  All of them are made from this generator, seeded the
+ * same way each time, so the pages are too.
+ */
+uint64_t	Rand;
+
+uint32_t
+rand32(void)
+{
+    Rand ^= Rand << 13;
+    Rand ^= Rand >> 7;
+    Rand ^= Rand << 17;
+    return Rand >> 32;
+}
+
+#define	GLYPHS	32
+#define	GLYPHW	24
+#define	GLYPHH	36
+#define	LINEH	100
+uint32_t	Glyph[GLYPHS][GLYPHH];
+
+/*
+ * Strokes, each a few pixels thick, in a cell of GLYPHW x GLYPHH
+ */
+void
+make_glyphs(void)
+{
+    int		g, s, y;
+    uint32_t	bits;
+
+    Rand = 0x5eed;
+    memset(Glyph, 0, sizeof(Glyph));
+    for (g = 0; g < GLYPHS; ++g)
+	for (s = 0; s < 3; ++s)
+	{
+	    if (rand32() & 1)
+	    {
+		// Vertical, 4 pixels wide
+		bits = 0xfu << (rand32() % (GLYPHW - 4));
+		for (y = rand32() % 8; y < GLYPHH - (int) (rand32() % 8); ++y)
+		    Glyph[g][y] |= bits;
+	    }
+	    else
+	    {
+		// Horizontal, 4 rows high
+		y = rand32() % (GLYPHH - 4);
+		bits = ((1u << GLYPHW) - 1) & ~((1u << (rand32() % 8)) - 1);
+		Glyph[g][y] |= bits;
+		Glyph[g][y + 1] |= bits;
+		Glyph[g][y + 2] |= bits;
+		Glyph[g][y + 3] |= bits;
+	    }
+	}
+}
+
+void
+set_bit(unsigned char *row, int x)
+{
+    row[x >> 3] |= 0x80 >> (x & 7);
+}
+
+/*
+ * Make row y of one plane (C, M, Y, K = 0..3) of a page of this kind.
+ * A pbm page is its K plane.  The margins are left blank, as they are on
+ * paper; that also keeps the first bytes of a bitcmyk page from looking
+ * like the magic number of some other format.
+ */
+void
+make_row(int kind, int plane, int page, int y, int w, unsigned char *row)
+{
+    static const unsigned char	screen[8][8] =
+    {
+	{ 24, 10, 12, 26, 35, 47, 49, 37 },
+	{  8,  0,  2, 14, 45, 59, 61, 51 },
+	{ 22,  6,  4, 16, 43, 57, 63, 53 },
+	{ 30, 20, 18, 28, 33, 41, 55, 39 },
+	{ 34, 46, 48, 36, 25, 11, 13, 27 },
+	{ 44, 58, 60, 50,  9,  1,  3, 15 },
+	{ 42, 56, 62, 52, 23,  7,  5, 17 },
+	{ 32, 40, 54, 38, 31, 21, 19, 29 },
+    };
+    int		mx = w / 16, my = PageHeight / 16;
+    int		x, line, ly, cell, g;
+    uint32_t	h, bits;
+    double	v;
+
+    memset(row, 0, (w + 7) / 8);
+    if (y < my || y >= PageHeight - my)
+	return;
+    switch (kind)
+    {
+    case KIND_BLANK:
+	break;
+    case KIND_TEXT:
+	// Black text, with a line of color text now and then
+	line = y / LINEH;
+	ly = y % LINEH - 20;
+	if (ly < 0 || ly >= GLYPHH)
+	    break;
+	if (plane == 3 ? (line % 7 == 6) : (line % 7 != plane + 3))
+	    break;
+	for (x = mx, cell = 0; x + GLYPHW < w - mx; x += GLYPHW + 4)
+	{
+	    h = (line * 7919u + cell++ * 104729u + page * 15485863u)
+		    * 2654435761u;
+	    if ((h >> 24) % 6 == 0)
+		continue;		// a space
+	    g = (h >> 8) % GLYPHS;
+	    for (bits = Glyph[g][ly]; bits; bits &= bits - 1)
+		set_bit(row, x + __builtin_ctz(bits));
+	}
+	break;
+    case KIND_HALFTONE:
+	// A clustered dot screen over a ramp, across or down the page
+	for (x = mx; x < w - mx; ++x)
+	{
+	    v = (plane & 1) ? (double) y / PageHeight : (double) x / w;
+	    if (plane >= 2)
+		v = 1 - v;
+	    if (v * 64 > screen[y & 7][x & 7] + 0.5)
+		set_bit(row, x);
+	}
+	break;
+    case KIND_PHOTO:
+	// A smooth image, dithered against noise
+	for (x = mx; x < w - mx; ++x)
+	{
+	    v = 0.5 + 0.25 * sin(x * (plane + 1) / 211.0)
+		    + 0.2 * cos((y + page * 97) * (plane + 2) / 157.0);
+	    if (v * 4294967296.0 > rand32())
+		set_bit(row, x);
+	}
+	break;
+    }
+}
+
+/*
+ * Write Pages pages of a kind into TmpDir, as pbmraw or as bitcmyk
+ */
+void
+make_raster(RASTER *r, int kind, int cmyk)
+{
+    char		path[512];
+    FILE		*fp;
+    int			w = PageWidth, h = PageHeight;
+    int			bpl = (w + 7) / 8, rawbpl = (w + 1) / 2;
+    unsigned char	*row[4], *raw;
+    int			page, y, x, p;
+
+    sprintf(path, "%s/%s.%s", TmpDir, KindName[kind], cmyk ? "cmyk" : "pbm");
+    fp = fopen(path, "w");
+    if (!fp)
+	error(1, "Can't create '%s'\n", path);
+
+    for (p = 0; p < 4; ++p)
+	row[p] = malloc(bpl);
+    raw = malloc(rawbpl + 1);
+    if (!row[0] || !row[1] || !row[2] || !row[3] || !raw)
+	error(1, "Can't allocate rows\n");
+
+    Rand = 0x5eed + kind;
+    for (page = 0; page < Pages; ++page)
+    {
+	if (!cmyk)
+	    fprintf(fp, "P4\n%d %d\n", w, h);
+	for (y = 0; y < h; ++y)
+	{
+	    if (!cmyk)
+	    {
+		make_row(kind, 3, page, y, w, row[3]);
+		fwrite(row[3], 1, bpl, fp);
+		continue;
+	    }
+	    for (p = 0; p < 4; ++p)
+		make_row(kind, p, page, y, w, row[p]);
+	    memset(raw, 0, rawbpl + 1);
+	    for (x = 0; x < w; ++x)
+		for (p = 0; p < 4; ++p)
+		    if (row[p][x >> 3] & (0x80 >> (x & 7)))
+			raw[x >> 1] |= (0x80 >> p) >> ((x & 1) * 4);
+	    fwrite(raw, 1, rawbpl, fp);
+	}
+    }
+    if (fclose(fp))
+	error(1, "Can't write '%s'\n", path);
+    for (p = 0; p < 4; ++p)
+	free(row[p]);
+    free(raw);
+
+    r->path = strdup(path);
+    r->name = strdup(path + strlen(TmpDir) + 1);
+    r->cmyk = cmyk;
+    r->w = w;
+    r->h = h;
+    r->pages = Pages;
+    r->mbytes = (double) Pages * h * (cmyk ? rawbpl : bpl) / 1e6;
+}
+
+/*
+ * Read a pbmraw header.  Returns 0 at the end of the file.
+ */
+int
+read_pbm_header(FILE *fp, int *w, int *h)
+{
+    int		c, n, val[2];
+
+    if (getc(fp) != 'P' || getc(fp) != '4')
+	return 0;
+    for (n = 0; n < 2; ++n)
+    {
+	while ((c = getc(fp)) == '#' || c == ' ' || c == '\t'
+			|| c == '\n' || c == '\r')
+	    if (c == '#')
+		while ((c = getc(fp)) != EOF && c != '\n')
+		    ;
+	if (c == EOF)
+	    return 0;
+	ungetc(c, fp);
+	if (fscanf(fp, "%d", &val[n]) != 1)
+	    return 0;
+    }
+    getc(fp);
+    *w = val[0];
+    *h = val[1];
+    return 1;
+}
+
+/*
+ * Look over a raster given on the command line
+ */
+void
+scan_raster(RASTER *r, char *path)
+{
+    FILE	*fp;
+    struct stat	st;
+    int		w, h;
+    size_t	bpl;
+
+    fp = fopen(path, "r");
+    if (!fp)
+	error(1, "Can't open '%s'\n", path);
+    if (fstat(fileno(fp), &st))
+	error(1, "Can't stat '%s'\n", path);
+    memset(r, 0, sizeof(*r));
+    r->path = path;
+    r->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    if (read_pbm_header(fp, &r->w, &r->h))
+    {
+	w = r->w;
+	h = r->h;
+	do
+	{
+	    bpl = (w + 7) / 8;
+	    if (fseek(fp, bpl * h, SEEK_CUR) || ftell(fp) > st.st_size)
+		break;
+	    ++r->pages;
+	    r->mbytes += (double) bpl * h / 1e6;
+	} while (read_pbm_header(fp, &w, &h));
+	if (r->pages == 0)
+	    error(1, "'%s' has no whole page\n", path);
+    }
+    else
+    {
+	r->cmyk = 1;
+	r->w = PageWidth;
+	r->h = PageHeight;
+	bpl = (r->w + 1) / 2;
+	r->pages = st.st_size / (bpl * r->h);
+	r->mbytes = (double) r->pages * bpl * r->h / 1e6;
+	if (r->pages == 0)
+	    error(1, "'%s' is not pbmraw, nor a bitcmyk page of %dx%d\n",
+		    path, r->w, r->h);
+    }
+    fclose(fp);
+}
+
+/*
+ * Collect the BIE of a plane
+ */
+typedef struct
+{
+    unsigned char	*data;
+    size_t		len, size;
+} BUF;
+
+void
+buf_out(unsigned char *start, size_t len, void *arg)
+{
+    BUF		*b = arg;
+
+    if (b->len + len > b->size)
+    {
+	b->size = (b->len + len) * 2;
+	b->data = realloc(b->data, b->size);
+	if (!b->data)
+	    error(1, "Can't allocate %ld bytes\n", (long) b->size);
+    }
+    memcpy(b->data + b->len, start, len);
+    b->len += len;
+}
+
+/*
+ * Compress then decompress one plane, adding to the times of each
+ */
+void
+code_plane(unsigned char *bitmap, int w, int h, RESULT *enc, RESULT *dec)
+{
+    struct jbg_enc_state	se;
+    struct jbg_dec_state	sd;
+    BUF				bie = { NULL, 0, 0 };
+    double			t;
+    size_t			cnt;
+    int				rc;
+
+    t = now();
+    jbg_enc_init(&se, w, h, 1, &bitmap, buf_out, &bie);
+    jbg_enc_options(&se, JbgOptions[0], JbgOptions[1],
+			JbgOptions[2], JbgOptions[3], JbgOptions[4]);
+    jbg_enc_out(&se);
+    jbg_enc_free(&se);
+    enc->secs += now() - t;
+    enc->mbytes += (double) (w + 7) / 8 * h / 1e6;
+
+    t = now();
+    jbg_dec_init(&sd);
+    rc = jbg_dec_in(&sd, bie.data, bie.len, &cnt);
+    if (rc != JBG_EOK)
+    {
+	error(0, "JBIG decode: %s\n", jbg_strerror(rc));
+	dec->failed = 1;
+    }
+    jbg_dec_free(&sd);
+    dec->secs += now() - t;
+    dec->mbytes += (double) (w + 7) / 8 * h / 1e6;
+
+    free(bie.data);
+}
+
+/*
+ * The kernels, on each page of a raster: split (bitcmyk only), encode and
+ * decode.  Runs in a child, which writes its results down fd.
+ */
+void
+kernels(RASTER *r, int fd)
+{
+    RESULT		res[3];		/* split, encode, decode */
+    FILE		*fp;
+    unsigned char	*raw = NULL, *plane[4];
+    int			w = r->w, h = r->h;
+    int			bpl, rawbpl, page, i;
+    unsigned long	dots[4];
+    double		t;
+
+    memset(res, 0, sizeof(res));
+    memset(dots, 0, sizeof(dots));	/* split counts dots, as in the drivers */
+    fp = fopen(r->path, "r");
+    if (!fp)
+	error(1, "Can't open '%s'\n", r->path);
+
+    for (page = 0; page < r->pages; ++page)
+    {
+	if (!r->cmyk && !read_pbm_header(fp, &w, &h))
+	    break;
+	bpl = (w + 7) / 8;
+	rawbpl = (w + 1) / 2;
+	if (page == 0 || !r->cmyk)
+	{
+	    free(raw);
+	    raw = malloc((size_t) (r->cmyk ? rawbpl : bpl) * h);
+	    for (i = 0; r->cmyk && i < 4; ++i)
+		plane[i] = malloc((size_t) bpl * h);
+	    if (!raw || (r->cmyk && (!plane[0] || !plane[1]
+					|| !plane[2] || !plane[3])))
+		error(1, "Can't allocate page of %dx%d\n", w, h);
+	}
+	if (fread(raw, r->cmyk ? rawbpl : bpl, h, fp) != h)
+	    error(1, "Premature EOF on '%s'\n", r->path);
+
+	if (r->cmyk)
+	{
+	    t = now();
+	    bitcmyk_split(plane, bpl, raw, rawbpl, h, 0, 0, dots);
+	    res[0].secs += now() - t;
+	    res[0].mbytes += (double) rawbpl * h / 1e6;
+	    ++res[0].pages;
+	    for (i = 0; i < 4; ++i)
+		code_plane(plane[i], w, h, &res[1], &res[2]);
+	}
+	else
+	    code_plane(raw, w, h, &res[1], &res[2]);
+	++res[1].pages;
+	++res[2].pages;
+    }
+    fclose(fp);
+
+    if (write(fd, res, sizeof(res)) != sizeof(res))
+	error(1, "Can't write results\n");
+}
+
+/*
+ * Run one test in a child: either a function, or a program with its
+ * stdin and stdout redirected.  Returns the peak RSS of the child, in KB.
+ */
+long
+run(RESULT *res, int nres, RASTER *r, char **argv, char *in, char *out,
+	char *dir)
+{
+    int			fds[2], status, i;
+    pid_t		pid;
+    struct rusage	ru;
+    double		t;
+
+    if (pipe(fds))
+	error(1, "Can't create pipe\n");
+    t = now();
+    pid = fork();
+    if (pid < 0)
+	error(1, "Can't fork\n");
+    if (pid == 0)
+    {
+	close(fds[0]);
+	if (!argv)
+	{
+	    kernels(r, fds[1]);
+	    _exit(0);
+	}
+	if (dir && chdir(dir))
+	    _exit(126);
+	if (freopen(in, "r", stdin) == NULL
+		|| freopen(out, "w", stdout) == NULL
+		|| (Debug < 2 && freopen("/dev/null", "w", stderr) == NULL))
+	    _exit(126);
+	execv(argv[0], argv);
+	_exit(127);
+    }
+    close(fds[1]);
+
+    memset(res, 0, nres * sizeof(*res));
+    if (!argv && read(fds[0], res, nres * sizeof(*res))
+		    != nres * sizeof(*res))
+	res[0].failed = 1;
+    close(fds[0]);
+    if (wait4(pid, &status, 0, &ru) != pid)
+	error(1, "Can't wait for child\n");
+    if (argv)
+    {
+	res[0].secs = now() - t;
+	res[0].pages = r->pages;
+	res[0].mbytes = r->mbytes;
+	res[0].failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	debug(1, "%s exited with status %d\n", argv[0], status);
+    }
+    else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	for (i = 0; i < nres; ++i)
+	    res[i].failed = 1;
+    return ru.ru_maxrss;
+}
+
+void
+report(char *raster, char *what, RESULT *res, long rss)
+{
+    char	name[64];
+
+    snprintf(name, sizeof(name), "%s %s", raster, what);
+    if (res->secs <= 0)
+	res->secs = 1e-9;
+    printf("%-28s %5d %9.3f %9.2f %9.2f %9ld%s\n",
+	    name, res->pages, res->secs,
+	    res->pages / res->secs, res->mbytes / res->secs, rss,
+	    res->failed ? "  FAILED" : "");
+    fflush(stdout);
+}
+
+/*
+ * Remove what a decoder left in a directory
+ */
+void
+clean_dir(char *dir)
+{
+    DIR			*d;
+    struct dirent	*de;
+    char		path[512];
+
+    d = opendir(dir);
+    if (!d)
+	return;
+    while ((de = readdir(d)) != NULL)
+    {
+	if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	    continue;
+	snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+	unlink(path);
+    }
+    closedir(d);
+}
+
+void
+bench(RASTER *r)
+{
+    RESULT	res[3];
+    long	rss;
+    char	prog[512], geom[32], stream[512], decdir[512];
+    char	*argv[8];
+    int		i, n;
+
+    rss = run(res, 3, r, NULL, NULL, NULL, NULL);
+    if (r->cmyk)
+	report(r->name, "split", &res[0], rss);
+    report(r->name, "encode", &res[1], rss);
+    report(r->name, "decode", &res[2], rss);
+    if (KernelsOnly)
+	return;
+
+    snprintf(geom, sizeof(geom), "-g%dx%d", r->w, r->h);
+    snprintf(stream, sizeof(stream), "%s/stream", TmpDir);
+    snprintf(decdir, sizeof(decdir), "%s/decoded", TmpDir);
+    mkdir(decdir, 0700);
+    for (i = 0; i < NLANGS; ++i)
+    {
+	snprintf(prog, sizeof(prog), "%s/%s", BinDir, Langs[i].driver);
+	if (access(prog, X_OK))
+	{
+	    error(0, "No '%s', skipped\n", prog);
+	    continue;
+	}
+	n = 0;
+	argv[n++] = prog;
+	argv[n++] = geom;
+	argv[n++] = "-r";
+	argv[n++] = Res;
+	if (r->cmyk)
+	    argv[n++] = "-c";
+	if (Langs[i].option)
+	    argv[n++] = Langs[i].option;
+	argv[n] = NULL;
+	rss = run(res, 1, r, argv, r->path, stream, NULL);
+	report(r->name, Langs[i].driver, res, rss);
+
+	snprintf(prog, sizeof(prog), "%s/%s", BinDir, Langs[i].decoder);
+	if (res->failed || access(prog, X_OK))
+	    continue;
+	if (prog[0] != '/')
+	{
+	    // The decoder runs in decdir
+	    char	*cwd = getcwd(NULL, 0);
+
+	    snprintf(prog, sizeof(prog), "%s/%s/%s",
+		    cwd, BinDir, Langs[i].decoder);
+	    free(cwd);
+	}
+	n = 0;
+	argv[n++] = prog;
+	argv[n++] = "-d";
+	argv[n++] = "page";
+	argv[n] = NULL;
+	rss = run(res, 1, r, argv, stream, "/dev/null", decdir);
+	// Some decoders complain at the end of a good stream; not our job
+	res->failed = 0;
+	report(r->name, Langs[i].decoder, res, rss);
+	clean_dir(decdir);
+    }
+    unlink(stream);
+    rmdir(decdir);
+}
+
+int
+main(int argc, char *argv[])
+{
+	extern int	optind;
+	extern char	*optarg;
+	int		c;
+	int		i, kind, cmyk;
+	char		*tmp;
+	RASTER		r, *files;
+
+	while ( (c = getopt(argc, argv, "b:g:kn:r:D:?h")) != EOF)
+		switch (c)
+		{
+		case 'b':	BinDir = optarg; break;
+		case 'g':	if (sscanf(optarg, "%dx%d",
+					&PageWidth, &PageHeight) != 2
+					|| PageWidth <= 0 || PageHeight <= 0)
+				    error(1, "Illegal format '%s' for -g\n",
+					optarg);
+				break;
+		case 'k':	KernelsOnly = 1; break;
+		case 'n':	Pages = atoi(optarg);
+				if (Pages < 0)
+				    error(1, "Illegal page count '%s'\n",
+					optarg);
+				break;
+		case 'r':	Res = optarg; break;
+		case 'D':	Debug = atoi(optarg); break;
+		default:	usage(); break;
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	// Look the files over before anything is timed
+	files = calloc(argc + 1, sizeof(*files));
+	if (!files)
+	    error(1, "Can't allocate\n");
+	for (i = 0; i < argc; ++i)
+	    scan_raster(&files[i], argv[i]);
+
+	tmp = getenv("TMPDIR");
+	snprintf(TmpDir, sizeof(TmpDir), "%s/foo2bench.XXXXXX",
+		tmp ? tmp : "/tmp");
+	if (!mkdtemp(TmpDir))
+	    error(1, "Can't create '%s'\n", TmpDir);
+
+	printf("%-28s %5s %9s %9s %9s %9s\n",
+		"test", "pages", "secs", "pages/s", "MB/s", "maxRSS-KB");
+	fflush(stdout);
+
+	make_glyphs();
+	for (kind = 0; Pages && kind < NKINDS; ++kind)
+	    for (cmyk = 0; cmyk < 2; ++cmyk)
+	    {
+		make_raster(&r, kind, cmyk);
+		bench(&r);
+		unlink(r.path);
+		free(r.path);
+		free(r.name);
+	    }
+
+	for (i = 0; i < argc; ++i)
+	    bench(&files[i]);
+
+	rmdir(TmpDir);
+	exit(0);
+}
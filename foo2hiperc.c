@@ -61,12 +61,20 @@ static char Version[] = "$Id: foo2hiperc.c,v 1.35 2013/12/01 20:13:58 rick Exp $
     #include <sys/utsname.h>
 #endif
 #include "jbig.h"
+#include "bitcmyk.h"
+#include "biechain.h"
+#include "workpool.h"
+#include "stats.h"
+#include "mirror.h"
+#include "dots.h"
+#include "pageq.h"
 #include "hiperc.h"
 
 /*
  * Command line options
  */
 int	Debug = 0;
+int	ZeroTime = 0;
 int	ResX = 600;
 int	ResY = 600;
 int	Bpp = 1;
@@ -103,6 +111,7 @@ int	SaveToner = 0;
 int	PageNum = 0;
 int	RealWidth;
 int	EconoMode = 0;
+unsigned long	Dots[4];
 int	Compressed = 0;
 
 int	IsCUPS = 0;
@@ -115,6 +124,9 @@ typedef struct
 SEEKREC	SeekRec[2000];
 int	SeekIndex = 0;
 
+int	Threads = 1;
+WORKPOOL	*Pool = NULL;
+
 long JbgOptions[5] =
 {
     /* Order */
@@ -161,6 +173,7 @@ usage(void)
 "-d duplex         Duplex code to send to printer [%d]\n"
 "                    1=off, 2=longedge, 3=shortedge\n"
 "-g <xpix>x<ypix>  Set page dimensions in pixels [%dx%d]\n"
+"-j threads        Compress planes using this many threads [%d]\n"
 "-m media          Media code to send to printer [%d]\n"
 "                    0=plain 1=labels 2=transparency\n"
 "-p paper          Paper code to send to printer [%d]\n"
@@ -196,6 +209,7 @@ usage(void)
 "-V                Version %s\n"
     , Duplex
     , PageWidth , PageHeight
+    , Threads
     , MediaCode
     , PaperCode
     , Copies
@@ -215,92 +229,6 @@ usage(void)
   exit(1);
 }
 
-/*
- * Mirror1: bits 01234567 become 76543210
- */
-unsigned char	Mirror1[256] =
-{
-	  0,128, 64,192, 32,160, 96,224, 16,144, 80,208, 48,176,112,240,
-	  8,136, 72,200, 40,168,104,232, 24,152, 88,216, 56,184,120,248,
-	  4,132, 68,196, 36,164,100,228, 20,148, 84,212, 52,180,116,244,
-	 12,140, 76,204, 44,172,108,236, 28,156, 92,220, 60,188,124,252,
-	  2,130, 66,194, 34,162, 98,226, 18,146, 82,210, 50,178,114,242,
-	 10,138, 74,202, 42,170,106,234, 26,154, 90,218, 58,186,122,250,
-	  6,134, 70,198, 38,166,102,230, 22,150, 86,214, 54,182,118,246,
-	 14,142, 78,206, 46,174,110,238, 30,158, 94,222, 62,190,126,254,
-	  1,129, 65,193, 33,161, 97,225, 17,145, 81,209, 49,177,113,241,
-	  9,137, 73,201, 41,169,105,233, 25,153, 89,217, 57,185,121,249,
-	  5,133, 69,197, 37,165,101,229, 21,149, 85,213, 53,181,117,245,
-	 13,141, 77,205, 45,173,109,237, 29,157, 93,221, 61,189,125,253,
-	  3,131, 67,195, 35,163, 99,227, 19,147, 83,211, 51,179,115,243,
-	 11,139, 75,203, 43,171,107,235, 27,155, 91,219, 59,187,123,251,
-	  7,135, 71,199, 39,167,103,231, 23,151, 87,215, 55,183,119,247,
-	 15,143, 79,207, 47,175,111,239, 31,159, 95,223, 63,191,127,255,
-};
-
-/*
- * Mirror2: bits 01234567 become 67452301
- */
-unsigned char	Mirror2[256] =
-{
-	  0, 64,128,192, 16, 80,144,208, 32, 96,160,224, 48,112,176,240,
-	  4, 68,132,196, 20, 84,148,212, 36,100,164,228, 52,116,180,244,
-	  8, 72,136,200, 24, 88,152,216, 40,104,168,232, 56,120,184,248,
-	 12, 76,140,204, 28, 92,156,220, 44,108,172,236, 60,124,188,252,
-	  1, 65,129,193, 17, 81,145,209, 33, 97,161,225, 49,113,177,241,
-	  5, 69,133,197, 21, 85,149,213, 37,101,165,229, 53,117,181,245,
-	  9, 73,137,201, 25, 89,153,217, 41,105,169,233, 57,121,185,249,
-	 13, 77,141,205, 29, 93,157,221, 45,109,173,237, 61,125,189,253,
-	  2, 66,130,194, 18, 82,146,210, 34, 98,162,226, 50,114,178,242,
-	  6, 70,134,198, 22, 86,150,214, 38,102,166,230, 54,118,182,246,
-	 10, 74,138,202, 26, 90,154,218, 42,106,170,234, 58,122,186,250,
-	 14, 78,142,206, 30, 94,158,222, 46,110,174,238, 62,126,190,254,
-	  3, 67,131,195, 19, 83,147,211, 35, 99,163,227, 51,115,179,243,
-	  7, 71,135,199, 23, 87,151,215, 39,103,167,231, 55,119,183,247,
-	 11, 75,139,203, 27, 91,155,219, 43,107,171,235, 59,123,187,251,
-	 15, 79,143,207, 31, 95,159,223, 47,111,175,239, 63,127,191,255,
-};
-
-/*
- * Mirror4: bits 01234567 become 45670123
- */
-unsigned char	Mirror4[256] =
-{
-	  0, 16, 32, 48, 64, 80, 96,112,128,144,160,176,192,208,224,240,
-	  1, 17, 33, 49, 65, 81, 97,113,129,145,161,177,193,209,225,241,
-	  2, 18, 34, 50, 66, 82, 98,114,130,146,162,178,194,210,226,242,
-	  3, 19, 35, 51, 67, 83, 99,115,131,147,163,179,195,211,227,243,
-	  4, 20, 36, 52, 68, 84,100,116,132,148,164,180,196,212,228,244,
-	  5, 21, 37, 53, 69, 85,101,117,133,149,165,181,197,213,229,245,
-	  6, 22, 38, 54, 70, 86,102,118,134,150,166,182,198,214,230,246,
-	  7, 23, 39, 55, 71, 87,103,119,135,151,167,183,199,215,231,247,
-	  8, 24, 40, 56, 72, 88,104,120,136,152,168,184,200,216,232,248,
-	  9, 25, 41, 57, 73, 89,105,121,137,153,169,185,201,217,233,249,
-	 10, 26, 42, 58, 74, 90,106,122,138,154,170,186,202,218,234,250,
-	 11, 27, 43, 59, 75, 91,107,123,139,155,171,187,203,219,235,251,
-	 12, 28, 44, 60, 76, 92,108,124,140,156,172,188,204,220,236,252,
-	 13, 29, 45, 61, 77, 93,109,125,141,157,173,189,205,221,237,253,
-	 14, 30, 46, 62, 78, 94,110,126,142,158,174,190,206,222,238,254,
-	 15, 31, 47, 63, 79, 95,111,127,143,159,175,191,207,223,239,255,
-};
-
-void
-rotate_bytes_180(unsigned char *sp, unsigned char *ep, unsigned char *mirror)
-{
-    unsigned char tmp;
-
-    while (sp < ep)
-    {
-	tmp = mirror[*sp];
-	*sp = mirror[*ep];
-	*ep = tmp;
-	++sp;
-	--ep;
-    }
-    if (sp == ep)
-	*sp = mirror[*sp];
-}
-
 void
 debug(int level, char *fmt, ...)
 {
@@ -328,29 +256,6 @@ error(int fatal, char *fmt, ...)
 	exit(fatal);
 }
 
-/*
- * A linked list of compressed data
- */
-typedef struct _BIE_CHAIN{
-    unsigned char	*data;
-    size_t		len;
-    struct _BIE_CHAIN	*next;
-} BIE_CHAIN;
-
-void
-free_chain(BIE_CHAIN *chain)
-{
-    BIE_CHAIN	*next;
-    next = chain;
-    while ((chain = next))
-    {
-	next = chain->next;
-	if (chain->data)
-	    free(chain->data);
-	free(chain);
-    }
-}
-
 /*
  * This creates a linked list of compressed data.  The first item
  * in the list is the BIH and is always 20 bytes in size.  Each following
@@ -362,15 +267,13 @@ output_jbig(unsigned char *start, size_t len, void *cbarg)
     BIE_CHAIN	*current, **root = (BIE_CHAIN **) cbarg;
     int		size = 0x80000;	// Printer does strange things otherwise.
 
+    stats_bytes(STATS_OUT, len);
+
     if ( (*root) == NULL)
     {
-	(*root) = malloc(sizeof(BIE_CHAIN));
+	(*root) = bie_alloc();
 	if (!(*root))
 	    error(1, "Can't allocate space for chain\n");
-
-	(*root)->data = NULL;
-	(*root)->next = NULL;
-	(*root)->len = 0;
 	size = 20;
 	if (len != 20)
 	    error(1, "First chunk must be BIH and 20 bytes long\n");
@@ -386,9 +289,10 @@ output_jbig(unsigned char *start, size_t len, void *cbarg)
 
 	if (!current->data)
 	{
-	    current->data = malloc(size);
+	    current->data = bie_block(size);
 	    if (!current->data)
 		error(1, "Can't allocate space for compressed data\n");
+	    current->size = size;
 	}
 
 	left = size - current->len;
@@ -400,13 +304,10 @@ output_jbig(unsigned char *start, size_t len, void *cbarg)
 
 	if (current->len == size)
 	{
-	    current->next = malloc(sizeof(BIE_CHAIN));
+	    current->next = bie_alloc();
 	    if (!current->next)
 		error(1, "Can't allocate space for chain\n");
 	    current = current->next;
-	    current->data = NULL;
-	    current->next = NULL;
-	    current->len = 0;
 	}
     }
 }
@@ -443,56 +344,89 @@ start_page_compressed(int nbie, int w, int h, int plane, unsigned char *bih,
     if (rc == 0) error(1, "fwrite(2): rc == 0!\n");
 }
 
+/*
+ * Each band of write_plane_compressed() is a complete BIE, so with -j a
+ * window of bands is compressed on the worker threads and then written
+ * out in order.  The window bounds the compressed data held in memory.
+ */
+#define	BANDWINDOW	16
+
+typedef struct
+{
+    unsigned char	*bitmaps[1];
+    int			w, lines;
+    BIE_CHAIN		*chain;
+} BAND;
+
+// One encoder per job, kept from band to band by jbg_enc_reinit()
+static struct jbg_enc_state	BandEnc[BANDWINDOW];
+
+static void
+encode_band(void *arg, int i)
+{
+    BAND		*band = (BAND *) arg + i;
+    struct jbg_enc_state *se = &BandEnc[i];
+
+    band->chain = NULL;
+    jbg_enc_reinit(se, band->w, band->lines, 1, band->bitmaps,
+			output_jbig, &band->chain);
+    jbg_enc_options(se, JbgOptions[0], JbgOptions[1],
+			band->lines, JbgOptions[3], JbgOptions[4]);
+    stats_begin(STATS_ENCODE);
+    jbg_enc_out(se);
+    stats_end(STATS_ENCODE);
+}
+
 void
 write_plane_compressed(int nbie, unsigned char *buf, int w, int h, int plane,
 			FILE *ofp)
 {
     int		y;
     int		ns = 256;
+    BAND	band[BANDWINDOW];
+    int		i, n;
 
-    for (y = 0; y < h; y += ns)
+    for (y = 0; y < h; y += n * ns)
     {
-	struct jbg_enc_state	se;
-	BIE_CHAIN		*chain;
-	BIE_CHAIN		*current;
-	unsigned char		*bitmaps[1];
-	int			lines = (h-y) > ns ? ns : (h-y);
-	int			chainlen;
-	DWORD			rec[5];
-	int			rc;
-
-	bitmaps[0] = buf + y * ((w+7)/8);
-	chain = NULL;
-	JbgOptions[2] = (lines < ns) ? lines : ns;
-
-	jbg_enc_init(&se, w, lines, 1, bitmaps, output_jbig, &chain);
-	jbg_enc_options(&se, JbgOptions[0], JbgOptions[1],
-			JbgOptions[2], JbgOptions[3], JbgOptions[4]);
-	jbg_enc_out(&se);
-	jbg_enc_free(&se);
-
-	if (chain->len != 20)
-	    error(1,"Program error: missing BIH at start of chain\n"); 
-	if (y == 0)
-	    start_page_compressed(nbie, w, h, plane, chain->data, ofp);
-
-	chainlen = 0;
-	for (current = chain->next; current; current = current->next)
-	    chainlen += current->len;
-
-	rec[0] = be32(chainlen + 20);	//reclen
-	rec[1] = be32(1);		//rectype=1
+	for (n = 0; n < BANDWINDOW && y + n*ns < h; ++n)
+	{
+	    int		yy = y + n*ns;
 
-	rec[2] = be32(4);		//block0: len=4
-	rec[3] = be32(plane << 24);	//block0: black
+	    band[n].bitmaps[0] = buf + yy * ((w+7)/8);
+	    band[n].w = w;
+	    band[n].lines = (h-yy) > ns ? ns : (h-yy);
+	}
+	workpool_run(Pool, n, encode_band, band);
 
-	rec[4] = be32(chainlen);	//block1: len
-	rc = fwrite(rec, 20, 1, ofp);
-	if (rc == 0) error(1, "fwrite(3): rc == 0!\n");
-	for (current = chain->next; current; current = current->next)
+	for (i = 0; i < n; ++i)
 	{
-	    rc = fwrite(current->data, 1, current->len, ofp);
-	    if (rc == 0) error(1, "fwrite(4): rc == 0!\n");
+	    BIE_CHAIN		*chain = band[i].chain;
+	    BIE_CHAIN		*current;
+	    int			chainlen;
+	    DWORD		rec[5];
+	    int			rc;
+
+	    if (chain->len != 20)
+		error(1,"Program error: missing BIH at start of chain\n"); 
+	    if (y == 0 && i == 0)
+		start_page_compressed(nbie, w, h, plane, chain->data, ofp);
+
+	    chainlen = 0;
+	    for (current = chain->next; current; current = current->next)
+		chainlen += current->len;
+
+	    rec[0] = be32(chainlen + 20);	//reclen
+	    rec[1] = be32(1);		//rectype=1
+
+	    rec[2] = be32(4);		//block0: len=4
+	    rec[3] = be32(plane << 24);	//block0: black
+
+	    rec[4] = be32(chainlen);	//block1: len
+	    rc = fwrite(rec, 20, 1, ofp);
+	    if (rc == 0) error(1, "fwrite(3): rc == 0!\n");
+	    if (bie_write(chain->next, ofp) == EOF)
+		error(1, "fwrite(4): rc == 0!\n");
+	    free_chain(chain);
 	}
     }
 }
@@ -550,6 +484,7 @@ write_plane(int pn, BIE_CHAIN **root, FILE *ofp)
 	rec[4] = be32(blklen);	//block1: len
 	rc = fwrite(rec, 20, 1, ofp);
 	if (rc == 0) error(1, "fwrite(5): rc == 0!\n");
+	stats_bytes(STATS_OUT, blklen);
 	rc = fwrite(buf + y*(w/8), 1, blklen, ofp);
 	if (rc == 0) error(1, "fwrite(6): rc == 0!\n");
     }
@@ -573,6 +508,9 @@ end_page(FILE *ofp)
     ++pageno;
     if (IsCUPS)
 	fprintf(stderr, "PAGE: %d %d\n", pageno, Copies);
+    stats_dots(Dots);
+    memset(Dots, 0, sizeof(Dots));
+    stats_page();
 }
 
 void
@@ -634,6 +572,7 @@ write_plane_uncompressed(unsigned char *buf, int w, int h, int plane, FILE *ofp)
 	rec[4] = be32(w256);		//block1: len
 	rc = fwrite(rec, 20, 1, ofp);
 	if (rc == 0) error(1, "fwrite(9): rc == 0!\n");
+	stats_bytes(STATS_OUT, blklen);
 	rc = fwrite(buf + y*(w/8), 1, blklen, ofp);
 	if (rc == 0) error(1, "fwrite(10): rc == 0!\n");
     }
@@ -650,6 +589,7 @@ write_page(BIE_CHAIN **root, BIE_CHAIN **root2,
 {
     int	nbie = root2 ? 4 : 1;
 
+    stats_begin(STATS_WRITE);
 //    start_page(root, nbie, ofp);
 
     if (root)
@@ -666,6 +606,7 @@ write_page(BIE_CHAIN **root, BIE_CHAIN **root2,
     if (root4)
 	write_plane(4, root4, ofp);
 
+    stats_end(STATS_WRITE);
     end_page(ofp);
     return 0;
 }
@@ -714,6 +655,8 @@ start_doc(FILE *ofp)
     #endif
 
     now = time(NULL);
+    if (ZeroTime)
+	now = 0;
     tmp = localtime(&now);
     strftime(datetime, sizeof(datetime), "00:00:00 %Y/%m/%d", tmp);
     fprintf(ofp, "@PJL SET OKIAUXJOBINFO DATA=\"ReceptionTime=%s\"\r\n",
@@ -805,78 +748,12 @@ cmyk_planes(unsigned char *plane[4], unsigned char *raw, int w, int h)
 {
     int			rawbpl = (w+1) / 2;
     int			bpl = (w + 7) / 8;
-    int			i;
-    int			x, y;
-    unsigned char	byte;
-    unsigned char	mask[8] = { 128, 64, 32, 16, 8, 4, 2, 1 };
-    int			aib = AllIsBlack;
-    int			bc = BlackClears;
 
     bpl = (bpl + 15) & ~15;
     debug(1, "w=%d, bpl=%d, rawbpl=%d\n", w, bpl, rawbpl);
-    AnyColor = 0;
-    for (i = 0; i < 4; ++i)
-	memset(plane[i], 0, bpl * h);
 
-    //
-    // Unpack the combined plane into individual color planes
-    //
-    // TODO: this can be speeded up using a 256 or 65536 entry lookup table
-    //
-    for (y = 0; y < h; ++y)
-    {
-	for (x = 0; x < w; ++x)
-	{
-	    byte = raw[y*rawbpl + x/2];
-
-	    if (aib && (byte & 0xE0) == 0xE0)
-	    {
-		plane[3][y*bpl + x/8] |= mask[x&7];
-	    }
-	    else if (byte & 0x10)
-	    {
-		plane[3][y*bpl + x/8] |= mask[x&7];
-		if (!bc)
-		{
-		    if (byte & 0x80) plane[0][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x40) plane[1][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x20) plane[2][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0xE0) AnyColor |= byte;
-		}
-	    }
-	    else
-	    {
-		if (byte & 0x80) plane[0][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x40) plane[1][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x20) plane[2][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0xE0) AnyColor |= byte;
-	    }
-
-	    ++x;
-	    if (aib && (byte & 0x0E) == 0x0E)
-	    {
-		plane[3][y*bpl + x/8] |= mask[x&7];
-	    }
-	    else if (byte & 0x1)
-	    {
-		plane[3][y*bpl + x/8] |= mask[x&7];
-		if (!bc)
-		{
-		    if (byte & 0x8) plane[0][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x4) plane[1][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x2) plane[2][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0xE) AnyColor |= byte;
-		}
-	    }
-	    else
-	    {
-		if (byte & 0x8) plane[0][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x4) plane[1][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x2) plane[2][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0xE) AnyColor |= byte;
-	    }
-	}
-    }
+    AnyColor = bitcmyk_split(plane, bpl, raw, rawbpl, h,
+				AllIsBlack, BlackClears, Dots);
     debug(2, "BlackClears = %d; AnyColor = %s %s %s\n",
 	    BlackClears,
 	    (AnyColor & 0x88) ? "Cyan" : "",
@@ -885,14 +762,43 @@ cmyk_planes(unsigned char *plane[4], unsigned char *raw, int w, int h)
 	    );
 }
 
+/*
+ * The planes of a color page are compressed independently, so with -j
+ * they are handed to the worker threads.  A job only touches its own
+ * bitmap and chain.
+ */
+typedef struct
+{
+    unsigned char	*bitmaps[4][1];
+    int			w, h;
+    BIE_CHAIN		*chain[4];
+} PLANES;
+
+// One encoder per plane, kept from page to page by jbg_enc_reinit()
+static struct jbg_enc_state	PlaneEnc[4];
+
+static void
+encode_plane(void *arg, int i)
+{
+    PLANES		*pl = arg;
+    struct jbg_enc_state *se = &PlaneEnc[i];
+
+    jbg_enc_reinit(se, pl->w, pl->h, 1, pl->bitmaps[i],
+			output_jbig, &pl->chain[i]);
+    jbg_enc_options(se, JbgOptions[0], JbgOptions[1],
+			JbgOptions[2], JbgOptions[3], JbgOptions[4]);
+    stats_begin(STATS_ENCODE);
+    jbg_enc_out(se);
+    stats_end(STATS_ENCODE);
+}
+
 int
 cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
 {
-    BIE_CHAIN *chain[4];
+    PLANES pl;
     int i;
     int	bpl, bpl16;
-    unsigned char *plane[4], *bitmaps[4][1];
-    struct jbg_enc_state se[4]; 
+    unsigned char *plane[4];
 
     RealWidth = w;
     w = (w + 127) & ~127;
@@ -904,10 +810,12 @@ cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
     {
 	plane[i] = malloc(bpl16 * h);
 	if (!plane[i]) error(3, "Cannot allocate space for bit plane\n");
-	chain[i] = NULL;
+	pl.chain[i] = NULL;
     }
 
+    stats_begin(STATS_SPLIT);
     cmyk_planes(plane, raw, RealWidth, h);
+    stats_end(STATS_SPLIT);
 
     if (Compressed)
     {
@@ -927,21 +835,20 @@ cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
 		}
 	    }
 
-	    *bitmaps[i] = plane[i];
-
-	    jbg_enc_init(&se[i], w, h, 1, bitmaps[i], output_jbig, &chain[i]);
-	    jbg_enc_options(&se[i], JbgOptions[0], JbgOptions[1],
-			    JbgOptions[2], JbgOptions[3], JbgOptions[4]);
-	    jbg_enc_out(&se[i]);
-	    jbg_enc_free(&se[i]);
+	    *pl.bitmaps[i] = plane[i];
 	}
 
+	pl.w = w;
+	pl.h = h;
+	workpool_run(Pool, 4, encode_plane, &pl);
+
 	if (Color2Mono)
-	    write_page(&chain[Color2Mono-1], NULL, NULL, NULL, ofp);
+	    write_page(&pl.chain[Color2Mono-1], NULL, NULL, NULL, ofp);
 	else if (AnyColor)
-	    write_page(&chain[0], &chain[1], &chain[2], &chain[3], ofp);
+	    write_page(&pl.chain[0], &pl.chain[1],
+			&pl.chain[2], &pl.chain[3], ofp);
 	else
-	    write_page(&chain[3], NULL, NULL, NULL, ofp);
+	    write_page(&pl.chain[3], NULL, NULL, NULL, ofp);
     }
     else
     {
@@ -974,10 +881,8 @@ cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
 int
 pksm_page(unsigned char *plane[4], int w, int h, FILE *ofp)
 {
-    BIE_CHAIN *chain[4];
+    PLANES pl;
     int i;
-    unsigned char *bitmaps[4][1];
-    struct jbg_enc_state se[4]; 
 
     RealWidth = w;
     w = (w + 127) & ~127;
@@ -985,26 +890,23 @@ pksm_page(unsigned char *plane[4], int w, int h, FILE *ofp)
 
     if (Compressed)
     {
-	for (i = 0; i < 4; ++i)
-	    chain[i] = NULL;
-
 	for (i = 0; i < 4; ++i)
 	{
-	    *bitmaps[i] = plane[i];
-
-	    jbg_enc_init(&se[i], w, h, 1, bitmaps[i], output_jbig, &chain[i]);
-	    jbg_enc_options(&se[i], JbgOptions[0], JbgOptions[1],
-			    JbgOptions[2], JbgOptions[3], JbgOptions[4]);
-	    jbg_enc_out(&se[i]);
-	    jbg_enc_free(&se[i]);
+	    pl.chain[i] = NULL;
+	    *pl.bitmaps[i] = plane[i];
 	}
 
+	pl.w = w;
+	pl.h = h;
+	workpool_run(Pool, 4, encode_plane, &pl);
+
 	if (Color2Mono)
-	    write_page(&chain[Color2Mono-1], NULL, NULL, NULL, ofp);
+	    write_page(&pl.chain[Color2Mono-1], NULL, NULL, NULL, ofp);
 	else if (AnyColor)
-	    write_page(&chain[0], &chain[1], &chain[2], &chain[3], ofp);
+	    write_page(&pl.chain[0], &pl.chain[1],
+			&pl.chain[2], &pl.chain[3], ofp);
 	else
-	    write_page(&chain[3], NULL, NULL, NULL, ofp);
+	    write_page(&pl.chain[3], NULL, NULL, NULL, ofp);
     }
     else
     {
@@ -1037,7 +939,7 @@ pbm_page(unsigned char *buf, int w, int h, FILE *ofp)
 {
     // BIE_CHAIN		*chain = NULL;
     unsigned char	*bitmaps[1];
-    // struct jbg_enc_state se; 
+    // struct jbg_enc_state *se = &PlaneEnc[3];
 
     RealWidth = w;
     w = (w + 127) & ~127;
@@ -1056,6 +958,10 @@ pbm_page(unsigned char *buf, int w, int h, FILE *ofp)
 	for (y = 1; y < h; y += 2)
 	    for (x = 0; x < bpl16; ++x)
 		buf[y*bpl16 + x] &= 0xaa;
+	// The mask takes dots away, so count them again
+	stats_begin(STATS_DOTS);
+	Dots[3] = dots_count(buf, (size_t) bpl16 * h);
+	stats_end(STATS_DOTS);
     }
 
     *bitmaps = buf;
@@ -1068,11 +974,13 @@ pbm_page(unsigned char *buf, int w, int h, FILE *ofp)
 
 	end_page(ofp);
 #if 0
-	jbg_enc_init(&se, w, h, 1, bitmaps, output_jbig, &chain);
-	jbg_enc_options(&se, JbgOptions[0], JbgOptions[1],
+	// A mono page is the K plane, and reuses its encoder
+	jbg_enc_reinit(se, w, h, 1, bitmaps, output_jbig, &chain);
+	jbg_enc_options(se, JbgOptions[0], JbgOptions[1],
 			    JbgOptions[2], JbgOptions[3], JbgOptions[4]);
-	jbg_enc_out(&se);
-	jbg_enc_free(&se);
+	stats_begin(STATS_ENCODE);
+	jbg_enc_out(se);
+	stats_end(STATS_ENCODE);
 
 	write_page(&chain, NULL, NULL, NULL, ofp);
 #endif
@@ -1089,18 +997,42 @@ pbm_page(unsigned char *buf, int w, int h, FILE *ofp)
     return 0;
 }
 
+/*
+ * Why read_and_clip_image() couldn't read a page.  With -j it runs on the
+ * reader thread, which must not exit, so it leaves the message here and
+ * returns READ_ERROR for the main thread to make the complaint.
+ */
+#define READ_ERROR	(-2)
+static char	ReadError[80];
+
+static void
+read_error(char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(ReadError, sizeof(ReadError), fmt, ap);
+    va_end(ap);
+}
+
 int
 read_and_clip_image(unsigned char *buf,
 			int rawBpl, int rightBpl, int pixelsPerByte,
-			int bpl, int h, int bpl16, FILE *ifp)
+			int bpl, int h, int bpl16, int rotate,
+			unsigned long *dots, FILE *ifp)
 {
     unsigned char	*rowbuf, *rowp;
     int			y;
     int			rc;
+    int			pad = rotate ? bpl16 - bpl : 0;
 
+    stats_begin(STATS_READ);
     rowbuf = malloc(rawBpl);
     if (!rowbuf)
-	error(1, "Can't allocate row buffer\n");
+    {
+	read_error("Can't allocate row buffer\n");
+	goto fail;
+    }
 
     // Clip top rows
     if (UpperLeftY)
@@ -1111,14 +1043,19 @@ read_and_clip_image(unsigned char *buf,
 	    if (rc == 0)
 		goto eof;
 	    if (rc != 1)
-		error(1, "Premature EOF(1) on input at y=%d\n", y);
+	    {
+		read_error("Premature EOF(1) on input at y=%d\n", y);
+		goto fail;
+	    }
 	}
     }
 
-    // Copy the rows that we want to image
-    rowp = buf;
-    for (y = 0; y < h; ++y, rowp += bpl16)
+    // Copy the rows that we want to image, from the bottom up if the
+    // page is being turned around
+    for (y = 0; y < h; ++y)
     {
+	rowp = buf + (size_t) (rotate ? h - 1 - y : y) * bpl16;
+
 	// Clip left pixel *bytes*
 	if (UpperLeftX)
 	{
@@ -1126,23 +1063,36 @@ read_and_clip_image(unsigned char *buf,
 	    if (rc == 0 && y == 0 && !UpperLeftY)
 		goto eof;
 	    if (rc != 1)
-		error(1, "Premature EOF(2) on input at y=%d\n", y);
+	    {
+		read_error("Premature EOF(2) on input at y=%d\n", y);
+		goto fail;
+	    }
 	}
 
 	if (bpl != bpl16)
 	    memset(rowp, 0, bpl16);
-	rc = fread(rowp, bpl, 1, ifp);
+	rc = fread(rowp + pad, bpl, 1, ifp);
 	if (rc == 0 && y == 0 && !UpperLeftY && !UpperLeftX)
 	    goto eof;
 	if (rc != 1)
-		error(1, "Premature EOF(3) on input at y=%d\n", y);
+	{
+	    read_error("Premature EOF(3) on input at y=%d\n", y);
+	    goto fail;
+	}
+	if (rotate)
+	    mirror_row(rowp + pad, rowp + pad, bpl, 8 / pixelsPerByte);
+	if (dots)
+	    *dots += dots_count(rowp + pad, bpl);
 
 	// Clip right pixels
 	if (rightBpl != bpl)
 	{
 	    rc = fread(rowbuf, rightBpl - bpl, 1, ifp);
 	    if (rc != 1)
-		error(1, "Premature EOF(4) on input at y=%d\n", y);
+	    {
+		read_error("Premature EOF(4) on input at y=%d\n", y);
+		goto fail;
+	    }
 	}
     }
 
@@ -1153,16 +1103,53 @@ read_and_clip_image(unsigned char *buf,
 	{
 	    rc = fread(rowbuf, rawBpl, 1, ifp);
 	    if (rc != 1)
-		error(1, "Premature EOF(5) on input at y=%d\n", y);
+	    {
+		read_error("Premature EOF(5) on input at y=%d\n", y);
+		goto fail;
+	    }
 	}
     }
 
     free(rowbuf);
+    stats_bytes(STATS_IN, (size_t) rawBpl * (UpperLeftY + h + LowerRightY));
+    stats_end(STATS_READ);
     return (0);
 
 eof:
     free(rowbuf);
+    stats_end(STATS_READ);
     return (EOF);
+
+fail:
+    free(rowbuf);
+    stats_end(STATS_READ);
+    return (READ_ERROR);
+}
+
+/*
+ * With -j, the next bitcmyk page is read from Ghostscript on its own
+ * thread while the current one is being split and compressed.  So the
+ * reader counts the pages itself, to know which ones to turn around.
+ */
+typedef struct
+{
+    int		rawBpl, rightBpl, bpl, h;
+    int		pages;		/* read so far */
+    FILE	*ifp;
+} CMYKREAD;
+
+static int
+read_cmyk_page(void *arg, unsigned char *buf)
+{
+    CMYKREAD	*rd = arg;
+    int		rotate;
+
+    ++rd->pages;
+    rotate = (rd->pages & 1) == 0 && (Duplex == DMDUPLEX_LONGEDGE
+		|| Duplex == DMDUPLEX_MANUALLONG);
+    return read_and_clip_image(buf, rd->rawBpl, rd->rightBpl, 2,
+				rd->bpl, rd->h, rd->bpl, rotate, NULL,
+				rd->ifp);
 }
 
 int
@@ -1173,6 +1160,8 @@ cmyk_pages(FILE *ifp, FILE *ofp)
     int			rightBpl;
     int			w, h, bpl;
     int			rc;
+    PAGEQ		*pq;
+    CMYKREAD		rd;
 
     //
     // Save the original Upper Right clip values as the logical offset,
@@ -1198,22 +1187,20 @@ cmyk_pages(FILE *ifp, FILE *ofp)
     bpl = (w + 1) / 2;
     rightBpl = (rawW - UpperLeftX + 1) / 2;
 
-    buf = malloc(bpl * h);
-    if (!buf)
+    rd.rawBpl = rawBpl;
+    rd.rightBpl = rightBpl;
+    rd.bpl = bpl;
+    rd.h = h;
+    rd.pages = 0;
+    rd.ifp = ifp;
+    pq = pageq_create((Threads > 1) ? 2 : 1, bpl * h, read_cmyk_page, &rd);
+    if (!pq)
 	error(1, "Unable to allocate page buffer of %d x %d = %d bytes\n",
 		rawW, rawH, rawBpl * rawH);
 
-    for (;;)
+    while ((buf = pageq_get(pq, &rc)) != NULL)
     {
-	rc = read_and_clip_image(buf, rawBpl, rightBpl, 2, bpl, h, bpl, ifp);
-	if (rc == EOF)
-	    goto done;
-
 	++PageNum;
-	if (Duplex == DMDUPLEX_LONGEDGE && (PageNum & 1) == 0)
-	    rotate_bytes_180(buf, buf + bpl * h - 1, Mirror4);
-	if (Duplex == DMDUPLEX_MANUALLONG && (PageNum & 1) == 0)
-	    rotate_bytes_180(buf, buf + bpl * h - 1, Mirror4);
 
 	if ((PageNum & 1) == 0 && EvenPages)
 	{
@@ -1226,10 +1213,15 @@ cmyk_pages(FILE *ifp, FILE *ofp)
 	}
 	else
 	    cmyk_page(buf, w, h, ofp);
+
+	// Let the printer have this page while the next one is read
+	fflush(ofp);
+	pageq_put(pq, buf);
     }
 
-done:
-    free(buf);
+    if (rc != EOF)
+	error(1, "%s", ReadError);
+    pageq_destroy(pq);
     return 0;
 }
 
@@ -1361,7 +1353,13 @@ pksm_pages(FILE *ifp, FILE *ofp)
 		error(1, "Can't allocate plane buffer\n");
 
 	    rc = read_and_clip_image(plane[i],
-				    rawBpl, rightBpl, 8, bpl, h, bpl16, ifp);
+				    rawBpl, rightBpl, 8, bpl, h, bpl16,
+				    (PageNum & 1) == 0
+					&& (Duplex == DMDUPLEX_LONGEDGE
+					|| Duplex == DMDUPLEX_MANUALLONG),
+				    &Dots[i], ifp);
+	    if (rc == READ_ERROR)
+		error(1, "%s", ReadError);
 	    if (rc == EOF)
 		error(1, "Premature EOF(pksm) on page %d data, plane %d\n",
 			    PageNum, i);
@@ -1380,23 +1378,10 @@ pksm_pages(FILE *ifp, FILE *ofp)
 		}
 	    }
 
-	    // See if we can optimize this to be a monochrome page
-	    if (!AnyColor && i != 3)
-	    {
-		unsigned char *p, *e;
-
-		for (p = plane[i], e = p + bpl16*h; p < e; ++p)
-		    if (*p)
-		    {
-			AnyColor |= 1<<i;
-			break;
-		    }
-	    }
-
-	    if (Duplex == DMDUPLEX_LONGEDGE && (PageNum & 1) == 0)
-		rotate_bytes_180(plane[i], plane[i] + bpl16 * h - 1, Mirror1);
-	    if (Duplex == DMDUPLEX_MANUALLONG && (PageNum & 1) == 0)
-		rotate_bytes_180(plane[i], plane[i] + bpl16 * h - 1, Mirror1);
+	    // See if we can optimize this to be a monochrome page: the
+	    // dots of the plane were counted as it was read
+	    if (!AnyColor && i != 3 && Dots[i])
+		AnyColor |= 1<<i;
 	}
 
 	debug(2, "AnyColor = %s %s %s\n",
@@ -1433,6 +1418,7 @@ pbm_pages(FILE *ifp, FILE *ofp)
     int			w, h, bpl;
     int			bpl16 = 0;
     int			rc;
+    int			rotate;
     int			p4eaten = 1;
 
     //
@@ -1465,22 +1451,25 @@ pbm_pages(FILE *ifp, FILE *ofp)
 	bpl16 = (bpl + 15) & ~15;
 	debug(1, "bpl=%d bpl16=%d\n", bpl, bpl16);
 
+	// The back of a long edge duplex sheet is turned around as it
+	// is read
+	rotate = ((PageNum + 1) & 1) == 0 && (Duplex == DMDUPLEX_LONGEDGE
+		|| (EvenPages && Duplex == DMDUPLEX_MANUALLONG));
+
 	buf = malloc(bpl16 * h);
 	if (!buf)
 	    error(1, "Can't allocate page buffer\n");
 
-	rc = read_and_clip_image(buf, rawBpl, rightBpl, 8, bpl, h, bpl16, ifp);
+	rc = read_and_clip_image(buf, rawBpl, rightBpl, 8, bpl, h, bpl16,
+					rotate, &Dots[3], ifp);
+	if (rc == READ_ERROR)
+	    error(1, "%s", ReadError);
 	if (rc == EOF)
 	    error(1, "Premature EOF(pbm) on input stream\n");
 
 	++PageNum;
-	if (Duplex == DMDUPLEX_LONGEDGE && (PageNum & 1) == 0)
-	    rotate_bytes_180(buf, buf + bpl16 * h - 1, Mirror1);
-
 	if ((PageNum & 1) == 0 && EvenPages)
 	{
-	    if (Duplex == DMDUPLEX_MANUALLONG)
-		rotate_bytes_180(buf, buf + bpl16 * h - 1, Mirror1);
 	    SeekRec[SeekIndex].b = ftell(EvenPages);
 	    pbm_page(buf, w, h, EvenPages);
 	    SeekRec[SeekIndex].e = ftell(EvenPages);
@@ -1577,7 +1566,7 @@ main(int argc, char *argv[])
     int i, j;
 
     while ( (c = getopt(argc, argv,
-		    "cd:g:n:m:p:r:s:tu:l:L:ABPJ:S:U:X:Z:D:V?h")) != EOF)
+		    "cd:g:j:n:m:p:r:s:tu:l:L:ABPJ:S:U:X:Z:D:V?h")) != EOF)
 	switch (c)
 	{
 	case 'c':	Mode = MODE_COLOR; break;
@@ -1594,6 +1583,10 @@ main(int argc, char *argv[])
 			if (PageHeight < 0 || PageHeight > 1000000)
 			    error(1, "Illegal Y value '%s' for -g\n", optarg);
 			break;
+	case 'j':	Threads = atoi(optarg);
+			if (Threads < 1)
+			    error(1, "Illegal value '%s' for -j\n", optarg);
+			break;
 	case 'm':	MediaCode = atoi(optarg); break;
 	case 'n':	Copies = atoi(optarg); break;
 	case 'p':	PaperCode = atoi(optarg); break;
@@ -1625,7 +1618,14 @@ main(int argc, char *argv[])
 	case 'U':	if (optarg[0]) Username = optarg; break;
 	case 'X':	ExtraPad = atoi(optarg); break;
 	case 'Z':	Compressed = atoi(optarg); break;
-	case 'D':	Debug = atoi(optarg); break;
+	case 'D':	Debug = atoi(optarg);
+			if (Debug == 12345678)
+			{
+			    // Hack to force time to zero for regression tests
+			    ZeroTime = 1;
+			    Debug = 0;
+			}
+			break;
 	case 'V':	printf("%s\n", Version); exit(0);
 	default:	usage(); exit(1);
 	}
@@ -1664,6 +1664,9 @@ if (getenv("ccc"))
 	break;
     }
 
+    stats_init("foo2hiperc");
+    Pool = workpool_create(Threads);
+
     start_doc(stdout);
 
     if (argc == 0)
@@ -1715,5 +1718,6 @@ if (getenv("ccc"))
 
     end_doc(stdout);
 
+    workpool_destroy(Pool);
     exit(0);
 }
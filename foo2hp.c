@@ -51,6 +51,18 @@ static char Version[] = "$Id: foo2hp.c,v 1.48 2011/06/09 13:58:50 rick Exp $";
 #include <unistd.h>
 #include <stdarg.h>
 #include "jbig.h"
+#include "bitcmyk.h"
+#include "biechain.h"
+#include "workpool.h"
+#include "stats.h"
+#include "biecache.h"
+#include "blank.h"
+#include "mirror.h"
+#include "dots.h"
+#include "toner.h"
+#include "pageq.h"
+#include "mapin.h"
+#include "cupsraster.h"
 #include "zjs.h"
 #include "cups.h"
 
@@ -93,7 +105,9 @@ int	CMYK_Offset[4] = {0, 0, 0, 0};
 #define LOGICAL_CLIP_Y	1
 int	LogicalClip = LOGICAL_CLIP_X | LOGICAL_CLIP_Y;
 int	SaveToner = 0;
+unsigned char	TonerMask[4];	/* for each row, by row number mod 4 */
 int	PageNum = 0;
+unsigned long	Dots[4];
 
 int	IsCUPS = 0;
 
@@ -105,6 +119,13 @@ typedef struct
 SEEKREC	SeekRec[2000];
 int	SeekIndex = 0;
 
+int	Threads = 1;
+WORKPOOL	*Pool = NULL;
+int	CacheMB = 0;
+BIECACHE	*Cache = NULL;
+BIECACHE	*Blanks = NULL;		/* blank planes of each size */
+MAPIN		*MapIn = NULL;
+
 long JbgOptions[5] =
 {
     /* Order */
@@ -150,10 +171,13 @@ usage(void)
 "Normal Options:\n"
 "-b bits           Bits per plane if autodetect doesn't work (1 or 2) [%d]\n"
 "-c                Force color mode if autodetect doesn't work\n"
+"-C megabytes      Reuse the compressed planes of repeated pages, such as\n"
+"                  forms, keeping up to this many megabytes of them [%d]\n"
 "-d duplex         Duplex code to send to printer [%d]\n"
 "                    1=off, 2=longedge, 3=shortedge,\n"
 //"                    4=manual longedge, 5=manual shortedge\n"
 "-g <xpix>x<ypix>  Set page dimensions in pixels [%dx%d]\n"
+"-j threads        Compress planes using this many threads [%d]\n"
 "-m media          Media code to send to printer [%d]\n"
 "		     1=plain 514=preprinted 513=letterhead 2=transparency\n"
 "                    515=prepunched 265=labels 260=bond 516=recycled\n"
@@ -169,6 +193,9 @@ usage(void)
 "                    1=tray2 2=tray1 7=auto\n"
 "                    Code numbers may vary with printer model\n"
 "-t                Draft mode.  Every other pixel is white.\n"
+"-E pattern        Draft mode with another pattern: checker (as -t),\n"
+"                    lines (every other row white), or 1-99 (percent\n"
+"                    of the pixels kept, by an ordered dither)\n"
 "-J filename       Filename string to send to printer [%s]\n"
 "-U username       Username string to send to printer [%s]\n"
 "\n"
@@ -191,8 +218,10 @@ usage(void)
 "-D lvl            Set Debug level [%d]\n"
 "-V                Version %s\n"
     , Bpp
+    , CacheMB
     , Duplex
     , PageWidth , PageHeight
+    , Threads
     , MediaCode
     , PaperCode
     , Copies
@@ -212,75 +241,6 @@ usage(void)
   exit(1);
 }
 
-/*
- * Mirror1: bits 01234567 become 76543210
- */
-unsigned char	Mirror1[256] =
-{
-	  0,128, 64,192, 32,160, 96,224, 16,144, 80,208, 48,176,112,240,
-	  8,136, 72,200, 40,168,104,232, 24,152, 88,216, 56,184,120,248,
-	  4,132, 68,196, 36,164,100,228, 20,148, 84,212, 52,180,116,244,
-	 12,140, 76,204, 44,172,108,236, 28,156, 92,220, 60,188,124,252,
-	  2,130, 66,194, 34,162, 98,226, 18,146, 82,210, 50,178,114,242,
-	 10,138, 74,202, 42,170,106,234, 26,154, 90,218, 58,186,122,250,
-	  6,134, 70,198, 38,166,102,230, 22,150, 86,214, 54,182,118,246,
-	 14,142, 78,206, 46,174,110,238, 30,158, 94,222, 62,190,126,254,
-	  1,129, 65,193, 33,161, 97,225, 17,145, 81,209, 49,177,113,241,
-	  9,137, 73,201, 41,169,105,233, 25,153, 89,217, 57,185,121,249,
-	  5,133, 69,197, 37,165,101,229, 21,149, 85,213, 53,181,117,245,
-	 13,141, 77,205, 45,173,109,237, 29,157, 93,221, 61,189,125,253,
-	  3,131, 67,195, 35,163, 99,227, 19,147, 83,211, 51,179,115,243,
-	 11,139, 75,203, 43,171,107,235, 27,155, 91,219, 59,187,123,251,
-	  7,135, 71,199, 39,167,103,231, 23,151, 87,215, 55,183,119,247,
-	 15,143, 79,207, 47,175,111,239, 31,159, 95,223, 63,191,127,255,
-};
-
-/*
- * Mirror2: bits 01234567 become 67452301
- */
-unsigned char	Mirror2[256] =
-{
-	  0, 64,128,192, 16, 80,144,208, 32, 96,160,224, 48,112,176,240,
-	  4, 68,132,196, 20, 84,148,212, 36,100,164,228, 52,116,180,244,
-	  8, 72,136,200, 24, 88,152,216, 40,104,168,232, 56,120,184,248,
-	 12, 76,140,204, 28, 92,156,220, 44,108,172,236, 60,124,188,252,
-	  1, 65,129,193, 17, 81,145,209, 33, 97,161,225, 49,113,177,241,
-	  5, 69,133,197, 21, 85,149,213, 37,101,165,229, 53,117,181,245,
-	  9, 73,137,201, 25, 89,153,217, 41,105,169,233, 57,121,185,249,
-	 13, 77,141,205, 29, 93,157,221, 45,109,173,237, 61,125,189,253,
-	  2, 66,130,194, 18, 82,146,210, 34, 98,162,226, 50,114,178,242,
-	  6, 70,134,198, 22, 86,150,214, 38,102,166,230, 54,118,182,246,
-	 10, 74,138,202, 26, 90,154,218, 42,106,170,234, 58,122,186,250,
-	 14, 78,142,206, 30, 94,158,222, 46,110,174,238, 62,126,190,254,
-	  3, 67,131,195, 19, 83,147,211, 35, 99,163,227, 51,115,179,243,
-	  7, 71,135,199, 23, 87,151,215, 39,103,167,231, 55,119,183,247,
-	 11, 75,139,203, 27, 91,155,219, 43,107,171,235, 59,123,187,251,
-	 15, 79,143,207, 31, 95,159,223, 47,111,175,239, 63,127,191,255,
-};
-
-/*
- * Mirror4: bits 01234567 become 45670123
- */
-unsigned char	Mirror4[256] =
-{
-	  0, 16, 32, 48, 64, 80, 96,112,128,144,160,176,192,208,224,240,
-	  1, 17, 33, 49, 65, 81, 97,113,129,145,161,177,193,209,225,241,
-	  2, 18, 34, 50, 66, 82, 98,114,130,146,162,178,194,210,226,242,
-	  3, 19, 35, 51, 67, 83, 99,115,131,147,163,179,195,211,227,243,
-	  4, 20, 36, 52, 68, 84,100,116,132,148,164,180,196,212,228,244,
-	  5, 21, 37, 53, 69, 85,101,117,133,149,165,181,197,213,229,245,
-	  6, 22, 38, 54, 70, 86,102,118,134,150,166,182,198,214,230,246,
-	  7, 23, 39, 55, 71, 87,103,119,135,151,167,183,199,215,231,247,
-	  8, 24, 40, 56, 72, 88,104,120,136,152,168,184,200,216,232,248,
-	  9, 25, 41, 57, 73, 89,105,121,137,153,169,185,201,217,233,249,
-	 10, 26, 42, 58, 74, 90,106,122,138,154,170,186,202,218,234,250,
-	 11, 27, 43, 59, 75, 91,107,123,139,155,171,187,203,219,235,251,
-	 12, 28, 44, 60, 76, 92,108,124,140,156,172,188,204,220,236,252,
-	 13, 29, 45, 61, 77, 93,109,125,141,157,173,189,205,221,237,253,
-	 14, 30, 46, 62, 78, 94,110,126,142,158,174,190,206,222,238,254,
-	 15, 31, 47, 63, 79, 95,111,127,143,159,175,191,207,223,239,255,
-};
-
 /*
  * Mirror24: bits 01234567 become 10325476
  */
@@ -304,23 +264,6 @@ unsigned char   Mirror24[256] =
         240,242,241,243,248,250,249,251,244,246,245,247,252,254,253,255,
 };
 
-void
-rotate_bytes_180(unsigned char *sp, unsigned char *ep, unsigned char *mirror)
-{
-    unsigned char tmp;
-
-    while (sp < ep)
-    {
-	tmp = mirror[*sp];
-	*sp = mirror[*ep];
-	*ep = tmp;
-	++sp;
-	--ep;
-    }
-    if (sp == ep)
-	*sp = mirror[*sp];
-}
-
 void
 debug(int level, char *fmt, ...)
 {
@@ -436,29 +379,6 @@ item_bytelut_write(unsigned short item, int size, unsigned char *p, FILE *fp)
     return (sizeof(hdr) + 4 + lenpadded);
 }
 
-/*
- * A linked list of compressed data
- */
-typedef struct _BIE_CHAIN{
-    unsigned char	*data;
-    size_t		len;
-    struct _BIE_CHAIN	*next;
-} BIE_CHAIN;
-
-void
-free_chain(BIE_CHAIN *chain)
-{
-    BIE_CHAIN	*next;
-    next = chain;
-    while ((chain = next))
-    {
-	next = chain->next;
-	if (chain->data)
-	    free(chain->data);
-	free(chain);
-    }
-}
-
 int
 write_bitmap_plane(int planeNum, int eof, int incry, BIE_CHAIN **root, FILE *fp)
 {
@@ -467,6 +387,7 @@ write_bitmap_plane(int planeNum, int eof, int incry, BIE_CHAIN **root, FILE *fp)
     int		i, len, pad_len;
     #define	PADTO		4
 
+    stats_begin(STATS_WRITE);
     debug(3, "Write Plane %d\n", planeNum); 
 
     /* error handling */
@@ -536,6 +457,7 @@ write_bitmap_plane(int planeNum, int eof, int incry, BIE_CHAIN **root, FILE *fp)
 
     free_chain(*root);
 
+    stats_end(STATS_WRITE);
     return 0;
 }
 
@@ -587,6 +509,9 @@ end_page(int np, FILE *ofp)
     item_uint32_write(0x8205,            (np>1) ? 1 : 0,           ofp);
     item_uint32_write(0x8206,            (np>1) ? 1 : 0,           ofp);
     item_uint32_write(0x8207,            1,           		   ofp);
+    stats_dots(Dots);
+    memset(Dots, 0, sizeof(Dots));
+    stats_page();
 }
 
 /*
@@ -620,15 +545,13 @@ output_jbig(unsigned char *start, size_t len, void *cbarg)
     }
 out:
 
+    stats_bytes(STATS_OUT, len);
+
     if ( (*root) == NULL)
     {
-	(*root) = malloc(sizeof(BIE_CHAIN));
+	(*root) = bie_alloc();
 	if (!(*root))
 	    error(1, "Can't allocate space for chain\n");
-
-	(*root)->data = NULL;
-	(*root)->next = NULL;
-	(*root)->len = 0;
 	size = 20;
 	if (len != 20)
 	    error(1, "First chunk must be BIH and 20 bytes long\n");
@@ -644,9 +567,10 @@ out:
 
 	if (!current->data)
 	{
-	    current->data = malloc(size);
+	    current->data = bie_block(size);
 	    if (!current->data)
 		error(1, "Can't allocate space for compressed data\n");
+	    current->size = size;
 	}
 
 	left = size - current->len;
@@ -658,33 +582,175 @@ out:
 
 	if (current->len == size)
 	{
-	    current->next = malloc(sizeof(BIE_CHAIN));
+	    current->next = bie_alloc();
 	    if (!current->next)
 		error(1, "Can't allocate space for chain\n");
 	    current = current->next;
-	    current->data = NULL;
-	    current->next = NULL;
-	    current->len = 0;
 	}
     }
 }
 
-int
-write_bitmap_page(int w, int h, int np, unsigned char *bitmaps[4], FILE *ofp)
+/*
+ * A plane of a page, as write_bitmap_page() takes it: h rows, bpl bytes
+ * apart, of pixels of bpp bits.  Row y of the page is row y - shift of
+ * bits, and the rows that fall off either end are blank.  So registering
+ * a plane a few rows up or down the page (-O) costs nothing, and the
+ * plane is never copied or grown to do it.
+ *
+ * inked[r] is set if row r of bits has any dots.  It is found as the row
+ * is read or split, along with its dots, so a blank band is known without
+ * going over it again.
+ */
+typedef struct
+{
+    unsigned char	*bits;
+    unsigned char	*inked;
+    int			bpl, bpp;
+    int			shift;
+} PLANE;
+
+/*
+ * Each plane of each 100 line band is compressed independently, so with
+ * -j a window of them is handed to the worker threads, and then written
+ * out in order: band by band, and plane by plane within a band.  The
+ * window bounds the compressed data held in memory.
+ *
+ * The worker also makes the band ready to compress: it swaps the pixels
+ * of 2 bit rows into the printer's order, sees if the band is blank, and
+ * builds it in its scratch buffer if it can't be compressed where it is.
+ * A blank band of a given size always compresses the same, so that is
+ * done just once for the job.
+ */
+#define	BANDWINDOW	16
+
+typedef struct
+{
+    unsigned char	*bitmaps[1];
+    int			w, len;
+    int			blank;
+    BIE_CHAIN		*chain;
+    PLANE		*plane;		/* NULL if bitmaps is ready */
+    int			y, h;		/* rows y on of an h row page */
+    unsigned char	**scratch;	/* 100 rows, malloc'd when needed */
+} BAND;
+
+// One encoder per job, kept from band to band by jbg_enc_reinit()
+static struct jbg_enc_state	BandEnc[BANDWINDOW];
+
+/*
+ * Widen four 1 bit pixels to 2 bits each: abcd becomes aabbccdd.
+ */
+static inline unsigned char
+widen_nibble(unsigned int n)
+{
+    n = (n | (n << 2)) & 0x33;
+    n = (n | (n << 1)) & 0x55;
+    return n | (n << 1);
+}
+
+/*
+ * Point band at its rows of its plane.  A band that lies within its
+ * plane, with pixels of the printer's Bpp bits, is compressed where it
+ * is.  Otherwise it is built in the scratch buffer: blank where it is off
+ * the end of the plane, and with 1 bit pixels widened to 2 if the printer
+ * wants 2.  Widened pixels come out the same in either order.
+ */
+static void
+band_plane(BAND *band)
+{
+    PLANE		*pl = band->plane;
+    int			bpl = (band->w + 7) / 8;
+    int			i, x;
+    int			r0, a, n;
+    unsigned char	*src, *dst;
+
+    // Rows r0 on of the plane, the first a of them off the top
+    r0 = band->y - pl->shift;
+    a = (r0 < 0) ? -r0 : 0;
+    if (a > band->len)
+	a = band->len;
+    n = ((r0 + band->len < band->h) ? r0 + band->len : band->h) - (r0 + a);
+    if (n < 0)
+	n = 0;
+    src = pl->bits + (ptrdiff_t) (r0 + a) * pl->bpl;
+
+    // Each row of a plane is in just one band, so this is done once
+    if (pl->bpp == 2)
+	for (i = 0; i < n * pl->bpl; ++i)
+	    src[i] = Mirror24[src[i]];
+
+    band->blank = (n == 0) || blank_region(pl->inked + r0 + a, n);
+    if (n == band->len && pl->bpp == Bpp && pl->bpl == bpl)
+    {
+	band->bitmaps[0] = src;
+	return;
+    }
+
+    if (!*band->scratch)
+    {
+	*band->scratch = malloc((size_t) 100 * bpl);
+	if (!*band->scratch)
+	    error(1, "Can't allocate band buffer\n");
+    }
+    dst = *band->scratch;
+    memset(dst, 0, (size_t) bpl * band->len);
+    for (i = 0; i < n; ++i, src += pl->bpl)
+    {
+	if (pl->bpp == Bpp)
+	    memcpy(dst + (a + i) * bpl, src, (pl->bpl < bpl) ? pl->bpl : bpl);
+	else
+	    for (x = 0; x < pl->bpl && 2 * x + 1 < bpl; ++x)
+	    {
+		dst[(a + i) * bpl + 2 * x] = widen_nibble(src[x] >> 4);
+		dst[(a + i) * bpl + 2 * x + 1] = widen_nibble(src[x] & 15);
+	    }
+    }
+    band->bitmaps[0] = dst;
+}
+
+static void
+encode_band(void *arg, int i)
+{
+    BAND		*band = (BAND *) arg + i;
+    struct jbg_enc_state *se = &BandEnc[i];
+    BIECACHE_OUT	out = output_jbig;
+    void		*outarg = &band->chain;
+    BIECACHE_REC	rec;
+    int			hit;
+
+    band->chain = NULL;
+    if (band->plane)
+	band_plane(band);
+
+    if (band->blank)
+	hit = biecache_lookup(Blanks, &rec, NULL, 0,
+			band->w, band->len, JbgOptions, 5, &out, &outarg);
+    else
+	hit = biecache_lookup(Cache, &rec, band->bitmaps[0],
+			(band->w + 7) / 8, band->w, band->len,
+			JbgOptions, 5, &out, &outarg);
+    if (hit)
+	return;
+
+    jbg_enc_reinit(se, band->w, band->len, 1, band->bitmaps, out, outarg);
+    jbg_enc_options(se, JbgOptions[0], JbgOptions[1],
+			JbgOptions[2], JbgOptions[3], JbgOptions[4]);
+    stats_begin(STATS_ENCODE);
+    jbg_enc_out(se);
+    stats_end(STATS_ENCODE);
+    biecache_done(&rec);
+}
+
+/*
+ * The header of each plane, with the BIH that all of its bands share.
+ */
+static void
+start_bitmap_planes(int w16, int np, FILE *ofp)
 {
-    int		x, y;
     int		p;
     int		size;
     int		i;
     DWORD	bih[5];
-    int		w16;
-
-    start_bitmap_page(w, h, np, ofp);
-    if (Bpp == 2)
-	w16 = (w + 63) & ~63;
-    else
-	w16 = (w + 127) & ~127;
-    debug(2, "w16 = %d\n", w16);
 
     for (p = 0; p < np; ++p)
     {
@@ -712,39 +778,63 @@ write_bitmap_page(int w, int h, int np, unsigned char *bitmaps[4], FILE *ofp)
 	item_uint32_write(ZJI_VIDEO_BPP,      Bpp,        	 	ofp);
 	item_uint32_write(ZJI_PLANE,          (np==1) ? 4 : p+1,	ofp);
 	item_bytelut_write(ZJI_JBIG_BIH, 20, (unsigned char *) bih,	ofp);
-
-	if (Bpp == 2)
-	{
-	    for (y = 0; y < h; ++y)
-		for (x = 0; x < w16*Bpp/8; ++x)
-		    bitmaps[p][y*w16*Bpp/8 + x]
-			    = Mirror24[ bitmaps[p][y*w16*Bpp/8 + x] ];
-	}
     }
+}
+
+/*
+ * Compress the n planes of whole bands set up in band[], np planes to a
+ * band, and write them.  eof if they end the page.
+ */
+static void
+write_bitmap_bands(BAND *band, int n, int np, int eof, FILE *ofp)
+{
+    int		i;
+
+    workpool_run(Pool, n, encode_band, band);
+
+    for (i = 0; i < n; ++i)
+	write_bitmap_plane((np==1) ? 4 : (i % np) + 1, eof && i >= n - np,
+				    band[i].len, &band[i].chain, ofp);
+}
+
+int
+write_bitmap_page(int w, int h, int np, PLANE *planes, FILE *ofp)
+{
+    int			y;
+    int			i, n, nb;
+    int			w16;
+    BAND		band[BANDWINDOW];
+    unsigned char	*scratch[BANDWINDOW];
+
+    start_bitmap_page(w, h, np, ofp);
+    if (Bpp == 2)
+	w16 = (w + 63) & ~63;
+    else
+	w16 = (w + 127) & ~127;
+    debug(2, "w16 = %d\n", w16);
+
+    start_bitmap_planes(w16, np, ofp);
 
-    for (y = 0; y < h; y += 100)
+    nb = BANDWINDOW / np;		// bands in the window
+    for (i = 0; i < BANDWINDOW; ++i)
+	scratch[i] = NULL;
+    for (y = 0; y < h; y += nb * 100)
     {
-	for (p = 0; p < np; ++p)
+	for (n = 0; n < nb * np && y + n / np * 100 < h; ++n)
 	{
-	    struct jbg_enc_state se; 
-	    BIE_CHAIN		*chain = NULL;
-	    int	len, eof;
-
-	    len = h - y;
-	    if (len > 100)
-		len = 100;
-	    eof = (y+100) >= h;
-	    jbg_enc_init(&se, w16*Bpp, len, 1, &bitmaps[p],
-				output_jbig, &chain);
-	    jbg_enc_options(&se, JbgOptions[0], JbgOptions[1],
-				JbgOptions[2], JbgOptions[3], JbgOptions[4]);
-	    jbg_enc_out(&se);
-	    jbg_enc_free(&se);
-
-	    write_bitmap_plane((np==1) ? 4 : p+1, eof, len, &chain, ofp);
-	    bitmaps[p] += (100*w16*Bpp + 7) / 8;
+	    band[n].w = w16*Bpp;
+	    band[n].y = y + n / np * 100;
+	    band[n].len = h - band[n].y;
+	    if (band[n].len > 100)
+		band[n].len = 100;
+	    band[n].plane = &planes[n % np];
+	    band[n].h = h;
+	    band[n].scratch = &scratch[n];
 	}
+	write_bitmap_bands(band, n, np, y + nb * 100 >= h, ofp);
     }
+    for (i = 0; i < BANDWINDOW; ++i)
+	free(scratch[i]);
 
     end_page(np, ofp);
     return 0;
@@ -805,80 +895,36 @@ load_tray2(FILE *fp)
 
 static int AnyColor;
 
+/*
+ * Split the page a row at a time, to see which rows of each plane have
+ * dots as they are counted.
+ */
 void
-cmyk_planes(unsigned char *plane[4], unsigned char *raw, int w, int h)
+cmyk_planes(unsigned char *plane[4], unsigned char *inked[4],
+		unsigned char *raw, int rawstride, int w, int h)
 {
     int			rawbpl = (w+1) / 2;
     int			bpl = (w + 7) / 8;
-    int			i;
-    int			x, y;
-    unsigned char	byte;
-    unsigned char	mask[8] = { 128, 64, 32, 16, 8, 4, 2, 1 };
-    int			aib = AllIsBlack;
-    int			bc = BlackClears;
+    unsigned char	*row[4];
+    unsigned long	dots[4];
+    int			y, i;
 
     bpl = (bpl + 15) & ~15;
-    AnyColor = 0;
-    for (i = 0; i < 4; ++i)
-	memset(plane[i], 0, bpl * (h + abs(CMYK_Offset[i])) );
 
-    //
-    // Unpack the combined plane into individual color planes
-    //
-    // TODO: this can be speeded up using a 256 or 65536 entry lookup table
-    //
-    for (y = 0; y < h; ++y)
+    AnyColor = 0;
+    for (y = 0; y < h; ++y, raw += rawstride)
     {
-	for (x = 0; x < w; ++x)
+	for (i = 0; i < 4; ++i)
 	{
-	    byte = raw[y*rawbpl + x/2];
-
-	    if (aib && (byte & 0xE0) == 0xE0)
-	    {
-		plane[3][y*bpl + x/8] |= mask[x&7];
-	    }
-	    else if (byte & 0x10)
-	    {
-		plane[3][y*bpl + x/8] |= mask[x&7];
-		if (!bc)
-		{
-		    if (byte & 0x80) plane[0][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x40) plane[1][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x20) plane[2][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0xE0) AnyColor |= byte;
-		}
-	    }
-	    else
-	    {
-		if (byte & 0x80) plane[0][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x40) plane[1][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x20) plane[2][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0xE0) AnyColor |= byte;
-	    }
-
-	    ++x;
-	    if (aib && (byte & 0x0E) == 0x0E)
-	    {
-		plane[3][y*bpl + x/8] |= mask[x&7];
-	    }
-	    else if (byte & 0x1)
-	    {
-		plane[3][y*bpl + x/8] |= mask[x&7];
-		if (!bc)
-		{
-		    if (byte & 0x8) plane[0][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x4) plane[1][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x2) plane[2][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0xE) AnyColor |= byte;
-		}
-	    }
-	    else
-	    {
-		if (byte & 0x8) plane[0][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x4) plane[1][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x2) plane[2][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0xE) AnyColor |= byte;
-	    }
+	    row[i] = plane[i] + (size_t) y * bpl;
+	    dots[i] = 0;
+	}
+	AnyColor |= bitcmyk_split_stride(row, bpl, raw, rawbpl, rawstride, 1,
+				AllIsBlack, BlackClears, dots);
+	for (i = 0; i < 4; ++i)
+	{
+	    Dots[i] += dots[i];
+	    inked[i][y] = dots[i] != 0;
 	}
     }
     debug(2, "BlackClears = %d; AnyColor = %s %s %s\n",
@@ -890,21 +936,27 @@ cmyk_planes(unsigned char *plane[4], unsigned char *raw, int w, int h)
 }
 
 int
-cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
+cmyk_page(unsigned char *raw, int rawstride, int w, int h, FILE *ofp)
 {
     int i;
     int	bpl = (w + 7) / 8;
     int	bpl16 = (bpl + 15) & ~15;
-    unsigned char *plane[4], *bitmaps[4];
+    unsigned char *plane[4];
+    unsigned char *inked[4];
+    PLANE planes[4];
 
     for (i = 0; i < 4; ++i)
     {
-	plane[i] = malloc(bpl16 * (h + abs(CMYK_Offset[i])) );
-	if (!plane[i]) error(3, "Cannot allocate space for bit plane\n");
+	plane[i] = malloc(bpl16 * h);
+	inked[i] = malloc(h);
+	if (!plane[i] || !inked[i])
+	    error(3, "Cannot allocate space for bit plane\n");
 	debug(1, "malloc plane[%d] = %x\n", i, plane[i]);
     }
 
-    cmyk_planes(plane, raw, w, h);
+    stats_begin(STATS_SPLIT);
+    cmyk_planes(plane, inked, raw, rawstride, w, h);
+    stats_end(STATS_SPLIT);
     for (i = 0; i < 4; ++i)
     {
 	if (Debug >= 9)
@@ -921,48 +973,53 @@ cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
 	    }
 	}
 
-	bitmaps[i] = plane[i] + CMYK_Offset[i] * bpl16;
+	// A positive offset moves a bitcmyk plane up the page
+	planes[i].bits = plane[i];
+	planes[i].inked = inked[i];
+	planes[i].bpl = bpl16;
+	planes[i].bpp = 1;
+	planes[i].shift = -CMYK_Offset[i];
     }
 
     if (Color2Mono)
-	write_bitmap_page(w, h, 1, &bitmaps[Color2Mono-1], ofp);
+	write_bitmap_page(w, h, 1, &planes[Color2Mono-1], ofp);
     else if (AnyColor)
-	write_bitmap_page(w, h, 4, bitmaps, ofp);
+	write_bitmap_page(w, h, 4, planes, ofp);
     else
-	write_bitmap_page(w, h, 1, &bitmaps[3], ofp);
+	write_bitmap_page(w, h, 1, &planes[3], ofp);
 
     for (i = 0; i < 4; ++i)
     {
 	debug(1, "free plane[%d] = %x\n", i, plane[i]);
 	free(plane[i]);
+	free(inked[i]);
     }
     return 0;
 }
 
+/*
+ * A page of four planes of pixels of bpp bits, rows padded to 16 bytes,
+ * and which of their rows have dots.
+ */
 int
-pksm_page(unsigned char *plane[4], int w, int h, FILE *ofp)
+pksm_page(unsigned char *plane[4], unsigned char *inked[4], int bpp,
+		int w, int h, FILE *ofp)
 {
     int i, j;
-    unsigned char *bitmaps[4];
+    PLANE planes[4];
 
-    int w16;
     int bpl;
 
-    if (Bpp == 2)
-        w16 = (w + 63) & ~63;
-    else
-        w16 = (w + 127) & ~127;
-
     // bytes per line
-    bpl = (w16 * Bpp + 7) / 8;
+    bpl = ((w * bpp + 7) / 8 + 15) & ~15;
 
     if (AnyColor && (AllIsBlack || BlackClears))
     {
 	for (i = 0; i < h * bpl; ++i) 
 	{
-	    for (j = 0; j < 8; j += Bpp) 
+	    for (j = 0; j < 8; j += bpp) 
 	    {
-  	        unsigned char mask = (Bpp == 2 ? 0x03 : 0x01) << j;
+  	        unsigned char mask = (bpp == 2 ? 0x03 : 0x01) << j;
 
 		if ((BlackClears && (plane[3][i] & mask) == mask) ||
 		    (AllIsBlack &&
@@ -975,105 +1032,204 @@ pksm_page(unsigned char *plane[4], int w, int h, FILE *ofp)
 		}
 	    }
 	}
-    }
 
+	// Black may have been added where all three colors were
+	if (AllIsBlack)
+	    for (i = 0; i < h; ++i)
+		inked[3][i] |= inked[0][i] | inked[1][i] | inked[2][i];
+    }
 
+    // A positive offset moves a pksm or CUPS plane down the page
     for (i = 0; i < 4; ++i) 
     {
-         if (CMYK_Offset[i]) 
-	 {
-	     unsigned char *tmp = malloc(h * bpl);
-	     if (!tmp) error(3, "Cannot allocate space for bitmap\n");
-	     debug(1, "malloc bitmaps[%d] = %x\n", i, tmp);
-
-	     if (CMYK_Offset[i] < 0) 
-	     {
-	         memcpy(tmp, plane[i] - CMYK_Offset[i] * bpl,
-				    (h + CMYK_Offset[i]) * bpl);
-		 memset(tmp + (h + CMYK_Offset[i]) * bpl, 0,
-				    -CMYK_Offset[i] * bpl);
-	     }
-	     else 
-	     {
-	         memcpy(tmp + (CMYK_Offset[i] * bpl), plane[i],
-				    (h - CMYK_Offset[i])  * bpl);
-		 memset(tmp, 0, CMYK_Offset[i] * bpl);
-	     }
-
-	     free(plane[i]);
-	     plane[i] = tmp;
-	 }
-	 bitmaps[i] = plane[i];
+	planes[i].bits = plane[i];
+	planes[i].inked = inked[i];
+	planes[i].bpl = bpl;
+	planes[i].bpp = bpp;
+	planes[i].shift = CMYK_Offset[i];
     }
   
     if (Color2Mono)
-	write_bitmap_page(w, h, 1, &bitmaps[Color2Mono-1], ofp);
+	write_bitmap_page(w, h, 1, &planes[Color2Mono-1], ofp);
     else if (AnyColor)
-	write_bitmap_page(w, h, 4, bitmaps, ofp);
+	write_bitmap_page(w, h, 4, planes, ofp);
     else
-	write_bitmap_page(w, h, 1, &bitmaps[3], ofp);
+	write_bitmap_page(w, h, 1, &planes[3], ofp);
 
     return 0;
 }
 
+/*
+ * A black and white page of pixels of bpp bits, rows padded to 16 bytes,
+ * and which of its rows have dots.
+ */
 int
-pbm_page(unsigned char *buf, int w, int h, FILE *ofp)
+pbm_page(unsigned char *buf, unsigned char *inked, int bpp, int w, int h,
+		FILE *ofp)
 {
-    unsigned char	*bitmaps[1];
+    PLANE		plane;
 
-    if (SaveToner && Bpp == 1)
-    {
-	int	x, y;
-	int	bpl, bpl16;
+    plane.bits = buf;
+    plane.inked = inked;
+    plane.bpl = ((w * bpp + 7) / 8 + 15) & ~15;
+    plane.bpp = bpp;
+    plane.shift = 0;
 
-	bpl = (w + 7) / 8;
-	bpl16 = (bpl + 15) & ~15;
+    write_bitmap_page(w, h, 1, &plane, ofp);
 
-	for (y = 0; y < h; y += 2)
-	    for (x = 0; x < bpl16; ++x)
-		buf[y*bpl16 + x] &= 0x55;
-	for (y = 1; y < h; y += 2)
-	    for (x = 0; x < bpl16; ++x)
-		buf[y*bpl16 + x] &= 0xaa;
+    return 0;
+}
+
+/*
+ * When the input file is memory mapped, clipping is just pointer
+ * arithmetic: return the first imaged byte of the next page, whose rows
+ * are still rawBpl bytes apart, and skip ifp past the whole page.
+ * Returns NULL if the input isn't mapped or the page isn't all there;
+ * read_and_clip_image() then reads it (and complains) as usual.
+ */
+unsigned char *
+map_and_clip_image(int rawBpl, int pixelsPerByte, int h, FILE *ifp)
+{
+    unsigned char	*raw;
+
+    raw = mapin_take(MapIn, ifp,
+		(size_t) rawBpl * (UpperLeftY + h + LowerRightY));
+    if (!raw)
+	return NULL;
+    stats_bytes(STATS_IN, (size_t) rawBpl * (UpperLeftY + h + LowerRightY));
+    return raw + (size_t) rawBpl * UpperLeftY + UpperLeftX / pixelsPerByte;
+}
+
+/*
+ * Add the dots of a row to *dots, and set *inked if it has any.  Either
+ * may be NULL.
+ */
+static inline void
+count_row(const unsigned char *row, int bpl, unsigned long *dots,
+		unsigned char *inked)
+{
+    unsigned long	n;
+
+    if (!dots && !inked)
+	return;
+    n = dots_count(row, bpl);
+    if (dots)
+	*dots += n;
+    if (inked)
+	*inked = n != 0;
+}
+
+/*
+ * Copy rows y0 to y0+n-1 of a mapped page into buf.  If rotate, they are
+ * turned through 180 degrees on the way: the rows go in bottom up,
+ * reversed, and with any padding at the start of the row rather than the
+ * end.  If toner isn't NULL, each row is masked with toner[y & 3] for
+ * draft mode as it goes in.  If dots isn't NULL, the dots of the rows are
+ * added to it, and if inked isn't NULL, inked[y] is set to whether row y
+ * of buf has any.
+ */
+void
+copy_clipped_rows(unsigned char *buf, unsigned char *raw, int rawBpl,
+			int pixelsPerByte, int bpl, int y0, int n, int bpl16,
+			int rotate, const unsigned char *toner,
+			unsigned long *dots, unsigned char *inked)
+{
+    int		y;
+
+    if (rotate)
+    {
+	for (y = n - 1; y >= 0; --y, raw += rawBpl)
+	{
+	    memset(buf + y*bpl16, 0, bpl16 - bpl);
+	    mirror_row(buf + y*bpl16 + bpl16 - bpl, raw, bpl,
+			8 / pixelsPerByte);
+	    if (toner)
+		toner_row(buf + y*bpl16 + bpl16 - bpl, bpl,
+			    toner[(y0 + y) & 3]);
+	    count_row(buf + y*bpl16 + bpl16 - bpl, bpl, dots,
+			inked ? &inked[y] : NULL);
+	}
+	return;
+    }
+    for (y = 0; y < n; ++y, buf += bpl16, raw += rawBpl)
+    {
+	memcpy(buf, raw, bpl);
+	if (toner)
+	    toner_row(buf, bpl, toner[(y0 + y) & 3]);
+	count_row(buf, bpl, dots, inked ? &inked[y] : NULL);
+	if (bpl != bpl16)
+	    memset(buf + bpl, 0, bpl16 - bpl);
     }
+}
 
-    bitmaps[0] = buf;
+/*
+ * Why read_and_clip_rows() couldn't read a page.  With -j it runs on the
+ * reader thread, which must not exit, so it leaves the message here and
+ * returns READ_ERROR for the main thread to make the complaint.
+ */
+#define READ_ERROR	(-2)
+static char	ReadError[80];
 
-    write_bitmap_page(w, h, 1, bitmaps, ofp);
+static void
+read_error(char *fmt, ...)
+{
+    va_list ap;
 
-    return 0;
+    va_start(ap, fmt);
+    vsnprintf(ReadError, sizeof(ReadError), fmt, ap);
+    va_end(ap);
 }
 
+/*
+ * Read rows y0 to y0+n-1 of an h row page into buf, clipping the rows
+ * above the page before the first one and those below it after the last.
+ * If rotate, they are turned through 180 degrees as they come in.  toner,
+ * dots and inked are as for copy_clipped_rows().
+ */
 int
-read_and_clip_image(unsigned char *buf,
+read_and_clip_rows(unsigned char *buf,
 			int rawBpl, int rightBpl, int pixelsPerByte,
-			int bpl, int h, int bpl16, FILE *ifp)
+			int bpl, int y0, int n, int h, int bpl16,
+			int rotate, const unsigned char *toner,
+			unsigned long *dots, unsigned char *inked, FILE *ifp)
 {
     unsigned char	*rowbuf, *rowp;
-    int			y;
+    int			y, i;
     int			rc;
+    int			rows = n;
+    int			pad = rotate ? bpl16 - bpl : 0;
 
     rowbuf = malloc(rawBpl);
     if (!rowbuf)
-	error(1, "Can't allocate row buffer\n");
+    {
+	read_error("Can't allocate row buffer\n");
+	goto fail;
+    }
 
     // Clip top rows
-    if (UpperLeftY)
+    if (UpperLeftY && y0 == 0)
     {
+	rows += UpperLeftY;
 	for (y = 0; y < UpperLeftY; ++y)
 	{
 	    rc = fread(rowbuf, rawBpl, 1, ifp);
 	    if (rc == 0)
 		goto eof;
 	    if (rc != 1)
-		error(1, "Premature EOF(1) on input at y=%d\n", y);
+	    {
+		read_error("Premature EOF(1) on input at y=%d\n", y);
+		goto fail;
+	    }
 	}
     }
 
-    // Copy the rows that we want to image
-    rowp = buf;
-    for (y = 0; y < h; ++y, rowp += bpl16)
+    // Copy the rows that we want to image, from the bottom up if the
+    // page is being turned around
+    for (y = y0; y < y0 + n; ++y)
     {
+	i = rotate ? y0 + n - 1 - y : y - y0;
+	rowp = buf + (size_t) i * bpl16;
+
 	// Clip left pixel *bytes*
 	if (UpperLeftX)
 	{
@@ -1081,53 +1237,131 @@ read_and_clip_image(unsigned char *buf,
 	    if (rc == 0 && y == 0 && !UpperLeftY)
 		goto eof;
 	    if (rc != 1)
-		error(1, "Premature EOF(2) on input at y=%d\n", y);
+	    {
+		read_error("Premature EOF(2) on input at y=%d\n", y);
+		goto fail;
+	    }
 	}
 
 	if (bpl != bpl16)
 	    memset(rowp, 0, bpl16);
-	rc = fread(rowp, bpl, 1, ifp);
+	rc = fread(rowp + pad, bpl, 1, ifp);
 	if (rc == 0 && y == 0 && !UpperLeftY && !UpperLeftX)
 	    goto eof;
 	if (rc != 1)
-		error(1, "Premature EOF(3) on input at y=%d\n", y);
+	{
+	    read_error("Premature EOF(3) on input at y=%d\n", y);
+	    goto fail;
+	}
+	if (rotate)
+	    mirror_row(rowp + pad, rowp + pad, bpl, 8 / pixelsPerByte);
+	if (toner)
+	    toner_row(rowp + pad, bpl, toner[(y0 + i) & 3]);
+	count_row(rowp + pad, bpl, dots, inked ? &inked[i] : NULL);
 
 	// Clip right pixels
 	if (rightBpl != bpl)
 	{
 	    rc = fread(rowbuf, rightBpl - bpl, 1, ifp);
 	    if (rc != 1)
-		error(1, "Premature EOF(4) on input at y=%d\n", y);
+	    {
+		read_error("Premature EOF(4) on input at y=%d\n", y);
+		goto fail;
+	    }
 	}
     }
 
     // Clip bottom rows
-    if (LowerRightY)
+    if (LowerRightY && y0 + n == h)
     {
+	rows += LowerRightY;
 	for (y = 0; y < LowerRightY; ++y)
 	{
 	    rc = fread(rowbuf, rawBpl, 1, ifp);
 	    if (rc != 1)
-		error(1, "Premature EOF(5) on input at y=%d\n", y);
+	    {
+		read_error("Premature EOF(5) on input at y=%d\n", y);
+		goto fail;
+	    }
 	}
     }
 
     free(rowbuf);
+    stats_bytes(STATS_IN, (size_t) rawBpl * rows);
     return (0);
 
 eof:
     free(rowbuf);
     return (EOF);
+
+fail:
+    free(rowbuf);
+    return (READ_ERROR);
+}
+
+int
+read_and_clip_image(unsigned char *buf,
+			int rawBpl, int rightBpl, int pixelsPerByte,
+			int bpl, int h, int bpl16, int rotate,
+			const unsigned char *toner, unsigned long *dots,
+			unsigned char *inked, FILE *ifp)
+{
+    unsigned char	*raw;
+    int			rc;
+
+    stats_begin(STATS_READ);
+    raw = map_and_clip_image(rawBpl, pixelsPerByte, h, ifp);
+    if (raw)
+    {
+	copy_clipped_rows(buf, raw, rawBpl, pixelsPerByte, bpl, 0, h, bpl16,
+			    rotate, toner, dots, inked);
+	rc = 0;
+    }
+    else
+	rc = read_and_clip_rows(buf, rawBpl, rightBpl, pixelsPerByte,
+				    bpl, 0, h, h, bpl16, rotate, toner, dots,
+				    inked, ifp);
+    stats_end(STATS_READ);
+    return (rc);
+}
+
+/*
+ * With -j, the next bitcmyk page is read from Ghostscript on its own
+ * thread while the current one is being split and compressed.  So the
+ * reader counts the pages itself, to know which ones to turn around.
+ */
+typedef struct
+{
+    int		rawBpl, rightBpl, bpl, h;
+    int		pages;		/* read so far */
+    FILE	*ifp;
+} CMYKREAD;
+
+static int
+read_cmyk_page(void *arg, unsigned char *buf)
+{
+    CMYKREAD	*rd = arg;
+    int		rotate;
+
+    ++rd->pages;
+    rotate = (rd->pages & 1) == 0 && (Duplex == DMDUPLEX_LONGEDGE
+		|| Duplex == DMDUPLEX_MANUALLONG);
+    return read_and_clip_image(buf, rd->rawBpl, rd->rightBpl, 2,
+				rd->bpl, rd->h, rd->bpl, rotate, NULL, NULL,
+				NULL, rd->ifp);
 }
 
 int
 cmyk_pages(FILE *ifp, FILE *ofp)
 {
-    unsigned char	*buf;
+    unsigned char	*buf, *raw;
     int			rawW, rawH, rawBpl;
     int			rightBpl;
     int			w, h, bpl;
+    int			mapped;
     int			rc;
+    PAGEQ		*pq;
+    CMYKREAD		rd;
 
     //
     // Save the original Upper Right clip values as the logical offset,
@@ -1153,38 +1387,53 @@ cmyk_pages(FILE *ifp, FILE *ofp)
     bpl = (w + 1) / 2;
     rightBpl = (rawW - UpperLeftX + 1) / 2;
 
-    buf = malloc(bpl * h);
-    if (!buf)
+    rd.rawBpl = rawBpl;
+    rd.rightBpl = rightBpl;
+    rd.bpl = bpl;
+    rd.h = h;
+    rd.pages = 0;
+    rd.ifp = ifp;
+
+    // From a mapped file, pages that need not be rotated are split
+    // straight out of the mapping, and there is nothing to read ahead.
+    mapped = MapIn && Duplex != DMDUPLEX_LONGEDGE
+		    && Duplex != DMDUPLEX_MANUALLONG;
+    pq = pageq_create((Threads > 1 && !mapped) ? 2 : 1, bpl * h,
+			read_cmyk_page, &rd);
+    if (!pq)
 	error(1, "Unable to allocate page buffer of %d x %d = %d bytes\n",
 		rawW, rawH, rawBpl * rawH);
 
     for (;;)
     {
-	rc = read_and_clip_image(buf, rawBpl, rightBpl, 2, bpl, h, bpl, ifp);
-	if (rc == EOF)
-	    goto done;
+	buf = NULL;
+	raw = mapped ? map_and_clip_image(rawBpl, 2, h, ifp) : NULL;
+	if (!raw && (raw = buf = pageq_get(pq, &rc)) == NULL)
+	    break;
 
 	++PageNum;
-	if (Duplex == DMDUPLEX_LONGEDGE && (PageNum & 1) == 0)
-	    rotate_bytes_180(buf, buf + bpl * h - 1, Mirror4);
-	if (Duplex == DMDUPLEX_MANUALLONG && (PageNum & 1) == 0)
-	    rotate_bytes_180(buf, buf + bpl * h - 1, Mirror4);
 
 	if ((PageNum & 1) == 0 && EvenPages)
 	{
 	    SeekRec[SeekIndex].b = ftell(EvenPages);
-	    cmyk_page(buf, w, h, EvenPages);
+	    cmyk_page(raw, buf ? bpl : rawBpl, w, h, EvenPages);
 	    SeekRec[SeekIndex].e = ftell(EvenPages);
 	    debug(1, "CMYK Page: %d	%ld	%ld\n",
 		PageNum, SeekRec[SeekIndex].b, SeekRec[SeekIndex].e);
 	    SeekIndex++;
 	}
 	else
-	    cmyk_page(buf, w, h, ofp);
+	    cmyk_page(raw, buf ? bpl : rawBpl, w, h, ofp);
+
+	// Let the printer have this page while the next one is read
+	fflush(ofp);
+	if (buf)
+	    pageq_put(pq, buf);
     }
 
-done:
-    free(buf);
+    if (rc != EOF)
+	error(1, "%s", ReadError);
+    pageq_destroy(pq);
     return 0;
 }
 
@@ -1249,7 +1498,7 @@ pbm_header(FILE *ifp, int *p4eatenp, int *wp, int *hp)
 int
 pksm_pages(FILE *ifp, FILE *ofp)
 {
-    unsigned char	*plane[4];
+    unsigned char	*plane[4], *inked[4];
     int			rawW, rawH, rawBpl;
     int			saveW = 0, saveH = 0;
     int			rightBpl;
@@ -1310,11 +1559,18 @@ pksm_pages(FILE *ifp, FILE *ofp)
 
 	    bpl16 = (bpl + 15) & ~15;
 	    plane[i] = malloc(bpl16 * h);
-	    if (!plane[i])
+	    inked[i] = malloc(h);
+	    if (!plane[i] || !inked[i])
 		error(1, "Can't allocate plane buffer\n");
 
 	    rc = read_and_clip_image(plane[i],
-				    rawBpl, rightBpl, 8, bpl, h, bpl16, ifp);
+				    rawBpl, rightBpl, 8, bpl, h, bpl16,
+				    (PageNum & 1) == 0
+					&& (Duplex == DMDUPLEX_LONGEDGE
+					|| Duplex == DMDUPLEX_MANUALLONG),
+				    NULL, &Dots[i], inked[i], ifp);
+	    if (rc == READ_ERROR)
+		error(1, "%s", ReadError);
 	    if (rc == EOF)
 		error(1, "Premature EOF(pksm) on page %d data, plane %d\n",
 			    PageNum, i);
@@ -1333,23 +1589,10 @@ pksm_pages(FILE *ifp, FILE *ofp)
 		}
 	    }
 
-	    // See if we can optimize this to be a monochrome page
-	    if (!AnyColor && i != 3)
-	    {
-		unsigned char *p, *e;
-
-		for (p = plane[i], e = p + bpl16*h; p < e; ++p)
-		    if (*p)
-		    {
-			AnyColor |= 1<<i;
-			break;
-		    }
-	    }
-
-	    if (Duplex == DMDUPLEX_LONGEDGE && (PageNum & 1) == 0)
-		rotate_bytes_180(plane[i], plane[i] + bpl16 * h - 1, Mirror1);
-	    if (Duplex == DMDUPLEX_MANUALLONG && (PageNum & 1) == 0)
-		rotate_bytes_180(plane[i], plane[i] + bpl16 * h - 1, Mirror1);
+	    // See if we can optimize this to be a monochrome page: the
+	    // dots of the plane were counted as it was read
+	    if (!AnyColor && i != 3 && Dots[i])
+		AnyColor |= 1<<i;
 	}
 
 	debug(2, "AnyColor = %s %s %s\n",
@@ -1361,32 +1604,111 @@ pksm_pages(FILE *ifp, FILE *ofp)
 	if ((PageNum & 1) == 0 && EvenPages)
 	{
 	    SeekRec[SeekIndex].b = ftell(EvenPages);
-	    pksm_page(plane, w, h, EvenPages);
+	    pksm_page(plane, inked, 1, w, h, EvenPages);
 	    SeekRec[SeekIndex].e = ftell(EvenPages);
 	    debug(1, "PKSM Page: %d	%ld	%ld\n",
 		PageNum, SeekRec[SeekIndex].b, SeekRec[SeekIndex].e);
 	    SeekIndex++;
 	}
 	else
-	    pksm_page(plane, w, h, ofp);
+	    pksm_page(plane, inked, 1, w, h, ofp);
 
 	for (i = 0; i < 4; ++i)
+	{
 	    free(plane[i]);
+	    free(inked[i]);
+	}
     }
 eof:
     return (0);
 }
 
+/*
+ * Where the rows of a pbm page come from, for pbm_page_bands(): the
+ * mapped page, or else ifp.
+ */
+typedef struct
+{
+    unsigned char	*raw;
+    int			rawBpl, rightBpl, bpl, bpl16;
+    FILE		*ifp;
+} PBMREAD;
+
+/*
+ * Compress a pbm page a band at a time as it is read, rather than
+ * reading it whole first.  Each band is a BIE of its own anyway, so only
+ * the one band is ever held in memory.  The output is the same as from
+ * pbm_page().
+ */
+int
+pbm_page_bands(PBMREAD *rd, int w, int h, FILE *ofp)
+{
+    BAND		band;
+    unsigned char	*buf, *raw = rd->raw;
+    int			bpl16 = rd->bpl16;
+    unsigned long	dots;
+    int			y;
+    int			rc;
+
+    buf = malloc(100 * bpl16);
+    if (!buf)
+	error(1, "Can't allocate band buffer\n");
+
+    start_bitmap_page(w, h, 1, ofp);
+    start_bitmap_planes((w + 127) & ~127, 1, ofp);
+
+    band.w = (w + 127) & ~127;
+    band.plane = NULL;
+    band.bitmaps[0] = buf;
+    for (y = 0; y < h; y += band.len)
+    {
+	band.len = h - y;
+	if (band.len > 100)
+	    band.len = 100;
+
+	// The band is blank if reading it found no dots
+	dots = Dots[3];
+	stats_begin(STATS_READ);
+	if (raw)
+	{
+	    copy_clipped_rows(buf, raw, rd->rawBpl, 8, rd->bpl, y, band.len,
+				bpl16, 0, SaveToner ? TonerMask : NULL,
+				&Dots[3], NULL);
+	    raw += (size_t) band.len * rd->rawBpl;
+	    rc = 0;
+	}
+	else
+	    rc = read_and_clip_rows(buf, rd->rawBpl, rd->rightBpl, 8,
+				rd->bpl, y, band.len, h, bpl16, 0,
+				SaveToner ? TonerMask : NULL, &Dots[3],
+				NULL, rd->ifp);
+	stats_end(STATS_READ);
+	if (rc == READ_ERROR)
+	    error(1, "%s", ReadError);
+	if (rc == EOF)
+	    error(1, "Premature EOF(pbm) on input stream\n");
+
+	band.blank = Dots[3] == dots;
+	write_bitmap_bands(&band, 1, 1, (y+100) >= h, ofp);
+    }
+    free(buf);
+
+    end_page(1, ofp);
+    return 0;
+}
+
 int
 pbm_pages(FILE *ifp, FILE *ofp)
 {
-    unsigned char	*buf;
+    unsigned char	*buf, *inked;
     int			rawW, rawH, rawBpl;
     int			rightBpl;
     int			w, h, bpl;
     int			bpl16;
     int			rc;
+    int			rotate;
     int			p4eaten = 1;
+    PBMREAD		rd, *bands;
 
     //
     // Save the original Upper Right clip values as the logical offset,
@@ -1416,33 +1738,59 @@ pbm_pages(FILE *ifp, FILE *ofp)
 	rightBpl = (rawW - UpperLeftX + 7) / 8;
 
 	bpl16 = (bpl + 15) & ~15;
-	buf = malloc(bpl16 * h);
-	if (!buf)
-	    error(1, "Can't allocate page buffer\n");
 
-	rc = read_and_clip_image(buf, rawBpl, rightBpl, 8, bpl, h, bpl16, ifp);
-	if (rc == EOF)
-	    error(1, "Premature EOF(pbm) on input stream\n");
+	// The page is only read whole when it has to be turned around,
+	// which is done as it is read
+	rotate = (PageNum & 1) == 1 && (Duplex == DMDUPLEX_LONGEDGE
+		|| (EvenPages && Duplex == DMDUPLEX_MANUALLONG));
+	bands = NULL;
+	buf = inked = NULL;
+	if (Bpp == 1 && !rotate)
+	{
+	    rd.raw = map_and_clip_image(rawBpl, 8, h, ifp);
+	    rd.rawBpl = rawBpl;
+	    rd.rightBpl = rightBpl;
+	    rd.bpl = bpl;
+	    rd.bpl16 = bpl16;
+	    rd.ifp = ifp;
+	    bands = &rd;
+	}
+	else
+	{
+	    buf = malloc(bpl16 * h);
+	    inked = malloc(h);
+	    if (!buf || !inked)
+		error(1, "Can't allocate page buffer\n");
+
+	    rc = read_and_clip_image(buf, rawBpl, rightBpl, 8, bpl, h, bpl16,
+					rotate, SaveToner ? TonerMask : NULL,
+					&Dots[3], inked, ifp);
+	    if (rc == READ_ERROR)
+		error(1, "%s", ReadError);
+	    if (rc == EOF)
+		error(1, "Premature EOF(pbm) on input stream\n");
+	}
 
 	++PageNum;
-	if (Duplex == DMDUPLEX_LONGEDGE && (PageNum & 1) == 0)
-	    rotate_bytes_180(buf, buf + bpl16 * h - 1, Mirror1);
-
 	if ((PageNum & 1) == 0 && EvenPages)
 	{
-	    if (Duplex == DMDUPLEX_MANUALLONG)
-		rotate_bytes_180(buf, buf + bpl16 * h - 1, Mirror1);
 	    SeekRec[SeekIndex].b = ftell(EvenPages);
-	    pbm_page(buf, w, h, EvenPages);
+	    if (bands)
+		pbm_page_bands(bands, w, h, EvenPages);
+	    else
+		pbm_page(buf, inked, 1, w, h, EvenPages);
 	    SeekRec[SeekIndex].e = ftell(EvenPages);
 	    debug(1, "PBM Page: %d	%ld	%ld\n",
 		PageNum, SeekRec[SeekIndex].b, SeekRec[SeekIndex].e);
 	    SeekIndex++;
 	}
+	else if (bands)
+	    pbm_page_bands(bands, w, h, ofp);
 	else
-	    pbm_page(buf, w, h, ofp);
+	    pbm_page(buf, inked, 1, w, h, ofp);
 
 	free(buf);
+	free(inked);
     }
     return (0);
 }
@@ -1450,41 +1798,18 @@ pbm_pages(FILE *ifp, FILE *ofp)
 int
 cups_pages(FILE *ifp, FILE *ofp)
 {
-    unsigned char	*plane[4];
-    int			p, np = 1;
-    int			bpc;
-    int			bpp;
-    int			co, cs;
-    int			rawW, rawH, rawBpl;
-    int			rightBpl;
+    unsigned char	*plane[4], *inked[4];
+    unsigned char	t;
+    int			p, np, y;
+    CUPSRASTER		*r;
+    const cups_page_header_t *hdr;
+    int			rawW, rawH;
     int			w, h, bpl, bpl16;
     int			rc;
-    int			version = 0, swapped = 0, compress = 0;
-    int			seek;
-    unsigned		magic;
-    cups_page_header_t	c1;
-    cups_page_header2_t	c2;
-
-    if (fread(&magic, sizeof(magic), 1, ifp) != 1)
-	error(1, "Premature EOF reading magic number\n");
-    switch (magic)
-    {
-    case CUPS_RASTER_SYNCv1:	version = 1; swapped = 0; compress = 0; break;
-    case CUPS_RASTER_REVSYNCv1:	version = 1; swapped = 1; compress = 0; break;
-    case CUPS_RASTER_SYNCv2:	version = 2; swapped = 0; compress = 1; break;
-    case CUPS_RASTER_REVSYNCv2:	version = 2; swapped = 1; compress = 1; break;
-    case CUPS_RASTER_SYNC:	version = 3; swapped = 0; compress = 0; break;
-    case CUPS_RASTER_REVSYNC:	version = 3; swapped = 1; compress = 0; break;
-    default:  error(1, "Illegal cups magic number '%4.4s'\n", (char *) &magic);
-	break;
-    }
-    debug(2, "CUPS magic number '%4.4s', version=%d, swapped=%d, compress=%d\n",
-	(char *) &magic, version, swapped, compress);
 
-    if (swapped)
-	error(1, "Don't know how to swap '%4.4s'\n", (char *) &magic);
-    if (compress)
-	error(1, "Don't know how to decompress '%4.4s'\n", (char *) &magic);
+    r = cupsraster_open(ifp);
+    if (!r)
+	error(1, "Illegal cups magic number\n");
 
     //
     // Save the original Upper Right clip values as the logical offset,
@@ -1502,81 +1827,83 @@ cups_pages(FILE *ifp, FILE *ofp)
     UpperLeftX &= ~3;
 
     AnyColor = 1;
-    for (;;)
+    while ((rc = cupsraster_next_page(r)) == 1)
     {
-	seek = sizeof(magic); 
-	if (fread(&c1, sizeof(c1), 1, ifp) != 1)
-	    break;
-	seek += sizeof(c1);
-	if (version != 1)
-	{
-	    if (fread(&c2, sizeof(c2), 1, ifp) != 1)
-		error(1, "Premature EOF skipping CUPS header V2\n");
-	    seek += sizeof(c2);
-	}
-
 	++PageNum;
 
-	rawW = c1.cupsWidth;
-	rawH = c1.cupsHeight;
-	// c1.cupsMediaType
-	bpc = c1.cupsBitsPerColor;
-	if (bpc != 2)
-	    error(1, "Illegal number of bits per color (%d)\n", bpc);
-	bpp = c1.cupsBitsPerPixel;
-	rawBpl = c1.cupsBytesPerLine;
-	co = c1.cupsColorOrder;
-	if (co != CUPS_ORDER_PLANAR)
-	    error(1, "Illegal color order (%d)\n", co);
-	cs = c1.cupsColorSpace;
-	switch (cs)
-	{
-	case CUPS_CSPACE_K:	np = 1; break;
-	case CUPS_CSPACE_CMYK:	np = 4; break;
-	default:	error(1, "Illegal color space (%d)\n", cs); break;
-	}
-	debug(2,"data at %ld\n", seek);
+	hdr = cupsraster_header(r);
+	np = cupsraster_planes(r);
+	if (np == 0)
+	    error(1, "Illegal bits per color (%d), color order (%d), "
+		    "or color space (%d)\n", hdr->cupsBitsPerColor,
+		    hdr->cupsColorOrder, hdr->cupsColorSpace);
+	rawW = hdr->cupsWidth;
+	rawH = hdr->cupsHeight;
 
 	debug(1, "%s: %d x %d x %d, %d (%d)\n",
-		cs==3 ? "mono" : "color", rawW, rawH, bpp, rawBpl, rawBpl*8);
+		np == 1 ? "mono" : "color", rawW, rawH,
+		hdr->cupsBitsPerPixel, hdr->cupsBytesPerLine,
+		hdr->cupsBytesPerLine*8);
 
 	w = rawW - UpperLeftX - LowerRightX;
 	h = rawH - UpperLeftY - LowerRightY;
-	bpl = (w + 3) / 4;
+	bpl = (w * Bpp + 7) / 8;
 	debug(2, "w = %d, bpl = %d\n", w, bpl);
-	rightBpl = (rawW - UpperLeftX + 3) / 4;
 
 	bpl16 = (bpl + 15) & ~15;
-	debug(2, "rawBpl = %d, bpl16 = %d\n", rawBpl, bpl16);
 
 	for (p = 0; p < np; ++p)
 	{
 	    plane[p] = malloc(bpl16 * h);
-	    if (!plane[p])
+	    inked[p] = malloc(h);
+	    if (!plane[p] || !inked[p])
 		error(1, "Unable to allocate plane[%d] of %d x %d = %d bytes\n",
-			    p, rawW, rawH, rawBpl * rawH);
+			    p, bpl16, h, bpl16 * h);
 	}
 
-	for (p = 0; p < np; ++p)
-	{
-	    rc = read_and_clip_image(plane[p], rawBpl, rightBpl, 4,
-					bpl, h, bpl16, ifp);
-	    if (rc == EOF)
-		error(1, "Premature EOF on plane[%d]\n", p);
+	rc = cupsraster_read_page(r, plane, bpl16, UpperLeftX, UpperLeftY,
+				    w, h, Bpp, (np == 1) ? &Dots[3] : Dots,
+				    inked);
+	if (rc == EOF)
+	    error(1, "Premature EOF on CUPS page %d\n", PageNum);
+
+	// Turned around as one long row, since the raster is read whole,
+	// so the rows with dots are the other way up too
+	if ((PageNum & 1) == 0 && (Duplex == DMDUPLEX_LONGEDGE
+		|| Duplex == DMDUPLEX_MANUALLONG))
+	    for (p = 0; p < np; ++p)
+	    {
+		mirror_row(plane[p], plane[p], (size_t) bpl16 * h, Bpp);
+		for (y = 0; y < h / 2; ++y)
+		{
+		    t = inked[p][y];
+		    inked[p][y] = inked[p][h - 1 - y];
+		    inked[p][h - 1 - y] = t;
+		}
+	    }
 
-	    if (Duplex == DMDUPLEX_LONGEDGE && (PageNum & 1) == 0)
-		rotate_bytes_180(plane[p], plane[p] + bpl16 * h - 1, Mirror1);
-	    if (Duplex == DMDUPLEX_MANUALLONG && (PageNum & 1) == 0)
-		rotate_bytes_180(plane[p], plane[p] + bpl16 * h - 1, Mirror1);
+	// The mask takes dots away, so count them again
+	if (SaveToner && np == 1 && Bpp == 1)
+	{
+	    Dots[3] = 0;
+	    for (y = 0; y < h; ++y)
+	    {
+		toner_row(plane[0] + (size_t) y * bpl16, bpl16,
+			    TonerMask[y & 3]);
+		stats_begin(STATS_DOTS);
+		count_row(plane[0] + (size_t) y * bpl16, bpl16, &Dots[3],
+			    &inked[0][y]);
+		stats_end(STATS_DOTS);
+	    }
 	}
 
 	if ((PageNum & 1) == 0 && EvenPages)
 	{
 	    SeekRec[SeekIndex].b = ftell(EvenPages);
 	    if (np == 1)
-		pbm_page(plane[0], w, h, EvenPages);
+		pbm_page(plane[0], inked[0], Bpp, w, h, EvenPages);
 	    else
-		pksm_page(plane, w, h, EvenPages);
+		pksm_page(plane, inked, Bpp, w, h, EvenPages);
 	    SeekRec[SeekIndex].e = ftell(EvenPages);
 	    debug(1, "CUPS Page: %d	%ld	%ld\n",
 		PageNum, SeekRec[SeekIndex].b, SeekRec[SeekIndex].e);
@@ -1585,15 +1912,21 @@ cups_pages(FILE *ifp, FILE *ofp)
 	else
 	{
 	    if (np == 1)
-		pbm_page(plane[0], w, h, ofp);
+		pbm_page(plane[0], inked[0], Bpp, w, h, ofp);
 	    else
-		pksm_page(plane, w, h, ofp);
+		pksm_page(plane, inked, Bpp, w, h, ofp);
 	}
 
 	for (p = 0; p < np; ++p)
+	{
 	    free(plane[p]);
+	    free(inked[p]);
+	}
     }
+    if (rc == EOF)
+	error(1, "Premature EOF reading CUPS header\n");
 
+    cupsraster_close(r);
     return 0;
 }
 
@@ -1601,7 +1934,7 @@ void
 blank_page(FILE *ofp)
 {
     int			w, h, bpl, bpl16;
-    unsigned char	*plane;
+    unsigned char	*plane, *inked;
     
     w = PageWidth - UpperLeftX - LowerRightX;
     h = PageHeight - UpperLeftY - LowerRightY;
@@ -1612,13 +1945,15 @@ blank_page(FILE *ofp)
     bpl16 = (bpl + 15) & ~15;
 
     plane = malloc(bpl16 * h);
-    if (!plane)
+    inked = calloc(h, 1);
+    if (!plane || !inked)
 	error(1, "Unable to allocate blank plane (%d bytes)\n", bpl16*h);
     memset(plane, 0, bpl16*h);
 
-    pbm_page(plane, w, h, ofp);
+    pbm_page(plane, inked, Bpp, w, h, ofp);
     ++PageNum;
     free(plane);
+    free(inked);
 }
 
 int
@@ -1644,8 +1979,9 @@ do_one(FILE *in)
 {
     int	mode;
 
+    MapIn = mapin_open(in);
     mode = getc(in);
-    if (mode == 't' || (mode >= '2' && mode <='5') )
+    if (mode == 't' || mode == 'R' || (mode >= '2' && mode <='5') )
     {
 	ungetc(mode, in);
 	cups_pages(in, stdout);
@@ -1676,6 +2012,8 @@ do_one(FILE *in)
 	else
 	    error(1, "Not a pbmraw file!\n");
     }
+    mapin_close(MapIn);
+    MapIn = NULL;
 }
 
 int
@@ -1686,7 +2024,7 @@ main(int argc, char *argv[])
     int i, j;
 
     while ( (c = getopt(argc, argv,
-		    "b:cd:g:n:m:p:r:s:tu:l:L:ABO:PJ:S:U:X:D:V?h")) != EOF)
+		    "b:cC:d:E:g:j:n:m:p:r:s:tu:l:L:ABO:PJ:S:U:X:D:V?h")) != EOF)
 	switch (c)
 	{
 	case 'b':	Bpp = atoi(optarg);
@@ -1707,6 +2045,14 @@ main(int argc, char *argv[])
 			if (PageHeight < 0 || PageHeight > 1000000)
 			    error(1, "Illegal Y value '%s' for -g\n", optarg);
 			break;
+	case 'C':	CacheMB = atoi(optarg);
+			if (CacheMB < 0)
+			    error(1, "Illegal value '%s' for -C\n", optarg);
+			break;
+	case 'j':	Threads = atoi(optarg);
+			if (Threads < 1)
+			    error(1, "Illegal value '%s' for -j\n", optarg);
+			break;
 	case 'm':	MediaCode = atoi(optarg); break;
 	case 'n':	Copies = atoi(optarg); break;
 	case 'p':	PaperCode = atoi(optarg); break;
@@ -1714,7 +2060,13 @@ main(int argc, char *argv[])
 			    error(1, "Illegal format '%s' for -r\n", optarg);
 			break;
 	case 's':	SourceCode = atoi(optarg); break;
-	case 't':	SaveToner = 1; break;
+	case 't':	SaveToner = 1;
+			toner_pattern(TonerMask, "checker");
+			break;
+	case 'E':	if (toner_pattern(TonerMask, optarg) < 0)
+			    error(1, "Illegal value '%s' for -E\n", optarg);
+			SaveToner = 1;
+			break;
 	case 'u':
 			if (strcmp(optarg, "0") == 0)
 			    break;
@@ -1765,6 +2117,18 @@ main(int argc, char *argv[])
     if (getenv("DEVICE_URI"))
 	IsCUPS = 1;
 
+    stats_init("foo2hp");
+    Pool = workpool_create(Threads);
+    if (CacheMB)
+    {
+	Cache = biecache_create((size_t) CacheMB << 20);
+	if (!Cache)
+	    error(1, "Can't allocate page cache\n");
+    }
+    Blanks = biecache_create(1 << 20);
+    if (!Blanks)
+	error(1, "Can't allocate page cache\n");
+
     start_doc(stdout);
 
     switch (Duplex)
@@ -1828,5 +2192,8 @@ main(int argc, char *argv[])
 
     end_doc(stdout);
 
+    biecache_destroy(Blanks);
+    biecache_destroy(Cache);
+    workpool_destroy(Pool);
     exit(0);
 }
@@ -74,6 +74,13 @@ static char Version[] = "$Id: foo2oak.c,v 1.69 2011/11/08 20:25:27 rick Exp $";
 #include <stdarg.h>
 #include <time.h>
 #include "jbig.h"
+#include "bitcmyk.h"
+#include "biechain.h"
+#include "cupsraster.h"
+#include "workpool.h"
+#include "stats.h"
+#include "dither.h"
+#include "dots.h"
 #include "oak.h"
 
 /*
@@ -122,6 +129,9 @@ int	LogicalClip = LOGICAL_CLIP_X | LOGICAL_CLIP_Y;
 
 int	IsCUPS = 0;
 int	Mirror = 1;
+int	Threads = 1;
+unsigned long	Dots[4];
+WORKPOOL	*Pool = NULL;
 
 /*
  * I now believe this is a YMCK printer as far as plane output ordering goes.
@@ -175,6 +185,7 @@ usage(void)
 "-d duplex         Duplex code to send to printer [%d]\n"
 "                    1=off, 2=longedge, 3=shortedge\n"
 "-g <xpix>x<ypix>  Set page dimensions in pixels [%dx%d]\n"
+"-j threads        Dither pgm pages using this many threads [%d]\n"
 "-m media          Media code to send to printer [%d]\n"
 "                    0=auto 1=plain 2=preprinted 3=letterhead 4=transparency\n"
 "                    5=prepunched 6=labels 7=bond 8=recycled 9=color\n"
@@ -213,6 +224,7 @@ usage(void)
     , Duplex
     , Bpp
     , PageWidth , PageHeight
+    , Threads
     , MediaCode
     , PaperCode
     , Copies
@@ -363,41 +375,19 @@ mirror_bytes(unsigned char *sp, int bpl, unsigned char *mirror)
  * in the list is the BIH and is always 20 bytes in size.  Each following
  * item is 65536 bytes in length.  The last item length is whatever remains.
  */
-typedef struct _BIE_CHAIN{
-    unsigned char	*data;
-    size_t		len;
-    struct _BIE_CHAIN	*next;
-} BIE_CHAIN;
-
-void
-free_chain(BIE_CHAIN *chain)
-{
-    BIE_CHAIN	*next;
-    next = chain;
-    while ((chain = next))
-    {
-	next = chain->next;
-	if (chain->data)
-	    free(chain->data);
-	free(chain);
-    }
-}
-
 void
 output_jbig(unsigned char *start, size_t len, void *cbarg)
 {
     BIE_CHAIN	*current, **root = (BIE_CHAIN **) cbarg;
     int		size = 65536;	// Printer does strange things otherwise.
 
+    stats_bytes(STATS_OUT, len);
+
     if ( (*root) == NULL)
     {
-	(*root) = malloc(sizeof(BIE_CHAIN));
+	(*root) = bie_alloc();
 	if (!(*root))
 	    error(1, "Can't allocate space for chain\n");
-
-	(*root)->data = NULL;
-	(*root)->next = NULL;
-	(*root)->len = 0;
 	size = 20;
 	if (len != 20)
 	    error(1, "First chunk must be BIH and 20 bytes long\n");
@@ -413,9 +403,10 @@ output_jbig(unsigned char *start, size_t len, void *cbarg)
 
 	if (!current->data)
 	{
-	    current->data = malloc(size);
+	    current->data = bie_block(size);
 	    if (!current->data)
 		error(1, "Can't allocate space for compressed data\n");
+	    current->size = size;
 	}
 
 	left = size - current->len;
@@ -427,13 +418,10 @@ output_jbig(unsigned char *start, size_t len, void *cbarg)
 
 	if (current->len == size)
 	{
-	    current->next = malloc(sizeof(BIE_CHAIN));
+	    current->next = bie_alloc();
 	    if (!current->next)
 		error(1, "Can't allocate space for chain\n");
 	    current = current->next;
-	    current->data = NULL;
-	    current->next = NULL;
-	    current->len = 0;
 	}
     }
 }
@@ -446,6 +434,7 @@ oak_record(FILE *fp, int type, void *payload, int paylen)
     static int	pageno = 0;
     int		rc;
 
+    stats_begin(STATS_WRITE);
     memcpy(hdr.magic, OAK_HDR_MAGIC, sizeof(hdr.magic));
     hdr.type = type;
     hdr.len = (sizeof(hdr) + paylen + 15) & ~0x0f;
@@ -470,6 +459,7 @@ oak_record(FILE *fp, int type, void *payload, int paylen)
 	    fprintf(stderr, "PAGE: %d %d\n", pageno, Copies);
     }
 
+    stats_end(STATS_WRITE);
     return 0;
 }
 
@@ -531,161 +521,55 @@ cmyk_planes(unsigned char *plane[4], unsigned char *raw, int w, int h)
 {
     int			rawbpl = (w + 1) / 2;
     int			bpl = (w + 7) / 8;
-    int			i;
-    int			x, y;
-    unsigned char	byte;
-    unsigned char	mask[8] = { 128, 64, 32, 16, 8, 4, 2, 1 };
-    int			aib = AllIsBlack;
-    int			bc = BlackClears;
-
-    for (i = 0; i < 4; ++i)
-	memset(plane[i], 0, bpl * h);
+    unsigned char	*cmyk[4];
 
     //
     // Unpack the combined plane into individual color planes
     //
-    // TODO: this can be speeded up using a 256 or 65536 entry lookup table
-    //
-    for (y = 0; y < h; ++y)
-    {
-	for (x = 0; x < w; ++x)
-	{
-	    byte = raw[y*rawbpl + x/2];
-
-	    if (aib && (byte & 0xE0) == 0xE0)
-	    {
-		plane[PL_K][y*bpl + x/8] |= mask[x&7];
-	    }
-	    else if (byte & 0x10)
-	    {
-		plane[PL_K][y*bpl + x/8] |= mask[x&7];
-		if (!bc)
-		{
-		    if (byte & 0x80) plane[PL_C][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x40) plane[PL_M][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x20) plane[PL_Y][y*bpl + x/8] |= mask[x&7];
-		}
-	    }
-	    else
-	    {
-		if (byte & 0x80) plane[PL_C][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x40) plane[PL_M][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x20) plane[PL_Y][y*bpl + x/8] |= mask[x&7];
-	    }
-
-	    ++x;
-	    if (aib && (byte & 0x0E) == 0x0E)
-	    {
-		plane[PL_K][y*bpl + x/8] |= mask[x&7];
-	    }
-	    else if (byte & 0x1)
-	    {
-		plane[PL_K][y*bpl + x/8] |= mask[x&7];
-		if (!bc)
-		{
-		    if (byte & 0x8) plane[PL_C][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x4) plane[PL_M][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x2) plane[PL_Y][y*bpl + x/8] |= mask[x&7];
-		}
-	    }
-	    else
-	    {
-		if (byte & 0x8) plane[PL_C][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x4) plane[PL_M][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x2) plane[PL_Y][y*bpl + x/8] |= mask[x&7];
-	    }
-	}
-    }
+    cmyk[0] = plane[PL_C];
+    cmyk[1] = plane[PL_M];
+    cmyk[2] = plane[PL_Y];
+    cmyk[3] = plane[PL_K];
+    bitcmyk_split(cmyk, bpl, raw, rawbpl, h, AllIsBlack, BlackClears, Dots);
 }
 
 void
 pgm_subplanes(unsigned char *subplane[2], unsigned char *raw, int w, int h)
 {
-    int			bpl = (w + 7) / 8;
-    int			x, y;
-    unsigned char	byte;
-    unsigned char	ormask[8] = { 128, 64, 32, 16, 8, 4, 2, 1 };
-    unsigned char	andmask[8] = { 0x7f, ~64, ~32, ~16, ~8, ~4, ~2, ~1 };
-    double		*carry0, *carry1, *carrytmp;
-    double		sum;
-    static int		dir = 1;
-    int			xs, xe;
-static int cnt[4];
-int tot = 0;
-
-    // TODO: convert this to scaled integer arithmetic
-
-    carry0 = (double *) calloc((w+2), sizeof(*carry0));
-    if (!carry0)
-	error(1, "Could not allocate space for carries\n");
-    carry1 = (double *) calloc((w+2), sizeof(*carry0));
-    if (!carry1)
-	error(1, "Could not allocate space for carries\n");
-    ++carry0; ++carry1;
-    for (y = 0; y < h; ++y)
+    static DITHER_LEVEL	level[] =
     {
-	if (dir > 0)
-	    { dir = -1; xs = w-1; xe = -1; }
-	else
-	    { dir = 1; xs = 0; xe = w; }
-	for (x = xs; x != xe; x += dir)
-	{
-	    byte = 255 - raw[y*w + x];
-	    sum = byte + carry0[x];
-
-++tot;
-	    if (byte == 255 || sum >= 255)
-	    {	// Full black
-++cnt[2];
-		byte = 255;
-		subplane[1][y*bpl + x/8] |= ormask[x&7];
-		subplane[0][y*bpl + x/8] &= andmask[x&7];
-	    }
-	    else if (sum >= (70.0/100)*255)
-	    {	// Dark gray
-++cnt[3];
-		byte = 255;
-		subplane[1][y*bpl + x/8] |= ormask[x&7];
-		subplane[0][y*bpl + x/8] |= ormask[x&7];
-	    }
-	    else if (sum > 0)
-	    {	// Light gray
-++cnt[1];
-		byte = (40.0/100)*255;
-		subplane[1][y*bpl + x/8] &= andmask[x&7];
-		subplane[0][y*bpl + x/8] |= ormask[x&7];
-	    }
-	    else
-	    {	// Full white
-++cnt[0];
-		byte = 0;
-		subplane[1][y*bpl + x/8] &= andmask[x&7];
-		subplane[0][y*bpl + x/8] &= andmask[x&7];
-	    }
-
-	    // Compute the carry that must be distributed
-	    sum -= byte;
-	    carry0[x+dir] += (sum*7)/16.0;
-	    carry1[x-dir] += (sum*3)/16.0;
-	    carry1[x    ] += (sum*5)/16.0;
-	    carry1[x+dir] += (sum*1)/16.0;
-	}
-	// Advance carry buffers
-	carrytmp = carry0; carry0 = carry1; carry1 = carrytmp;
-	memset(carry1-1, 0, (w+2) * sizeof(*carry1));
-    }
-debug(1, "%d	%d %d %d %d\n", tot, cnt[3], cnt[2], cnt[1], cnt[0]);
+	{ 255 * DITHER_ONE,		255,	2 },	// Full black
+	{ 255 * DITHER_ONE * 7 / 10,	255,	3 },	// Dark gray
+	{ 1,				102,	1 },	// Light gray
+	{ 0,				0,	0 },	// Full white
+    };
+    static DITHER	*dither;
+
+    if (!dither)
+	dither = dither_create(level, 4, 0, 2);
+    if (!dither || dither_page(dither, subplane, (w + 7) / 8,
+				raw, w, w, h, 1, Pool, Threads) < 0)
+	error(1, "Could not allocate space for carries\n");
 
-    free(--carry0); free(--carry1);
+    // The dots only exist once the page is dithered
+    stats_begin(STATS_DOTS);
+    Dots[3] = dots_count(subplane[0], (size_t) (w + 7) / 8 * h)
+		+ dots_count(subplane[1], (size_t) (w + 7) / 8 * h);
+    stats_end(STATS_DOTS);
 }
 
+/*
+ * Split the 2 bit per pixel C, M, Y and K planes of a CUPS raster page
+ * (rows of cbpl bytes) into the two bit planes of each color.
+ */
 void
-cups_planes(unsigned char *plane[4][2], unsigned char *raw, int w, int h)
+cups_planes(unsigned char *plane[4][2], unsigned char *cmyk[4], int cbpl,
+		int w, int h)
 {
     int			bpl = (w + 7) / 8;
     int			i, sub;
     int			x, y;
-    unsigned char	byte;
+    int			cv, mv, yv, kv;
     unsigned char	mask[8] = { 128, 64, 32, 16, 8, 4, 2, 1 };
     int			aib = AllIsBlack;
     int			bc = BlackClears;
@@ -696,38 +580,48 @@ cups_planes(unsigned char *plane[4][2], unsigned char *raw, int w, int h)
 	    memset(plane[i][sub], 0, bpl * h);
 
     //
-    // Unpack the combined plane into individual color planes
-    //
-    // TODO: this can be speeded up using a 256 or 65536 entry lookup table
+    // Move the two bits of each color into its two bit planes
     //
     for (y = 0; y < h; ++y)
     {
 	for (x = 0; x < w; ++x)
 	{
-	    byte = raw[y*w + x];
+	    int		o = y*cbpl + x/4;
+	    int		s = 6 - 2 * (x & 3);
+	    int		b = y*bpl + x/8;
 
-	    if (aib && (byte & 0xfc) == 0xfc)
-	    {
-		plane[PL_K][1][y*bpl + x/8] |= mask[x&7];
-		plane[PL_K][0][y*bpl + x/8] |= mask[x&7];
-	    }
-	    else if (bc && (byte & 0x03) == 0x03)
+	    cv = (cmyk[0][o] >> s) & 3;
+	    mv = (cmyk[1][o] >> s) & 3;
+	    yv = (cmyk[2][o] >> s) & 3;
+	    kv = (cmyk[3][o] >> s) & 3;
+
+	    if ((aib && cv == 3 && mv == 3 && yv == 3) || (bc && kv == 3))
 	    {
-		plane[PL_K][1][y*bpl + x/8] |= mask[x&7];
-		plane[PL_K][0][y*bpl + x/8] |= mask[x&7];
+		plane[PL_K][1][b] |= mask[x&7];
+		plane[PL_K][0][b] |= mask[x&7];
 	    }
 	    else
 	    {
-		if (byte & 128) plane[PL_C][1][y*bpl + x/8] |= mask[x&7];
-		if (byte & 64)  plane[PL_C][0][y*bpl + x/8] |= mask[x&7];
-		if (byte & 32)  plane[PL_M][1][y*bpl + x/8] |= mask[x&7];
-		if (byte & 16)  plane[PL_M][0][y*bpl + x/8] |= mask[x&7];
-		if (byte & 8)   plane[PL_Y][1][y*bpl + x/8] |= mask[x&7];
-		if (byte & 4)   plane[PL_Y][0][y*bpl + x/8] |= mask[x&7];
-		if (byte & 2)   plane[PL_K][1][y*bpl + x/8] |= mask[x&7];
-		if (byte & 1)   plane[PL_K][0][y*bpl + x/8] |= mask[x&7];
+		if (cv & 2) plane[PL_C][1][b] |= mask[x&7];
+		if (cv & 1) plane[PL_C][0][b] |= mask[x&7];
+		if (mv & 2) plane[PL_M][1][b] |= mask[x&7];
+		if (mv & 1) plane[PL_M][0][b] |= mask[x&7];
+		if (yv & 2) plane[PL_Y][1][b] |= mask[x&7];
+		if (yv & 1) plane[PL_Y][0][b] |= mask[x&7];
+		if (kv & 2) plane[PL_K][1][b] |= mask[x&7];
+		if (kv & 1) plane[PL_K][0][b] |= mask[x&7];
 	    }
 	}
+
+	// Count the dots of each color while its rows are still cached
+	Dots[0] += dots_count(plane[PL_C][0] + y*bpl, bpl)
+		    + dots_count(plane[PL_C][1] + y*bpl, bpl);
+	Dots[1] += dots_count(plane[PL_M][0] + y*bpl, bpl)
+		    + dots_count(plane[PL_M][1] + y*bpl, bpl);
+	Dots[2] += dots_count(plane[PL_Y][0] + y*bpl, bpl)
+		    + dots_count(plane[PL_Y][1] + y*bpl, bpl);
+	Dots[3] += dots_count(plane[PL_K][0] + y*bpl, bpl)
+		    + dots_count(plane[PL_K][1] + y*bpl, bpl);
     }
 }
 
@@ -795,7 +689,9 @@ cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
 	if (!plane[p]) error(3, "Cannot allocate space for bit plane\n");
     }
 
+    stats_begin(STATS_SPLIT);
     cmyk_planes(plane, raw, w, h);
+    stats_end(STATS_SPLIT);
 
     oak_record(ofp, OAK_TYPE_START_PAGE, NULL, 0);
 
@@ -881,7 +777,7 @@ cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
     #define N 256
     for (y = 0; y < h; y += N)
     {
-	struct jbg_enc_state	se;
+	static struct jbg_enc_state se;	// Reused for every band
 	unsigned char		*bitmaps[1];
 	BIE_CHAIN		*chain;
 	BIE_CHAIN		*current;
@@ -910,11 +806,12 @@ cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
 		JbgOptions[2] = lines;
 	    else
 		JbgOptions[2] = N;
-	    jbg_enc_init(&se, w, lines, 1, bitmaps, output_jbig, &chain);
+	    jbg_enc_reinit(&se, w, lines, 1, bitmaps, output_jbig, &chain);
 	    jbg_enc_options(&se, JbgOptions[0], JbgOptions[1],
 				JbgOptions[2], JbgOptions[3], JbgOptions[4]);
+	    stats_begin(STATS_ENCODE);
 	    jbg_enc_out(&se);
-	    jbg_enc_free(&se);
+	    stats_end(STATS_ENCODE);
 
 	    if (chain->len != 20)
 		error(1, "Program error: missing BIH at start of chain\n");
@@ -933,11 +830,8 @@ cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
 	    recdata.datalen = chainlen;
 	    recdata.padlen = (recdata.datalen + 15) & ~0x0f;
 	    oak_record(ofp, OAK_TYPE_IMAGE_DATA, &recdata, sizeof(recdata));
-	    for (current = chain->next; current; current = current->next)
-	    {
-		rc = fwrite(current->data, 1, current->len, ofp);
-		if (rc == 0) error(1, "fwrite(4): rc == 0!\n");
-	    }
+	    if (bie_write(chain->next, ofp) == EOF)
+		error(1, "fwrite(4): rc == 0!\n");
 	    padlen = recdata.padlen - recdata.datalen;  
 	    if (padlen)
 	    {
@@ -957,6 +851,9 @@ cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
 
     endpage_arg = 1;	// Color
     oak_record(ofp, OAK_TYPE_END_PAGE, &endpage_arg, sizeof(endpage_arg));
+    stats_dots(Dots);
+    memset(Dots, 0, sizeof(Dots));
+    stats_page();
 
     return 0;
 }
@@ -1037,7 +934,7 @@ pbm_page(unsigned char *buf, int w, int h, FILE *ofp)
     #define N 256
     for (y = 0; y < h; y += N)
     {
-	struct jbg_enc_state	se;
+	static struct jbg_enc_state se;	// Reused for every band
 	unsigned char		*bitmaps[1];
 	BIE_CHAIN		*chain;
 	BIE_CHAIN		*current;
@@ -1067,11 +964,12 @@ pbm_page(unsigned char *buf, int w, int h, FILE *ofp)
 	    JbgOptions[2] = lines;
 	else
 	    JbgOptions[2] = N;
-	jbg_enc_init(&se, w, lines, 1, bitmaps, output_jbig, &chain);
+	jbg_enc_reinit(&se, w, lines, 1, bitmaps, output_jbig, &chain);
 	jbg_enc_options(&se, JbgOptions[0], JbgOptions[1],
 			    JbgOptions[2], JbgOptions[3], JbgOptions[4]);
+	stats_begin(STATS_ENCODE);
 	jbg_enc_out(&se);
-	jbg_enc_free(&se);
+	stats_end(STATS_ENCODE);
 
 	if (chain->len != 20)
 	    error(1, "Program error: missing BIH at start of chain\n");
@@ -1090,11 +988,8 @@ pbm_page(unsigned char *buf, int w, int h, FILE *ofp)
 	recdata.datalen = chainlen;
 	recdata.padlen = (recdata.datalen + 15) & ~0x0f;
 	oak_record(ofp, OAK_TYPE_IMAGE_DATA, &recdata, sizeof(recdata));
-	for (current = chain->next; current; current = current->next)
-	{
-	    rc = fwrite(current->data, 1, current->len, ofp);
-	    if (rc == 0) error(1, "fwrite(7): rc == 0!\n");
-	}
+	if (bie_write(chain->next, ofp) == EOF)
+	    error(1, "fwrite(7): rc == 0!\n");
 	padlen = recdata.padlen - recdata.datalen;  
 	if (padlen)
 	{
@@ -1108,6 +1003,9 @@ pbm_page(unsigned char *buf, int w, int h, FILE *ofp)
 
     endpage_arg = 0;	// Mono
     oak_record(ofp, OAK_TYPE_END_PAGE, &endpage_arg, sizeof(endpage_arg));
+    stats_dots(Dots);
+    memset(Dots, 0, sizeof(Dots));
+    stats_page();
 
     return 0;
 }
@@ -1201,7 +1099,7 @@ pgm_page(unsigned char *raw, int w, int h, FILE *ofp)
     #define N 256
     for (y = 0; y < h; y += N)
     {
-	struct jbg_enc_state	se;
+	static struct jbg_enc_state se;	// Reused for every band
 	unsigned char		*bitmaps[1];
 	BIE_CHAIN		*chain;
 	BIE_CHAIN		*current;
@@ -1230,11 +1128,12 @@ pgm_page(unsigned char *raw, int w, int h, FILE *ofp)
 		JbgOptions[2] = lines;
 	    else
 		JbgOptions[2] = N;
-	    jbg_enc_init(&se, w, lines, 1, bitmaps, output_jbig, &chain);
+	    jbg_enc_reinit(&se, w, lines, 1, bitmaps, output_jbig, &chain);
 	    jbg_enc_options(&se, JbgOptions[0], JbgOptions[1],
 				JbgOptions[2], JbgOptions[3], JbgOptions[4]);
+	    stats_begin(STATS_ENCODE);
 	    jbg_enc_out(&se);
-	    jbg_enc_free(&se);
+	    stats_end(STATS_ENCODE);
 
 	    if (chain->len != 20)
 		error(1, "Program error: missing BIH at start of chain\n");
@@ -1253,11 +1152,8 @@ pgm_page(unsigned char *raw, int w, int h, FILE *ofp)
 	    recdata.datalen = chainlen;
 	    recdata.padlen = (recdata.datalen + 15) & ~0x0f;
 	    oak_record(ofp, OAK_TYPE_IMAGE_DATA, &recdata, sizeof(recdata));
-	    for (current = chain->next; current; current = current->next)
-	    {
-		rc = fwrite(current->data, 1, current->len, ofp);
-		if (rc == 0) error(1, "fwrite(9): rc == 0!\n");
-	    }
+	    if (bie_write(chain->next, ofp) == EOF)
+		error(1, "fwrite(9): rc == 0!\n");
 	    padlen = recdata.padlen - recdata.datalen;  
 	    if (padlen)
 	    {
@@ -1276,12 +1172,15 @@ pgm_page(unsigned char *raw, int w, int h, FILE *ofp)
 
     endpage_arg = 0;
     oak_record(ofp, OAK_TYPE_END_PAGE, &endpage_arg, sizeof(endpage_arg));
+    stats_dots(Dots);
+    memset(Dots, 0, sizeof(Dots));
+    stats_page();
 
     return 0;
 }
 
 int
-cups_page(unsigned char *raw, int w, int h, FILE *ofp)
+cups_page(unsigned char *cmyk[4], int cbpl, int w, int h, FILE *ofp)
 {
     WORD		endpage_arg;
     DWORD		source_arg;
@@ -1311,7 +1210,7 @@ cups_page(unsigned char *raw, int w, int h, FILE *ofp)
 	}
     }
 
-    cups_planes(plane, raw, w, h);
+    cups_planes(plane, cmyk, cbpl, w, h);
 
     oak_record(ofp, OAK_TYPE_START_PAGE, NULL, 0);
 
@@ -1398,7 +1297,7 @@ cups_page(unsigned char *raw, int w, int h, FILE *ofp)
     #define N 256
     for (y = 0; y < h; y += N)
     {
-	struct jbg_enc_state	se;
+	static struct jbg_enc_state se;	// Reused for every band
 	unsigned char		*bitmaps[1];
 	BIE_CHAIN		*chain;
 	BIE_CHAIN		*current;
@@ -1429,11 +1328,12 @@ cups_page(unsigned char *raw, int w, int h, FILE *ofp)
 		    JbgOptions[2] = lines;
 		else
 		    JbgOptions[2] = N;
-		jbg_enc_init(&se, w, lines, 1, bitmaps, output_jbig, &chain);
+		jbg_enc_reinit(&se, w, lines, 1, bitmaps, output_jbig, &chain);
 		jbg_enc_options(&se, JbgOptions[0], JbgOptions[1],
 				JbgOptions[2], JbgOptions[3], JbgOptions[4]);
+		stats_begin(STATS_ENCODE);
 		jbg_enc_out(&se);
-		jbg_enc_free(&se);
+		stats_end(STATS_ENCODE);
 
 		if (chain->len != 20)
 		    error(1, "Program error: missing BIH at start of chain\n");
@@ -1452,14 +1352,14 @@ cups_page(unsigned char *raw, int w, int h, FILE *ofp)
 		recdata.datalen = chainlen;
 		recdata.padlen = (recdata.datalen + 15) & ~0x0f;
 		oak_record(ofp, OAK_TYPE_IMAGE_DATA, &recdata, sizeof(recdata));
-		for (current = chain->next; current; current = current->next)
+		if (bie_write(chain->next, ofp) == EOF)
+		    error(1, "fwrite(11): rc == 0!\n");
+		padlen = recdata.padlen - recdata.datalen;  
+		if (padlen)
 		{
-		    rc = fwrite(current->data, 1, current->len, ofp);
-		    if (rc == 0) error(1, "fwrite(11): rc == 0!\n");
+		    rc = fwrite(pad, 1, padlen, ofp);
+		    if (rc == 0) error(1, "fwrite(12): rc == 0!\n");
 		}
-		padlen = recdata.padlen - recdata.datalen;  
-		rc = fwrite(pad, 1, padlen, ofp);
-		if (rc == 0) error(1, "fwrite(12): rc == 0!\n");
 
 		free_chain(chain);
 	    }
@@ -1474,6 +1374,9 @@ cups_page(unsigned char *raw, int w, int h, FILE *ofp)
 
     endpage_arg = 0;
     oak_record(ofp, OAK_TYPE_END_PAGE, &endpage_arg, sizeof(endpage_arg));
+    stats_dots(Dots);
+    memset(Dots, 0, sizeof(Dots));
+    stats_page();
 
     return 0;
 }
@@ -1481,12 +1384,13 @@ cups_page(unsigned char *raw, int w, int h, FILE *ofp)
 int
 read_and_clip_image(unsigned char *buf,
 			int rawBpl, int rightBpl, int pixelsPerByte,
-			int bpl, int h, FILE *ifp)
+			int bpl, int h, unsigned long *dots, FILE *ifp)
 {
     unsigned char	*rowbuf, *rowp;
     int			y;
     int			rc;
 
+    stats_begin(STATS_READ);
     debug(1, "read_and_clip_image: rawBpl=%d, rightBpl=%d, pixelsePerByte=%d\n",
 		rawBpl, rightBpl, pixelsPerByte);
     debug(1, "read_and_clip_image: bpl=%d, h=%d\n", bpl, h);
@@ -1529,6 +1433,8 @@ read_and_clip_image(unsigned char *buf,
 	    goto eof;
 	if (rc != 1)
 		error(1, "Premature EOF(3) on input at y=%d\n", y);
+	if (dots)
+	    *dots += dots_count(rowp, bpl);
 
 	// Clip right pixels
 	if (rightBpl != bpl)
@@ -1551,10 +1457,13 @@ read_and_clip_image(unsigned char *buf,
     }
 
     free(rowbuf);
+    stats_bytes(STATS_IN, (size_t) rawBpl * (UpperLeftY + h + LowerRightY));
+    stats_end(STATS_READ);
     return (0);
 
 eof:
     free(rowbuf);
+    stats_end(STATS_READ);
     return (EOF);
 }
 
@@ -1598,7 +1507,7 @@ cmyk_pages(FILE *ifp, FILE *ofp)
 
     for (;;)
     {
-	rc = read_and_clip_image(buf, rawBpl, rightBpl, 2, bpl, h, ifp);
+	rc = read_and_clip_image(buf, rawBpl, rightBpl, 2, bpl, h, NULL, ifp);
 	if (rc == EOF)
 	    goto done;
 
@@ -1710,7 +1619,8 @@ pbm_pages(FILE *ifp, FILE *ofp)
 	if (!buf)
 	    error(1, "Can't allocate page buffer\n");
 
-	rc = read_and_clip_image(buf, rawBpl, rightBpl, 8, bpl, h, ifp);
+	rc = read_and_clip_image(buf, rawBpl, rightBpl, 8, bpl, h, &Dots[3],
+				    ifp);
 	if (rc == EOF)
 	    error(1, "Premature EOF(pbm) on input stream\n");
 
@@ -1765,7 +1675,7 @@ pgm_pages(FILE *ifp, FILE *ofp, int first)
 	if (!buf)
 	    error(1, "Can't allocate page buffer\n");
 
-	rc = read_and_clip_image(buf, rawBpl, rightBpl, 1, bpl, h, ifp);
+	rc = read_and_clip_image(buf, rawBpl, rightBpl, 1, bpl, h, NULL, ifp);
 	if (rc == EOF)
 	    error(1, "Premature EOF(pgm) on input stream\n");
 
@@ -1779,13 +1689,13 @@ pgm_pages(FILE *ifp, FILE *ofp, int first)
 int
 cups_pages(FILE *ifp, FILE *ofp)
 {
-    unsigned char	*buf;
-    int			bpc;
-    int			rawW, rawH, rawBpl;
-    int			rightBpl;
-    int			w, h, bpl;
+    unsigned char	*cmyk[4];
+    CUPSRASTER		*r;
+    const cups_page_header_t *hdr;
+    int			rawW, rawH;
+    int			w, h, cbpl;
+    int			np, p;
     int			rc;
-    char		hdr[512];
 
     //
     // Save the original Upper Right clip values as the logical offset,
@@ -1796,68 +1706,50 @@ cups_pages(FILE *ifp, FILE *ofp)
     if (LogicalClip & LOGICAL_CLIP_Y)
 	LogicalOffsetY = UpperLeftY;
 
-    // 00000000: 74 53 61 52 00 00 00 00  00 00 00 00 00 00 00 00 | tSaR
-    // 00000170: 00 00 00 00 00 00 00 00  ec 13 00 00 c8 19 00 00
-    // 00000180: 00 00 00 00 02 00 00 00  02 00 00 00 ec 13 00 00
-
-    if (fread(hdr, 4, 1, ifp) != 1)
-	error(1, "Preamture EOF reading magic number\n");
-    if (memcmp(hdr, "tSaR", 4) != 0 && memcmp(hdr, "RaSt", 4) != 0)
+    r = cupsraster_open(ifp);
+    if (!r)
 	error(1, "Illegal magic number\n");
-    if (fread(hdr, 0x178-4, 1, ifp) != 1)
-	error(1, "Preamture EOF skipping start of CUPS header\n");
-
-    if (fread(&rawW, 4, 1, ifp) != 1)
-	error(1, "Preamture EOF reading width\n");
-    if (fread(&rawH, 4, 1, ifp) != 1)
-	error(1, "Preamture EOF reading height\n");
 
-    if (fread(&hdr, 4, 1, ifp) != 1)
-	error(1, "Preamture EOF skipping mediaType\n");
-
-    if (fread(&bpc, 4, 1, ifp) != 1)
-	error(1, "Preamture EOF reading height\n");
-    if (bpc != 2)
-	error(1, "Illegal number of bits per color (%d)\n", bpc);
-
-    if (fread(&hdr, 4, 1, ifp) != 1)
-	error(1, "Preamture EOF skipping bitPerPixel\n");
-
-    if (fread(&rawBpl, 4, 1, ifp) != 1)
-	error(1, "Preamture EOF reading height\n");
-
-    if (fread(&hdr, 6*4, 1, ifp) != 1)
-	error(1, "Preamture EOF skipping end of CUPS header\n");
-
-    debug(1, "%d x %d, %d\n", rawW, rawH, rawBpl);
-
-    // We only clip multiples of 1 pixels off the leading edge, and
-    // add any remainder to the amount we clip from the right edge.
-    // Its fast, and good enough for government work.
-    LowerRightX += UpperLeftX & 0;
-    UpperLeftX &= ~0;
+    while ((rc = cupsraster_next_page(r)) == 1)
+    {
+	hdr = cupsraster_header(r);
+	np = cupsraster_planes(r);
+	if (np == 0)
+	    error(1, "Can't handle CUPS raster with %d bits per color, "
+		    "color order %d, color space %d\n",
+		    hdr->cupsBitsPerColor, hdr->cupsColorOrder,
+		    hdr->cupsColorSpace);
+	rawW = hdr->cupsWidth;
+	rawH = hdr->cupsHeight;
+	debug(1, "%d x %d, %d\n", rawW, rawH, hdr->cupsBytesPerLine);
 
-    w = rawW - UpperLeftX - LowerRightX;
-    h = rawH - UpperLeftY - LowerRightY;
-    bpl = (w + 0) / 1;
-    rightBpl = (rawW - UpperLeftX + 0) / 1;
+	w = rawW - UpperLeftX - LowerRightX;
+	h = rawH - UpperLeftY - LowerRightY;
+	cbpl = (w + 3) / 4;
 
-    buf = malloc(bpl * h);
-    if (!buf)
-	error(1, "Unable to allocate page buffer of %d x %d = %d bytes\n",
-		rawW, rawH, rawBpl * rawH);
+	for (p = 0; p < 4; ++p)
+	{
+	    cmyk[p] = calloc(cbpl, h);
+	    if (!cmyk[p])
+		error(1, "Unable to allocate page buffer of %d x %d bytes\n",
+			cbpl, h);
+	}
 
-    for (;;)
-    {
-	rc = read_and_clip_image(buf, rawBpl, rightBpl, 1, bpl, h, ifp);
+	// A K only page just fills the K plane
+	rc = cupsraster_read_page(r, (np == 1) ? &cmyk[3] : cmyk, cbpl,
+				    UpperLeftX, UpperLeftY, w, h, 2, NULL, NULL);
 	if (rc == EOF)
-	    goto done;
+	    error(1, "Premature EOF on CUPS page\n");
+
+	cups_page(cmyk, cbpl, w, h, ofp);
 
-	cups_page(buf, w, h, ofp);
+	for (p = 0; p < 4; ++p)
+	    free(cmyk[p]);
     }
+    if (rc == EOF)
+	error(1, "Premature EOF reading CUPS header\n");
 
-done:
-    free(buf);
+    cupsraster_close(r);
     return 0;
 }
 
@@ -1867,7 +1759,7 @@ do_one(FILE *in)
     int	mode;
 
     mode = getc(in);
-    if (mode == 't')
+    if (mode == 't' || mode == 'R' || (mode >= '2' && mode <= '3'))
     {
 	ungetc(mode, in);
 	cups_pages(in, stdout);
@@ -1895,7 +1787,7 @@ main(int argc, char *argv[])
     int	c;
 
     while ( (c = getopt(argc, argv,
-		    "b:cd:g:n:m:p:r:s:u:l:z:L:ABJ:M:S:U:D:V?h")) != EOF)
+		    "b:cd:g:j:n:m:p:r:s:u:l:z:L:ABJ:M:S:U:D:V?h")) != EOF)
 	switch (c)
 	{
 	case 'b':	Bpp = atoi(optarg);
@@ -1919,6 +1811,10 @@ main(int argc, char *argv[])
 			if (PageHeight < 0 || PageHeight > 1000000)
 			    error(1, "Illegal Y value '%s' for -g\n", optarg);
 			break;
+	case 'j':	Threads = atoi(optarg);
+			if (Threads < 1)
+			    error(1, "Illegal value '%s' for -j\n", optarg);
+			break;
 	case 'm':	MediaCode = atoi(optarg); break;
 	case 'n':	Copies = atoi(optarg); break;
 	case 'p':	PaperCode = atoi(optarg); break;
@@ -1985,6 +1881,9 @@ main(int argc, char *argv[])
 	JbgOptions[3] = 32;
     }
 
+    stats_init("foo2oak");
+    Pool = workpool_create(Threads);
+
     start_doc(stdout);
 
     if (argc == 0)
@@ -2007,5 +1906,7 @@ main(int argc, char *argv[])
 	}
     }
     end_doc(stdout);
+
+    workpool_destroy(Pool);
     exit(0);
 }
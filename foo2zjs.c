@@ -77,12 +77,23 @@ static char Version[] = "$Id: foo2zjs.c,v 1.109 2011/11/12 16:39:53 rick Exp $";
 #include <stdarg.h>
 #include <time.h>
 #include "jbig.h"
+#include "bitcmyk.h"
+#include "biechain.h"
+#include "workpool.h"
+#include "stats.h"
+#include "biecache.h"
+#include "mirror.h"
+#include "dots.h"
+#include "toner.h"
+#include "pageq.h"
+#include "mapin.h"
 #include "zjs.h"
 
 /*
  * Command line options
  */
 int	Debug = 0;
+int	ZeroTime = 0;
 int	ResX = 1200;
 int	ResY = 600;
 int	Bpp = 1;
@@ -122,13 +133,14 @@ int	LogicalOffsetY = 0;
 #define LOGICAL_CLIP_Y	1
 int	LogicalClip = LOGICAL_CLIP_X | LOGICAL_CLIP_Y;
 int	SaveToner = 0;
+unsigned char	TonerMask[4];	/* for each row, by row number mod 4 */
 int	PageNum = 0;
 	#define even_page(x) ( ((x) & 1) == 0 )
 	#define odd_page(x) ( ((x) & 1) == 1 )
 int	RealWidth;
 int	EconoMode = 0;
 int     PrintDensity = 3;
-int	Dots[4];
+unsigned long	Dots[4];
 int	TotalDots;
 
 int	IsCUPS = 0;
@@ -142,6 +154,13 @@ SEEKREC	SeekRec[2000];
 int	SeekIndex = 0;
 off_t	SeekMedia;
 
+int	Threads = 1;
+WORKPOOL	*Pool = NULL;
+int	CacheMB = 0;
+BIECACHE	*Cache = NULL;
+BIECACHE	*Blanks = NULL;		/* blank planes of each size */
+MAPIN		*MapIn = NULL;
+
 long JbgOptions[5] =
 {
     /* Order */
@@ -186,10 +205,13 @@ usage(void)
 "\n"
 "Normal Options:\n"
 "-c                Force color mode if autodetect doesn't work\n"
+"-C megabytes      Reuse the compressed planes of repeated pages, such as\n"
+"                  forms, keeping up to this many megabytes of them [%d]\n"
 "-d duplex         Duplex code to send to printer [%d]\n"
 "                    1=off, 2=longedge, 3=shortedge\n"
 "                    4=manual longedge, 5=manual shortedge\n"
 "-g <xpix>x<ypix>  Set page dimensions in pixels [%dx%d]\n"
+"-j threads        Compress planes using this many threads [%d]\n"
 "-m media          Media code to send to printer [%d]\n"
 "                  -z0:\n"
 "                    1=standard, 2=transparency, 3=glossy, 257=envelope,\n"
@@ -220,6 +242,9 @@ usage(void)
 "                    1=upper 2=lower 4=manual 7=auto\n"
 "                    Code numbers may vary with printer model\n"
 "-t                Draft mode.  Every other pixel is white.\n"
+"-E pattern        Draft mode with another pattern: checker (as -t),\n"
+"                    lines (every other row white), or 1-99 (percent\n"
+"                    of the pixels kept, by an ordered dither)\n"
 "-T density        Print density (1-5) [%d].\n"
 "-J filename       Filename string to send to printer [%s]\n"
 "-U username       Username string to send to printer [%s]\n"
@@ -246,8 +271,10 @@ usage(void)
 "                  1=Cyan, 2=Magenta, 3=Yellow, 4=Black\n"
 "-D lvl            Set Debug level [%d]\n"
 "-V                Version %s\n"
+    , CacheMB
     , Duplex
     , PageWidth , PageHeight
+    , Threads
     , MediaCode
     , PaperCode
     , Copies
@@ -268,112 +295,6 @@ usage(void)
   exit(1);
 }
 
-/*
- * Mirror1: bits 01234567 become 76543210
- */
-unsigned char	Mirror1[256] =
-{
-	  0,128, 64,192, 32,160, 96,224, 16,144, 80,208, 48,176,112,240,
-	  8,136, 72,200, 40,168,104,232, 24,152, 88,216, 56,184,120,248,
-	  4,132, 68,196, 36,164,100,228, 20,148, 84,212, 52,180,116,244,
-	 12,140, 76,204, 44,172,108,236, 28,156, 92,220, 60,188,124,252,
-	  2,130, 66,194, 34,162, 98,226, 18,146, 82,210, 50,178,114,242,
-	 10,138, 74,202, 42,170,106,234, 26,154, 90,218, 58,186,122,250,
-	  6,134, 70,198, 38,166,102,230, 22,150, 86,214, 54,182,118,246,
-	 14,142, 78,206, 46,174,110,238, 30,158, 94,222, 62,190,126,254,
-	  1,129, 65,193, 33,161, 97,225, 17,145, 81,209, 49,177,113,241,
-	  9,137, 73,201, 41,169,105,233, 25,153, 89,217, 57,185,121,249,
-	  5,133, 69,197, 37,165,101,229, 21,149, 85,213, 53,181,117,245,
-	 13,141, 77,205, 45,173,109,237, 29,157, 93,221, 61,189,125,253,
-	  3,131, 67,195, 35,163, 99,227, 19,147, 83,211, 51,179,115,243,
-	 11,139, 75,203, 43,171,107,235, 27,155, 91,219, 59,187,123,251,
-	  7,135, 71,199, 39,167,103,231, 23,151, 87,215, 55,183,119,247,
-	 15,143, 79,207, 47,175,111,239, 31,159, 95,223, 63,191,127,255,
-};
-
-/*
- * Mirror2: bits 01234567 become 67452301
- */
-unsigned char	Mirror2[256] =
-{
-	  0, 64,128,192, 16, 80,144,208, 32, 96,160,224, 48,112,176,240,
-	  4, 68,132,196, 20, 84,148,212, 36,100,164,228, 52,116,180,244,
-	  8, 72,136,200, 24, 88,152,216, 40,104,168,232, 56,120,184,248,
-	 12, 76,140,204, 28, 92,156,220, 44,108,172,236, 60,124,188,252,
-	  1, 65,129,193, 17, 81,145,209, 33, 97,161,225, 49,113,177,241,
-	  5, 69,133,197, 21, 85,149,213, 37,101,165,229, 53,117,181,245,
-	  9, 73,137,201, 25, 89,153,217, 41,105,169,233, 57,121,185,249,
-	 13, 77,141,205, 29, 93,157,221, 45,109,173,237, 61,125,189,253,
-	  2, 66,130,194, 18, 82,146,210, 34, 98,162,226, 50,114,178,242,
-	  6, 70,134,198, 22, 86,150,214, 38,102,166,230, 54,118,182,246,
-	 10, 74,138,202, 26, 90,154,218, 42,106,170,234, 58,122,186,250,
-	 14, 78,142,206, 30, 94,158,222, 46,110,174,238, 62,126,190,254,
-	  3, 67,131,195, 19, 83,147,211, 35, 99,163,227, 51,115,179,243,
-	  7, 71,135,199, 23, 87,151,215, 39,103,167,231, 55,119,183,247,
-	 11, 75,139,203, 27, 91,155,219, 43,107,171,235, 59,123,187,251,
-	 15, 79,143,207, 31, 95,159,223, 47,111,175,239, 63,127,191,255,
-};
-
-/*
- * Mirror4: bits 01234567 become 45670123
- */
-unsigned char	Mirror4[256] =
-{
-	  0, 16, 32, 48, 64, 80, 96,112,128,144,160,176,192,208,224,240,
-	  1, 17, 33, 49, 65, 81, 97,113,129,145,161,177,193,209,225,241,
-	  2, 18, 34, 50, 66, 82, 98,114,130,146,162,178,194,210,226,242,
-	  3, 19, 35, 51, 67, 83, 99,115,131,147,163,179,195,211,227,243,
-	  4, 20, 36, 52, 68, 84,100,116,132,148,164,180,196,212,228,244,
-	  5, 21, 37, 53, 69, 85,101,117,133,149,165,181,197,213,229,245,
-	  6, 22, 38, 54, 70, 86,102,118,134,150,166,182,198,214,230,246,
-	  7, 23, 39, 55, 71, 87,103,119,135,151,167,183,199,215,231,247,
-	  8, 24, 40, 56, 72, 88,104,120,136,152,168,184,200,216,232,248,
-	  9, 25, 41, 57, 73, 89,105,121,137,153,169,185,201,217,233,249,
-	 10, 26, 42, 58, 74, 90,106,122,138,154,170,186,202,218,234,250,
-	 11, 27, 43, 59, 75, 91,107,123,139,155,171,187,203,219,235,251,
-	 12, 28, 44, 60, 76, 92,108,124,140,156,172,188,204,220,236,252,
-	 13, 29, 45, 61, 77, 93,109,125,141,157,173,189,205,221,237,253,
-	 14, 30, 46, 62, 78, 94,110,126,142,158,174,190,206,222,238,254,
-	 15, 31, 47, 63, 79, 95,111,127,143,159,175,191,207,223,239,255,
-};
-
-int BlackOnes[256] =
-{
-    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8
-};
-
-void
-rotate_bytes_180(unsigned char *sp, unsigned char *ep, unsigned char *mirror)
-{
-    unsigned char tmp;
-
-    while (sp < ep)
-    {
-	tmp = mirror[*sp];
-	*sp = mirror[*ep];
-	*ep = tmp;
-	++sp;
-	--ep;
-    }
-    if (sp == ep)
-	*sp = mirror[*sp];
-}
-
 void
 debug(int level, char *fmt, ...)
 {
@@ -463,35 +384,14 @@ item_str_write(unsigned short item, char *str, FILE *fp)
 }
 
 /*
- * A linked list of compressed data
+ * A plane goes out in three steps, so that a page encoded a stripe at a
+ * time can be written as it goes: the plane header with the BIH, then the
+ * BIDs, then the trailer.
  */
-typedef struct _BIE_CHAIN{
-    unsigned char	*data;
-    size_t		len;
-    struct _BIE_CHAIN	*next;
-} BIE_CHAIN;
-
-void
-free_chain(BIE_CHAIN *chain)
-{
-    BIE_CHAIN	*next;
-    next = chain;
-    while ((chain = next))
-    {
-	next = chain->next;
-	if (chain->data)
-	    free(chain->data);
-	free(chain);
-    }
-}
-
-int
-write_plane(int planeNum, BIE_CHAIN **root, FILE *fp)
+static void
+write_plane_start(int planeNum, BIE_CHAIN *root, FILE *fp)
 {
-    BIE_CHAIN	*current = *root;
-    BIE_CHAIN	*next;
-    int		i, len, pad_len;
-    #define	PADTO		4
+    BIE_CHAIN	*current = root;
 
     debug(3, "Write Plane %d\n", planeNum); 
 
@@ -513,30 +413,50 @@ write_plane(int planeNum, BIE_CHAIN **root, FILE *fp)
 	item_uint32_write(ZJI_PLANE, planeNum, fp);
     }
 
-    for (current = *root; current && current->len; current = current->next)
+    chunk_write(ZJT_JBIG_BIH, 0, root->len, fp);
+    fwrite(root->data, 1, root->len, fp);
+}
+
+/*
+ * Write the BIDs that follow the BIH at root, and take them off the
+ * chain.  Unless this is the end of the plane, the last block is kept
+ * back, because more may still go into it, and only the very last one
+ * is padded.
+ */
+static void
+write_plane_data(BIE_CHAIN *root, int last, FILE *fp)
+{
+    BIE_CHAIN	*current;
+    BIE_CHAIN	*next;
+    int		i, len, pad_len;
+    #define	PADTO		4
+
+    while ((current = root->next) && current->len)
     {
-	if (current == *root)
+	len = current->len;
+	next = current->next;
+	if (!next || !next->len)
 	{
-	    chunk_write(ZJT_JBIG_BIH, 0, current->len, fp);
-	    fwrite(current->data, 1, current->len, fp);
+	    if (!last)
+		break;
+	    pad_len = ExtraPad + PADTO * ((len+PADTO-1)/PADTO) - len;
 	}
 	else
-	{
-	    len = current->len;
-	    next = current->next;
-	    if (!next || !next->len)
-		pad_len = ExtraPad + PADTO * ((len+PADTO-1)/PADTO) - len;
-	    else
-		pad_len = 0;
-	    chunk_write(ZJT_JBIG_BID, 0, len + pad_len, fp);
-	    fwrite(current->data, 1, len, fp);
-	    for (i = 0; i < pad_len; i++ )
-		putc(0, fp);
-	}
+	    pad_len = 0;
+	chunk_write(ZJT_JBIG_BID, 0, len + pad_len, fp);
+	fwrite(current->data, 1, len, fp);
+	for (i = 0; i < pad_len; i++ )
+	    putc(0, fp);
+
+	root->next = next;
+	current->next = NULL;
+	free_chain(current);
     }
+}
 
-    free_chain(*root);
-
+static void
+write_plane_end(int planeNum, FILE *fp)
+{
     switch (Model)
     {
     case MODEL_2300DL:
@@ -575,7 +495,15 @@ write_plane(int planeNum, BIE_CHAIN **root, FILE *fp)
 	    chunk_write(ZJT_END_PLANE, 0, 0, fp);
 	break;
     }
+}
 
+int
+write_plane(int planeNum, BIE_CHAIN **root, FILE *fp)
+{
+    write_plane_start(planeNum, *root, fp);
+    write_plane_data(*root, 1, fp);
+    free_chain(*root);
+    write_plane_end(planeNum, fp);
     return 0;
 }
 
@@ -724,6 +652,9 @@ end_page(FILE *ofp)
 	}
 	break;
     }
+    stats_dots(Dots);
+    memset(Dots, 0, sizeof(Dots));
+    stats_page();
 }
 
 int
@@ -732,6 +663,7 @@ write_page(BIE_CHAIN **root, BIE_CHAIN **root2,
 {
     int	nbie = root2 ? 4 : 1;
 
+    stats_begin(STATS_WRITE);
     start_page(root, nbie, ofp);
 
     if (root3)
@@ -748,6 +680,7 @@ write_page(BIE_CHAIN **root, BIE_CHAIN **root2,
     if (root4)
 	write_plane(4, root4, ofp);
 
+    stats_end(STATS_WRITE);
     end_page(ofp);
     return 0;
 }
@@ -763,15 +696,13 @@ output_jbig(unsigned char *start, size_t len, void *cbarg)
     BIE_CHAIN	*current, **root = (BIE_CHAIN **) cbarg;
     int		size = 65536;	// Printer does strange things otherwise.
 
+    stats_bytes(STATS_OUT, len);
+
     if ( (*root) == NULL)
     {
-	(*root) = malloc(sizeof(BIE_CHAIN));
+	(*root) = bie_alloc();
 	if (!(*root))
 	    error(1, "Can't allocate space for chain\n");
-
-	(*root)->data = NULL;
-	(*root)->next = NULL;
-	(*root)->len = 0;
 	size = 20;
 	if (len != 20)
 	    error(1, "First chunk must be BIH and 20 bytes long\n");
@@ -787,9 +718,10 @@ output_jbig(unsigned char *start, size_t len, void *cbarg)
 
 	if (!current->data)
 	{
-	    current->data = malloc(size);
+	    current->data = bie_block(size);
 	    if (!current->data)
 		error(1, "Can't allocate space for compressed data\n");
+	    current->size = size;
 	}
 
 	left = size - current->len;
@@ -801,13 +733,10 @@ output_jbig(unsigned char *start, size_t len, void *cbarg)
 
 	if (current->len == size)
 	{
-	    current->next = malloc(sizeof(BIE_CHAIN));
+	    current->next = bie_alloc();
 	    if (!current->next)
 		error(1, "Can't allocate space for chain\n");
 	    current = current->next;
-	    current->data = NULL;
-	    current->next = NULL;
-	    current->len = 0;
 	}
     }
 }
@@ -828,6 +757,8 @@ start_doc(FILE *fp)
     case MODEL_HP_PRO:
     case MODEL_HP_PRO_CP:
 	now = time(NULL);
+	if (ZeroTime)
+	    now = 0;
 	tmp = localtime(&now);
 	strftime(datetime, sizeof(datetime), "%Y%m%d%H%M%S", tmp);
 
@@ -944,106 +875,21 @@ load_tray2(FILE *fp)
     chunk_write(ZJT_2600N_PAUSE, nitems, nitems * sizeof(ZJ_ITEM_UINT32), fp);
 }
 
-int
-compute_image_dots(int w, int h, unsigned char *bitmap)
-{
-    int dots = 0;
-    int x, y, bpl;
-
-    switch (Model)
-    {
-    case MODEL_HP_PRO_CP:
-	bpl = (w + 7) / 8;
-	for (y = 0; y < h; ++y)
-	    for (x = 0; x < bpl; ++x)
-		dots += BlackOnes[ bitmap[y*bpl + x] ];
-	return dots;
-    default:
-	return 0;
-    }
-}
-
 static int AnyColor;
 
 void
-cmyk_planes(unsigned char *plane[4], unsigned char *raw, int w, int h)
+cmyk_planes(unsigned char *plane[4], unsigned char *raw, int rawstride,
+		int w, int h)
 {
     int			rawbpl = (w+1) / 2;
     int			bpl = (w + 7) / 8;
-    int			i;
-    int			x, y;
-    unsigned char	byte;
-    unsigned char	mask[8] = { 128, 64, 32, 16, 8, 4, 2, 1 };
-    int			aib = AllIsBlack;
-    int			bc = BlackClears;
 
     if (Model != MODEL_2300DL)
 	bpl = (bpl + 15) & ~15;
     debug(1, "w=%d, bpl=%d, rawbpl=%d\n", w, bpl, rawbpl);
 
-    AnyColor = 0;
-    for (i = 0; i < 4; ++i)
-	memset(plane[i], 0, bpl * h);
-
-    //
-    // Unpack the combined plane into individual color planes
-    //
-    // TODO: this can be speeded up using a 256 or 65536 entry lookup table
-    //
-    for (y = 0; y < h; ++y)
-    {
-	for (x = 0; x < w; ++x)
-	{
-	    byte = raw[y*rawbpl + x/2];
-
-	    if (aib && (byte & 0xE0) == 0xE0)
-	    {
-		plane[3][y*bpl + x/8] |= mask[x&7];
-	    }
-	    else if (byte & 0x10)
-	    {
-		plane[3][y*bpl + x/8] |= mask[x&7];
-		if (!bc)
-		{
-		    if (byte & 0x80) plane[0][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x40) plane[1][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x20) plane[2][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0xE0) AnyColor |= byte;
-		}
-	    }
-	    else
-	    {
-		if (byte & 0x80) plane[0][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x40) plane[1][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x20) plane[2][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0xE0) AnyColor |= byte;
-	    }
-
-	    ++x;
-	    if (aib && (byte & 0x0E) == 0x0E)
-	    {
-		plane[3][y*bpl + x/8] |= mask[x&7];
-	    }
-	    else if (byte & 0x1)
-	    {
-		plane[3][y*bpl + x/8] |= mask[x&7];
-		if (!bc)
-		{
-		    if (byte & 0x8) plane[0][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x4) plane[1][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0x2) plane[2][y*bpl + x/8] |= mask[x&7];
-		    if (byte & 0xE) AnyColor |= byte;
-		}
-	    }
-	    else
-	    {
-		if (byte & 0x8) plane[0][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x4) plane[1][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0x2) plane[2][y*bpl + x/8] |= mask[x&7];
-		if (byte & 0xE) AnyColor |= byte;
-	    }
-	}
-    }
+    AnyColor = bitcmyk_split_stride(plane, bpl, raw, rawbpl, rawstride, h,
+				AllIsBlack, BlackClears, Dots);
     debug(2, "BlackClears = %d; AnyColor = %s %s %s\n",
 	    BlackClears,
 	    (AnyColor & 0x88) ? "Cyan" : "",
@@ -1052,14 +898,58 @@ cmyk_planes(unsigned char *plane[4], unsigned char *raw, int w, int h)
 	    );
 }
 
+/*
+ * The planes of a color page are compressed independently, so with -j
+ * they are handed to the worker threads.  A job only touches its own
+ * bitmap and chain.
+ */
+typedef struct
+{
+    unsigned char	*bitmaps[4][1];
+    int			w, h;
+    BIE_CHAIN		*chain[4];
+} PLANES;
+
+// One encoder per plane, kept from page to page by jbg_enc_reinit()
+static struct jbg_enc_state	PlaneEnc[4];
+
+static void
+encode_plane(void *arg, int i)
+{
+    PLANES		*pl = arg;
+    struct jbg_enc_state *se = &PlaneEnc[i];
+    BIECACHE_OUT	out = output_jbig;
+    void		*outarg = &pl->chain[i];
+    BIECACHE_REC	rec;
+    int			hit;
+
+    // A blank plane is only compressed once for the whole job.  Its dots
+    // were counted as it was read or split, so it need not be scanned.
+    if (Dots[i] == 0)
+	hit = biecache_lookup(Blanks, &rec, NULL, 0,
+			pl->w, pl->h, JbgOptions, 5, &out, &outarg);
+    else
+	hit = biecache_lookup(Cache, &rec, *pl->bitmaps[i], (pl->w + 7) / 8,
+			pl->w, pl->h, JbgOptions, 5, &out, &outarg);
+    if (hit)
+	return;
+
+    jbg_enc_reinit(se, pl->w, pl->h, 1, pl->bitmaps[i], out, outarg);
+    jbg_enc_options(se, JbgOptions[0], JbgOptions[1],
+			JbgOptions[2], JbgOptions[3], JbgOptions[4]);
+    stats_begin(STATS_ENCODE);
+    jbg_enc_out(se);
+    stats_end(STATS_ENCODE);
+    biecache_done(&rec);
+}
+
 int
-cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
+cmyk_page(unsigned char *raw, int rawstride, int w, int h, FILE *ofp)
 {
-    BIE_CHAIN *chain[4];
+    PLANES pl;
     int	i;
     int	bpl, bpl16;
-    unsigned char *plane[4], *bitmaps[4][1];
-    struct jbg_enc_state se[4]; 
+    unsigned char *plane[4];
 
     RealWidth = w;
     if (Model == MODEL_HP1020
@@ -1080,10 +970,12 @@ cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
     {
 	plane[i] = malloc(bpl16 * h);
 	if (!plane[i]) error(3, "Cannot allocate space for bit plane\n");
-	chain[i] = NULL;
+	pl.chain[i] = NULL;
     }
 
-    cmyk_planes(plane, raw, RealWidth, h);
+    stats_begin(STATS_SPLIT);
+    cmyk_planes(plane, raw, rawstride, RealWidth, h);
+    stats_end(STATS_SPLIT);
     for (i = 0; i < 4; ++i)
     {
 	if (Debug >= 9)
@@ -1100,23 +992,20 @@ cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
 	    }
 	}
 
-	Dots[i] = compute_image_dots(w, h, plane[i]);
-
-	*bitmaps[i] = plane[i];
-
-	jbg_enc_init(&se[i], w, h, 1, bitmaps[i], output_jbig, &chain[i]);
-	jbg_enc_options(&se[i], JbgOptions[0], JbgOptions[1],
-			JbgOptions[2], JbgOptions[3], JbgOptions[4]);
-	jbg_enc_out(&se[i]);
-	jbg_enc_free(&se[i]);
+	*pl.bitmaps[i] = plane[i];
     }
 
+    pl.w = w;
+    pl.h = h;
+    workpool_run(Pool, 4, encode_plane, &pl);
+
     if (Color2Mono)
-	write_page(&chain[Color2Mono-1], NULL, NULL, NULL, ofp);
+	write_page(&pl.chain[Color2Mono-1], NULL, NULL, NULL, ofp);
     else if (AnyColor)
-	write_page(&chain[0], &chain[1], &chain[2], &chain[3], ofp);
+	write_page(&pl.chain[0], &pl.chain[1],
+		    &pl.chain[2], &pl.chain[3], ofp);
     else
-	write_page(&chain[3], NULL, NULL, NULL, ofp);
+	write_page(&pl.chain[3], NULL, NULL, NULL, ofp);
 
     for (i = 0; i < 4; ++i)
 	free(plane[i]);
@@ -1126,73 +1015,51 @@ cmyk_page(unsigned char *raw, int w, int h, FILE *ofp)
 int
 pksm_page(unsigned char *plane[4], int w, int h, FILE *ofp)
 {
-    BIE_CHAIN *chain[4];
+    PLANES pl;
     int i;
-    unsigned char *bitmaps[4][1];
-    struct jbg_enc_state se[4]; 
 
     RealWidth = w;
     if (Model == MODEL_HP1020
 	|| Model == MODEL_HP_PRO || Model == MODEL_HP_PRO_CP)
 	w = (w + 127) & ~127;
 
-    for (i = 0; i < 4; ++i)
-	chain[i] = NULL;
-
     for (i = 0; i < 4; ++i)
     {
-	Dots[i] = compute_image_dots(w, h, plane[i]);
-
-	*bitmaps[i] = plane[i];
-
-	jbg_enc_init(&se[i], w, h, 1, bitmaps[i], output_jbig, &chain[i]);
-	jbg_enc_options(&se[i], JbgOptions[0], JbgOptions[1],
-			JbgOptions[2], JbgOptions[3], JbgOptions[4]);
-	jbg_enc_out(&se[i]);
-	jbg_enc_free(&se[i]);
+	pl.chain[i] = NULL;
+	*pl.bitmaps[i] = plane[i];
     }
 
+    pl.w = w;
+    pl.h = h;
+    workpool_run(Pool, 4, encode_plane, &pl);
+
     if (Color2Mono)
-	write_page(&chain[Color2Mono-1], NULL, NULL, NULL, ofp);
+	write_page(&pl.chain[Color2Mono-1], NULL, NULL, NULL, ofp);
     else if (AnyColor)
-	write_page(&chain[0], &chain[1], &chain[2], &chain[3], ofp);
+	write_page(&pl.chain[0], &pl.chain[1],
+		    &pl.chain[2], &pl.chain[3], ofp);
     else
-	write_page(&chain[3], NULL, NULL, NULL, ofp);
+	write_page(&pl.chain[3], NULL, NULL, NULL, ofp);
 
     return 0;
 }
 
 int
-pbm_page(unsigned char *buf, int w, int h, FILE *ofp)
+pbm_page(unsigned char *buf, int stride, int w, int h, FILE *ofp)
 {
     BIE_CHAIN		*chain = NULL;
     unsigned char	*bitmaps[1];
-    struct jbg_enc_state se; 
+    struct jbg_enc_state *se = &PlaneEnc[3];
+    BIECACHE_OUT	out = output_jbig;
+    void		*outarg = &chain;
+    BIECACHE_REC	rec;
+    int			hit;
 
     RealWidth = w;
     if (Model == MODEL_HP1020
 	|| Model == MODEL_HP_PRO || Model == MODEL_HP_PRO_CP)
 	w = (w + 127) & ~127;
 
-    if (SaveToner)
-    {
-	int	x, y;
-	int	bpl, bpl16;
-
-	bpl = (w + 7) / 8;
-	if (Model == MODEL_2300DL)
-	    bpl16 = bpl;
-	else
-	    bpl16 = (bpl + 15) & ~15;
-
-	for (y = 0; y < h; y += 2)
-	    for (x = 0; x < bpl16; ++x)
-		buf[y*bpl16 + x] &= 0x55;
-	for (y = 1; y < h; y += 2)
-	    for (x = 0; x < bpl16; ++x)
-		buf[y*bpl16 + x] &= 0xaa;
-    }
-
     if (Model == MODEL_HP_PRO || Model == MODEL_HP_PRO_CP)
     {
 	int	x, y;
@@ -1221,52 +1088,164 @@ pbm_page(unsigned char *buf, int w, int h, FILE *ofp)
 		memset(buf + y*bpl16, 0, bpl16);
     }
 
-    Dots[3] = compute_image_dots(w, h, buf);
-
     *bitmaps = buf;
 
     debug(9, "w x h = %d x %d\n", w, h);
-    jbg_enc_init(&se, w, h, 1, bitmaps, output_jbig, &chain);
-    jbg_enc_options(&se, JbgOptions[0], JbgOptions[1],
-			JbgOptions[2], JbgOptions[3], JbgOptions[4]);
-    jbg_enc_out(&se);
-    jbg_enc_free(&se);
+    if (Dots[3] == 0)
+	hit = biecache_lookup(Blanks, &rec, NULL, 0, w, h,
+			    JbgOptions, 5, &out, &outarg);
+    else
+	hit = biecache_lookup(Cache, &rec, buf, stride, w, h,
+			    JbgOptions, 5, &out, &outarg);
+    if (!hit)
+    {
+	// A mono page is the K plane, and reuses its encoder
+	jbg_enc_reinit(se, w, h, 1, bitmaps, out, outarg);
+	jbg_enc_stride(se, stride);
+	jbg_enc_options(se, JbgOptions[0], JbgOptions[1],
+			    JbgOptions[2], JbgOptions[3], JbgOptions[4]);
+	stats_begin(STATS_ENCODE);
+	jbg_enc_out(se);
+	stats_end(STATS_ENCODE);
+	biecache_done(&rec);
+    }
 
     write_page(&chain, NULL, NULL, NULL, ofp);
 
     return 0;
 }
 
+/*
+ * When the input file is memory mapped, clipping is just pointer
+ * arithmetic: return the first imaged byte of the next page, whose rows
+ * are still rawBpl bytes apart, and skip ifp past the whole page.
+ * Returns NULL if the input isn't mapped or the page isn't all there;
+ * read_and_clip_image() then reads it (and complains) as usual.
+ */
+unsigned char *
+map_and_clip_image(int rawBpl, int pixelsPerByte, int h, FILE *ifp)
+{
+    unsigned char	*raw;
+
+    raw = mapin_take(MapIn, ifp,
+		(size_t) rawBpl * (UpperLeftY + h + LowerRightY));
+    if (!raw)
+	return NULL;
+    stats_bytes(STATS_IN, (size_t) rawBpl * (UpperLeftY + h + LowerRightY));
+    return raw + (size_t) rawBpl * UpperLeftY + UpperLeftX / pixelsPerByte;
+}
+
+/*
+ * Copy rows y0 to y0+n-1 of a mapped page into buf.  If rotate, they are
+ * turned through 180 degrees on the way: the rows go in bottom up,
+ * reversed, and with any padding at the start of the row rather than the
+ * end.  If toner isn't NULL, each row is masked with toner[y & 3] for
+ * draft mode as it goes in.  If dots isn't NULL, the dots of the rows are
+ * added to it.
+ */
+void
+copy_clipped_rows(unsigned char *buf, unsigned char *raw, int rawBpl,
+			int pixelsPerByte, int bpl, int y0, int n, int bpl16,
+			int rotate, const unsigned char *toner,
+			unsigned long *dots)
+{
+    int		y;
+
+    if (rotate)
+    {
+	for (y = n - 1; y >= 0; --y, raw += rawBpl)
+	{
+	    memset(buf + y*bpl16, 0, bpl16 - bpl);
+	    mirror_row(buf + y*bpl16 + bpl16 - bpl, raw, bpl,
+			8 / pixelsPerByte);
+	    if (toner)
+		toner_row(buf + y*bpl16 + bpl16 - bpl, bpl,
+			    toner[(y0 + y) & 3]);
+	    if (dots)
+		*dots += dots_count(buf + y*bpl16 + bpl16 - bpl, bpl);
+	}
+	return;
+    }
+    for (y = 0; y < n; ++y, buf += bpl16, raw += rawBpl)
+    {
+	memcpy(buf, raw, bpl);
+	if (toner)
+	    toner_row(buf, bpl, toner[(y0 + y) & 3]);
+	if (dots)
+	    *dots += dots_count(buf, bpl);
+	if (bpl != bpl16)
+	    memset(buf + bpl, 0, bpl16 - bpl);
+    }
+}
+
+/*
+ * Why read_and_clip_rows() couldn't read a page.  With -j it runs on the
+ * reader thread, which must not exit, so it leaves the message here and
+ * returns READ_ERROR for the main thread to make the complaint.
+ */
+#define READ_ERROR	(-2)
+static char	ReadError[80];
+
+static void
+read_error(char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(ReadError, sizeof(ReadError), fmt, ap);
+    va_end(ap);
+}
+
+/*
+ * Read rows y0 to y0+n-1 of an h row page into buf, clipping the rows
+ * above the page before the first one and those below it after the last.
+ * If rotate, they are turned through 180 degrees as they come in.  toner
+ * and dots are as for copy_clipped_rows().
+ */
 int
-read_and_clip_image(unsigned char *buf,
+read_and_clip_rows(unsigned char *buf,
 			int rawBpl, int rightBpl, int pixelsPerByte,
-			int bpl, int h, int bpl16, FILE *ifp)
+			int bpl, int y0, int n, int h, int bpl16,
+			int rotate, const unsigned char *toner,
+			unsigned long *dots, FILE *ifp)
 {
     unsigned char	*rowbuf, *rowp;
-    int			y;
+    int			y, i;
     int			rc;
+    int			rows = n;
+    int			pad = rotate ? bpl16 - bpl : 0;
 
     rowbuf = malloc(rawBpl);
     if (!rowbuf)
-	error(1, "Can't allocate row buffer\n");
+    {
+	read_error("Can't allocate row buffer\n");
+	goto fail;
+    }
 
     // Clip top rows
-    if (UpperLeftY)
+    if (UpperLeftY && y0 == 0)
     {
+	rows += UpperLeftY;
 	for (y = 0; y < UpperLeftY; ++y)
 	{
 	    rc = fread(rowbuf, rawBpl, 1, ifp);
 	    if (rc == 0)
 		goto eof;
 	    if (rc != 1)
-		error(1, "Premature EOF(1) on input at y=%d\n", y);
+	    {
+		read_error("Premature EOF(1) on input at y=%d\n", y);
+		goto fail;
+	    }
 	}
     }
 
-    // Copy the rows that we want to image
-    rowp = buf;
-    for (y = 0; y < h; ++y, rowp += bpl16)
+    // Copy the rows that we want to image, from the bottom up if the
+    // page is being turned around
+    for (y = y0; y < y0 + n; ++y)
     {
+	i = rotate ? y0 + n - 1 - y : y - y0;
+	rowp = buf + (size_t) i * bpl16;
+
 	// Clip left pixel *bytes*
 	if (UpperLeftX)
 	{
@@ -1274,53 +1253,234 @@ read_and_clip_image(unsigned char *buf,
 	    if (rc == 0 && y == 0 && !UpperLeftY)
 		goto eof;
 	    if (rc != 1)
-		error(1, "Premature EOF(2) on input at y=%d\n", y);
+	    {
+		read_error("Premature EOF(2) on input at y=%d\n", y);
+		goto fail;
+	    }
 	}
 
 	if (bpl != bpl16)
 	    memset(rowp, 0, bpl16);
-	rc = fread(rowp, bpl, 1, ifp);
+	rc = fread(rowp + pad, bpl, 1, ifp);
 	if (rc == 0 && y == 0 && !UpperLeftY && !UpperLeftX)
 	    goto eof;
 	if (rc != 1)
-		error(1, "Premature EOF(3) on input at y=%d\n", y);
+	{
+	    read_error("Premature EOF(3) on input at y=%d\n", y);
+	    goto fail;
+	}
+	if (rotate)
+	    mirror_row(rowp + pad, rowp + pad, bpl, 8 / pixelsPerByte);
+	if (toner)
+	    toner_row(rowp + pad, bpl, toner[(y0 + i) & 3]);
+	if (dots)
+	    *dots += dots_count(rowp + pad, bpl);
 
 	// Clip right pixels
 	if (rightBpl != bpl)
 	{
 	    rc = fread(rowbuf, rightBpl - bpl, 1, ifp);
 	    if (rc != 1)
-		error(1, "Premature EOF(4) on input at y=%d\n", y);
+	    {
+		read_error("Premature EOF(4) on input at y=%d\n", y);
+		goto fail;
+	    }
 	}
     }
 
     // Clip bottom rows
-    if (LowerRightY)
+    if (LowerRightY && y0 + n == h)
     {
+	rows += LowerRightY;
 	for (y = 0; y < LowerRightY; ++y)
 	{
 	    rc = fread(rowbuf, rawBpl, 1, ifp);
 	    if (rc != 1)
-		error(1, "Premature EOF(5) on input at y=%d\n", y);
+	    {
+		read_error("Premature EOF(5) on input at y=%d\n", y);
+		goto fail;
+	    }
 	}
     }
 
     free(rowbuf);
+    stats_bytes(STATS_IN, (size_t) rawBpl * rows);
     return (0);
 
 eof:
     free(rowbuf);
     return (EOF);
+
+fail:
+    free(rowbuf);
+    return (READ_ERROR);
+}
+
+int
+read_and_clip_image(unsigned char *buf,
+			int rawBpl, int rightBpl, int pixelsPerByte,
+			int bpl, int h, int bpl16, int rotate,
+			const unsigned char *toner, unsigned long *dots,
+			FILE *ifp)
+{
+    unsigned char	*raw;
+    int			rc;
+
+    stats_begin(STATS_READ);
+    raw = map_and_clip_image(rawBpl, pixelsPerByte, h, ifp);
+    if (raw)
+    {
+	copy_clipped_rows(buf, raw, rawBpl, pixelsPerByte, bpl, 0, h, bpl16,
+			    rotate, toner, dots);
+	rc = 0;
+    }
+    else
+	rc = read_and_clip_rows(buf, rawBpl, rightBpl, pixelsPerByte,
+				    bpl, 0, h, h, bpl16, rotate, toner, dots,
+				    ifp);
+    stats_end(STATS_READ);
+    return (rc);
+}
+
+/*
+ * Where the rows of a pbm page come from, for pbm_page_stripes(): the
+ * mapped page, or else ifp.
+ */
+typedef struct
+{
+    unsigned char	*raw;
+    int			rawBpl, rightBpl, bpl, bpl16;
+    FILE		*ifp;
+} PBMREAD;
+
+/*
+ * Compress a pbm page a stripe at a time as it is read, rather than
+ * reading it whole first, so that neither the page nor its compressed
+ * data is ever held in memory: the encoder gets each stripe of l0 rows as
+ * soon as it is in, and each 64K block of output goes to ofp as soon as
+ * it is full.  The output is the same as from pbm_page().
+ */
+int
+pbm_page_stripes(PBMREAD *rd, int w, int h, FILE *ofp)
+{
+    BIE_CHAIN		*chain = NULL;
+    unsigned char	*band, *rows, *raw = rd->raw;
+    unsigned char	*bitmaps[1];
+    struct jbg_enc_state *se = &PlaneEnc[3];
+    int			bpl16 = rd->bpl16;
+    int			planeNum = OutputStartPlane ? 4 : 0;
+    int			l0, y, n;
+    int			rc;
+
+    RealWidth = w;
+    if (Model == MODEL_HP1020
+	|| Model == MODEL_HP_PRO || Model == MODEL_HP_PRO_CP)
+	w = (w + 127) & ~127;
+
+    *bitmaps = NULL;
+    // A mono page is the K plane, and reuses its encoder
+    jbg_enc_reinit(se, w, h, 1, bitmaps, output_jbig, &chain);
+    jbg_enc_stride(se, bpl16);
+    jbg_enc_options(se, JbgOptions[0], JbgOptions[1],
+			JbgOptions[2], JbgOptions[3], JbgOptions[4]);
+    if (jbg_enc_stripes(se) == 0)
+	error(1, "Can't compress the page a stripe at a time\n");
+    l0 = se->l0;
+
+    // The last two rows of the previous stripe, then the stripe
+    band = malloc((size_t) (2 + l0) * bpl16);
+    if (!band)
+	error(1, "Can't allocate band buffer\n");
+    rows = band + 2 * bpl16;
+
+    stats_begin(STATS_WRITE);
+    start_page(&chain, 1, ofp);
+    write_plane_start(planeNum, chain, ofp);
+    stats_end(STATS_WRITE);
+
+    for (y = 0; y < h; y += n)
+    {
+	n = (h - y < l0) ? h - y : l0;
+
+	stats_begin(STATS_READ);
+	if (raw)
+	{
+	    copy_clipped_rows(rows, raw, rd->rawBpl, 8, rd->bpl, y, n, bpl16, 0,
+				SaveToner ? TonerMask : NULL, &Dots[3]);
+	    raw += (size_t) n * rd->rawBpl;
+	    rc = 0;
+	}
+	else
+	    rc = read_and_clip_rows(rows, rd->rawBpl, rd->rightBpl, 8,
+					rd->bpl, y, n, h, bpl16, 0,
+					SaveToner ? TonerMask : NULL,
+					&Dots[3], rd->ifp);
+	stats_end(STATS_READ);
+	if (rc == READ_ERROR)
+	    error(1, "%s", ReadError);
+	if (rc == EOF)
+	    error(1, "Premature EOF(pbm) on input stream\n");
+
+	*bitmaps = rows;
+	stats_begin(STATS_ENCODE);
+	jbg_enc_stripe(se, bitmaps);
+	stats_end(STATS_ENCODE);
+
+	stats_begin(STATS_WRITE);
+	write_plane_data(chain, y + n == h, ofp);
+	stats_end(STATS_WRITE);
+
+	memmove(band, band + (size_t) n * bpl16, 2 * bpl16);
+    }
+
+    free(band);
+    free_chain(chain);
+
+    stats_begin(STATS_WRITE);
+    write_plane_end(planeNum, ofp);
+    stats_end(STATS_WRITE);
+    end_page(ofp);
+
+    return 0;
+}
+
+/*
+ * With -j, the next bitcmyk page is read from Ghostscript on its own
+ * thread while the current one is being split and compressed.  So the
+ * reader counts the pages itself, to know which ones to turn around.
+ */
+typedef struct
+{
+    int		rawBpl, rightBpl, bpl, h;
+    int		pages;		/* read so far */
+    FILE	*ifp;
+} CMYKREAD;
+
+static int
+read_cmyk_page(void *arg, unsigned char *buf)
+{
+    CMYKREAD	*rd = arg;
+    int		rotate;
+
+    ++rd->pages;
+    rotate = even_page(rd->pages) && (Duplex == DMDUPLEX_LONGEDGE
+		|| Duplex == DMDUPLEX_MANUALLONG);
+    return read_and_clip_image(buf, rd->rawBpl, rd->rightBpl, 2,
+				rd->bpl, rd->h, rd->bpl, rotate, NULL, NULL,
+				rd->ifp);
 }
 
 int
 cmyk_pages(FILE *ifp, FILE *ofp)
 {
-    unsigned char	*buf;
+    unsigned char	*buf, *raw;
     int			rawW, rawH, rawBpl;
     int			rightBpl;
     int			w, h, bpl;
+    int			mapped;
     int			rc;
+    PAGEQ		*pq;
+    CMYKREAD		rd;
 
     //
     // Save the original Upper Right clip values as the logical offset,
@@ -1346,38 +1506,53 @@ cmyk_pages(FILE *ifp, FILE *ofp)
     bpl = (w + 1) / 2;
     rightBpl = (rawW - UpperLeftX + 1) / 2;
 
-    buf = malloc(bpl * h);
-    if (!buf)
+    rd.rawBpl = rawBpl;
+    rd.rightBpl = rightBpl;
+    rd.bpl = bpl;
+    rd.h = h;
+    rd.pages = 0;
+    rd.ifp = ifp;
+
+    // From a mapped file, pages that need not be rotated are split
+    // straight out of the mapping, and there is nothing to read ahead.
+    mapped = MapIn && Duplex != DMDUPLEX_LONGEDGE
+		    && Duplex != DMDUPLEX_MANUALLONG;
+    pq = pageq_create((Threads > 1 && !mapped) ? 2 : 1, bpl * h,
+			read_cmyk_page, &rd);
+    if (!pq)
 	error(1, "Unable to allocate page buffer of %d x %d = %d bytes\n",
 		rawW, rawH, rawBpl * rawH);
 
     for (;;)
     {
-	rc = read_and_clip_image(buf, rawBpl, rightBpl, 2, bpl, h, bpl, ifp);
-	if (rc == EOF)
-	    goto done;
+	buf = NULL;
+	raw = mapped ? map_and_clip_image(rawBpl, 2, h, ifp) : NULL;
+	if (!raw && (raw = buf = pageq_get(pq, &rc)) == NULL)
+	    break;
 
 	++PageNum;
-	if (Duplex == DMDUPLEX_LONGEDGE && even_page(PageNum))
-	    rotate_bytes_180(buf, buf + bpl * h - 1, Mirror4);
-	if (Duplex == DMDUPLEX_MANUALLONG && even_page(PageNum))
-	    rotate_bytes_180(buf, buf + bpl * h - 1, Mirror4);
 
 	if (even_page(PageNum) && EvenPages)
 	{
 	    SeekRec[SeekIndex].b = ftell(EvenPages);
-	    cmyk_page(buf, w, h, EvenPages);
+	    cmyk_page(raw, buf ? bpl : rawBpl, w, h, EvenPages);
 	    SeekRec[SeekIndex].e = ftell(EvenPages);
 	    debug(1, "CMYK Page: %d	%ld	%ld\n",
 		PageNum, SeekRec[SeekIndex].b, SeekRec[SeekIndex].e);
 	    SeekIndex++;
 	}
 	else
-	    cmyk_page(buf, w, h, ofp);
+	    cmyk_page(raw, buf ? bpl : rawBpl, w, h, ofp);
+
+	// Let the printer have this page while the next one is read
+	fflush(ofp);
+	if (buf)
+	    pageq_put(pq, buf);
     }
 
-done:
-    free(buf);
+    if (rc != EOF)
+	error(1, "%s", ReadError);
+    pageq_destroy(pq);
     return 0;
 }
 
@@ -1513,7 +1688,13 @@ pksm_pages(FILE *ifp, FILE *ofp)
 		error(1, "Can't allocate plane buffer\n");
 
 	    rc = read_and_clip_image(plane[i],
-				    rawBpl, rightBpl, 8, bpl, h, bpl16, ifp);
+				    rawBpl, rightBpl, 8, bpl, h, bpl16,
+				    even_page(PageNum)
+					&& (Duplex == DMDUPLEX_LONGEDGE
+					|| Duplex == DMDUPLEX_MANUALLONG),
+				    NULL, &Dots[i], ifp);
+	    if (rc == READ_ERROR)
+		error(1, "%s", ReadError);
 	    if (rc == EOF)
 		error(1, "Premature EOF(pksm) on page %d data, plane %d\n",
 			    PageNum, i);
@@ -1531,23 +1712,10 @@ pksm_pages(FILE *ifp, FILE *ofp)
 		}
 	    }
 
-	    // See if we can optimize this to be a monochrome page
-	    if (!AnyColor && i != 3)
-	    {
-		unsigned char *p, *e;
-
-		for (p = plane[i], e = p + bpl16*h; p < e; ++p)
-		    if (*p)
-		    {
-			AnyColor |= 1<<i;
-			break;
-		    }
-	    }
-
-	    if (Duplex == DMDUPLEX_LONGEDGE && even_page(PageNum))
-		rotate_bytes_180(plane[i], plane[i] + bpl * h - 1, Mirror1);
-	    if (Duplex == DMDUPLEX_MANUALLONG && even_page(PageNum))
-		rotate_bytes_180(plane[i], plane[i] + bpl * h - 1, Mirror1);
+	    // See if we can optimize this to be a monochrome page: the
+	    // dots of the plane were counted as it was read
+	    if (!AnyColor && i != 3 && Dots[i])
+		AnyColor |= 1<<i;
 	}
 
 	debug(2, "AnyColor = %s %s %s\n",
@@ -1598,7 +1766,7 @@ blank_page(FILE *ofp)
     error(1, "Unable to allocate blank plane (%d bytes)\n", bpl16*h);
     memset(plane, 0, bpl16*h);
 
-    pbm_page(plane, w, h, ofp);
+    pbm_page(plane, bpl16, w, h, ofp);
     ++PageNum;
     free(plane);
 }
@@ -1606,13 +1774,16 @@ blank_page(FILE *ofp)
 int
 pbm_pages(FILE *ifp, FILE *ofp)
 {
-    unsigned char	*buf;
+    unsigned char	*buf, *raw;
     int			rawW, rawH, rawBpl;
     int			rightBpl;
     int			w, h, bpl;
     int			bpl16 = 0;
+    int			stride;
     int			rc;
     int			p4eaten = 1;
+    int			rotate;
+    PBMREAD		rd, *stripes;
     FILE		*tfp = NULL;
     long		tpos = 0;
 
@@ -1652,24 +1823,62 @@ pbm_pages(FILE *ifp, FILE *ofp)
 	default:		error(1, "Bad model %d\n", Model); break;
 	}
 
-	buf = malloc(bpl16 * h);
-	if (!buf)
-	    error(1, "Can't allocate page buffer\n");
+	rotate = even_page(PageNum + 1) && (Duplex == DMDUPLEX_LONGEDGE
+		|| (EvenPages && Duplex == DMDUPLEX_MANUALLONG));
 
-	rc = read_and_clip_image(buf, rawBpl, rightBpl, 8, bpl, h, bpl16, ifp);
-	if (rc == EOF)
-	    error(1, "Premature EOF(pbm) on input stream\n");
+	// From a mapped file, the encoder can read the rows in place,
+	// unless the page is padded or modified first.
+	raw = NULL;
+	if (Model == MODEL_2300DL && !SaveToner && !rotate)
+	    raw = map_and_clip_image(rawBpl, 8, h, ifp);
 
-	++PageNum;
-	if (Duplex == DMDUPLEX_LONGEDGE && even_page(PageNum))
-	    rotate_bytes_180(buf, buf + bpl16 * h - 1, Mirror1);
+	// Otherwise the page is only read whole when it has to be turned
+	// around, or looked up in the cache.
+	stripes = NULL;
+	buf = NULL;
+	if (raw)
+	{
+	    buf = raw;
+	    stride = rawBpl;
+	    stats_begin(STATS_DOTS);
+	    Dots[3] = dots_rows(raw, rawBpl, bpl, h);
+	    stats_end(STATS_DOTS);
+	}
+	else if (!rotate && !Cache)
+	{
+	    rd.raw = map_and_clip_image(rawBpl, 8, h, ifp);
+	    rd.rawBpl = rawBpl;
+	    rd.rightBpl = rightBpl;
+	    rd.bpl = bpl;
+	    rd.bpl16 = bpl16;
+	    rd.ifp = ifp;
+	    stripes = &rd;
+	    stride = bpl16;
+	}
+	else
+	{
+	    buf = malloc(bpl16 * h);
+	    if (!buf)
+		error(1, "Can't allocate page buffer\n");
+
+	    rc = read_and_clip_image(buf, rawBpl, rightBpl, 8, bpl, h, bpl16,
+					rotate, SaveToner ? TonerMask : NULL,
+					&Dots[3], ifp);
+	    if (rc == READ_ERROR)
+		error(1, "%s", ReadError);
+	    if (rc == EOF)
+		error(1, "Premature EOF(pbm) on input stream\n");
+	    stride = bpl16;
+	}
 
+	++PageNum;
 	if (even_page(PageNum) && EvenPages)
 	{
-	    if (Duplex == DMDUPLEX_MANUALLONG)
-		rotate_bytes_180(buf, buf + bpl16 * h - 1, Mirror1);
 	    SeekRec[SeekIndex].b = ftell(EvenPages);
-	    pbm_page(buf, w, h, EvenPages);
+	    if (stripes)
+		pbm_page_stripes(stripes, w, h, EvenPages);
+	    else
+		pbm_page(buf, stride, w, h, EvenPages);
 	    SeekRec[SeekIndex].e = ftell(EvenPages);
 	    debug(1, "PBM Page: %d	%ld	%ld\n",
 		PageNum, SeekRec[SeekIndex].b, SeekRec[SeekIndex].e);
@@ -1685,23 +1894,32 @@ pbm_pages(FILE *ifp, FILE *ofp)
 	    if (odd_page(PageNum))
 	    {
 		tfp = tmpfile();
-		pbm_page(buf, w, h, tfp);
+		if (stripes)
+		    pbm_page_stripes(stripes, w, h, tfp);
+		else
+		    pbm_page(buf, stride, w, h, tfp);
 		fflush(tfp);
 		tpos = ftell(tfp);
 		rewind(tfp);
 	    }
 	    else
 	    {
-		pbm_page(buf, w, h, ofp);
+		if (stripes)
+		    pbm_page_stripes(stripes, w, h, ofp);
+		else
+		    pbm_page(buf, stride, w, h, ofp);
 		while (tpos--)
 		    putc(getc(tfp), ofp);
 		fclose(tfp);
 	    }
 	}
+	else if (stripes)
+	    pbm_page_stripes(stripes, w, h, ofp);
 	else
-	    pbm_page(buf, w, h, ofp);
+	    pbm_page(buf, stride, w, h, ofp);
 
-	free(buf);
+	if (!raw)
+	    free(buf);
     }
 
     if (Model == MODEL_HP_PRO
@@ -1744,6 +1962,7 @@ do_one(FILE *in)
 {
     int	mode;
 
+    MapIn = mapin_open(in);
     if (Mode == MODE_COLOR)
     {
 	mode = getc(in);
@@ -1772,6 +1991,8 @@ do_one(FILE *in)
 	else
 	    error(1, "Not a pbmraw file!\n");
     }
+    mapin_close(MapIn);
+    MapIn = NULL;
 }
 
 int
@@ -1781,7 +2002,7 @@ main(int argc, char *argv[])
     int i, j;
 
     while ( (c = getopt(argc, argv,
-		    "cd:g:n:m:p:r:s:tT:u:l:z:L:ABPJ:S:U:X:D:V?h")) != EOF)
+		    "cC:d:E:g:j:n:m:p:r:s:tT:u:l:z:L:ABPJ:S:U:X:D:V?h")) != EOF)
 	switch (c)
 	{
 	case 'c':	Mode = MODE_COLOR; break;
@@ -1798,6 +2019,14 @@ main(int argc, char *argv[])
 			if (PageHeight < 0 || PageHeight > 1000000)
 			    error(1, "Illegal Y value '%s' for -g\n", optarg);
 			break;
+	case 'C':	CacheMB = atoi(optarg);
+			if (CacheMB < 0)
+			    error(1, "Illegal value '%s' for -C\n", optarg);
+			break;
+	case 'j':	Threads = atoi(optarg);
+			if (Threads < 1)
+			    error(1, "Illegal value '%s' for -j\n", optarg);
+			break;
 	case 'm':	MediaCode = atoi(optarg); break;
 	case 'n':	Copies = atoi(optarg); break;
 	case 'p':	PaperCode = atoi(optarg); break;
@@ -1805,7 +2034,13 @@ main(int argc, char *argv[])
 			    error(1, "Illegal format '%s' for -r\n", optarg);
 			break;
 	case 's':	SourceCode = atoi(optarg); break;
-	case 't':	SaveToner = 1; break;
+	case 't':	SaveToner = 1;
+			toner_pattern(TonerMask, "checker");
+			break;
+	case 'E':	if (toner_pattern(TonerMask, optarg) < 0)
+			    error(1, "Illegal value '%s' for -E\n", optarg);
+			SaveToner = 1;
+			break;
 	case 'T':       PrintDensity = atoi(optarg);
 			if (PrintDensity < 1 || PrintDensity > 5)
 			    error(1, "Illegal value '%s' for PrintDensity -T\n",
@@ -1837,7 +2072,14 @@ main(int argc, char *argv[])
 	case 'J':	if (optarg[0]) Filename = optarg; break;
 	case 'U':	if (optarg[0]) Username = optarg; break;
 	case 'X':	ExtraPad = atoi(optarg); break;
-	case 'D':	Debug = atoi(optarg); break;
+	case 'D':	Debug = atoi(optarg);
+			if (Debug == 12345678)
+			{
+			    // Hack to force time to zero for regression tests
+			    ZeroTime = 1;
+			    Debug = 0;
+			}
+			break;
 	case 'V':	printf("%s\n", Version); exit(0);
 	default:	usage(); exit(1);
 	}
@@ -1881,6 +2123,18 @@ main(int argc, char *argv[])
 	break;
     }
 
+    stats_init("foo2zjs");
+    Pool = workpool_create(Threads);
+    if (CacheMB)
+    {
+	Cache = biecache_create((size_t) CacheMB << 20);
+	if (!Cache)
+	    error(1, "Can't allocate page cache\n");
+    }
+    Blanks = biecache_create(1 << 20);
+    if (!Blanks)
+	error(1, "Can't allocate page cache\n");
+
     start_doc(stdout);
 
     if (argc == 0)
@@ -1947,5 +2201,8 @@ main(int argc, char *argv[])
 
     end_doc(stdout);
 
+    biecache_destroy(Blanks);
+    biecache_destroy(Cache);
+    workpool_destroy(Pool);
     exit(0);
 }
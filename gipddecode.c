@@ -39,6 +39,7 @@ b*/
 
 #include "slx.h"
 #include "jbig.h"
+#include "recscan.h"
 
 /*
  * Global option flags
@@ -156,10 +157,12 @@ typedef struct
 } GDI;
 
 void
-decode(FILE *fp)
+decode(RECSCAN *r)
 {
     DWORD	magic;
     SL_HEADER	hdr;
+    RECSCAN_REC	rec;
+    const unsigned char	*p, *end;
     int		c;
     int		rc;
     int		size;
@@ -175,6 +178,7 @@ decode(FILE *fp)
     unsigned char	bih[20];
     //DWORD	bih[5];
     int			bihlen = 0;
+    const unsigned char	*data;
     int			imageCnt[5] = {0,0,0,0,0};
     int         	pn = 0;
     int         	incrY = 0;
@@ -189,8 +193,7 @@ decode(FILE *fp)
 
     for (;;)
     {
-	rc = fread(&ofst, sizeof(ofst), 1, fp);
-	if (rc != 1)
+	if (recscan_read(r, &ofst, sizeof(ofst)) != sizeof(ofst))
 	    error(1, "aaa\n");
 	if (memcmp(ofst.magic, "OFST", 4) != 0)
 	{
@@ -212,8 +215,8 @@ decode(FILE *fp)
 	    ++ocnt;
 	}
 	curOff += sizeof(ofst);
-	c = getc(fp);
-	ungetc(c, fp);
+	c = recscan_getc(r);
+	recscan_ungetc(r, c);
 	if (c == 'G')
 	    break;
 	if (c == '\033')
@@ -226,19 +229,24 @@ decode(FILE *fp)
     /*
      * Zenographics ZX format
      */
-    c = getc(fp);
+    c = recscan_getc(r);
     if (c == EOF)
     {
 	printf("EOF on file reading header.\n");
 	return;
     }
-    ungetc(c, fp);
+    recscan_ungetc(r, c);
     if (c == '\033')
     {
 	char	buf[1024];
 
-	while (fgets(buf, sizeof(buf), fp))
+	for (;;)
 	{
+	    if (!recscan_gets(r, buf, sizeof(buf)))
+	    {
+		printf("\n");
+		return;
+	    }
 	    if (PrintOffset)
 		printf("%d:	", curOff);
 	    else if (PrintHexOffset)
@@ -254,19 +262,14 @@ decode(FILE *fp)
 	    if (strcmp(buf, "@PJL SET REVERSEPRINT=OFF\r\n") == 0)
 		break;
 	}
-	if (feof(fp))
-	{
-	    printf("\n");
-	    return;
-	}
     }
 
-    c =  getc(fp);
-    ungetc(c, fp);
+    c = recscan_getc(r);
+    recscan_ungetc(r, c);
     ver = 0; //Dell
     if (c == '\033')
     {
-	rc = fread(&ofst, 9, 1, fp);	// %-12345X
+	recscan_read(r, &ofst, 9);	// %-12345X
 	ver = 1; //Lexmark
 	if (PrintOffset)
 	    printf("%d:	", curOff);
@@ -281,7 +284,7 @@ decode(FILE *fp)
 	    printf("%d:	", curOff);
 	else if (PrintHexOffset)
 	    printf("%6x:	", curOff);
-	rc = fread(&gdi, sizeof(gdi), 1, fp);	// %-12345X
+	recscan_read(r, &gdi, sizeof(gdi));	// %-12345X
 	curOff += sizeof(gdi);
 	if (memcmp(gdi.magic, "JIDG", 4) == 0)
 	{
@@ -319,7 +322,7 @@ decode(FILE *fp)
 		int	paper;
 		int	i;
 
-		rc = fread(&dbuf, gdi.len, 1, fp);
+		recscan_read(r, &dbuf, gdi.len);
 		curOff += gdi.len;
 
 		unk0 = be32(dbuf[0]);
@@ -346,7 +349,7 @@ decode(FILE *fp)
 	    curOff += gdi.len;
 	    //printf("cr=%x\n", curOff);
 	    while (gdi.len--)
-		getc(fp);
+		recscan_getc(r);
 	    break;
 	case 'P':
 	    printf("%.4s	len=%d\n", gdi.magic, gdi.len);
@@ -358,7 +361,7 @@ decode(FILE *fp)
 		int	i;
 		char	*buf = (char *) dbuf;
 
-		rc = fread(&dbuf, gdi.len, 1, fp);
+		recscan_read(r, &dbuf, gdi.len);
 		curOff += gdi.len;
 
 		w254 = (buf[0] << 8) + buf[1];
@@ -376,11 +379,11 @@ decode(FILE *fp)
 	    curOff += gdi.len;
 	    //printf("cr=%x\n", curOff);
 	    while (gdi.len--)
-		getc(fp);
+		recscan_getc(r);
 	    break;
 	case 'B':
 	    //printf("cr=%x\n", curOff);
-	    rc = fread(&dbuf, 3*4, 1, fp);
+	    recscan_read(r, &dbuf, 3*4);
 	    curOff += 3*4;
 	    //debug(0, "%x\n", be32(gdi.len2));
 	    //debug(0, "%x\n", be32(dbuf[0]));
@@ -396,7 +399,7 @@ decode(FILE *fp)
 	    if (0) {
 		int	i;
 
-		rc = fread(&dbuf, gdi.len, 1, fp);
+		recscan_read(r, &dbuf, gdi.len);
 		printf("\t0x%x\n", be32(dbuf[0]));
 		printf("\t");
 		for (i = 0; i < 4; i += 4)
@@ -411,7 +414,7 @@ decode(FILE *fp)
 		printf("\t");
 	    while (gdi.len--)
 	    {
-		c = getc(fp);
+		c = recscan_getc(r);
 		if (Debug > 0 && i++ < 48)
 		{
 		    printf("%02x, ", c);
@@ -431,8 +434,8 @@ decode(FILE *fp)
     /*
      * Software Imaging K.K.  SLX_MAGIC format
      */
-    rc = fread(&magic, len = sizeof(magic), 1, fp);
-    if (rc != 1)
+    len = sizeof(magic);
+    if (recscan_read(r, &magic, len) != len)
     {
 	printf("Missing SLX Magic number\n");
 	return;
@@ -458,9 +461,12 @@ decode(FILE *fp)
 	else if (PrintHexOffset)
 	    printf("%6x:	", curOff);
 
-	rc = fread(&hdr, len = sizeof(hdr), 1, fp);
-	if (rc != 1) break;
+	rc = recscan_zjs(r, &rec, 1);
+	if (rc == 0 || rec.headlen < sizeof(hdr)) break;
+	memcpy(&hdr, rec.head, len = sizeof(hdr));
 	curOff += len;
+	p = rec.data;
+	end = rec.data + rec.len;
 
 	hdr.type = be32(hdr.type);
 	hdr.size = be32(hdr.size);
@@ -539,7 +545,7 @@ decode(FILE *fp)
 
 	    size -= sizeof(ihdr);
 
-	    rc = fread(&ihdr, len = sizeof(ihdr), 1, fp);
+	    rc = recscan_get(&p, end, &ihdr, len = sizeof(ihdr));
 	    if (rc != 1) break;
 	    curOff += len;
 
@@ -582,7 +588,7 @@ decode(FILE *fp)
 	    switch (ihdr.type)
 	    {
 	    case SLIT_UINT32:
-		rc = fread(&val, len = sizeof(val), 1, fp);
+		rc = recscan_get(&p, end, &val, len = sizeof(val));
 		curOff += len;
 		val = be32(val);
 		isize -= 4;
@@ -601,8 +607,8 @@ decode(FILE *fp)
 	    case SLIT_STRING:
 		for (i = 0; i < sizeof(buf) - 1; )
 		{
-		    c = fgetc(fp);
-		    if (c == EOF) break;
+		    if (p == end) break;
+		    c = *p++;
 		    ++curOff;
 		    buf[i++] = c;
 		    --isize;
@@ -616,7 +622,7 @@ decode(FILE *fp)
 		break;
 	    default:
 	    case SLIT_BYTELUT:
-		rc = fread(&val, len = sizeof(val), 1, fp);
+		rc = recscan_get(&p, end, &val, len = sizeof(val));
 		curOff += len;
 		val = be32(val);
 		isize -= 4;
@@ -626,7 +632,8 @@ decode(FILE *fp)
 		    printf("	SLI_0x%x, BYTELUT (len=%d)", ihdr.item, val);
 		if (0) // ihdr.item == SLI_JBIG_BIH && val == 20)
 		{
-		    bihlen = fread(bih, 1, len = sizeof(bih), fp);
+		    bihlen = recscan_skip(&p, end, len = sizeof(bih));
+		    memcpy(bih, p - bihlen, bihlen);
 		    if (bihlen <= 0)
 			isize = 0;
 		    else
@@ -648,10 +655,10 @@ decode(FILE *fp)
 	    printf("\n");
 	    fflush(stdout);
 
-	    while (isize-- > 0)
+	    if (isize > 0)
 	    {
-		fgetc(fp);
-		++curOff;
+		recscan_skip(&p, end, isize);
+		curOff += isize;
 	    }
 
 	    if (size <= 0 && items)
@@ -673,7 +680,8 @@ decode(FILE *fp)
 
 	    if (hdr.type == SLT_JBIG_BIH)
 	    {
-		bihlen = fread(bih, 1, len = sizeof(bih), fp);
+		bihlen = recscan_skip(&p, end, len = sizeof(bih));
+		memcpy(bih, p - bihlen, bihlen);
 		if (bihlen <= 0)
 		    size = 0;
 		else
@@ -712,60 +720,52 @@ decode(FILE *fp)
 			    error(1, "JBIG uses unimplemented feature\n");
 		    }
 		}
-		while (size--)
+		data = p;
+		len = recscan_skip(&p, end, size);
+		curOff += len;
+		if (rfp && len)
+		    fwrite(data, 1, len, rfp);
+		if (DecFile && len)
 		{
-		    int	c;
-		    c = fgetc(fp);
-		    ++curOff;
-		    if (rfp)
-			fputc(c, rfp);
-		    if (DecFile)
-		    {
-			size_t		cnt;
-			unsigned char	ch = c;
+		    size_t	cnt;
 
-			rc = JBG_EAGAIN;
-			rc = jbg_dec_in(&s[pn], &ch, 1, &cnt);
-			if (rc == JBG_EOK)
+		    // Anything after the end of the BIE is ignored
+		    rc = jbg_dec_in(&s[pn], data, len, &cnt);
+		    if (rc == JBG_EOK)
+		    {
+			int	h, w, len;
+			unsigned char *image;
+
+			// debug(1, "JBG_EOK: %d\n", pn);
+			h = jbg_dec_getheight(&s[pn]);
+			w = jbg_dec_getwidth(&s[pn]);
+			image = jbg_dec_getimage(&s[pn], 0);
+			len = jbg_dec_getsize(&s[pn]);
+			if (image)
 			{
-			    int	h, w, len;
-			    unsigned char *image;
-
-			    // debug(1, "JBG_EOK: %d\n", pn);
-			    h = jbg_dec_getheight(&s[pn]);
-			    w = jbg_dec_getwidth(&s[pn]);
-			    image = jbg_dec_getimage(&s[pn], 0);
-			    len = jbg_dec_getsize(&s[pn]);
-			    if (image)
+			    char	buf[512];
+			    sprintf(buf, "%s-%02d-%d.pbm",
+				    DecFile, pageNum, pn);
+			    dfp = fopen(buf,
+					imageCnt[pn] ? "a" : "w");
+			    if (dfp)
 			    {
-				char	buf[512];
-				sprintf(buf, "%s-%02d-%d.pbm",
-					DecFile, pageNum, pn);
-				dfp = fopen(buf,
-					    imageCnt[pn] ? "a" : "w");
-				if (dfp)
-				{
-				    if (imageCnt[pn] == 0)
-					fprintf(dfp, "P4\n%8d %8d\n", w, h);
-				    imageCnt[pn] += incrY;
-				    rc = fwrite(image, 1, len, dfp);
-				    fclose(dfp);
-				}
+				if (imageCnt[pn] == 0)
+				    fprintf(dfp, "P4\n%8d %8d\n", w, h);
+				imageCnt[pn] += incrY;
+				rc = fwrite(image, 1, len, dfp);
+				fclose(dfp);
 			    }
-			    else
-				debug(0, "Missing image %dx%d!\n", h, w);
-			    jbg_dec_free(&s[pn]);
 			}
+			else
+			    debug(0, "Missing image %dx%d!\n", h, w);
+			jbg_dec_free(&s[pn]);
 		    }
 		}
 	    }
 	    else
 	    {
-		while (size--)
-		{
-		    fgetc(fp);
-		    ++curOff;
-		}
+		curOff += recscan_skip(&p, end, size);
 		if (rfp)
 		{
 		    fclose(rfp);
@@ -774,11 +774,7 @@ decode(FILE *fp)
 	    }
 	}
 
-	while (padding--)
-	{
-	    fgetc(fp);
-	    ++curOff;
-	}
+	curOff += padding;
 
 	if (hdr.type == SLT_END_DOC)
 	    break;
@@ -794,6 +790,8 @@ main(int argc, char *argv[])
 	extern int	optind;
 	extern char	*optarg;
 	int		c;
+	FILE		*fp;
+	RECSCAN		*r;
 
 	while ( (c = getopt(argc, argv, "d:hor:D:?h")) != EOF)
 		switch (c)
@@ -809,32 +807,27 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-        if (argc > 0)
-        {
-            FILE        *fp;
-
-            fp = fopen(argv[0], "r");
-            if (!fp)
-                error(1, "file '%s' doesn't exist\n", argv[0]);
-            for (;;)
-            {
-                decode(fp);
-                c = getc(fp); ungetc(c, fp);
-                if (feof(fp))
-                    break;
-            }
-            fclose(fp);
+	if (argc > 0)
+	{
+	    fp = fopen(argv[0], "r");
+	    if (!fp)
+		error(1, "file '%s' doesn't exist\n", argv[0]);
 	}
 	else
+	    fp = stdin;
+
+	r = recscan_open(fp);
+	if (!r)
+	    error(1, "Can't allocate input buffer\n");
+	for (;;)
 	{
-	    for(;;)
-	    {
-		decode(stdin);
-		c = getc(stdin); ungetc(c, stdin);
-		if (feof(stdin))
-		    break;
-	    }
+	    decode(r);
+	    if (recscan_eof(r))
+		break;
 	}
+	recscan_close(r);
+	if (fp != stdin)
+	    fclose(fp);
 
 	exit(0);
 }
@@ -32,6 +32,7 @@ b*/
 #include <errno.h>
 
 #include "jbig.h"
+#include "recscan.h"
 
 /*
  * Global option flags
@@ -176,7 +177,7 @@ getLEword(unsigned char buf[2])
 }
 
 void
-print_bih(unsigned char bih[20])
+print_bih(const unsigned char bih[20])
 {
     unsigned int xd, yd, l0;
 
@@ -225,7 +226,7 @@ proff(int curOff)
  */
 void
 decode_image(char *filename, int pagenum, int planenum,
-		unsigned char *bih, unsigned char *jbig, int jbiglen)
+		const unsigned char *bih, const unsigned char *jbig, int jbiglen)
 {
     FILE			*dfp;
     struct jbg_dec_state        s;
@@ -268,7 +269,7 @@ decode_image(char *filename, int pagenum, int planenum,
 }
 
 void
-decode2(FILE *fp, int curOff)
+decode2(RECSCAN *r, int curOff)
 {
     // int		c;
     int		rc;
@@ -303,7 +304,7 @@ decode2(FILE *fp, int curOff)
     for (;;)
     {
 	len = 4;
-	rc = fread(header, 1, len, fp);
+	rc = recscan_read(r, header, len);
 	if (rc != len)
 	{
 	    error(1, "len=%d, but EOF on file\n", len);
@@ -324,7 +325,7 @@ decode2(FILE *fp, int curOff)
 	}
 	
 	curOff += len+4;
-	rc = fread(buf, 1, len, fp);
+	rc = recscan_read(r, buf, len);
 	if (rc != len)
 	{
 	    error(1, "len=%d, but EOF on file\n", len);
@@ -354,7 +355,7 @@ decode2(FILE *fp, int curOff)
 	
 	else if (header[1] == 'P' && header[2] == 'S')
 	{
-	    unsigned char	*mbuf;
+	    const unsigned char	*mbuf;
 
 	    printf("[Page Start]\n");
 	    if (Debug)
@@ -380,13 +381,10 @@ decode2(FILE *fp, int curOff)
 	    }
 
 	    len = getLEdword(&buf[12]);
-	    mbuf = malloc(len);
+	    mbuf = recscan_take(r, len);
 	    if (!mbuf)
-		error(1, "malloc on mbuf, size=%d failed\n", len);
-	    rc = fread(mbuf, 1, len, fp);
-	    if (rc != len)
 	    {
-		error(1, "len=%d, but EOF on file\n");
+		error(1, "len=%d, but EOF on file\n", len);
 	    }
 	    if (Debug > 2) hexdump(stdout, 0, "", "", mbuf, len);
 	    if (color == 1)
@@ -433,7 +431,6 @@ decode2(FILE *fp, int curOff)
 		    offbih[3]-20, offbih[3]-20);
 		decode_image(DecFile, pageNum, 0, mbuf, mbuf+20, offbih[3]-20);
 	    }
-	    free(mbuf);
 	    curOff += len;
 	    ++pageNum;
 	}
@@ -455,19 +452,19 @@ decode2(FILE *fp, int curOff)
  */
 
 unsigned short
-get2(FILE *fp)
+get2(RECSCAN *r)
 {
     unsigned char buf[2];
-    if (fread (buf, 2, 1, fp))
+    if (recscan_read(r, buf, 2) == 2)
 	return getLEword (buf);
     return 0xffff;
 }
 
 unsigned
-get4(FILE *fp)
+get4(RECSCAN *r)
 {
     unsigned char buf[4];
-    if (fread (buf, 4, 1, fp))
+    if (recscan_read(r, buf, 4) == 4)
 	return getLEdword(buf);
     return 0xffffffff;
 }
@@ -608,7 +605,7 @@ get_diff(STREAM *s)
 }
 
 void
-decode1(FILE *fp, int ilen, int page, int color, int width, int height)
+decode1(RECSCAN *rs, int ilen, int page, int color, int width, int height)
 {
     static const char huff[2][68] =
     {
@@ -635,7 +632,7 @@ decode1(FILE *fp, int ilen, int page, int color, int width, int height)
     FILE *dfp;
 
     if (!(in = malloc (ilen))) return;
-    r = fread (in, 1, ilen, fp);
+    r = recscan_read (rs, in, ilen);
     if (!DecFile)
     {
 	free (in);
@@ -722,7 +719,7 @@ decode1(FILE *fp, int ilen, int page, int color, int width, int height)
 }
 
 int
-parse1(FILE *fp, int *curOff)
+parse1(RECSCAN *r, int *curOff)
 {
     int rectype, stoptype, type, subtype;
     int val[2] = { 0,0 }, page = 0, color = 0, width = 0, height = 0;
@@ -740,7 +737,7 @@ parse1(FILE *fp, int *curOff)
     strsize[205] = "folio";	// 8.5x13
 
     proff(*curOff); printf("[hbpldecode1]\n");
-    while ((proff(*curOff), (*curOff)++, rectype = fgetc(fp)) != EOF)
+    while ((proff(*curOff), (*curOff)++, rectype = recscan_getc(r)) != EOF)
     {
 	printf("RECTYPE '%c' [0x%x]:\n", rectype, rectype);
 	stoptype = 0;
@@ -756,7 +753,7 @@ parse1(FILE *fp, int *curOff)
 	case 0x42:  return 0;
 	default:
 		    (*curOff)--;
-		    ungetc (rectype, fp);
+		    recscan_ungetc (r, rectype);
 		    printf ("Unknown rectype 0x%x at 0x%x(%d)\n",
 				    rectype, *curOff, *curOff);
 		    return 1;
@@ -764,16 +761,16 @@ parse1(FILE *fp, int *curOff)
 	if (!stoptype) continue;
 	do
 	{
-	    type = fgetc(fp);
+	    type = recscan_getc(r);
 	    (*curOff)++;
-again:	    switch ((*curOff)++, subtype = fgetc(fp))
+again:	    switch ((*curOff)++, subtype = recscan_getc(r))
 	    {
-	    case 0xa1: val[0] = fgetc(fp);  (*curOff)++;   break;
-	    case 0xc2: val[1] = get2(fp);   *curOff += 2;
-	    case 0xa2: val[0] = get2(fp);   *curOff += 2;  break;
-	    case 0xc4: val[1] = get4(fp);   *curOff += 4;
+	    case 0xa1: val[0] = recscan_getc(r);  (*curOff)++;   break;
+	    case 0xc2: val[1] = get2(r);   *curOff += 2;
+	    case 0xa2: val[0] = get2(r);   *curOff += 2;  break;
+	    case 0xc4: val[1] = get4(r);   *curOff += 4;
 	    case 0xc3:
-	    case 0xa4: val[0] = get4(fp);   *curOff += 4;  break;
+	    case 0xa4: val[0] = get4(r);   *curOff += 4;  break;
 	    case 0xb1: goto again;
 	    default: error (1, "Unknown subtype 0x%02x\n", subtype);
 	    }
@@ -805,7 +802,7 @@ again:	    switch ((*curOff)++, subtype = fgetc(fp))
 		break;
 	    case 0xa4:
 		printf("%d (0x%x) bytes of data...\n", val[0], val[0]);
-		decode1 (fp, val[0], page, color, width, height);
+		decode1 (r, val[0], page, color, width, height);
 		*curOff += val[0];
 		break;
 	    default:
@@ -817,7 +814,7 @@ again:	    switch ((*curOff)++, subtype = fgetc(fp))
 }
 
 void
-decode(FILE *fp)
+decode(RECSCAN *r)
 {
     int		c;
     // int		rc;
@@ -831,16 +828,16 @@ decode(FILE *fp)
     // int         	pn = 0;
     char		buf[70000];
 
-    c = getc(fp);
+    c = recscan_getc(r);
     if (c == EOF)
     {
 	printf("EOF on file\n");
 	return;
     }
-    ungetc(c, fp);
+    recscan_ungetc(r, c);
     if (c == '\033')
     {
-	while (fgets(buf, sizeof(buf), fp))
+	while (recscan_gets(r, buf, sizeof(buf)))
 	{
 	    proff(curOff);
             if (buf[0] == '\033')
@@ -857,30 +854,30 @@ decode(FILE *fp)
 	}
     }
 
-    c = getc(fp);
-    ungetc(c, fp);
+    c = recscan_getc(r);
+    recscan_ungetc(r, c);
     if (c == 0x1b)
     {
 	// Decode version 2, ESC based
-	decode2(fp, curOff);
+	decode2(r, curOff);
 	goto done;
     }
 
-    if (parse1 (fp, &curOff))
+    if (parse1 (r, &curOff))
     {
 	printf ("Continuing with hexdump...\n");
-	if ( (len = fread(buf, 1, sizeof(buf), fp)) )
+	if ( (len = recscan_read(r, buf, sizeof(buf))) )
 	hexdump (stdout, 0, "", "", buf, len);
 	exit(1);
     }
 
 done:
-    c = fgetc(fp);
+    c = recscan_getc(r);
     if (c != 033)
 	return;
-    ungetc(c, fp);
+    recscan_ungetc(r, c);
 
-    while (fgets(buf, sizeof(buf), fp))
+    while (recscan_gets(r, buf, sizeof(buf)))
     {
 	proff(curOff);
         if (buf[0] == '\033')
@@ -903,6 +900,8 @@ main(int argc, char *argv[])
     extern int	optind;
     extern char	*optarg;
     int		c;
+    FILE	*fp;
+    RECSCAN	*r;
 
     while ( (c = getopt(argc, argv, "d:hor:D:?h")) != EOF)
 	switch (c)
@@ -920,16 +919,20 @@ main(int argc, char *argv[])
 
     if (argc > 0)
     {
-        FILE	*fp;
-
         fp = fopen(argv[0], "r");
         if (!fp)
 	error(1, "file '%s' doesn't exist\n", argv[0]);
-        decode(fp);
-        fclose(fp);
     }
     else
-	decode(stdin);
+	fp = stdin;
+
+    r = recscan_open(fp);
+    if (!r)
+	error(1, "Can't allocate input buffer\n");
+    decode(r);
+    recscan_close(r);
+    if (fp != stdin)
+	fclose(fp);
 
     exit(0);
 }
@@ -31,6 +31,7 @@ b*/
 
 #include "hiperc.h"
 #include "jbig.h"
+#include "recscan.h"
 
 /*
  * Global option flags
@@ -103,7 +104,7 @@ usage(void)
 }
 
 static int
-getdword(unsigned char buf[4])
+getdword(const unsigned char buf[4])
 {
     return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | (buf[3] << 0);
 }
@@ -143,11 +144,12 @@ print_bih(unsigned char bih[20])
 	((yd >> bih[1]) +  ((((1UL << bih[1]) - 1) & xd) != 0) + l0 - 1) / l0,
 	bih[1] - bih[0], bih[2]);
 }
-	    unsigned char blk[50*1024*1024];
 
 void
-decode(FILE *fp)
+decode(RECSCAN *r)
 {
+    RECSCAN_REC	rec;
+    const unsigned char	*p, *end;
     int		c;
     int		rc;
     FILE	*dfp = NULL;
@@ -163,16 +165,16 @@ decode(FILE *fp)
     int			uncompressed = 0;
     unsigned int	w = 0, h = 0;
 
-    c = getc(fp);
+    c = recscan_getc(r);
     if (c == EOF)
     {
 	printf("EOF on file\n");
 	return;
     }
-    ungetc(c, fp);
+    recscan_ungetc(r, c);
     if (c == '\033')
     {
-	while (fgets(buf, sizeof(buf), fp))
+	while (recscan_gets(r, buf, sizeof(buf)))
 	{
 	    if (PrintOffset)
 		printf("%d:	", curOff);
@@ -197,10 +199,12 @@ decode(FILE *fp)
 	unsigned int	rectype;
 	unsigned int	blknum;
 
-	rc = fread(&reclen, 4, 1, fp);
-	if (rc != 1) break;
-	rc = fread(&rectype, 4, 1, fp);
-	if (rc != 1) break;
+	rc = recscan_hiperc(r, &rec);
+	if (rc == 0 || rec.headlen < 8) break;
+	memcpy(&reclen, rec.head, 4);
+	memcpy(&rectype, rec.head + 4, 4);
+	p = rec.data;
+	end = rec.data + rec.len;
 
 	reclen = be32(reclen);
 	rectype = be32(rectype);
@@ -220,19 +224,20 @@ decode(FILE *fp)
 	{
 	    int	blklen;
 	    int	i;
-//	    unsigned char blk[50*1024*1024];
+	    const unsigned char	*blk;
 
 	    if (PrintOffset) printf("%d:	", curOff);
 	    else if (PrintHexOffset) printf("%6x:	", curOff);
 
-	    rc = fread(&blklen, 4, 1, fp);
+	    rc = recscan_get(&p, end, &blklen, 4);
 	    if (rc != 1) break;
 	    curOff += 4;
 	    reclen -= 4;
 	    
 	    blklen = be32(blklen);
-	    rc = fread(&blk, blklen, 1, fp);
-	    if (rc != 1) return;
+	    if (blklen < 0 || end - p < blklen) return;
+	    blk = p;
+	    p += blklen;
 	    curOff += blklen;
 	    reclen -= blklen;
 
@@ -329,15 +334,12 @@ decode(FILE *fp)
 			    if (image && len)
 				memset(image, 0, len);
 			}
-			for (i = 0; i < blklen; ++i)
-			{
-			    rc = jbg_dec_in(&s[pn], &blk[i], 1, &cnt);
-			    if (rc == JBG_EOK)
-				break;
-			    if (rc != JBG_EAGAIN && rc != JBG_EOK)
-				error(1, "jbg_dec_in c=%x i=%d rc=%d (%s)\n",
-				    blk[i], i, rc, jbg_strerror(rc));
-			}
+			// Anything after the end of the BIE is ignored
+			rc = jbg_dec_in(&s[pn], blk, blklen, &cnt);
+			i = cnt;
+			if (rc != JBG_EAGAIN && rc != JBG_EOK)
+			    error(1, "jbg_dec_in c=%x i=%d rc=%d (%s)\n",
+				i < blklen ? blk[i] : 0, i, rc, jbg_strerror(rc));
 			if (0) {
 			    printf("\ti=%d (%s)\n", i,  jbg_strerror(rc));
 			    len = jbg_dec_getsize(&s[pn]);
@@ -399,15 +401,15 @@ decode(FILE *fp)
 		    FpDec[i] = 0;
 		}
 	    }
-	    c = getc(fp);
+	    c = recscan_getc(r);
 	    if (c == EOF) break;
-	    ungetc(c, fp);
+	    recscan_ungetc(r, c);
 	    if (c == '\033') break;
 	    ++pageNum;
 	}
     }
 
-    while (fgets(buf, sizeof(buf), fp))
+    while (recscan_gets(r, buf, sizeof(buf)))
     {
 	if (PrintOffset)
 	    printf("%d:	", curOff);
@@ -433,6 +435,8 @@ main(int argc, char *argv[])
 	extern int	optind;
 	extern char	*optarg;
 	int		c;
+	FILE		*fp;
+	RECSCAN		*r;
 
 	while ( (c = getopt(argc, argv, "d:hor:D:?h")) != EOF)
 		switch (c)
@@ -450,16 +454,20 @@ main(int argc, char *argv[])
 
 	if (argc > 0)
 	{
-	    FILE	*fp;
-
 	    fp = fopen(argv[0], "r");
 	    if (!fp)
 		error(1, "file '%s' doesn't exist\n", argv[0]);
-	    decode(fp);
-	    fclose(fp);
 	}
 	else
-	    decode(stdin);
+	    fp = stdin;
+
+	r = recscan_open(fp);
+	if (!r)
+	    error(1, "Can't allocate input buffer\n");
+	decode(r);
+	recscan_close(r);
+	if (fp != stdin)
+	    fclose(fp);
 
 	exit(0);
 }
@@ -37,8 +37,15 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "jbig.h"
 
 #define MX_MAX  127    /* maximal supported mx offset for
@@ -277,6 +284,46 @@ static void jbg_buf_write(int b, void *head)
 }
 
 
+/*
+ * Give the arithmetic encoder the free space at the end of the list
+ * that starts with the block *(struct jbg_buf *) se->file as its output
+ * window, adding a new block to the list when the last one is full.
+ * The arithmetic encoder calls this whenever its window is full, so it
+ * can write the bytes of a PSCD straight into the blocks.
+ */
+static void jbg_buf_refill(struct jbg_arenc_state *se)
+{
+  struct jbg_buf *head = (struct jbg_buf *) se->file;
+  struct jbg_buf *now = head->last;
+
+  if (se->out)
+    now->len = se->out - now->d;
+  if (now->len >= JBG_BUFSIZE - 1) {
+    now->next = jbg_buf_init(head->free_list);
+    now->next->previous = now;
+    head->last = now = now->next;
+  }
+  se->out = now->d + now->len;
+  se->out_end = now->d + JBG_BUFSIZE - 1;
+
+  return;
+}
+
+
+/*
+ * Account for the bytes the arithmetic encoder has written into its
+ * output window since the last jbg_buf_refill().
+ */
+static void jbg_buf_sync(struct jbg_arenc_state *se)
+{
+  struct jbg_buf *head = (struct jbg_buf *) se->file;
+
+  head->last->len = se->out - head->last->d;
+
+  return;
+}
+
+
 /*
  * Remove any trailing zero bytes from the end of a linked jbg_buf list,
  * however make sure that no zero byte is removed which directly
@@ -806,9 +853,9 @@ void jbg_enc_init(struct jbg_enc_state *s, unsigned long x, unsigned long y,
     checked_malloc(planes, sizeof(unsigned char *));
   for (i = 0; i < planes; i++) {
     s->highres[i] = 0;
-    s->lhp[1][i] = (unsigned char *)
-      checked_malloc(jbg_ceil_half(y, 1), jbg_ceil_half(x, 1+3));
+    s->lhp[1][i] = NULL;    /* see alloc_lowres() */
   }
+  s->lhp_size = 0;
   
   s->free_list = NULL;
   s->s = (struct jbg_arenc_state *) 
@@ -816,8 +863,113 @@ void jbg_enc_init(struct jbg_enc_state *s, unsigned long x, unsigned long y,
   s->tx = (int *) checked_malloc(s->planes, sizeof(int));
   lx = jbg_ceil_half(x, 1);
   s->tp = (char *) checked_malloc(lx, sizeof(char));
+  s->tp_size = lx;
   for (l = 0; l < lx; s->tp[l++] = 2) ;
   s->sde = NULL;
+  s->sde_stripes = 0;
+  s->sde_layers = 0;
+  s->stride = 0;
+  s->stripe0 = 0;
+
+  return;
+}
+
+
+/*
+ * Release the sde[][][] array, and any SDEs still held in it.
+ */
+static void jbg_enc_free_sde(struct jbg_enc_state *s)
+{
+  unsigned long stripe;
+  int layer, plane;
+
+  if (s->sde) {
+    for (stripe = 0; stripe < s->sde_stripes; stripe++) {
+      for (layer = 0; layer < s->sde_layers; layer++) {
+	for (plane = 0; plane < s->planes; plane++)
+	  if (s->sde[stripe][layer][plane] != SDE_DONE &&
+	      s->sde[stripe][layer][plane] != SDE_TODO)
+	    jbg_buf_free(&s->sde[stripe][layer][plane]);
+	checked_free(s->sde[stripe][layer]);
+      }
+      checked_free(s->sde[stripe]);
+    }
+    checked_free(s->sde);
+    s->sde = NULL;
+  }
+}
+
+
+/*
+ * Same as jbg_enc_init(), but for an encoder that is to be used again for
+ * another image, e.g. the next page or band.  s must either be all zero,
+ * or have been set up by jbg_enc_init() or jbg_enc_reinit() and not been
+ * released by jbg_enc_free() since.  All buffers of the previous image are
+ * kept, and only reallocated if the new image needs more, so encoding a
+ * long run of images of similar size hardly touches malloc at all.  The
+ * encoder is released with jbg_enc_free() as usual.
+ */
+void jbg_enc_reinit(struct jbg_enc_state *s, unsigned long x, unsigned long y,
+		    int planes, unsigned char **p,
+		    void (*data_out)(unsigned char *start, size_t len,
+				     void *file),
+		    void *file)
+{
+  unsigned long l, lx;
+  unsigned long stripe;
+  int layer, i;
+
+  if (s->highres == NULL || s->planes != planes) {
+    if (s->highres != NULL)
+      jbg_enc_free(s);
+    jbg_enc_init(s, x, y, planes, p, data_out, file);
+    return;
+  }
+
+  assert(x > 0 && y > 0);
+  s->xd = x;
+  s->yd = y;
+  s->yd1 = y;
+  s->data_out = data_out;
+  s->file = file;
+
+  s->d = 0;
+  s->dl = 0;
+  s->dh = s->d;
+  jbg_set_default_l0(s);
+  s->mx = 8;
+  s->my = 0;
+  s->order = JBG_ILEAVE | JBG_SMID;
+  s->options = JBG_TPBON | JBG_TPDON | JBG_DPON;
+  s->comment = NULL;
+  s->dppriv = jbg_dptable;
+  s->res_tab = jbg_resred;
+  s->stride = 0;
+
+  s->stripe0 = 0;
+
+  s->lhp[0] = p;
+  for (i = 0; i < planes; i++)
+    s->highres[i] = 0;
+
+  lx = jbg_ceil_half(x, 1);
+  if (lx > s->tp_size) {
+    checked_free(s->tp);
+    s->tp = (char *) checked_malloc(lx, sizeof(char));
+    s->tp_size = lx;
+  }
+  for (l = 0; l < lx; s->tp[l++] = 2) ;
+
+  /* forget the SDEs of the previous image, but keep the array for them */
+  if (s->sde)
+    for (stripe = 0; stripe < s->sde_stripes; stripe++)
+      for (layer = 0; layer < s->sde_layers; layer++)
+	for (i = 0; i < planes; i++) {
+	  if (s->sde[stripe][layer][i] != SDE_DONE &&
+	      s->sde[stripe][layer][i] != SDE_TODO)
+	    jbg_buf_free(&s->sde[stripe][layer][i]);
+	  s->sde[stripe][layer][i] = SDE_TODO;
+	}
 
   return;
 }
@@ -865,6 +1017,23 @@ void jbg_enc_layers(struct jbg_enc_state *s, int d)
 }
 
 
+/*
+ * Tell the encoder that the rows of the input image are stride bytes
+ * apart, rather than packed one after the other, so that it can encode
+ * straight from a larger buffer such as a clipped view of a memory
+ * mapped file.  Only single layer images (d = 0) can be encoded this
+ * way: with resolution layers, the input image is also used as working
+ * space.  The last byte of each row is still zero padded in place.
+ */
+void jbg_enc_stride(struct jbg_enc_state *s, unsigned long stride)
+{
+  if (stride < jbg_ceil_half(s->xd, 3))
+    stride = 0;
+  s->stride = stride;
+  return;
+}
+
+
 /*
  * Specify the highest and lowest resolution layers which will be
  * written to the output file. Call this function not before
@@ -908,7 +1077,7 @@ static void encode_sde(struct jbg_enc_state *s,
 		       long stripe, int layer, int plane)
 {
   unsigned char *hp, *lp1, *lp2, *p0, *p1, *q1, *q2;
-  unsigned long hl, ll, hx, hy, lx, ly, hbpl, lbpl;
+  unsigned long hl, ll, hx, hy, lx, ly, hbpl, lbpl, hstride;
   unsigned long line_h0 = 0, line_h1 = 0;
   unsigned long line_h2, line_h3, line_l1, line_l2, line_l3;
   struct jbg_arenc_state *se;
@@ -918,6 +1087,7 @@ static void encode_sde(struct jbg_enc_state *s,
   long o;
   unsigned a, p, t;
   int ltp, ltp_old, cx;
+  unsigned long zrun = 0;  /* white pixels in context 0 not yet encoded */
   unsigned long c_all, c[MX_MAX + 1], cmin, cmax, clmin, clmax;
   int tmax, at_determined;
   int new_tx;
@@ -956,10 +1126,15 @@ static void encode_sde(struct jbg_enc_state *s,
   /* bytes per line in highres and lowres image */
   hbpl = jbg_ceil_half(hx, 3);
   lbpl = jbg_ceil_half(lx, 3);
+  /* bytes from one highres line to the next, see jbg_enc_stride() */
+  hstride = (s->d == 0 && s->stride) ? s->stride : hbpl;
   /* pointer to first image byte of highres stripe */
-  hp = s->lhp[s->highres[plane]][plane] + stripe * hl * hbpl;
-  lp2 = s->lhp[1 - s->highres[plane]][plane] + stripe * ll * lbpl;
-  lp1 = lp2 + lbpl;
+  hp = s->lhp[s->highres[plane]][plane] + (stripe - s->stripe0) * hl * hstride;
+  lp1 = lp2 = NULL;
+  if (layer > 0) {
+    lp2 = s->lhp[1 - s->highres[plane]][plane] + stripe * ll * lbpl;
+    lp1 = lp2 + lbpl;
+  }
   
   /* check whether we can refer to any state of a previous stripe */
   reset = (stripe == 0) || (s->options & JBG_SDRST);
@@ -968,8 +1143,10 @@ static void encode_sde(struct jbg_enc_state *s,
   se = s->s + plane;
   arith_encode_init(se, !reset);
   s->sde[stripe][layer][plane] = jbg_buf_init(&s->free_list);
-  se->byte_out = jbg_buf_write;
   se->file = s->sde[stripe][layer][plane];
+  se->refill = jbg_buf_refill;
+  se->out = se->out_end = NULL;
+  jbg_buf_refill(se);
 
   /* initialize adaptive template movement algorithm */
   c_all = 0;
@@ -988,12 +1165,12 @@ static void encode_sde(struct jbg_enc_state *s,
     ltp_old = 0;
   else {
     ltp_old = 1;
-    p1 = hp - hbpl;
+    p1 = hp - hstride;
     if (y > 1) {
-      q1 = p1 - hbpl;
-      while (p1 < hp && (ltp_old = (*p1++ == *q1++)) != 0) ;
+      q1 = p1 - hstride;
+      while (p1 < hp - hstride + hbpl && (ltp_old = (*p1++ == *q1++)) != 0) ;
     } else
-      while (p1 < hp && (ltp_old = (*p1++ == 0)) != 0) ;
+      while (p1 < hp - hstride + hbpl && (ltp_old = (*p1++ == 0)) != 0) ;
   }
 
   if (layer == 0) {
@@ -1044,8 +1221,8 @@ static void encode_sde(struct jbg_enc_state *s,
 	ltp = 1;
 	p1 = hp;
 	if (i > 0 || !reset) {
-	  q1 = hp - hbpl;
-	  while (q1 < hp && (ltp = (*p1++ == *q1++)) != 0) ;
+	  q1 = hp - hstride;
+	  while (q1 < hp - hstride + hbpl && (ltp = (*p1++ == *q1++)) != 0) ;
 	} else
 	  while (p1 < hp + hbpl && (ltp = (*p1++ == 0)) != 0) ;
 	arith_encode(se, (s->options & JBG_LRLTWO) ? TPB2CX : TPB3CX,
@@ -1056,7 +1233,7 @@ static void encode_sde(struct jbg_enc_state *s,
 	ltp_old = ltp;
 	if (ltp) {
 	  /* skip next line */
-	  hp += hbpl;
+	  hp += hstride;
 	  continue;
 	}
       }
@@ -1071,18 +1248,34 @@ static void encode_sde(struct jbg_enc_state *s,
        */
       
       line_h1 = line_h2 = line_h3 = 0;
-      if (i > 0 || !reset) line_h2 = (long)*(hp - hbpl) << 8;
-      if (i > 1 || !reset) line_h3 = (long)*(hp - hbpl - hbpl) << 8;
+      if (i > 0 || !reset) line_h2 = (long)*(hp - hstride) << 8;
+      if (i > 1 || !reset) line_h3 = (long)*(hp - hstride - hstride) << 8;
       
       /* encode line */
       for (j = 0; j < hx; hp++) {
 	line_h1 |= *hp;
 	if (j < hbpl * 8 - 8 && (i > 0 || !reset)) {
-	  line_h2 |= *(hp - hbpl + 1);
+	  line_h2 |= *(hp - hstride + 1);
 	  if (i > 1 || !reset)
-	    line_h3 |= *(hp - hbpl - hbpl + 1);
+	    line_h3 |= *(hp - hstride - hstride + 1);
 	}
 	if (s->options & JBG_LRLTWO) {
+	  /*
+	   * A white byte with an all white two line template for each of
+	   * its pixels is eight white pixels in context 0. Runs of such
+	   * bytes are collected and then encoded in one go.
+	   */
+	  if (at_determined && !s->tx[plane] && hx - j >= 8 &&
+	      !(line_h1 & 0xfffL) && !(line_h2 & 0x7ffc0L)) {
+	    zrun += 8;
+	    line_h1 <<= 8;  line_h2 <<= 8;  line_h3 <<= 8;
+	    j += 8;
+	    continue;
+	  }
+	  if (zrun) {
+	    arith_encode_run(se, 0, 0, zrun);
+	    zrun = 0;
+	  }
 	  /* two line template */
 	  do {
 	    line_h1 <<= 1;  line_h2 <<= 1;  line_h3 <<= 1;
@@ -1173,6 +1366,11 @@ static void encode_sde(struct jbg_enc_state *s,
 	  } while (++j & 7 && j < hx);
 	} /* if (s->options & JBG_LRLTWO) */
       } /* for (j = ...) */
+      if (zrun) {
+	arith_encode_run(se, 0, 0, zrun);
+	zrun = 0;
+      }
+      hp += hstride - hbpl;
     } /* for (i = ...) */
 
   } else {
@@ -1465,6 +1663,7 @@ static void encode_sde(struct jbg_enc_state *s,
   }
   
   arith_encode_flush(se);
+  jbg_buf_sync(se);
   jbg_buf_remove_zeros(s->sde[stripe][layer][plane]);
   jbg_buf_write(MARKER_ESC, s->sde[stripe][layer][plane]);
   jbg_buf_write((s->options & JBG_SDRST) ? MARKER_SDRST : MARKER_SDNORM,
@@ -1785,21 +1984,35 @@ void jbg_dppriv2int(char *internal, const unsigned char *dptable)
 
 
 /*
- * Encode one full BIE and pass the generated data to the specified
- * call-back function
+ * Make sure there is room for the lower resolution images.  They are
+ * only needed with resolution layers, so jbg_enc_init() leaves them to
+ * this.
  */
-void jbg_enc_out(struct jbg_enc_state *s)
+static void alloc_lowres(struct jbg_enc_state *s)
+{
+  unsigned long size;
+  int plane;
+
+  size = jbg_ceil_half(s->yd, 1) * jbg_ceil_half(s->xd, 1+3);
+  if (size <= s->lhp_size)
+    return;
+  for (plane = 0; plane < s->planes; plane++) {
+    checked_free(s->lhp[1][plane]);
+    s->lhp[1][plane] = (unsigned char *)
+      checked_malloc(jbg_ceil_half(s->yd, 1), jbg_ceil_half(s->xd, 1+3));
+  }
+  s->lhp_size = size;
+}
+
+
+/*
+ * Check and adjust the parameters before encoding. Returns 0 if they
+ * are beyond repair.
+ */
+static int enc_check(struct jbg_enc_state *s)
 {
-  unsigned long bpl;
-  unsigned char buf[20];
-  unsigned long xd, yd, y;
-  long ii[3], is[3], ie[3];    /* generic variables for the 3 nested loops */ 
-  unsigned long stripe;
-  int layer, plane;
   int order;
-  unsigned char dpbuf[1728];
 
-  /* some sanity checks */
   s->order &= JBG_HITOLO | JBG_SEQ | JBG_ILEAVE | JBG_SMID;
   order = s->order & (JBG_SEQ | JBG_ILEAVE | JBG_SMID);
   if (iindex[order][0] < 0)
@@ -1813,22 +2026,52 @@ void jbg_enc_out(struct jbg_enc_state *s)
     s->mx = 0;
   if (s->d > 255 || s->d < 0 || s->dh > s->d || s->dh < 0 ||
       s->dl < 0 || s->dl > s->dh || s->planes < 0 || s->planes > 255)
-    return;
+    return 0;
   /* prevent uint32 overflow: s->l0 * 2 ^ s->d < 2 ^ 32 */
   if (s->d > 31 || (s->d != 0 && s->l0 >= (1UL << (32 - s->d))))
-    return;
+    return 0;
   if (s->yd1 < s->yd)
     s->yd1 = s->yd;
   if (s->yd1 > s->yd)
     s->options |= JBG_VLENGTH;
 
-  /* ensure correct zero padding of bitmap at the final byte of each line */
+  /* a stride is only supported for single layer images */
+  assert(s->stride == 0 || s->d == 0);
+
+  return 1;
+}
+
+
+/*
+ * Ensure correct zero padding of the bitmap at the final byte of each
+ * of the given rows.
+ */
+static void zero_pad(struct jbg_enc_state *s, unsigned char **p,
+		     unsigned long rows)
+{
+  unsigned long bpl, stride, y;
+  int plane;
+
   if (s->xd & 7) {
     bpl = jbg_ceil_half(s->xd, 3);     /* bytes per line */
+    stride = s->stride ? s->stride : bpl;
     for (plane = 0; plane < s->planes; plane++)
-      for (y = 0; y < s->yd; y++)
-	s->lhp[0][plane][y * bpl + bpl - 1] &= ~((1 << (8 - (s->xd & 7))) - 1);
+      for (y = 0; y < rows; y++)
+	p[plane][y * stride + bpl - 1] &= ~((1 << (8 - (s->xd & 7))) - 1);
   }
+}
+
+
+/*
+ * Output the BIH, and get the sde[][][] array ready.
+ */
+static void enc_start(struct jbg_enc_state *s)
+{
+  unsigned char buf[20];
+  unsigned long xd, yd;
+  unsigned long stripe;
+  int layer, plane;
+  unsigned char dpbuf[1728];
 
   /* prepare BIH */
   buf[0] = s->dl;
@@ -1863,8 +2106,14 @@ void jbg_enc_out(struct jbg_enc_state *s)
   /* calculate number of stripes that will be required */
   s->stripes = jbg_stripes(s->l0, s->yd, s->d);
 
-  /* allocate buffers for SDE pointers */
+  /* allocate buffers for SDE pointers, unless jbg_enc_reinit() kept
+   * an array of the right size from a previous image */
+  if (s->sde != NULL &&
+      (s->sde_stripes != s->stripes || s->sde_layers != s->d + 1))
+    jbg_enc_free_sde(s);
   if (s->sde == NULL) {
+    s->sde_stripes = s->stripes;
+    s->sde_layers = s->d + 1;
     s->sde = (struct jbg_buf ****)
       checked_malloc(s->stripes, sizeof(struct jbg_buf ***));
     for (stripe = 0; stripe < s->stripes; stripe++) {
@@ -1887,6 +2136,51 @@ void jbg_enc_out(struct jbg_enc_state *s)
     jbg_int2dppriv(dpbuf, s->dppriv);
     s->data_out(dpbuf, 1728, s->file);
   }
+}
+
+
+/*
+ * Output the comment marker segment if there is any pending.
+ */
+static void output_comment(struct jbg_enc_state *s)
+{
+  unsigned char buf[6];
+
+  if (s->comment) {
+    buf[0] = MARKER_ESC;
+    buf[1] = MARKER_COMMENT;
+    buf[2] = s->comment_len >> 24;
+    buf[3] = (s->comment_len >> 16) & 0xff;
+    buf[4] = (s->comment_len >> 8) & 0xff;
+    buf[5] = s->comment_len & 0xff;
+    s->data_out(buf, 6, s->file);
+    s->data_out(s->comment, s->comment_len, s->file);
+    s->comment = NULL;
+  }
+}
+
+
+/*
+ * Encode one full BIE and pass the generated data to the specified
+ * call-back function
+ */
+void jbg_enc_out(struct jbg_enc_state *s)
+{
+  unsigned char buf[6];
+  unsigned long yd;
+  long ii[3], is[3], ie[3];    /* generic variables for the 3 nested loops */ 
+  unsigned long stripe;
+  int layer, plane;
+  int order;
+
+  if (!enc_check(s))
+    return;
+  order = s->order & (JBG_SEQ | JBG_ILEAVE | JBG_SMID);
+  if (s->d > 0)
+    alloc_lowres(s);
+  s->stripe0 = 0;
+  zero_pad(s, s->lhp[0], s->yd);
+  enc_start(s);
 
 #if 0
   /*
@@ -1929,19 +2223,7 @@ void jbg_enc_out(struct jbg_enc_state *s)
 	  layer = ii[iindex[order][LAYER]];
 	plane = ii[iindex[order][PLANE]];
 
-	/* output comment marker segment if there is any pending */
-	if (s->comment) {
-	  buf[0] = MARKER_ESC;
-	  buf[1] = MARKER_COMMENT;
-	  buf[2] = s->comment_len >> 24;
-	  buf[3] = (s->comment_len >> 16) & 0xff;
-	  buf[4] = (s->comment_len >> 8) & 0xff;
-	  buf[5] = s->comment_len & 0xff;
-	  s->data_out(buf, 6, s->file);
-	  s->data_out(s->comment, s->comment_len, s->file);
-	  s->comment = NULL;
-	}
-
+	output_comment(s);
 	output_sde(s, stripe, layer, plane);
 
 	/*
@@ -1978,29 +2260,68 @@ void jbg_enc_out(struct jbg_enc_state *s)
 }
 
 
+/*
+ * Encode one BIE a stripe at a time, for callers that don't want to
+ * hold the whole image in memory. jbg_enc_stripes() outputs the BIH and
+ * returns the number of stripes, or 0 if the image can't be encoded this
+ * way: that takes a single resolution layer, the height known up front
+ * (no NEWLEN), and with more than one plane, an order that has all
+ * planes of a stripe before the next stripe. Then jbg_enc_stripe() is
+ * called for each stripe in turn, with p[plane] pointing to its first
+ * row. A stripe is l0 rows (the last one may be less), one stride apart
+ * as with jbg_enc_stride(), and the two rows before the first one must
+ * still hold the last two rows of the previous stripe, as the templates
+ * and typical prediction look back that far.
+ */
+unsigned long jbg_enc_stripes(struct jbg_enc_state *s)
+{
+  int order;
+
+  if (!enc_check(s))
+    return 0;
+  order = s->order & (JBG_SEQ | JBG_ILEAVE | JBG_SMID);
+  if (s->d != 0 || s->yd1 != s->yd ||
+      (s->planes > 1 && iindex[order][STRIPE] > iindex[order][PLANE]))
+    return 0;
+  s->stripe0 = 0;
+  enc_start(s);
+  return s->stripes;
+}
+
+
+void jbg_enc_stripe(struct jbg_enc_state *s, unsigned char **p)
+{
+  unsigned long stripe = s->stripe0;
+  unsigned long rows;
+  int plane;
+
+  if (stripe >= s->stripes)
+    return;
+  rows = s->yd - stripe * s->l0;
+  if (rows > s->l0)
+    rows = s->l0;
+  s->lhp[0] = p;
+  zero_pad(s, p, rows);
+  for (plane = 0; plane < s->planes; plane++) {
+    output_comment(s);
+    output_sde(s, stripe, 0, plane);
+  }
+  s->stripe0++;
+
+  return;
+}
+
+
 void jbg_enc_free(struct jbg_enc_state *s)
 {
-  unsigned long stripe;
-  int layer, plane;
+  int plane;
 
 #ifdef DEBUG
   fprintf(stderr, "jbg_enc_free(%p)\n", (void *) s);
 #endif
 
   /* clear buffers for SDEs */
-  if (s->sde) {
-    for (stripe = 0; stripe < s->stripes; stripe++) {
-      for (layer = 0; layer < s->d + 1; layer++) {
-	for (plane = 0; plane < s->planes; plane++)
-	  if (s->sde[stripe][layer][plane] != SDE_DONE &&
-	      s->sde[stripe][layer][plane] != SDE_TODO)
-	    jbg_buf_free(&s->sde[stripe][layer][plane]);
-	checked_free(s->sde[stripe][layer]);
-      }
-      checked_free(s->sde[stripe]);
-    }
-    checked_free(s->sde);
-  }
+  jbg_enc_free_sde(s);
 
   /* clear free_list */
   jbg_buf_free(&s->free_list);
@@ -2023,6 +2344,7 @@ void jbg_enc_free(struct jbg_enc_state *s)
   
   /* clear buffer for index of highres image in lhp */
   checked_free(s->highres);
+  s->highres = NULL;   /* so that jbg_enc_reinit() starts from scratch */
   
   return;
 }
@@ -2084,7 +2406,7 @@ void jbg_dec_maxsize(struct jbg_dec_state *s, unsigned long xmax,
  * part of the data or if the final byte was 0xff, in which case
  * this code cannot determine whether we have a marker segment).
  */
-static size_t decode_pscd(struct jbg_dec_state *s, unsigned char *data,
+static size_t decode_pscd(struct jbg_dec_state *s, const unsigned char *data,
 			  size_t len)
 {
   unsigned long stripe;
@@ -2567,7 +2889,7 @@ static size_t decode_pscd(struct jbg_dec_state *s, unsigned char *data,
  * least significant bits of the return value will provide additional
  * information by identifying which test exactly has failed.)
  */
-int jbg_dec_in(struct jbg_dec_state *s, unsigned char *data, size_t len,
+int jbg_dec_in(struct jbg_dec_state *s, const unsigned char *data, size_t len,
 	       size_t *cnt)
 {
   int i, j, required_length;
@@ -3041,6 +3363,24 @@ void jbg_dec_free(struct jbg_dec_state *s)
 }
 
 
+/*
+ * Transpose the 8 x 8 bit matrix held in x, one row per byte: bit j of
+ * byte i becomes bit i of byte j.
+ */
+static uint64_t jbg_transpose8(uint64_t x)
+{
+  uint64_t t;
+
+  t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+  x ^= t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+  x ^= t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+  x ^= t ^ (t << 28);
+  return x;
+}
+
+
 /*
  * Split bigendian integer pixel field into separate bit planes. In the
  * src array, every pixel is represented by a ((has_planes + 7) / 8) byte
@@ -3048,6 +3388,11 @@ void jbg_dec_free(struct jbg_dec_state *s)
  * the number of used bits per pixel in the source image, encode_plane
  * is the number of most significant bits among those that we
  * actually transfer to dest.
+ *
+ * Pixels of up to 8 bits are split 8 at a time: the 8 pixel bytes,
+ * first pixel in the most significant byte, are an 8 x 8 bit matrix
+ * whose transpose holds one byte for each plane. With SSE2 or AVX2, a
+ * movemask gathers one plane of 16 or 32 pixels at once instead.
  */
 void jbg_split_planes(unsigned long x, unsigned long y, int has_planes,
 		      int encode_planes,
@@ -3066,6 +3411,82 @@ void jbg_split_planes(unsigned long x, unsigned long y, int has_planes,
   if (encode_planes > has_planes)
     encode_planes = has_planes;
   use_graycode = use_graycode != 0 && encode_planes > 1;
+
+  if (has_planes <= 8) {
+#if defined(__AVX2__)
+    const __m256i rev = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0,
+					 15, 14, 13, 12, 11, 10, 9, 8,
+					 7, 6, 5, 4, 3, 2, 1, 0,
+					 15, 14, 13, 12, 11, 10, 9, 8);
+#endif
+
+    for (line = 0; line < y; line++, src += x) {     /* lines loop */
+      i = 0;
+#if defined(__AVX2__)
+      for (; i + 32 <= x; i += 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+
+	if (use_graycode)
+	  v = _mm256_xor_si256(v, _mm256_and_si256(_mm256_srli_epi16(v, 1),
+						   _mm256_set1_epi8(0x7f)));
+	/* first pixel of each 8 into the top bit of the movemask byte */
+	v = _mm256_shuffle_epi8(v, rev);
+	for (p = 0; p < encode_planes; p++) {
+	  unsigned long b = (unsigned) _mm256_movemask_epi8(
+	    _mm256_slli_epi16(v, 7 - (msb - p)));
+	  unsigned char *d = dest[p] + bpl * line + i / 8;
+
+	  d[0] = b;
+	  d[1] = b >> 8;
+	  d[2] = b >> 16;
+	  d[3] = b >> 24;
+	}
+      }
+#elif defined(__SSE2__)
+      for (; i + 16 <= x; i += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+
+	if (use_graycode)
+	  v = _mm_xor_si128(v, _mm_and_si128(_mm_srli_epi16(v, 1),
+					     _mm_set1_epi8(0x7f)));
+	/* first pixel of each 8 into the top bit of the movemask byte */
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+	v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+	v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	for (p = 0; p < encode_planes; p++) {
+	  unsigned b = (unsigned) _mm_movemask_epi8(
+	    _mm_slli_epi16(v, 7 - (msb - p)));
+	  unsigned char *d = dest[p] + bpl * line + i / 8;
+
+	  d[0] = b;
+	  d[1] = b >> 8;
+	}
+      }
+#endif
+      for (; i < x; i += 8) {                        /* 8 pixels at a time */
+	unsigned char px[8];
+	const unsigned char *s8 = src + i;
+	uint64_t w;
+
+	if (x - i < 8) {
+	  /* the pixels right of the line become the zero padding bits */
+	  memset(px, 0, sizeof(px));
+	  memcpy(px, src + i, x - i);
+	  s8 = px;
+	}
+	w = ((uint64_t) s8[0] << 56) | ((uint64_t) s8[1] << 48) |
+	  ((uint64_t) s8[2] << 40) | ((uint64_t) s8[3] << 32) |
+	  ((uint64_t) s8[4] << 24) | ((uint64_t) s8[5] << 16) |
+	  ((uint64_t) s8[6] << 8) | (uint64_t) s8[7];
+	if (use_graycode)
+	  w ^= (w >> 1) & 0x7f7f7f7f7f7f7f7fULL;
+	w = jbg_transpose8(w);
+	for (p = 0; p < encode_planes; p++)
+	  dest[p][bpl * line + i / 8] = w >> (8 * (msb - p));
+      }
+    }
+    return;
+  }
   
   for (p = 0; p < encode_planes; p++)
     memset(dest[p], 0, bpl * y);
@@ -3109,12 +3530,17 @@ void jbg_split_planes(unsigned long x, unsigned long y, int has_planes,
  * Merge the separate bit planes decoded by the JBIG decoder into an
  * integer pixel field. This is essentially the counterpart to
  * jbg_split_planes().
+ *
+ * Images of up to 8 planes are merged 8 pixels at a time, by the same
+ * transpose that splits them, and Gray code is undone for all 8 pixels
+ * with three shifts. With SSE2 or AVX2, each plane byte is spread over
+ * 8 pixel bytes with a compare instead, 16 or 32 pixels at once.
  */
 void jbg_dec_merge_planes(const struct jbg_dec_state *s, int use_graycode,
 			  void (*data_out)(unsigned char *start, size_t len,
 					   void *file), void *file)
 {
-#define BUFLEN 4096
+#define BUFLEN 16384
   unsigned long bpl, line, i;
   unsigned k = 8;
   int p;
@@ -3140,6 +3566,106 @@ void jbg_dec_merge_planes(const struct jbg_dec_state *s, int use_graycode,
       src = s->lhp[(s->ii[0] - 1) & 1];
   else
     src = s->lhp[s->d & 1];
+
+  if (s->planes <= 8) {
+    int top = s->planes - 1;
+#if defined(__AVX2__)
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+					    1, 1, 1, 1, 1, 1, 1, 1,
+					    2, 2, 2, 2, 2, 2, 2, 2,
+					    3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i mask = _mm256_set1_epi64x(0x0102040810204080LL);
+#elif defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi64x(0x0102040810204080LL);
+#endif
+
+    for (line = 0; line < y; line++) {                  /* lines loop */
+      unsigned long o = bpl * line;
+
+      i = 0;
+#if defined(__AVX2__)
+      for (; i + 32 <= x; i += 32) {
+	__m256i acc = _mm256_setzero_si256();
+	__m256i b;
+	int32_t four;
+
+	for (p = 0; p <= top; p++) {
+	  memcpy(&four, src[p] + o + i / 8, 4);
+	  b = _mm256_shuffle_epi8(_mm256_set1_epi32(four), spread);
+	  b = _mm256_cmpeq_epi8(_mm256_and_si256(b, mask), mask);
+	  acc = _mm256_or_si256(acc, _mm256_and_si256(b,
+				  _mm256_set1_epi8(1 << (top - p))));
+	}
+	if (use_graycode) {
+	  acc = _mm256_xor_si256(acc, _mm256_and_si256(
+		  _mm256_srli_epi16(acc, 1), _mm256_set1_epi8(0x7f)));
+	  acc = _mm256_xor_si256(acc, _mm256_and_si256(
+		  _mm256_srli_epi16(acc, 2), _mm256_set1_epi8(0x3f)));
+	  acc = _mm256_xor_si256(acc, _mm256_and_si256(
+		  _mm256_srli_epi16(acc, 4), _mm256_set1_epi8(0x0f)));
+	}
+	if (bp + 32 > buf + BUFLEN) {
+	  data_out(buf, bp - buf, file);
+	  bp = buf;
+	}
+	_mm256_storeu_si256((__m256i *) bp, acc);
+	bp += 32;
+      }
+#elif defined(__SSE2__)
+      for (; i + 16 <= x; i += 16) {
+	__m128i acc = _mm_setzero_si128();
+	__m128i b;
+
+	for (p = 0; p <= top; p++) {
+	  b = _mm_cvtsi32_si128(src[p][o + i / 8] |
+				(src[p][o + i / 8 + 1] << 8));
+	  b = _mm_unpacklo_epi8(b, b);
+	  b = _mm_unpacklo_epi16(b, b);
+	  b = _mm_unpacklo_epi32(b, b);
+	  b = _mm_cmpeq_epi8(_mm_and_si128(b, mask), mask);
+	  acc = _mm_or_si128(acc, _mm_and_si128(b,
+			       _mm_set1_epi8(1 << (top - p))));
+	}
+	if (use_graycode) {
+	  acc = _mm_xor_si128(acc, _mm_and_si128(_mm_srli_epi16(acc, 1),
+						 _mm_set1_epi8(0x7f)));
+	  acc = _mm_xor_si128(acc, _mm_and_si128(_mm_srli_epi16(acc, 2),
+						 _mm_set1_epi8(0x3f)));
+	  acc = _mm_xor_si128(acc, _mm_and_si128(_mm_srli_epi16(acc, 4),
+						 _mm_set1_epi8(0x0f)));
+	}
+	if (bp + 16 > buf + BUFLEN) {
+	  data_out(buf, bp - buf, file);
+	  bp = buf;
+	}
+	_mm_storeu_si128((__m128i *) bp, acc);
+	bp += 16;
+      }
+#endif
+      for (; i < x; i += 8) {                           /* 8 pixels at a time */
+	uint64_t w = 0;
+
+	for (p = 0; p <= top; p++)
+	  w |= (uint64_t) src[p][o + i / 8] << (8 * (top - p));
+	w = jbg_transpose8(w);
+	if (use_graycode) {
+	  w ^= (w >> 1) & 0x7f7f7f7f7f7f7f7fULL;
+	  w ^= (w >> 2) & 0x3f3f3f3f3f3f3f3fULL;
+	  w ^= (w >> 4) & 0x0f0f0f0f0f0f0f0fULL;
+	}
+	if (bp + 8 > buf + BUFLEN) {
+	  data_out(buf, bp - buf, file);
+	  bp = buf;
+	}
+	/* the first pixel is in the most significant byte */
+	for (k = 0; k < 8 && i + k < x; k++)
+	  *bp++ = w >> (56 - 8 * k);
+      }
+    }
+    if (bp - buf > 0)
+      data_out(buf, bp - buf, file);
+    return;
+  }
   
   for (line = 0; line < y; line++) {                    /* lines loop */
     for (i = 0; i * 8 < x; i++) {                       /* src bytes loop */
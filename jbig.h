@@ -128,6 +128,15 @@ struct jbg_enc_state {
                              at next opportunity (will be reset to NULL
                              as soon as comment has been written)          */
   unsigned long comment_len;       /* length of data pointed to by comment */
+  unsigned long lhp_size;  /* bytes allocated for each lhp[1][plane] image */
+  unsigned long tp_size;                    /* bytes allocated for tp[] */
+  unsigned long sde_stripes;        /* dimensions of the sde[][][] array, */
+  int sde_layers;                         /* as allocated by jbg_enc_out() */
+  unsigned long stride;  /* bytes from one row of the input image to the
+                            next, 0 if the rows are packed (see
+                            jbg_enc_stride())                             */
+  unsigned long stripe0;   /* stripe whose first row is at lhp[0], the next
+                              one for jbg_enc_stripe()                    */
 };
 
 
@@ -198,19 +207,27 @@ void jbg_enc_init(struct jbg_enc_state *s, unsigned long x, unsigned long y,
 		  void (*data_out)(unsigned char *start, size_t len,
 				   void *file),
 		  void *file);
+void jbg_enc_reinit(struct jbg_enc_state *s, unsigned long x, unsigned long y,
+		    int planes, unsigned char **p,
+		    void (*data_out)(unsigned char *start, size_t len,
+				     void *file),
+		    void *file);
 int jbg_enc_lrlmax(struct jbg_enc_state *s, unsigned long mwidth,
 		   unsigned long mheight);
 void jbg_enc_layers(struct jbg_enc_state *s, int d);
+void jbg_enc_stride(struct jbg_enc_state *s, unsigned long stride);
 int  jbg_enc_lrange(struct jbg_enc_state *s, int dl, int dh);
 void jbg_enc_options(struct jbg_enc_state *s, int order, int options,
 		     unsigned long l0, int mx, int my);
 void jbg_enc_out(struct jbg_enc_state *s);
+unsigned long jbg_enc_stripes(struct jbg_enc_state *s);
+void jbg_enc_stripe(struct jbg_enc_state *s, unsigned char **p);
 void jbg_enc_free(struct jbg_enc_state *s);
 
 void jbg_dec_init(struct jbg_dec_state *s);
 void jbg_dec_maxsize(struct jbg_dec_state *s, unsigned long xmax,
 		     unsigned long ymax);
-int  jbg_dec_in(struct jbg_dec_state *s, unsigned char *data, size_t len,
+int  jbg_dec_in(struct jbg_dec_state *s, const unsigned char *data, size_t len,
 		size_t *cnt);
 unsigned long jbg_dec_getwidth(const struct jbg_dec_state *s);
 unsigned long jbg_dec_getheight(const struct jbg_dec_state *s);
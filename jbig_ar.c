@@ -35,7 +35,7 @@
  *  given by ITU T.82 Table 24.
  */
 
-static short lsztab[113] = {
+const short jbg_lsztab[113] = {
   0x5a1d, 0x2586, 0x1114, 0x080b, 0x03d8, 0x01da, 0x00e5, 0x006f,
   0x0036, 0x001a, 0x000d, 0x0006, 0x0003, 0x0001, 0x5a7f, 0x3f25,
   0x2cf2, 0x207c, 0x17b9, 0x1182, 0x0cef, 0x09a1, 0x072f, 0x055c,
@@ -53,7 +53,7 @@ static short lsztab[113] = {
   0x59eb
 };
 
-static unsigned char nmpstab[113] = {
+const unsigned char jbg_nmpstab[113] = {
     1,   2,   3,   4,   5,   6,   7,   8,
     9,  10,  11,  12,  13,  13,  15,  16,
    17,  18,  19,  20,  21,  22,  23,  24,
@@ -72,10 +72,10 @@ static unsigned char nmpstab[113] = {
 };
 
 /*
- * least significant 7 bits (mask 0x7f) of nlpstab[] contain NLPS value,
+ * least significant 7 bits (mask 0x7f) of jbg_nlpstab[] contain NLPS value,
  * most significant bit (mask 0x80) contains SWTCH bit
  */
-static unsigned char nlpstab[113] = {
+const unsigned char jbg_nlpstab[113] = {
   129,  14,  16,  18,  20,  23,  25,  28,
    30,  33,  35,   9,  10,  12, 143,  36,
    38,  39,  40,  42,  43,  45,  46,  48,
@@ -119,6 +119,18 @@ void arith_encode_init(struct jbg_arenc_state *s, int reuse_st)
 }
 
 
+/*
+ * Append one PSCD byte to the output window, asking for more room when
+ * the window is full.
+ */
+#define BYTE_OUT(s, b) \
+  do { \
+    if ((s)->out == (s)->out_end) \
+      (s)->refill(s); \
+    *(s)->out++ = (b); \
+  } while (0)
+
+
 void arith_encode_flush(struct jbg_arenc_state *s)
 {
   unsigned long temp;
@@ -134,32 +146,32 @@ void arith_encode_flush(struct jbg_arenc_state *s)
   if (s->c & 0xf8000000L) {
     /* one final overflow has to be handled */
     if (s->buffer >= 0) {
-      s->byte_out(s->buffer + 1, s->file);
+      BYTE_OUT(s, s->buffer + 1);
       if (s->buffer + 1 == MARKER_ESC)
-	s->byte_out(MARKER_STUFF, s->file);
+	BYTE_OUT(s, MARKER_STUFF);
     }
     /* output 0x00 bytes only when more non-0x00 will follow */
     if (s->c & 0x7fff800L)
       for (; s->sc; --s->sc)
-	s->byte_out(0x00, s->file);
+	BYTE_OUT(s, 0x00);
   } else {
     if (s->buffer >= 0)
-      s->byte_out(s->buffer, s->file); 
+      BYTE_OUT(s, s->buffer); 
     /* T.82 figure 30 says buffer+1 for the above line! Typo? */
     for (; s->sc; --s->sc) {
-      s->byte_out(0xff, s->file);
-      s->byte_out(MARKER_STUFF, s->file);
+      BYTE_OUT(s, 0xff);
+      BYTE_OUT(s, MARKER_STUFF);
     }
   }
   /* output final bytes only if they are not 0x00 */
   if (s->c & 0x7fff800L) {
-    s->byte_out((s->c >> 19) & 0xff, s->file);
+    BYTE_OUT(s, (s->c >> 19) & 0xff);
     if (((s->c >> 19) & 0xff) == MARKER_ESC)
-      s->byte_out(MARKER_STUFF, s->file);
+      BYTE_OUT(s, MARKER_STUFF);
     if (s->c & 0x7f800L) {
-      s->byte_out((s->c >> 11) & 0xff, s->file);
+      BYTE_OUT(s, (s->c >> 11) & 0xff);
       if (((s->c >> 11) & 0xff) == MARKER_ESC)
-	s->byte_out(MARKER_STUFF, s->file);
+	BYTE_OUT(s, MARKER_STUFF);
     }
   }
 
@@ -167,94 +179,99 @@ void arith_encode_flush(struct jbg_arenc_state *s)
 }
 
 
-void arith_encode(struct jbg_arenc_state *s, int cx, int pix) 
+/*
+ * Renormalize the coding interval after arith_encode() has coded a
+ * symbol that left A below 0x8000. Rather than doubling A and C one
+ * bit at a time, they are shifted up to the next byte boundary (or all
+ * the way) at once; the bytes come out exactly as before.
+ */
+void arith_encode_renorm(struct jbg_arenc_state *s)
 {
-  register unsigned lsz, ss;
-  register unsigned char *st;
+  int shift;
   long temp;
 
-  assert(cx >= 0 && cx < 4096);
-  st = s->st + cx;
-  ss = *st & 0x7f;
-  assert(ss < 113);
-  lsz = lsztab[ss];
-
-#if 0
-  fprintf(stderr, "pix = %d, cx = %d, mps = %d, st = %3d, lsz = 0x%04x, "
-	  "a = 0x%05lx, c = 0x%08lx, ct = %2d, buf = 0x%02x\n",
-	  pix, cx, !!(s->st[cx] & 0x80), ss, lsz, s->a, s->c, s->ct,
-	  s->buffer);
+  /* the number of doublings that bring A back to at least 0x8000 */
+#if defined(__GNUC__)
+  shift = __builtin_clz((unsigned) s->a) - (8 * sizeof(unsigned) - 16);
+#else
+  for (shift = 0; (s->a << shift) < 0x8000; shift++) ;
 #endif
 
-  if (((pix << 7) ^ s->st[cx]) & 0x80) {
-    /* encode the less probable symbol */
-    if ((s->a -= lsz) >= lsz) {
-      /* If the interval size (lsz) for the less probable symbol (LPS)
-       * is larger than the interval size for the MPS, then exchange
-       * the two symbols for coding efficiency, otherwise code the LPS
-       * as usual: */
-      s->c += s->a;
-      s->a = lsz;
-    }
-    /* Check whether MPS/LPS exchange is necessary
-     * and chose next probability estimator status */
-    *st &= 0x80;
-    *st ^= nlpstab[ss];
-  } else {
-    /* encode the more probable symbol */
-    if ((s->a -= lsz) & 0xffff8000L)
-      return;   /* A >= 0x8000 -> ready, no renormalization required */
-    if (s->a < lsz) {
-      /* If the interval size (lsz) for the less probable symbol (LPS)
-       * is larger than the interval size for the MPS, then exchange
-       * the two symbols for coding efficiency: */
-      s->c += s->a;
-      s->a = lsz;
+  while (shift >= s->ct) {
+    s->a <<= s->ct;
+    s->c <<= s->ct;
+    shift -= s->ct;
+    /* another byte is ready for output */
+    temp = s->c >> 19;
+    if (temp & 0xffffff00L) {
+      /* handle overflow over all buffered 0xff bytes */
+      if (s->buffer >= 0) {
+	++s->buffer;
+	BYTE_OUT(s, s->buffer);
+	if (s->buffer == MARKER_ESC)
+	  BYTE_OUT(s, MARKER_STUFF);
+      }
+      for (; s->sc; --s->sc)
+	BYTE_OUT(s, 0x00);
+      s->buffer = temp & 0xff;  /* new output byte, might overflow later */
+      assert(s->buffer != 0xff);
+      /* can s->buffer really never become 0xff here? */
+    } else if (temp == 0xff) {
+      /* buffer 0xff byte (which might overflow later) */
+      ++s->sc;
+    } else {
+      /* output all buffered 0xff bytes, they will not overflow any more */
+      if (s->buffer >= 0)
+	BYTE_OUT(s, s->buffer);
+      for (; s->sc; --s->sc) {
+	BYTE_OUT(s, 0xff);
+	BYTE_OUT(s, MARKER_STUFF);
+      }
+      s->buffer = temp;   /* buffer new output byte (can still overflow) */
     }
-    /* chose next probability estimator status */
-    *st &= 0x80;
-    *st |= nmpstab[ss];
+    s->c &= 0x7ffffL;
+    s->ct = 8;
   }
+  s->a <<= shift;
+  s->c <<= shift;
+  s->ct -= shift;
 
-  /* renormalization of coding interval */
-  do {
-    s->a <<= 1;
-    s->c <<= 1;
-    --s->ct;
-    if (s->ct == 0) {
-      /* another byte is ready for output */
-      temp = s->c >> 19;
-      if (temp & 0xffffff00L) {
-	/* handle overflow over all buffered 0xff bytes */
-	if (s->buffer >= 0) {
-	  ++s->buffer;
-	  s->byte_out(s->buffer, s->file);
-	  if (s->buffer == MARKER_ESC)
-	    s->byte_out(MARKER_STUFF, s->file);
-	}
-	for (; s->sc; --s->sc)
-	  s->byte_out(0x00, s->file);
-	s->buffer = temp & 0xff;  /* new output byte, might overflow later */
-	assert(s->buffer != 0xff);
-	/* can s->buffer really never become 0xff here? */
-      } else if (temp == 0xff) {
-	/* buffer 0xff byte (which might overflow later) */
-	++s->sc;
-      } else {
-	/* output all buffered 0xff bytes, they will not overflow any more */
-	if (s->buffer >= 0)
-	  s->byte_out(s->buffer, s->file);
-	for (; s->sc; --s->sc) {
-	  s->byte_out(0xff, s->file);
-	  s->byte_out(MARKER_STUFF, s->file);
-	}
-	s->buffer = temp;   /* buffer new output byte (can still overflow) */
+  return;
+}
+
+
+/*
+ * Encode n times the same symbol pix in context cx, as arith_encode()
+ * would. As long as pix is the MPS and A stays at 0x8000 or above,
+ * coding a symbol only subtracts LSZ from A, so such stretches are
+ * coded with a single subtraction. Long runs of white pixels in an
+ * all-white neighbourhood are mostly made up of such stretches.
+ */
+void arith_encode_run(struct jbg_arenc_state *s, int cx, int pix,
+		      unsigned long n)
+{
+  unsigned char *st = s->st + cx;
+  unsigned long lsz, m;
+
+  assert(cx >= 0 && cx < 4096);
+  while (n > 0) {
+    if (!(((pix << 7) ^ *st) & 0x80)) {
+      lsz = jbg_lsztab[*st & 0x7f];
+      if (s->a >= 0x8000 + lsz) {
+	/* this many MPS need no renormalization */
+	m = (s->a - 0x8000) / lsz;
+	if (m > n)
+	  m = n;
+	s->a -= m * lsz;
+	n -= m;
+	if (n == 0)
+	  break;
       }
-      s->c &= 0x7ffffL;
-      s->ct = 8;
     }
-  } while (s->a < 0x8000);
- 
+    arith_encode(s, cx, pix);
+    --n;
+  }
+
   return;
 }
 
@@ -369,7 +386,7 @@ int arith_decode(struct jbg_ardec_state *s, int cx)
   st = s->st + cx;
   ss = *st & 0x7f;
   assert(ss < 113);
-  lsz = lsztab[ss];
+  lsz = jbg_lsztab[ss];
 
 #if 0
   fprintf(stderr, "cx = %d, mps = %d, st = %3d, lsz = 0x%04x, a = 0x%05lx, "
@@ -387,11 +404,11 @@ int arith_decode(struct jbg_ardec_state *s, int cx)
 	/* Check whether MPS/LPS exchange is necessary
 	 * and chose next probability estimator status */
 	*st &= 0x80;
-	*st ^= nlpstab[ss];
+	*st ^= jbg_nlpstab[ss];
       } else {
 	pix = *st >> 7;
 	*st &= 0x80;
-	*st |= nmpstab[ss];
+	*st |= jbg_nmpstab[ss];
       }
     }
   else {
@@ -401,7 +418,7 @@ int arith_decode(struct jbg_ardec_state *s, int cx)
       s->a = lsz;
       pix = *st >> 7;
       *st &= 0x80;
-      *st |= nmpstab[ss];
+      *st |= jbg_nmpstab[ss];
     } else {
       s->c -= s->a << 16;
       s->a = lsz;
@@ -409,7 +426,7 @@ int arith_decode(struct jbg_ardec_state *s, int cx)
       /* Check whether MPS/LPS exchange is necessary
        * and chose next probability estimator status */
       *st &= 0x80;
-      *st ^= nlpstab[ss];
+      *st ^= jbg_nlpstab[ss];
     }
   }
 
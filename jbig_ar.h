@@ -22,8 +22,11 @@ struct jbg_arenc_state {
   long sc;     /* number of buffered 0xff values that might still overflow */
   int ct;  /* bit shift counter, determines when next byte will be written */
   int buffer;                /* buffer for most recent output byte != 0xff */
-  void (*byte_out)(int, void *);  /* function that receives all PSCD bytes */
-  void *file;                              /* parameter passed to byte_out */
+  unsigned char *out;       /* where the next PSCD byte will be written */
+  unsigned char *out_end;          /* end of the space available at out */
+  void (*refill)(struct jbg_arenc_state *);    /* called when out reaches *
+                                  * out_end, must make room for more bytes */
+  void *file;                               /* parameter for use by refill */
 };
 
 /*
@@ -35,8 +38,8 @@ struct jbg_ardec_state {
   unsigned long c;                /* register C: base of coding intervall, *
                                    * layout as in Table 25                 */
   unsigned long a;       /* register A: normalized size of coding interval */
-  unsigned char *pscd_ptr;               /* pointer to next PSCD data byte */
-  unsigned char *pscd_end;                   /* pointer to byte after PSCD */
+  const unsigned char *pscd_ptr;         /* pointer to next PSCD data byte */
+  const unsigned char *pscd_end;             /* pointer to byte after PSCD */
   int ct;    /* bit-shift counter, determines when next byte will be read;
               * special value -1 signals that zero-padding has started     */
   int startup;          /* boolean flag that controls initial fill of s->c */
@@ -46,10 +49,59 @@ struct jbg_ardec_state {
 			 * place */
 };
 
+extern const short jbg_lsztab[113];
+extern const unsigned char jbg_nmpstab[113];
+extern const unsigned char jbg_nlpstab[113];
+
 void arith_encode_init(struct jbg_arenc_state *s, int reuse_st);
 void arith_encode_flush(struct jbg_arenc_state *s);
-void arith_encode(struct jbg_arenc_state *s, int cx, int pix);
+void arith_encode_renorm(struct jbg_arenc_state *s);
+void arith_encode_run(struct jbg_arenc_state *s, int cx, int pix,
+		      unsigned long n);
 void arith_decode_init(struct jbg_ardec_state *s, int reuse_st);
 int  arith_decode(struct jbg_ardec_state *s, int cx);
 
+/*
+ * Encode one symbol pix in context cx. This is called for every pixel,
+ * so it is inlined; only the renormalization of the coding interval,
+ * which is needed after every LPS but rarely after an MPS, is left to
+ * arith_encode_renorm().
+ */
+static inline void arith_encode(struct jbg_arenc_state *s, int cx, int pix)
+{
+  unsigned char *st = s->st + cx;
+  unsigned ss = *st & 0x7f;
+  unsigned lsz = jbg_lsztab[ss];
+
+  if (((pix << 7) ^ *st) & 0x80) {
+    /* encode the less probable symbol */
+    if ((s->a -= lsz) >= lsz) {
+      /* If the interval size (lsz) for the less probable symbol (LPS)
+       * is larger than the interval size for the MPS, then exchange
+       * the two symbols for coding efficiency, otherwise code the LPS
+       * as usual: */
+      s->c += s->a;
+      s->a = lsz;
+    }
+    /* Check whether MPS/LPS exchange is necessary
+     * and chose next probability estimator status */
+    *st = (*st & 0x80) ^ jbg_nlpstab[ss];
+  } else {
+    /* encode the more probable symbol */
+    if ((s->a -= lsz) & 0xffff8000L)
+      return;   /* A >= 0x8000 -> ready, no renormalization required */
+    if (s->a < lsz) {
+      /* If the interval size (lsz) for the less probable symbol (LPS)
+       * is larger than the interval size for the MPS, then exchange
+       * the two symbols for coding efficiency: */
+      s->c += s->a;
+      s->a = lsz;
+    }
+    /* chose next probability estimator status */
+    *st = (*st & 0x80) | jbg_nmpstab[ss];
+  }
+
+  arith_encode_renorm(s);
+}
+
 #endif /* JBG_AR_H */
@@ -30,6 +30,7 @@ b*/
 #include <errno.h>
 
 #include "jbig.h"
+#include "recscan.h"
 
 /*
  * Global option flags
@@ -176,8 +177,31 @@ proff(int curOff)
 	printf("%6x:	", curOff);
 }
 
+/*
+ * Print the first 16 and last 16 bytes of len bytes of JBIG data.
+ */
+void
+print_data(const unsigned char *data, int len)
+{
+    int	i;
+
+    #define MAXTOT 16
+    for (i = 0; i < len; ++i)
+    {
+	if (i < MAXTOT)
+	{
+	    printf(" %02x", data[i]);
+	    if (i == MAXTOT - 1)
+		printf("\n\t\t\t...");
+	}
+	else if (len - i - 1 < 16)
+	    printf(" %02x", data[i]);
+    }
+    printf("\n");
+}
+
 void
-decode(FILE *fp)
+decode(RECSCAN *r)
 {
     int		c;
     int		rc;
@@ -215,7 +239,7 @@ decode(FILE *fp)
     strpage[835] = "photo4x6";
     strpage[837] = "photo10x15";
 
-    while (fgets(buf, sizeof(buf), fp))
+    while (recscan_gets(r, buf, sizeof(buf)))
     {
 	proff(curOff);
 	if (buf[0] == '\033')
@@ -233,10 +257,10 @@ decode(FILE *fp)
 	    int		state = 0;
 	    char	intro = 0, groupc = 0;
 	    int		neg = 0, val = 0, pres = 0;
-	    size_t		cnt;
-	    unsigned char	ch;
+	    const unsigned char	*data;
+	    int			len;
 	
-	    while ( (c = fgetc(fp)) != EOF)
+	    while ( (c = recscan_getc(r)) != EOF)
 	    {
 		curOff++;
 		switch (state)
@@ -348,7 +372,7 @@ decode(FILE *fp)
 			    unsigned char config[1024];
 			
 			    printf("\t\tBW/COLOR: [%d]", val);
-			    rc = fread(config, val, 1, fp);
+			    rc = recscan_read(r, config, val);
 			    curOff += val;
 			    print_config(config);
 			}
@@ -405,7 +429,7 @@ decode(FILE *fp)
 				    { "yellow", "magenta", "cyan", "black" };
 				    
 				++pn;
-				rc = fread(bih, bihlen = sizeof(bih), 1, fp);
+				rc = recscan_read(r, bih, bihlen = sizeof(bih));
 				curOff += bihlen;
 				if (nbie == 4 && pn >= 1 && pn <= 4)
 				    printf("\t\t[%s]", color[pn-1]);
@@ -434,7 +458,54 @@ decode(FILE *fp)
 			}
 			printf("\n");
 			if (state == 'd')
+			{
+			    // Read the JBIG data in one piece
 			    printf("\t\t\t");
+			    len = recscan_avail(r, totval);
+			    data = recscan_take(r, len);
+			    curOff += len;
+			    print_data(data, len);
+			    state = 0;
+			    if (DecFile && s[pn].s && len)
+			    {
+				size_t	cnt;
+
+				// Anything after the end of the BIE is ignored
+				rc = jbg_dec_in(&s[pn], data, len, &cnt);
+				if (rc == JBG_EOK)
+				{
+				    int	h, w, len;
+				    unsigned char *image;
+
+				    //debug(0, "JBG_EOK: %d\n", pn);
+				    h = jbg_dec_getheight(&s[pn]);
+				    w = jbg_dec_getwidth(&s[pn]);
+				    image = jbg_dec_getimage(&s[pn], 0);
+				    len = jbg_dec_getsize(&s[pn]);
+				    if (image)
+				    {
+					char	buf[512];
+					sprintf(buf, "%s-%02d-%d.pbm",
+						DecFile, pageNum, pn);
+					dfp = fopen(buf,
+						imageCnt[pn] ? "a" : "w");
+					if (dfp)
+					{
+					    if (imageCnt[pn] == 0)
+						fprintf(dfp, "P4\n%8d %8d\n",
+						    w, h);
+					    imageCnt[pn] += incrY;
+					    rc = fwrite(image, 1, len, dfp);
+					    fclose(dfp);
+					}
+				    }
+				    else
+					debug(0, "Missing image %dx%d!\n",
+					    h, w);
+				    jbg_dec_free(&s[pn]);
+				}
+			    }
+			}
 		    }
 		    else if (c >= '0' && c <= '9')
 		    {
@@ -448,65 +519,13 @@ decode(FILE *fp)
 		    else
 			error(1, "c=%d\n", c);
 		    break;
-		case 'd':
-		    --val;
-		    #define MAXTOT 16
-		    if ((totval-val) <= MAXTOT)
-		    {
-			printf(" %02x", c);
-			if ((totval-val) == MAXTOT)
-			    printf("\n\t\t\t...");
-		    }
-		    else if (val < 16)
-			printf(" %02x", c);
-		    if (val == 0)
-		    {
-			state = 0;
-			printf("\n");
-		    }
-		    if (!DecFile || s[pn].s == 0)
-			break;
-
-		    ch = c;
-		    rc = JBG_EAGAIN;
-		    rc = jbg_dec_in(&s[pn], &ch, 1, &cnt);
-		    if (rc == JBG_EOK)
-		    {
-			int	h, w, len;
-			unsigned char *image;
-
-			//debug(0, "JBG_EOK: %d\n", pn);
-			h = jbg_dec_getheight(&s[pn]);
-			w = jbg_dec_getwidth(&s[pn]);
-			image = jbg_dec_getimage(&s[pn], 0);
-			len = jbg_dec_getsize(&s[pn]);
-			if (image)
-			{
-			    char	buf[512];
-			    sprintf(buf, "%s-%02d-%d.pbm",
-				    DecFile, pageNum, pn);
-			    dfp = fopen(buf, imageCnt[pn] ? "a" : "w");
-			    if (dfp)
-			    {
-				if (imageCnt[pn] == 0)
-				    fprintf(dfp, "P4\n%8d %8d\n", w, h);
-				imageCnt[pn] += incrY;
-				rc = fwrite(image, 1, len, dfp);
-				fclose(dfp);
-			    }
-			}
-			else
-			    debug(0, "Missing image %dx%d!\n", h, w);
-			jbg_dec_free(&s[pn]);
-		    }
-		    break;
 		}
 	    }
 	out:
 	    ;
 	}
     }
-    if (feof(fp))
+    if (recscan_eof(r))
 	return;
 
     printf("Total size: %d bytes\n", totSize);
@@ -518,6 +537,8 @@ main(int argc, char *argv[])
 	extern int	optind;
 	extern char	*optarg;
 	int		c;
+	FILE		*fp;
+	RECSCAN		*r;
 
 	while ( (c = getopt(argc, argv, "d:hoD:?h")) != EOF)
 		switch (c)
@@ -532,32 +553,27 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-        if (argc > 0)
-        {
-            FILE        *fp;
-
-            fp = fopen(argv[0], "r");
-            if (!fp)
-                error(1, "file '%s' doesn't exist\n", argv[0]);
-            for (;;)
-            {
-                decode(fp);
-                c = getc(fp); ungetc(c, fp);
-                if (feof(fp))
-                    break;
-            }
-            fclose(fp);
-        }
-        else
-        {
-	    for(;;)
-	    {
-		decode(stdin);
-		c = getc(stdin); ungetc(c, stdin);
-		if (feof(stdin))
-		    break;
-	    }
+	if (argc > 0)
+	{
+	    fp = fopen(argv[0], "r");
+	    if (!fp)
+		error(1, "file '%s' doesn't exist\n", argv[0]);
+	}
+	else
+	    fp = stdin;
+
+	r = recscan_open(fp);
+	if (!r)
+	    error(1, "Can't allocate input buffer\n");
+	for (;;)
+	{
+	    decode(r);
+	    if (recscan_eof(r))
+		break;
 	}
+	recscan_close(r);
+	if (fp != stdin)
+	    fclose(fp);
 	printf("\n");
 
 	exit(0);
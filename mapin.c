@@ -0,0 +1,87 @@
+/*
+ * Memory mapped input for the foo2* drivers.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "mapin.h"
+
+struct _MAPIN
+{
+    unsigned char	*base;
+    size_t		size;
+};
+
+MAPIN *
+mapin_open(FILE *fp)
+{
+    MAPIN	*m;
+    struct stat	st;
+    void	*base;
+    int		fd = fileno(fp);
+
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+	|| st.st_size <= 0 || (off_t) (size_t) st.st_size != st.st_size)
+	return NULL;
+
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+	return NULL;
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    m = malloc(sizeof(*m));
+    if (!m)
+    {
+	munmap(base, st.st_size);
+	return NULL;
+    }
+    m->base = base;
+    m->size = st.st_size;
+    return m;
+}
+
+unsigned char *
+mapin_take(MAPIN *m, FILE *fp, size_t len)
+{
+    long	pos;
+
+    if (!m)
+	return NULL;
+    pos = ftell(fp);
+    if (pos < 0 || (size_t) pos > m->size || len > m->size - pos)
+	return NULL;
+    if (fseek(fp, pos + len, SEEK_SET) < 0)
+	return NULL;
+    return m->base + pos;
+}
+
+unsigned char *
+mapin_rest(MAPIN *m, FILE *fp, size_t *len)
+{
+    long	pos;
+
+    if (!m)
+	return NULL;
+    pos = ftell(fp);
+    if (pos < 0 || (size_t) pos >= m->size)
+	return NULL;
+    *len = m->size - pos;
+    return mapin_take(m, fp, *len);
+}
+
+void
+mapin_close(MAPIN *m)
+{
+    if (!m)
+	return;
+    munmap(m->base, m->size);
+    free(m);
+}
@@ -0,0 +1,41 @@
+/*
+ * Memory mapped input for the foo2* drivers.
+ *
+ * When the raster comes from a regular file (a stored spool, say) rather
+ * than a pipe, the whole file is mapped, and the drivers take their page
+ * images straight from the mapping instead of fread()ing them row by row
+ * into a page buffer.  The headers between the images are still parsed
+ * through stdio: mapin_take() keeps the FILE position in step.
+ *
+ * The mapping is private and writable, so a driver may modify the page
+ * in place (e.g. JBIG zero padding) without touching the file.
+ */
+
+#ifndef MAPIN_H
+#define MAPIN_H
+
+#include <stdio.h>
+
+typedef struct _MAPIN MAPIN;
+
+/*
+ * Map the file behind fp.  Returns NULL if fp is not a regular file, or
+ * cannot be mapped; the caller then simply reads fp as before.
+ */
+MAPIN		*mapin_open(FILE *fp);
+
+/*
+ * Return the next len bytes of fp, in place, and advance fp past them.
+ * Returns NULL, leaving fp untouched, if fewer than len bytes are left.
+ */
+unsigned char	*mapin_take(MAPIN *m, FILE *fp, size_t len);
+
+/*
+ * Return all of fp from its position on, in place, and its length in
+ * *len, and advance fp to the end.  Returns NULL if there is nothing left.
+ */
+unsigned char	*mapin_rest(MAPIN *m, FILE *fp, size_t *len);
+
+void		mapin_close(MAPIN *m);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Turning rows of pixels around, shared by the foo2* drivers.
+ *
+ * A row is done from both ends at once, a block from the front and one
+ * from the back, so that it can be turned around in place.  Each block
+ * has its bytes reversed and then the pixels within the bytes, by
+ * swapping nibbles, bit pairs and bits with shifts and masks: with AVX2
+ * or SSE2 when the compiler targets them, 32 or 16 bytes at a time, and
+ * in 64 bit words otherwise.  So bits 01234567 of a byte become 76543210
+ * with 1 bit pixels, 67452301 with 2 bits, and 45670123 with 4.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include "mirror.h"
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define	BLOCK	32
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+    #define	BLOCK	16
+#else
+    #define	BLOCK	8
+#endif
+
+static inline unsigned char
+mirror_byte(unsigned char b, int bpp)
+{
+    b = (b >> 4) | (b << 4);
+    if (bpp < 4)
+	b = ((b >> 2) & 0x33) | ((b & 0x33) << 2);
+    if (bpp < 2)
+	b = ((b >> 1) & 0x55) | ((b & 0x55) << 1);
+    return b;
+}
+
+#if defined(__AVX2__)
+typedef __m256i	BLOCK_T;
+
+static inline BLOCK_T
+load(const unsigned char *p)
+{
+    return _mm256_loadu_si256((const __m256i *) p);
+}
+
+static inline void
+store(unsigned char *p, BLOCK_T v)
+{
+    _mm256_storeu_si256((__m256i *) p, v);
+}
+
+static inline BLOCK_T
+swap_bits(BLOCK_T v, int n, int mask)
+{
+    BLOCK_T	m = _mm256_set1_epi8(mask);
+
+    return _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v, n), m),
+			    _mm256_slli_epi16(_mm256_and_si256(v, m), n));
+}
+
+static inline BLOCK_T
+mirror_block(BLOCK_T v, int bpp)
+{
+    const __m256i	rev = _mm256_setr_epi8(
+				15, 14, 13, 12, 11, 10, 9, 8,
+				7, 6, 5, 4, 3, 2, 1, 0,
+				15, 14, 13, 12, 11, 10, 9, 8,
+				7, 6, 5, 4, 3, 2, 1, 0);
+
+    v = _mm256_shuffle_epi8(v, rev);
+    v = _mm256_permute2x128_si256(v, v, 1);
+    v = swap_bits(v, 4, 0x0f);
+    if (bpp < 4)
+	v = swap_bits(v, 2, 0x33);
+    if (bpp < 2)
+	v = swap_bits(v, 1, 0x55);
+    return v;
+}
+#elif defined(__SSE2__)
+typedef __m128i	BLOCK_T;
+
+static inline BLOCK_T
+load(const unsigned char *p)
+{
+    return _mm_loadu_si128((const __m128i *) p);
+}
+
+static inline void
+store(unsigned char *p, BLOCK_T v)
+{
+    _mm_storeu_si128((__m128i *) p, v);
+}
+
+static inline BLOCK_T
+swap_bits(BLOCK_T v, int n, int mask)
+{
+    BLOCK_T	m = _mm_set1_epi8(mask);
+
+    return _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, n), m),
+			    _mm_slli_epi16(_mm_and_si128(v, m), n));
+}
+
+static inline BLOCK_T
+mirror_block(BLOCK_T v, int bpp)
+{
+    // Reverse the dwords, the words in them, and the bytes in those
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = swap_bits(v, 4, 0x0f);
+    if (bpp < 4)
+	v = swap_bits(v, 2, 0x33);
+    if (bpp < 2)
+	v = swap_bits(v, 1, 0x55);
+    return v;
+}
+#else
+typedef uint64_t BLOCK_T;
+
+static inline BLOCK_T
+load(const unsigned char *p)
+{
+    uint64_t	v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void
+store(unsigned char *p, BLOCK_T v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline BLOCK_T
+mirror_block(BLOCK_T v, int bpp)
+{
+    v = __builtin_bswap64(v);
+    v = ((v >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((v & 0x0f0f0f0f0f0f0f0fULL) << 4);
+    if (bpp < 4)
+	v = ((v >> 2) & 0x3333333333333333ULL)
+		| ((v & 0x3333333333333333ULL) << 2);
+    if (bpp < 2)
+	v = ((v >> 1) & 0x5555555555555555ULL)
+		| ((v & 0x5555555555555555ULL) << 1);
+    return v;
+}
+#endif
+
+void
+mirror_row(unsigned char *dst, const unsigned char *src, size_t n, int bpp)
+{
+    size_t		i = 0, j = n;	/* front and back not done yet */
+    BLOCK_T		a, b;
+    unsigned char	c, d;
+
+    for (; j - i >= 2 * BLOCK; i += BLOCK, j -= BLOCK)
+    {
+	a = load(src + i);
+	b = load(src + j - BLOCK);
+	store(dst + i, mirror_block(b, bpp));
+	store(dst + j - BLOCK, mirror_block(a, bpp));
+    }
+    for (; j - i >= 2; ++i, --j)
+    {
+	c = src[i];
+	d = src[j - 1];
+	dst[i] = mirror_byte(d, bpp);
+	dst[j - 1] = mirror_byte(c, bpp);
+    }
+    if (i < j)
+	dst[i] = mirror_byte(src[i], bpp);
+}
@@ -0,0 +1,24 @@
+/*
+ * Turning rows of pixels around, shared by the foo2* drivers.
+ *
+ * The back side of a long edge duplex sheet is printed upside down, so
+ * the drivers turn those pages through 180 degrees: the last row becomes
+ * the first, and each row is reversed.  They do it row by row as the
+ * page is read in, while each row is still in the cache, rather than in
+ * another pass over the whole page afterwards.
+ */
+
+#ifndef MIRROR_H
+#define MIRROR_H
+
+#include <stddef.h>
+
+/*
+ * Copy the n bytes at src to dst in reverse order, reversing the pixels
+ * of bpp bits (1, 2 or 4) within each byte as well.  dst may be src
+ * itself, but the two must not overlap otherwise.
+ */
+void	mirror_row(unsigned char *dst, const unsigned char *src, size_t n,
+			int bpp);
+
+#endif
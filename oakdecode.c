@@ -40,6 +40,7 @@ b*/
 
 #include "jbig.h"
 #include "oak.h"
+#include "recscan.h"
 
 /*
  * Global option flags
@@ -279,9 +280,11 @@ typedef struct
 } HDR_3X;
 
 void
-decode(FILE *fp)
+decode(RECSCAN *r)
 {
     OAK_HDR	hdr;
+    RECSCAN_REC	rec;
+    const unsigned char	*rp, *rend;
     int		rc;
     int		size;
     int		plane = 0;
@@ -289,7 +292,6 @@ decode(FILE *fp)
     int		pageNum = 0;
     int		len;
     int		i, j;
-    int		c;
     char	*p;
     int		curOff = 0;
     int		dwords[128];
@@ -302,7 +304,7 @@ decode(FILE *fp)
     HDR_3X	hdr3x[4];
     int		firstPlane;
     size_t	cnt;
-    char	*ibuf;
+    const unsigned char	*ibuf;
     struct jbg_dec_state	s[4][2];
     int		height[4][2];
     int		width[4][2];
@@ -340,14 +342,17 @@ decode(FILE *fp)
     {
 	static int	first3c = 1;
 
-	rc = fread(&hdr, 1, len = sizeof(hdr), fp);
-	if (rc <=0)
+	if (recscan_oak(r, &rec) == 0)
 	    break;
-	if (rc != len)
+	rc = rec.headlen;
+	if (rc != (len = sizeof(hdr)))
 	{
 	    debug(0, "Expected OAK header, got short read: %d bytes\n", rc);
 	    break;
 	}
+	memcpy(&hdr, rec.head, len);
+	rp = rec.data;
+	rend = rec.data + rec.len;
 
 	if (hdr.type == 0x3c && first3c)
 	{
@@ -373,13 +378,13 @@ decode(FILE *fp)
 	switch (hdr.type)
 	{
 	case 0x0d:	// first record
-	    rc = fread(&hdr0d, len = sizeof(hdr0d), 1, fp);
+	    rc = recscan_get(&rp, rend, &hdr0d, len = sizeof(hdr0d));
 	    if (rc != 1) goto out;
 	    curOff += len;
 	    printf(" %x %s", hdr0d.unk, hdr0d.string);
 	    break;
 	case 0x0c:	// time
-	    rc = fread(&hdr0c, len = sizeof(hdr0c), 1, fp);
+	    rc = recscan_get(&rp, rend, &hdr0c, len = sizeof(hdr0c));
 	    if (rc != 1) goto out;
 	    curOff += len;
 	    p = strchr(hdr0c.datetime, '\n');
@@ -397,20 +402,11 @@ decode(FILE *fp)
 	    else
 		printf(" driver=");
 	    curOff += size;
-	    while (size--)
-	    {
-		c = fgetc(fp);
-		if (c == EOF)
-		    break;
-		else if (c) putchar(c);
-		else break;
-	    }
-	    if (size > 0)
-		while (size--)
-		    fgetc(fp);
+	    while (rp < rend && *rp)
+		putchar(*rp++);
 	    break;
 	case 0x0f:
-	    rc = fread(dwords, len = 5*4, 1, fp);
+	    rc = recscan_get(&rp, rend, dwords, len = 5*4);
 	    if (rc != 1) goto out;
 	    curOff += len;
 	    printf("	Duplex=0x%x	Short=0x%x", dwords[0], dwords[1]);
@@ -420,11 +416,9 @@ decode(FILE *fp)
 	    printf(" (no args)");
 	    ++pageNum;
 	    curOff += size;
-	    while (size--)
-		fgetc(fp);
 	    break;
 	case 0x28:
-	    rc = fread(dwords, len = 1*4, 1, fp);
+	    rc = recscan_get(&rp, rend, dwords, len = 1*4);
 	    if (rc != 1) goto out;
 	    curOff += len;
 	    switch (dwords[0])
@@ -437,7 +431,7 @@ decode(FILE *fp)
 	    }
 	    break;
 	case 0x29:
-	    rc = fread(bytes, len = 17*4, 1, fp);
+	    rc = recscan_get(&rp, rend, bytes, len = 17*4);
 	    if (rc != 1) goto out;
 	    curOff += len;
 	    printf(" PaperType=%d UNK8=%d,%d,%d, str='%s'",
@@ -449,13 +443,13 @@ decode(FILE *fp)
 	    // 13=Light, 14=Tough
 	    break;
 	case 0x2a:
-	    rc = fread(dwords, len = 5*4, 1, fp);
+	    rc = recscan_get(&rp, rend, dwords, len = 5*4);
 	    if (rc != 1) goto out;
 	    curOff += len;
 	    printf("	Copies=0x%x	Duplex=0x%x", dwords[0], dwords[1]);
 	    break;
 	case 0x2b:
-	    rc = fread(dwords, len = 5*4, 1, fp);
+	    rc = recscan_get(&rp, rend, dwords, len = 5*4);
 	    if (rc != 1) goto out;
 	    curOff += len;
 	    printf("	papercode=%s(%d)",
@@ -473,7 +467,7 @@ decode(FILE *fp)
 	    printf("\n\tunk0	unk1	w	h	resx	resy	nBits");
 	    for (i = firstPlane; i < 4; ++i)
 	    {
-		rc = fread(&hdr3x[i], len = sizeof(HDR_3X), 1, fp);
+		rc = recscan_get(&rp, rend, &hdr3x[i], len = sizeof(HDR_3X));
 		if (rc != 1) goto out;
 		curOff += len;
 		size -= len;
@@ -487,18 +481,14 @@ decode(FILE *fp)
 			hdr3x[i].nbits);
 	    }
 	    curOff += size;
-	    while (size-- > 0)
-		fgetc(fp);
 	    break;
 	case 0x15:
 	    printf(" (no args)");
 	    curOff += size;
-	    while (size--)
-		fgetc(fp);
 	    break;
 	case 0x3c:
-	    // rc = fread(dwords, len = 48, 1, fp);
-	    rc = fread(&hdr3c, len = sizeof(hdr3c), 1, fp);
+	    // rc = recscan_get(&rp, rend, dwords, len = 48);
+	    rc = recscan_get(&rp, rend, &hdr3c, len = sizeof(hdr3c));
 	    if (rc != 1)
 	    {
 		debug(0, "Short read of hdr3c\n");
@@ -581,14 +571,13 @@ decode(FILE *fp)
 
 	    ImageRec[plane]++;
 
-	    // image data
+	    // image data, which follows the record
 	    if (!hdr3c.padlen)
 		break;
 	    size = hdr3c.datalen;
-	    ibuf = malloc(size);
-	    rc = fread(ibuf, 1, size, fp);
-	    if (rc <= 0)
-		break;
+	    ibuf = recscan_take(r, size);
+	    if (!ibuf)
+		goto out;
 	    curOff += size;
 	    if (FpRaw[plane][subplane])
 		rc = fwrite(ibuf, 1, size, FpRaw[plane][subplane]);
@@ -597,13 +586,11 @@ decode(FILE *fp)
 		unsigned char *image;
 
 		rc = JBG_EAGAIN;
-		p = ibuf;
 		while (size > 0 &&
 			(rc == JBG_EAGAIN || rc == JBG_EOK))
 		{
-		    rc = jbg_dec_in(&s[plane][subplane],
-			(unsigned char *) p, size, &cnt);
-		    p += cnt;
+		    rc = jbg_dec_in(&s[plane][subplane], ibuf, size, &cnt);
+		    ibuf += cnt;
 		    size -= cnt;
 		}
 		if (rc)
@@ -624,12 +611,10 @@ decode(FILE *fp)
 			    jbg_dec_getheight(&s[plane][subplane]));
 		jbg_dec_free(&s[plane][subplane]);
 	    }
-	    free(ibuf);
 
 	    size = hdr3c.padlen - hdr3c.datalen;
 	    curOff += size;
-	    while (size--)
-		c = fgetc(fp);
+	    recscan_take(r, size);
 	    continue;
 	case 0x17:
 	    printf(" (no args)");
@@ -653,11 +638,9 @@ decode(FILE *fp)
 		    }
 		}
 	    }
-	    while (size--)
-		fgetc(fp);
 	    break;
 	case 0x18:
-	    rc = fread(words, len = (1+1)*2, 1, fp);
+	    rc = recscan_get(&rp, rend, words, len = (1+1)*2);
 	    if (rc != 1) goto out;
 	    curOff += len;
 	    printf(" UNK=%x", words[0]);
@@ -665,13 +648,9 @@ decode(FILE *fp)
 	case 0x0b:
 	    printf(" (no args)");
 	    curOff += size;
-	    while (size--)
-		fgetc(fp);
 	    break;
 	default:
 	    curOff += size;
-	    while (size--)
-		fgetc(fp);
 	}
 
 	printf("\n");
@@ -686,6 +665,8 @@ main(int argc, char *argv[])
 	extern int	optind;
 	extern char	*optarg;
 	int		c;
+	FILE		*fp;
+	RECSCAN		*r;
 
 	while ( (c = getopt(argc, argv, "d:ior:D:?h")) != EOF)
 		switch (c)
@@ -703,16 +684,20 @@ main(int argc, char *argv[])
 
 	if (argc > 0)
 	{
-	    FILE        *fp;
-
-            fp = fopen(argv[0], "r");
-            if (!fp)
-                error(1, "file '%s' doesn't exist\n", argv[0]);
-	    decode(fp);
-            fclose(fp);
+	    fp = fopen(argv[0], "r");
+	    if (!fp)
+		error(1, "file '%s' doesn't exist\n", argv[0]);
 	}
 	else
-	    decode(stdin);
+	    fp = stdin;
+
+	r = recscan_open(fp);
+	if (!r)
+	    error(1, "Can't allocate input buffer\n");
+	decode(r);
+	recscan_close(r);
+	if (fp != stdin)
+	    fclose(fp);
 
 	exit(0);
 }
@@ -30,6 +30,7 @@ b*/
 #include <errno.h>
 
 #include "jbig.h"
+#include "recscan.h"
 
 /*
  * Global option flags
@@ -176,48 +177,15 @@ proff(int curOff)
 	printf("%6x:	", curOff);
 }
 
-char *
-fgetcomma(char *s, int size, int *datalen, FILE *stream)
-{
-    int	c;
-    char *os = s;
-
-    *datalen = 0;
-    while ((c = fgetc(stream)) != EOF)
-    {
-	*s++ = c;
-	if (c == ';')
-	    break;
-	if (c == '#')
-	{
-	    while ((c = fgetc(stream)) != EOF)
-	    {
-		*s++ = c;
-		if (c == '=')
-		    break;
-		else
-		{
-		    *datalen *= 10;
-		    *datalen += c - '0';
-		}
-	    }
-	    break;
-	}
-    }
-    if (c == EOF)
-	return (NULL);
-    *s++ = 0;
-    return (os);
-}
-
 int
-jbig_decode1(unsigned char ch, int pn, int page, struct jbg_dec_state *pstate,
-    FILE *dfp)
+jbig_decode(const unsigned char *data, int len, int pn, int page,
+    struct jbg_dec_state *pstate, FILE *dfp)
 {
     size_t	cnt;
     int		rc;
 
-    rc = jbg_dec_in(pstate, &ch, 1, &cnt);
+    // Anything after the end of the BIE is ignored
+    rc = jbg_dec_in(pstate, data, len, &cnt);
     if (rc == JBG_EOK)
     {
 	int     h, w, len;
@@ -249,9 +217,10 @@ jbig_decode1(unsigned char ch, int pn, int page, struct jbg_dec_state *pstate,
 }
 
 void
-decode(FILE *fp)
+decode(RECSCAN *r)
 {
-    int		c;
+    RECSCAN_REC	rec;
+    const unsigned char	*p, *end;
     int		rc;
     FILE	*dfp = NULL;
     int		pageNum = 1;
@@ -266,8 +235,15 @@ decode(FILE *fp)
     int			nbh = 0;
     int			firstbh = 1;
 
-    while (fgetcomma(buf, sizeof(buf), &datalen, fp))
+    while (recscan_opl(r, &rec) == 1)
     {
+	datalen = (rec.headlen < sizeof(buf)) ? rec.headlen : sizeof(buf) - 1;
+	memcpy(buf, rec.head, datalen);
+	buf[datalen] = 0;
+	datalen = rec.len;
+	p = rec.data;
+	end = rec.data + rec.len;
+
 	proff(curOff); curOff += strlen(buf);
 	if (strlen(buf) >= 65)
 	{
@@ -322,7 +298,7 @@ decode(FILE *fp)
 	    {
 		firstbh = 0;
 		debug(1, "firstbh\n");
-		rc = fread(bih, bihlen = sizeof(bih), 1, fp);
+		rc = recscan_get(&p, end, bih, bihlen = sizeof(bih));
 		print_bih(bih);
 		printf("\n");
 		datalen -= sizeof(bih);
@@ -340,10 +316,9 @@ decode(FILE *fp)
 	    totSize += datalen;
 	    if (datalen == 20) {
 		++pn;
-		rc = fread(bih, bihlen = sizeof(bih), 1, fp);
+		rc = recscan_get(&p, end, bih, bihlen = sizeof(bih));
 		print_bih(bih);
 		printf("\n");
-		getc(fp);
 		if (DecFile)
 		{
 		    size_t      cnt;
@@ -357,16 +332,12 @@ decode(FILE *fp)
 	    else {
 		if (datalen)
 		{
-		    unsigned char ch;
-
-		    while (datalen--)
-		    {
-			c = getc(fp);
-			ch = c;
-			if (DecFile)
-			    jbig_decode1(ch, pn, pageNum, &s[pn], dfp);
-		    }
-		    getc(fp);
+		    const unsigned char	*data = p;
+		    int			len;
+
+		    len = recscan_skip(&p, end, datalen);
+		    if (DecFile && len)
+			jbig_decode(data, len, pn, pageNum, &s[pn], dfp);
 		}
 	    }
 	}
@@ -379,6 +350,8 @@ main(int argc, char *argv[])
 	extern int	optind;
 	extern char	*optarg;
 	int		c;
+	FILE		*fp;
+	RECSCAN		*r;
 
 	while ( (c = getopt(argc, argv, "d:hoD:?h")) != EOF)
 		switch (c)
@@ -393,32 +366,27 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-        if (argc > 0)
-        {
-            FILE        *fp;
-
-            fp = fopen(argv[0], "r");
-            if (!fp)
-                error(1, "file '%s' doesn't exist\n", argv[0]);
-            for (;;)
-            {
-                decode(fp);
-                c = getc(fp); ungetc(c, fp);
-                if (feof(fp))
-                    break;
-            }
-            fclose(fp);
-        }
-        else
-        {
-	    for(;;)
-	    {
-		decode(stdin);
-		c = getc(stdin); ungetc(c, stdin);
-		if (feof(stdin))
-		    break;
-	    }
+	if (argc > 0)
+	{
+	    fp = fopen(argv[0], "r");
+	    if (!fp)
+		error(1, "file '%s' doesn't exist\n", argv[0]);
+	}
+	else
+	    fp = stdin;
+
+	r = recscan_open(fp);
+	if (!r)
+	    error(1, "Can't allocate input buffer\n");
+	for (;;)
+	{
+	    decode(r);
+	    if (recscan_eof(r))
+		break;
 	}
+	recscan_close(r);
+	if (fp != stdin)
+	    fclose(fp);
 	printf("\n");
 
 	exit(0);
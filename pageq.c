@@ -0,0 +1,230 @@
+/*
+ * A bounded queue of page buffers, filled by a reader thread, shared by
+ * the foo2* drivers for the -j option.
+ *
+ * All nbuf page buffers are allocated up front, so the amount of raster
+ * held in memory is fixed no matter how far the reader gets ahead.  The
+ * reader blocks when every buffer is full, and the caller blocks when
+ * none is.
+ *
+ * The reader's stats are held with the buffer it reads into, and go to
+ * the page being timed when pageq_get() hands the buffer over.  Otherwise
+ * the time spent reading page N+1 would be charged to page N.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "pageq.h"
+#include "stats.h"
+
+struct _PAGEQ
+{
+    PAGEFN		fn;
+    void		*arg;
+    int			nbuf;
+    unsigned char	**bufs;
+    STATS_HELD		*held;		/* the reader's stats, per buffer */
+    int			threaded;
+    pthread_t		thread;
+    pthread_mutex_t	lock;
+    pthread_cond_t	space;		/* a buffer was given back, or quit */
+    pthread_cond_t	ready;		/* a page was read, or EOF */
+    unsigned char	**freebuf;	/* stack of empty buffers */
+    int			nfree;
+    unsigned char	**full;		/* ring of pages in input order */
+    int			head;
+    int			nfull;
+    int			eof;
+    int			rc;		/* what fn returned at the end */
+    int			quit;
+};
+
+static int
+index_of(PAGEQ *q, unsigned char *buf)
+{
+    int		i;
+
+    for (i = 0; q->bufs[i] != buf; ++i)
+	;
+    return i;
+}
+
+static void *
+reader(void *arg)
+{
+    PAGEQ		*q = arg;
+    unsigned char	*buf;
+    int			rc;
+
+    for (;;)
+    {
+	pthread_mutex_lock(&q->lock);
+	while (!q->quit && q->nfree == 0)
+	    pthread_cond_wait(&q->space, &q->lock);
+	if (q->quit)
+	{
+	    pthread_mutex_unlock(&q->lock);
+	    break;
+	}
+	buf = q->freebuf[--q->nfree];
+	pthread_mutex_unlock(&q->lock);
+
+	stats_hold(&q->held[index_of(q, buf)]);
+	rc = q->fn(q->arg, buf);
+	stats_hold(NULL);
+
+	pthread_mutex_lock(&q->lock);
+	if (rc)
+	{
+	    q->freebuf[q->nfree++] = buf;
+	    q->eof = 1;
+	    q->rc = rc;
+	}
+	else
+	    q->full[(q->head + q->nfull++) % q->nbuf] = buf;
+	pthread_cond_signal(&q->ready);
+	pthread_mutex_unlock(&q->lock);
+	if (rc)
+	    break;
+    }
+    return NULL;
+}
+
+/*
+ * Create a queue of nbuf page buffers of size bytes each.  Returns NULL
+ * if the buffers cannot be allocated.  If the reader thread cannot be
+ * started, the queue quietly falls back to reading on the caller's thread.
+ */
+PAGEQ *
+pageq_create(int nbuf, size_t size, PAGEFN fn, void *arg)
+{
+    PAGEQ	*q;
+    int		i;
+
+    if (nbuf < 1)
+	nbuf = 1;
+
+    q = calloc(1, sizeof(*q));
+    if (!q)
+	return NULL;
+    q->fn = fn;
+    q->arg = arg;
+    q->bufs = calloc(nbuf, sizeof(*q->bufs));
+    q->held = calloc(nbuf, sizeof(*q->held));
+    q->freebuf = calloc(nbuf, sizeof(*q->freebuf));
+    q->full = calloc(nbuf, sizeof(*q->full));
+    if (!q->bufs || !q->held || !q->freebuf || !q->full)
+    {
+	pageq_destroy(q);
+	return NULL;
+    }
+    for (i = 0; i < nbuf; ++i)
+    {
+	q->bufs[i] = malloc(size ? size : 1);
+	if (!q->bufs[i])
+	{
+	    pageq_destroy(q);
+	    return NULL;
+	}
+	q->nbuf++;
+	q->freebuf[q->nfree++] = q->bufs[i];
+    }
+
+    if (nbuf > 1)
+    {
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->space, NULL);
+	pthread_cond_init(&q->ready, NULL);
+	if (pthread_create(&q->thread, NULL, reader, q) == 0)
+	    q->threaded = 1;
+	else
+	{
+	    pthread_cond_destroy(&q->ready);
+	    pthread_cond_destroy(&q->space);
+	    pthread_mutex_destroy(&q->lock);
+	}
+    }
+    return q;
+}
+
+unsigned char *
+pageq_get(PAGEQ *q, int *rc)
+{
+    unsigned char	*buf = NULL;
+    int			i;
+
+    if (!q->threaded)
+    {
+	*rc = q->fn(q->arg, q->bufs[0]);
+	return *rc ? NULL : q->bufs[0];
+    }
+
+    pthread_mutex_lock(&q->lock);
+    while (q->nfull == 0 && !q->eof)
+	pthread_cond_wait(&q->ready, &q->lock);
+    if (q->nfull)
+    {
+	buf = q->full[q->head];
+	q->head = (q->head + 1) % q->nbuf;
+	q->nfull--;
+	stats_release(&q->held[index_of(q, buf)]);
+	*rc = 0;
+    }
+    else
+    {
+	// Whatever went into the read that failed
+	for (i = 0; i < q->nbuf; ++i)
+	    stats_release(&q->held[i]);
+	*rc = q->rc;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return buf;
+}
+
+void
+pageq_put(PAGEQ *q, unsigned char *buf)
+{
+    if (!q->threaded)
+	return;
+
+    pthread_mutex_lock(&q->lock);
+    q->freebuf[q->nfree++] = buf;
+    pthread_cond_signal(&q->space);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void
+pageq_destroy(PAGEQ *q)
+{
+    int		i;
+
+    if (!q)
+	return;
+
+    if (q->threaded)
+    {
+	pthread_mutex_lock(&q->lock);
+	q->quit = 1;
+	pthread_cond_signal(&q->space);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->thread, NULL);
+
+	pthread_cond_destroy(&q->ready);
+	pthread_cond_destroy(&q->space);
+	pthread_mutex_destroy(&q->lock);
+    }
+
+    for (i = 0; i < q->nbuf; ++i)
+	free(q->bufs[i]);
+    free(q->bufs);
+    free(q->held);
+    free(q->freebuf);
+    free(q->full);
+    free(q);
+}
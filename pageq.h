@@ -0,0 +1,38 @@
+/*
+ * A bounded queue of page buffers, filled by a reader thread, shared by
+ * the foo2* drivers for the -j option.
+ *
+ * fn(arg, buf) reads a page into buf and returns 0, or returns EOF at the
+ * end of the input, or any other value if the page could not be read.
+ * It may run on the reader thread, so it must not exit on bad input:
+ * whatever it returned reaches the caller, whose thread reports it.
+ *
+ * pageq_get() returns the next page read, in order, or NULL once fn has
+ * returned anything but 0, with what it returned in *rc.  The caller
+ * gives each buffer back with pageq_put() when it is done with the page.
+ * While the caller compresses one page, the reader thread is already
+ * reading the next one from the input.
+ *
+ * This overlaps whole pages, not bands: a color page can't start to go
+ * out before all of it is in, because whether it is sent as one plane or
+ * four depends on whether any of its dots are color.  foo2zjs and foo2hp
+ * send monochrome pages a stripe at a time instead; see pbm_page_stripes().
+ *
+ * With nbuf <= 1 there is no thread: pageq_get() simply calls fn on a
+ * single buffer.
+ */
+
+#ifndef PAGEQ_H
+#define PAGEQ_H
+
+#include <stddef.h>
+
+typedef struct _PAGEQ PAGEQ;
+typedef int (*PAGEFN)(void *arg, unsigned char *buf);
+
+PAGEQ		*pageq_create(int nbuf, size_t size, PAGEFN fn, void *arg);
+unsigned char	*pageq_get(PAGEQ *q, int *rc);
+void		pageq_put(PAGEQ *q, unsigned char *buf);
+void		pageq_destroy(PAGEQ *q);
+
+#endif
@@ -30,6 +30,9 @@ b*/
 #include <errno.h>
 
 #include "jbig.h"
+#include "recscan.h"
+#include "workpool.h"
+#include "biedec.h"
 
 /*
  * Global option flags
@@ -39,6 +42,9 @@ char	*RawFile;
 char	*DecFile;
 int	PrintOffset = 0;
 int	PrintHexOffset = 0;
+int	Threads = 0;
+WORKPOOL	*Pool;
+BIEDEC	*BieDec;
 
 void
 debug(int level, char *fmt, ...)
@@ -65,7 +71,12 @@ error(int fatal, char *fmt, ...)
 	vfprintf(stderr, fmt, ap);
 	va_end(ap);
 	if (fatal > 0)
+	{
+	    // Write out the planes found so far, as they are queued
+	    if (BieDec)
+		biedec_sync(BieDec, 1);
 	    exit(fatal);
+	}
 	else
 	{
 	    errno = 0;
@@ -92,6 +103,7 @@ usage(void)
 //"       -r basename Basename of .jbg file for saving raw planes\n"
 "       -o          Print file offsets\n"
 "       -h          Print hex file offsets\n"
+"       -j threads  Decode planes using this many threads [all CPUs]\n"
 "       -D lvl      Set Debug level [%d]\n"
     , Debug
     );
@@ -100,28 +112,28 @@ usage(void)
 }
 
 static int
-getBEdword(char buf[4])
+getBEdword(const char buf[4])
 {
-    unsigned char *b = (unsigned char *) buf;
+    const unsigned char *b = (const unsigned char *) buf;
     return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | (b[3] << 0);
 }
 
 static int
-getLEdword(char buf[4])
+getLEdword(const char buf[4])
 {
-    unsigned char *b = (unsigned char *) buf;
+    const unsigned char *b = (const unsigned char *) buf;
     return (b[3] << 24) | (b[2] << 16) | (b[1] << 8) | (b[0] << 0);
 }
 
 static int
-getBEword(char buf[2])
+getBEword(const char buf[2])
 {
-    unsigned char *b = (unsigned char *) buf;
+    const unsigned char *b = (const unsigned char *) buf;
     return (b[0] << 8) | (b[1] << 0);
 }
 
 void
-print_bih(unsigned char bih[20])
+print_bih(const unsigned char bih[20])
 {
     unsigned int xd, yd, l0;
 
@@ -158,6 +170,25 @@ print_bih(unsigned char bih[20])
 	bih[1] - bih[0], bih[2]);
 }
 
+/*
+ * Queue a BIE to be decoded into the file for a plane of a page
+ */
+BIEDEC_BIE *
+start_bie(int pageNum, int pn, const unsigned char *bih)
+{
+    BIEDEC_BIE	*b;
+    char	buf[512];
+    int		rc;
+
+    sprintf(buf, "%s-%02d-%d.pbm", DecFile, pageNum, pn);
+    b = biedec_start(BieDec, buf, BIEDEC_PBM, 0, bih, 20, &rc);
+    if (!b)
+	error(1, "Can't allocate BIE\n");
+    if (rc == JBG_EIMPL)
+	error(1, "JBIG uses unimpl feature\n");
+    return b;
+}
+
 void
 proff(int curOff)
 {
@@ -168,43 +199,41 @@ proff(int curOff)
 }
 
 void
-decode(FILE *fp)
+decode(RECSCAN *r)
 {
+    RECSCAN_REC	rec;
     int		c;
-    int		rc;
-    FILE	*dfp = NULL;
     int		pageNum = 0;
     int		i;
     int		curOff = 0;
-    struct jbg_dec_state	s[5];
+    BIEDEC_BIE		*bie[5] = {0,0,0,0,0};
     unsigned char	bih[5][20];
-    int			imageCnt[5] = {0,0,0,0};
     int         	pn = 0;
     int			ver, end;
-    char		buf[5120*1024];
+    char		line[1024];
 
-    c = getc(fp);
+    c = recscan_getc(r);
     if (c == EOF)
     {
 	printf("EOF on file\n");
 	return;
     }
-    ungetc(c, fp);
+    recscan_ungetc(r, c);
     if (c == '\033')
     {
-	while (fgets(buf, sizeof(buf), fp))
+	while (recscan_gets(r, line, sizeof(line)))
 	{
 	    proff(curOff);
-	    if (buf[0] == '\033')
+	    if (line[0] == '\033')
 	    {
 		printf("\\033");
-		fputs(buf+1, stdout);
+		fputs(line+1, stdout);
 	    }
 	    else
-		fputs(buf, stdout);
-	    curOff += strlen(buf);
-	    if ((strcmp(buf, "@PJL ENTER LANGUAGE = QPDL\r\n") == 0)
-		|| (strcmp(buf, "@PJL ENTER LANGUAGE = QPDL\n") == 0))
+		fputs(line, stdout);
+	    curOff += strlen(line);
+	    if ((strcmp(line, "@PJL ENTER LANGUAGE = QPDL\r\n") == 0)
+		|| (strcmp(line, "@PJL ENTER LANGUAGE = QPDL\n") == 0))
 		break;
 	}
     }
@@ -215,6 +244,7 @@ decode(FILE *fp)
 	int	rectype, subtype;
 	int	wb, h, comp, stripe;
 	int	cksum;
+	const char	*buf;
 
 	#define STRARY(X, A) \
 	    ((X) >= 0 && (X) < sizeof(A)/sizeof(A[0])) \
@@ -232,9 +262,12 @@ decode(FILE *fp)
 	    /*00*/ "unk", "auto", "manual", "multi", "tray1",
 	    };
 
-	rectype = fgetc(fp);
-	if (rectype == EOF)
+	// The record header, type byte included, so buf[1] is the first
+	// byte after the type
+	if (recscan_qpdl(r, &rec) == 0)
 	    break;
+	buf = (const char *) rec.head;
+	rectype = rec.type;
 
 	proff(curOff);
 	curOff++;
@@ -244,13 +277,13 @@ decode(FILE *fp)
 	{
 	case 0x01:
 	    printf("	len=3\n");
-	    if (fread(buf+1, 2, 1, fp) != 1)
+	    if (rec.headlen != 3)
 		error(1, "Couldn't get 2 bytes\n");
 	    curOff += 2;
 	    printf("\t\tcopies=%d\n", getBEword(buf+1));
 	    break;
 	case 0x11:	// NOT JBIG!!
-	    if (fread(buf+1, 4, 1, fp) != 1)
+	    if (rec.headlen != 5)
 	    {
 		printf("\n");
                 error(1, "Couldn't get 4 bytes\n");
@@ -259,7 +292,7 @@ decode(FILE *fp)
 	    reclen = getBEdword(buf+1);
 	    ++reclen;
 	    printf("	len=%d(0x%x)\n", 5+reclen, 5+reclen);
-	    if (fread(buf, reclen, 1, fp) != 1)
+	    if (rec.len != reclen)
 		error(1, "Couldn't get 0x%x(%d) bytes\n", reclen, reclen);
 	    curOff += reclen;
 
@@ -270,7 +303,7 @@ decode(FILE *fp)
 	    break;
 	case 0x00:
 	    printf("	len=17	pageNum=%d\n", ++pageNum);
-	    if (fread(buf+1, 16, 1, fp) != 1)
+	    if (rec.headlen != 17)
 		error(1, "Couldn't get 16 bytes\n");
 	    curOff += 16;
 	    printf("\t\tyres=%d, copies=%d, papersize=%s(%d), w=%d, h=%d\n",
@@ -296,11 +329,12 @@ decode(FILE *fp)
 		);
 
 	    pn = 0;
-	    memset(imageCnt, 0, sizeof(imageCnt));
+	    memset(bie, 0, sizeof(bie));
+	    biedec_sync(BieDec, 0);
 	    break;
 	case 0x13:
 	    printf("    len=15\n");
-            if (fread(buf+1, 14, 1, fp) != 1)
+            if (rec.headlen != 15)
                 error(1, "Couldn't get 14 bytes\n");
             curOff += 14;
 	    printf("\t\t");
@@ -309,7 +343,7 @@ decode(FILE *fp)
 	    printf("\n");
 	    break;
 	case 0x14:
-            if (fread(buf+1, 7, 1, fp) != 1)
+            if (rec.headlen < 8)
                 error(1, "Couldn't get 7 bytes\n");
 	    curOff += 7;
 	    subtype = buf[1];
@@ -325,7 +359,7 @@ decode(FILE *fp)
 	    {
 		/* BIH */
 		printf("    len=25\n");
-		if (fread(buf+7+1, 24-7, 1, fp) != 1)
+		if (rec.headlen != 25)
 		    error(1, "Couldn't get 24 bytes\n");
 		curOff += 24-7;
 		if (0)
@@ -345,13 +379,13 @@ decode(FILE *fp)
 		    printf("(Margin=%d)", (unsigned char) buf[24]);
 		}
 		printf("\n");
-		print_bih( (unsigned char *) buf+1);
+		print_bih( (const unsigned char *) buf+1);
 		for (i = 0; i <=4; ++i)
 		    memcpy(bih[i], buf+1, 20);
 	    }
 	    break;
 	case 0x0c:
-	    if (fread(buf+1, 11, 1, fp) != 1)
+	    if (rec.headlen != 12)
 	    {
 		printf("\n");
 		error(1, "Couldn't get 11 bytes\n");
@@ -372,9 +406,10 @@ decode(FILE *fp)
 			"comp=0x%x,\n\t\tlen=%d(0x%x)\n",
 			stripe, wb, wb, h, h, pn, comp, reclen, reclen);
 
-	    if (fread(buf, reclen, 1, fp) != 1)
+	    if (rec.len != reclen)
 		error(1, "Couldn't get 0x%x(%d) bytes\n", reclen, reclen);
 	    curOff += reclen;
+	    buf = (const char *) rec.data;
 	
 	    cksum = 0;
 	    for (i = 0; i < reclen-4; ++i)
@@ -433,114 +468,42 @@ if (0) printf("stripe=%d\n", stripe);
 		// if ( (comp == 0x13 && stripe == 0) || comp == 0x15)
 		if (comp == 0x13 && stripe == 0)
 		{
-		    size_t      cnt;
-
 		    memcpy(bih[pn], buf+32, 20);
 		    print_bih(bih[pn]);
 
-		    jbg_dec_init(&s[pn]);
-		    rc = jbg_dec_in(&s[pn], bih[pn], 20, &cnt);
-		    if (rc == JBG_EIMPL)
-			error(1, "JBIG uses unimpl feature\n");
+		    if (DecFile)
+			bie[pn] = start_bie(pageNum, pn, bih[pn]);
 		    break;
 		}
 		else if (comp == 0x15)
 		{
-		    size_t      cnt;
-
-		    jbg_dec_init(&s[pn]);
-		    rc = jbg_dec_in(&s[pn], bih[pn], 20, &cnt);
-		    if (rc == JBG_EIMPL)
-			error(1, "JBIG uses unimpl feature\n");
+		    if (DecFile)
+		    {
+			bie[pn] = start_bie(pageNum, pn, bih[pn]);
+			biedec_stripe(bie[pn], stripe, wb);
+		    }
 		}
 		else if (comp == 0x13 && stripe >= 1)
 		{
 		    printf("\t\tData: ");
-		    for (i = 0; i < 16; ++i)
+		    for (i = 0; i < 16 && 32 + i < reclen; ++i)
 			printf("%02x ", (unsigned char) buf[32+i]);
 		    printf("...\n");
 		}
 
-		if (DecFile)
+		if (bie[pn])
 		{
+		    // The record ends with its checksum, which is not JBIG
+		    // data: feeding it to the decoder would corrupt a BIE
+		    // that goes on in the next record.
+		    reclen -= 4;
 		    if (comp == 0x15)
-		    {
-			reclen -= 4;
 			i = 0;
-		    }
 		    else
 			i = 32;
-if (0 && comp == 0x15) printf("c=%02x ", (unsigned char) buf[i]);
-		    for (; i < reclen; ++i)
-		    {
-			size_t              cnt;
-			unsigned char       ch = c;
-
-			ch = c = buf[i];
-
-			rc = JBG_EAGAIN;
-if (0 && comp == 0x15) printf("i=%d ", i);
-			rc = jbg_dec_in(&s[pn], &ch, 1, &cnt);
-if (0 && comp == 0x15) printf("rc=%d ", rc);
-if (0 && comp == 0x15 && i == (reclen-1))  printf("c=%02x ", ch);
-if (0 && comp == 0x15 && i == (reclen-2))  printf("c=%02x ", ch);
-			if (rc == JBG_EOK)
-			{
-			    int     h, w, len;
-			    unsigned char *image;
-
-if (0 && comp == 0x15) printf("OK\n");
-if (0) printf("OK\n");
-			    // debug(0, "JBG_EOK: %d\n", pn);
-			    h = jbg_dec_getheight(&s[pn]);
-			    w = jbg_dec_getwidth(&s[pn]);
-			    image = jbg_dec_getimage(&s[pn], 0);
-			    len = jbg_dec_getsize(&s[pn]);
-			    if (comp == 0x13 && image)
-			    {
-				char        buf[512];
-				sprintf(buf, "%s-%02d-%d.pbm",
-					DecFile, pageNum, pn);
-				dfp = fopen(buf,
-					    imageCnt[pn] ? "a" : "w");
-				if (dfp)
-				{
-				    if (imageCnt[pn] == 0)
-					fprintf(dfp, "P4\n%8d %8d\n", w, h);
-				    //imageCnt[pn] += incrY;
-				    rc = fwrite(image, 1, len, dfp);
-				    fclose(dfp);
-				    dfp = NULL;
-				}
-			    }
-			    else if (comp == 0x15 && image)
-			    {
-				char        buf[512];
-				if (dfp == 0)
-				{
-				    sprintf(buf, "%s-%02d-%d.pbm",
-					DecFile, pageNum, pn);
-				    dfp = fopen(buf,
-					    imageCnt[pn] ? "r+" : "w");
-				}
-				if (dfp)
-				{
-				    fseek(dfp, 0, SEEK_SET);
-				    // if (imageCnt[pn] == 0)
-				    fprintf(dfp, "P4\n%8d %8d\n", w, h*stripe);
-				    imageCnt[pn] += 1;
-				    fseek(dfp, stripe * h * wb, SEEK_CUR);
-				    rc = fwrite(image, 1, len, dfp);
-				    fclose(dfp);
-				    dfp = NULL;
-				}
-			    }
-			    else
-				debug(0, "Missing image %dx%d!\n", h, w);
-			    jbg_dec_free(&s[pn]);
-			    break;
-			}
-		    }
+		    if (i < reclen && biedec_data(bie[pn],
+			    (const unsigned char *) buf + i, reclen - i) < 0)
+			error(1, "Can't allocate BIE data\n");
 		}
 	    }
 	    break;
@@ -553,23 +516,24 @@ if (0) printf("OK\n");
     }
 
 done:
-    c = fgetc(fp);
+    biedec_sync(BieDec, 1);
+    c = recscan_getc(r);
     if (c != 033)
 	return;
-    ungetc(c, fp);
+    recscan_ungetc(r, c);
 
-    while (fgets(buf, sizeof(buf), fp))
+    while (recscan_gets(r, line, sizeof(line)))
     {
 	proff(curOff);
-	if (buf[0] == '\033')
+	if (line[0] == '\033')
         {
             printf("\\033");
-            fputs(buf+1, stdout);
+            fputs(line+1, stdout);
         }
         else
-            fputs(buf, stdout);
-	curOff += strlen(buf);
-	if (strcmp(buf, "@PJL ENTER LANGUAGE=HIPERC\n") == 0)
+            fputs(line, stdout);
+	curOff += strlen(line);
+	if (strcmp(line, "@PJL ENTER LANGUAGE=HIPERC\n") == 0)
 	    break;
     }
     printf("\n");
@@ -581,14 +545,20 @@ main(int argc, char *argv[])
 	extern int	optind;
 	extern char	*optarg;
 	int		c;
+	FILE		*fp;
+	RECSCAN		*r;
 
-	while ( (c = getopt(argc, argv, "d:hor:D:?h")) != EOF)
+	while ( (c = getopt(argc, argv, "d:hoj:r:D:?h")) != EOF)
 		switch (c)
 		{
 		case 'd': DecFile = optarg; break;
 		case 'r': RawFile = optarg; break;
 		case 'o': PrintOffset = 1; break;
 		case 'h': PrintHexOffset = 1; break;
+		case 'j': Threads = atoi(optarg);
+			  if (Threads < 1)
+			      error(1, "Illegal value '%s' for -j\n", optarg);
+			  break;
 		case 'D': Debug = atoi(optarg); break;
 		default: usage(); exit(1);
 		}
@@ -598,16 +568,29 @@ main(int argc, char *argv[])
 
 	if (argc > 0)
 	{
-	    FILE	*fp;
-
 	    fp = fopen(argv[0], "r");
 	    if (!fp)
 		error(1, "file '%s' doesn't exist\n", argv[0]);
-	    decode(fp);
-	    fclose(fp);
 	}
 	else
-	    decode(stdin);
+	    fp = stdin;
+
+	if (Threads == 0)
+	    Threads = sysconf(_SC_NPROCESSORS_ONLN);
+	Pool = workpool_create(Threads);
+	BieDec = biedec_create(Pool, Threads);
+	if (!BieDec)
+	    error(1, "Can't allocate BIE queue\n");
+
+	r = recscan_open(fp);
+	if (!r)
+	    error(1, "Can't allocate input buffer\n");
+	decode(r);
+	recscan_close(r);
+	biedec_destroy(BieDec);
+	workpool_destroy(Pool);
+	if (fp != stdin)
+	    fclose(fp);
 
 	exit(0);
 }
@@ -0,0 +1,431 @@
+/*
+ * Buffered, zero copy input for the *decode tools, and iterators over
+ * the records of the printer languages they take apart.
+ *
+ * A regular file is mapped whole, through mapin.  Anything else is read
+ * with fread() into a buffer that grows to hold the longest run of
+ * bytes asked for at once (normally the longest record), so a record
+ * always lies in one piece in memory.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mapin.h"
+#include "recscan.h"
+
+#define	CHUNK	(1024 * 1024)	/* read at least this much at a time */
+
+struct _RECSCAN
+{
+    FILE		*fp;
+    MAPIN		*map;
+    unsigned char	*base;		/* the mapping, or the buffer */
+    size_t		size;		/* of the buffer */
+    size_t		pos;		/* next byte, in base */
+    size_t		end;		/* end of the valid bytes in base */
+    long		off;		/* stream offset of base[0] */
+    int			eof;		/* nothing more to be read */
+};
+
+RECSCAN *
+recscan_open(FILE *fp)
+{
+    RECSCAN	*r;
+    size_t	len;
+    int		err = errno;
+
+    r = calloc(1, sizeof(*r));
+    if (!r)
+	return NULL;
+    r->fp = fp;
+
+    // A pipe has no position; don't leave that in errno for error()
+    r->off = ftell(fp);
+    if (r->off < 0)
+    {
+	r->off = 0;
+	errno = err;
+    }
+
+    r->map = mapin_open(fp);
+    if (r->map)
+    {
+	r->base = mapin_rest(r->map, fp, &len);
+	if (r->base)
+	{
+	    r->end = len;
+	    r->eof = 1;
+	    return r;
+	}
+	mapin_close(r->map);
+	r->map = NULL;
+    }
+    return r;
+}
+
+void
+recscan_close(RECSCAN *r)
+{
+    if (!r)
+	return;
+    if (r->map)
+	mapin_close(r->map);
+    else
+	free(r->base);
+    free(r);
+}
+
+/*
+ * Make at least len bytes available at pos.  Returns 1, or 0 if the
+ * stream ends first; whatever there is is then available.
+ */
+static int
+fill(RECSCAN *r, size_t len)
+{
+    size_t	have = r->end - r->pos;
+    size_t	n;
+
+    if (have >= len)
+	return 1;
+    if (r->eof)
+	return 0;
+
+    // Move what is left to the front, then make room for len bytes
+    if (r->pos)
+    {
+	memmove(r->base, r->base + r->pos, have);
+	r->off += r->pos;
+	r->pos = 0;
+	r->end = have;
+    }
+    if (len > r->size || r->size < CHUNK)
+    {
+	size_t		size = (len > CHUNK) ? len + CHUNK : CHUNK;
+	unsigned char	*base = realloc(r->base, size);
+
+	if (!base)
+	    return 0;
+	r->base = base;
+	r->size = size;
+    }
+
+    while (r->end < len)
+    {
+	n = fread(r->base + r->end, 1, r->size - r->end, r->fp);
+	if (n == 0)
+	{
+	    r->eof = 1;
+	    return 0;
+	}
+	r->end += n;
+    }
+    return 1;
+}
+
+const unsigned char *
+recscan_peek(RECSCAN *r, size_t len)
+{
+    if (!fill(r, len))
+	return NULL;
+    return r->base + r->pos;
+}
+
+size_t
+recscan_avail(RECSCAN *r, size_t len)
+{
+    fill(r, len);
+    return (r->end - r->pos < len) ? r->end - r->pos : len;
+}
+
+const unsigned char *
+recscan_take(RECSCAN *r, size_t len)
+{
+    const unsigned char	*p;
+
+    if (!fill(r, len))
+	return NULL;
+    p = r->base + r->pos;
+    r->pos += len;
+    return p;
+}
+
+int
+recscan_getc(RECSCAN *r)
+{
+    if (r->pos == r->end && !fill(r, 1))
+	return EOF;
+    return r->base[r->pos++];
+}
+
+void
+recscan_ungetc(RECSCAN *r, int c)
+{
+    if (c != EOF && r->pos)
+	--r->pos;
+}
+
+size_t
+recscan_read(RECSCAN *r, void *buf, size_t len)
+{
+    len = recscan_avail(r, len);
+    memcpy(buf, r->base + r->pos, len);
+    r->pos += len;
+    return len;
+}
+
+char *
+recscan_gets(RECSCAN *r, char *buf, int size)
+{
+    int		i = 0;
+    int		c;
+
+    while (i < size - 1)
+    {
+	c = recscan_getc(r);
+	if (c == EOF)
+	    break;
+	buf[i++] = c;
+	if (c == '\n')
+	    break;
+    }
+    if (i == 0)
+	return NULL;
+    buf[i] = 0;
+    return buf;
+}
+
+long
+recscan_tell(RECSCAN *r)
+{
+    return r->off + r->pos;
+}
+
+int
+recscan_eof(RECSCAN *r)
+{
+    return !fill(r, 1);
+}
+
+static unsigned long
+be32(const unsigned char *p)
+{
+    return ((unsigned long) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned long
+le32(const unsigned char *p)
+{
+    return ((unsigned long) p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+/*
+ * Take a record of headlen header bytes and len data bytes, and skip
+ * the pad bytes after it.  Returns 1, or EOF if the stream ends first.
+ */
+static int
+record(RECSCAN *r, RECSCAN_REC *rec, size_t headlen, size_t len, size_t pad)
+{
+    int		ok = fill(r, headlen + len);
+    size_t	have = r->end - r->pos;
+
+    rec->offset = recscan_tell(r);
+    rec->head = r->base + r->pos;
+    rec->headlen = (have < headlen) ? have : headlen;
+    rec->data = rec->head + rec->headlen;
+    rec->len = (have - rec->headlen < len) ? have - rec->headlen : len;
+    r->pos += rec->headlen + rec->len;
+    if (!ok)
+    {
+	rec->pad = 0;
+	return EOF;
+    }
+
+    // The pad may be missing at the very end
+    fill(r, pad);
+    rec->pad = (r->end - r->pos < pad) ? r->end - r->pos : pad;
+    r->pos += rec->pad;
+    return 1;
+}
+
+/*
+ * Peek at the first len bytes of a record.  Returns them, or NULL with
+ * *rc set to 0 if the stream has ended, or to EOF (after taking what
+ * there is as the header) if the record is cut short.
+ */
+static const unsigned char *
+header(RECSCAN *r, RECSCAN_REC *rec, size_t len, int *rc)
+{
+    const unsigned char	*p = recscan_peek(r, len);
+
+    if (p)
+	return p;
+    memset(rec, 0, sizeof(*rec));
+    *rc = 0;
+    if (r->end > r->pos)
+	*rc = record(r, rec, len, 0, 0);
+    return NULL;
+}
+
+int
+recscan_zjs(RECSCAN *r, RECSCAN_REC *rec, int pad)
+{
+    const unsigned char	*p;
+    unsigned long	size;
+    int			rc;
+
+    if (!(p = header(r, rec, 16, &rc)))
+	return rc;
+    size = be32(p);
+    rec->type = be32(p + 4);
+    rec->items = be32(p + 8);
+    size = (size > 16) ? size - 16 : 0;
+    return record(r, rec, 16, size, pad ? -(16 + size) & 3 : 0);
+}
+
+int
+recscan_xqx(RECSCAN *r, RECSCAN_REC *rec)
+{
+    const unsigned char	*p;
+    unsigned long	type, items, i;
+    size_t		len;
+    int			rc;
+
+    if (!(p = header(r, rec, 8, &rc)))
+	return rc;
+    type = be32(p);
+    items = be32(p + 4);
+
+    // JBIG data is items bytes; otherwise walk the items to their end
+    if (type == 7)
+	len = items;
+    else
+    {
+	len = 0;
+	for (i = 0; i < items; ++i)
+	{
+	    if (!(p = recscan_peek(r, 8 + len + 8)))
+		break;
+	    len += 8 + be32(p + 8 + len + 4);
+	}
+    }
+    rc = record(r, rec, 8, len, 0);
+    rec->type = type;
+    rec->items = items;
+    return rc;
+}
+
+int
+recscan_qpdl(RECSCAN *r, RECSCAN_REC *rec)
+{
+    const unsigned char	*p;
+    size_t		headlen, len = 0;
+    int			type, rc;
+
+    if (!(p = header(r, rec, 1, &rc)))
+	return rc;
+    type = p[0];
+    switch (type)
+    {
+    case 0x00:	headlen = 17; break;
+    case 0x01:	headlen = 3; break;
+    case 0x09:	headlen = 1; break;
+    case 0x13:	headlen = 15; break;
+    case 0x11:
+	headlen = 5;
+	if ((p = recscan_peek(r, headlen)))
+	    len = be32(p + 1) + 1;
+	break;
+    case 0x14:
+	headlen = 8;
+	if ((p = recscan_peek(r, headlen)) && p[1] != 0x10)
+	    headlen = 25;
+	break;
+    case 0x0c:
+	headlen = 12;
+	if ((p = recscan_peek(r, headlen)))
+	{
+	    len = be32(p + 8);
+	    if (p[7] == 0x11 || p[7] == 0x12)
+		++len;
+	}
+	break;
+    default:
+	// Unknown: the caller gets just the type
+	headlen = 1;
+	break;
+    }
+    rc = record(r, rec, headlen, len, 0);
+    rec->type = type;
+    return rc;
+}
+
+int
+recscan_hiperc(RECSCAN *r, RECSCAN_REC *rec)
+{
+    const unsigned char	*p;
+    unsigned long	len;
+    int			rc;
+
+    if (!(p = header(r, rec, 8, &rc)))
+	return rc;
+    len = be32(p);
+    rec->type = be32(p + 4);
+    return record(r, rec, 8, (len > 8) ? len - 8 : 0, 0);
+}
+
+int
+recscan_oak(RECSCAN *r, RECSCAN_REC *rec)
+{
+    const unsigned char	*p;
+    unsigned long	len;
+    int			rc;
+
+    if (!(p = header(r, rec, 12, &rc)))
+	return rc;
+    len = le32(p + 4);
+    rec->type = le32(p + 8);
+    return record(r, rec, 12, (len > 12) ? len - 12 : 0, 0);
+}
+
+int
+recscan_opl(RECSCAN *r, RECSCAN_REC *rec)
+{
+    const unsigned char	*p;
+    size_t		i, len = 0;
+
+    // The text runs to a ';', or to the '=' after a '#'
+    for (i = 0; ; ++i)
+    {
+	if (!(p = recscan_peek(r, i + 1)))
+	{
+	    memset(rec, 0, sizeof(*rec));
+	    if (i == 0)
+		return 0;
+	    record(r, rec, i, 0, 0);
+	    return EOF;
+	}
+	if (p[i] == ';')
+	    return record(r, rec, i + 1, 0, 0);
+	if (p[i] == '#')
+	    break;
+    }
+    for (++i; ; ++i)
+    {
+	if (!(p = recscan_peek(r, i + 1)))
+	{
+	    record(r, rec, i, 0, 0);
+	    return EOF;
+	}
+	if (p[i] == '=')
+	    break;
+	len = len * 10 + p[i] - '0';
+    }
+    return record(r, rec, i + 1, len, 1);
+}
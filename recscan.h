@@ -0,0 +1,129 @@
+/*
+ * Buffered, zero copy input for the *decode tools, and iterators over
+ * the records of the printer languages they take apart.
+ *
+ * A RECSCAN reads a stream either straight from a mapping of the file,
+ * when it is a regular file, or through a large read buffer, when it is
+ * a pipe.  Either way the bytes are handed out in place: a record, its
+ * items and its compressed data are never copied.  Pointers returned
+ * by the byte level calls and by the iterators stay valid until the
+ * next call on the same RECSCAN.
+ *
+ * The iterators know only the framing of each language: where a record
+ * starts, how long its header is, and how much data follows.  What the
+ * records and their items mean is left to the caller, which walks the
+ * record data in memory with recscan_get().  The language headers each
+ * define their own DWORD and be32(), so none of them is included here.
+ */
+
+#ifndef RECSCAN_H
+#define RECSCAN_H
+
+#include <stdio.h>
+#include <string.h>
+
+typedef struct _RECSCAN RECSCAN;
+
+/*
+ * Start reading fp at its current position.  Returns NULL if out of
+ * memory.  recscan_close() does not close fp.
+ */
+RECSCAN			*recscan_open(FILE *fp);
+void			recscan_close(RECSCAN *r);
+
+/*
+ * Byte level access.  recscan_peek() returns the next len bytes without
+ * consuming them, recscan_take() consumes them as well; both return
+ * NULL, consuming nothing, if fewer than len bytes are left, and
+ * recscan_avail() tells how many of the next len bytes there are.  The
+ * rest behave like their stdio namesakes, except that recscan_ungetc()
+ * can only step back over the byte c just read (unless c is EOF).
+ */
+const unsigned char	*recscan_peek(RECSCAN *r, size_t len);
+const unsigned char	*recscan_take(RECSCAN *r, size_t len);
+size_t			recscan_avail(RECSCAN *r, size_t len);
+int			recscan_getc(RECSCAN *r);
+void			recscan_ungetc(RECSCAN *r, int c);
+size_t			recscan_read(RECSCAN *r, void *buf, size_t len);
+char			*recscan_gets(RECSCAN *r, char *buf, int size);
+long			recscan_tell(RECSCAN *r);
+int			recscan_eof(RECSCAN *r);
+
+/*
+ * One record.  head is the record header as it is in the stream, data
+ * whatever follows it up to the end of the record; pad bytes after the
+ * record have already been skipped.  type and items are decoded from
+ * the header, where the language has them.
+ */
+typedef struct
+{
+    long		offset;		/* of the record in the stream */
+    unsigned long	type;
+    unsigned long	items;
+    const unsigned char	*head;
+    size_t		headlen;
+    const unsigned char	*data;
+    size_t		len;
+    size_t		pad;		/* pad bytes skipped after data */
+} RECSCAN_REC;
+
+/*
+ * Step to the next record.  Each returns 1, 0 if the stream ends before
+ * the record, or EOF if the record is cut short; in that case rec holds
+ * the header (or whatever there is of it) and all the data there is.
+ *
+ * recscan_zjs	ZjStream and SLX: 16 byte big endian {size, type, items,
+ *		reserved, signature} header, size counts the header, and
+ *		the record is padded to 4 bytes if pad is set.
+ * recscan_xqx	XQX: 8 byte {type, items} header; a JBIG record has items
+ *		bytes of data, the others items {type, size, value} items.
+ * recscan_qpdl	QPDL: a record type byte, then a layout that depends on
+ *		the type.
+ * recscan_hiperc HIPERC: 8 byte {len, type} header, len counts the
+ *		header; the data is a list of {len, bytes} blocks.
+ * recscan_oak	OAK: 12 byte little endian {"OAKT", len, type} header,
+ *		len counts the header.  The image data after an image
+ *		data record is not part of it.
+ * recscan_opl	OPL: a "name=value;" or "name#len=<len bytes>;" token.
+ *		head is the name and value (or "#len=") as text, data
+ *		the binary bytes, if any.
+ */
+int			recscan_zjs(RECSCAN *r, RECSCAN_REC *rec, int pad);
+int			recscan_xqx(RECSCAN *r, RECSCAN_REC *rec);
+int			recscan_qpdl(RECSCAN *r, RECSCAN_REC *rec);
+int			recscan_hiperc(RECSCAN *r, RECSCAN_REC *rec);
+int			recscan_oak(RECSCAN *r, RECSCAN_REC *rec);
+int			recscan_opl(RECSCAN *r, RECSCAN_REC *rec);
+
+/*
+ * Copy len bytes at *p into buf and step *p past them, like fread() of
+ * one item from the record data that ends at end.  Returns 1, or 0,
+ * copying nothing, if fewer than len bytes are left.
+ */
+static inline int
+recscan_get(const unsigned char **p, const unsigned char *end,
+		void *buf, size_t len)
+{
+    if ((size_t) (end - *p) < len)
+	return 0;
+    memcpy(buf, *p, len);
+    *p += len;
+    return 1;
+}
+
+/*
+ * Step *p over len bytes of the record data that ends at end, or over
+ * what is left of it if that is less.  Returns the number of bytes.
+ */
+static inline int
+recscan_skip(const unsigned char **p, const unsigned char *end, long len)
+{
+    if (len <= 0)
+	return 0;
+    if (end - *p < len)
+	len = end - *p;
+    *p += len;
+    return len;
+}
+
+#endif
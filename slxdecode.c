@@ -31,6 +31,7 @@ b*/
 
 #include "slx.h"
 #include "jbig.h"
+#include "recscan.h"
 
 /*
  * Global option flags
@@ -139,10 +140,12 @@ print_bih(unsigned char bih[20])
 }
 
 void
-decode(FILE *fp)
+decode(RECSCAN *r)
 {
     DWORD	magic;
     SL_HEADER	hdr;
+    RECSCAN_REC	rec;
+    const unsigned char	*p, *end;
     int		c;
     int		rc;
     int		size;
@@ -157,6 +160,7 @@ decode(FILE *fp)
     struct jbg_dec_state	s[5];
     unsigned char	bih[20];
     int			bihlen = 0;
+    const unsigned char	*data;
     int			imageCnt[5] = {0,0,0,0,0};
     int         	pn = 0;
     int         	incrY = 0;
@@ -165,19 +169,24 @@ decode(FILE *fp)
     /*
      * Zenographics ZX format
      */
-    c = getc(fp);
+    c = recscan_getc(r);
     if (c == EOF)
     {
 	printf("EOF on file reading header.\n");
 	return;
     }
-    ungetc(c, fp);
+    recscan_ungetc(r, c);
     if (c == '\033')
     {
 	char	buf[1024];
 
-	while (fgets(buf, sizeof(buf), fp))
+	for (;;)
 	{
+	    if (!recscan_gets(r, buf, sizeof(buf)))
+	    {
+		printf("\n");
+		return;
+	    }
 	    if (PrintOffset)
 		printf("%d:	", curOff);
 	    else if (PrintHexOffset)
@@ -194,22 +203,17 @@ decode(FILE *fp)
 		break;
 	    if (strcmp(buf, "@PJL USTATUS TIMED = 30\n") == 0)
 	    {
-		rc = fread(buf, 52, 1, fp);
+		recscan_read(r, buf, 52);
 		break;
 	    }
 	}
-	if (feof(fp))
-	{
-	    printf("\n");
-	    return;
-	}
     }
 
     /*
      * Software Imaging K.K.  SLX_MAGIC format
      */
-    rc = fread(&magic, len = sizeof(magic), 1, fp);
-    if (rc != 1)
+    len = sizeof(magic);
+    if (recscan_read(r, &magic, len) != len)
     {
 	printf("Missing SLX Magic number\n");
 	return;
@@ -235,9 +239,12 @@ decode(FILE *fp)
 	else if (PrintHexOffset)
 	    printf("%6x:	", curOff);
 
-	rc = fread(&hdr, len = sizeof(hdr), 1, fp);
-	if (rc != 1) break;
+	rc = recscan_zjs(r, &rec, 1);
+	if (rc == 0 || rec.headlen < sizeof(hdr)) break;
+	memcpy(&hdr, rec.head, len = sizeof(hdr));
 	curOff += len;
+	p = rec.data;
+	end = rec.data + rec.len;
 
 	hdr.type = be32(hdr.type);
 	hdr.size = be32(hdr.size);
@@ -305,7 +312,7 @@ decode(FILE *fp)
 	{
 	    SL_ITEM_HEADER	ihdr;
 	    int			isize;
-	    DWORD		val;
+	    DWORD		val = 0;
 	    char		buf[512];
 	    int			i, c;
 
@@ -316,7 +323,7 @@ decode(FILE *fp)
 
 	    size -= sizeof(ihdr);
 
-	    rc = fread(&ihdr, len = sizeof(ihdr), 1, fp);
+	    rc = recscan_get(&p, end, &ihdr, len = sizeof(ihdr));
 	    if (rc != 1) break;
 	    curOff += len;
 
@@ -359,7 +366,7 @@ decode(FILE *fp)
 	    switch (ihdr.type)
 	    {
 	    case SLIT_UINT32:
-		rc = fread(&val, len = sizeof(val), 1, fp);
+		rc = recscan_get(&p, end, &val, len = sizeof(val));
 		curOff += len;
 		val = be32(val);
 		isize -= 4;
@@ -378,8 +385,8 @@ decode(FILE *fp)
 	    case SLIT_STRING:
 		for (i = 0; i < sizeof(buf) - 1; )
 		{
-		    c = fgetc(fp);
-		    if (c == EOF) break;
+		    if (p == end) break;
+		    c = *p++;
 		    ++curOff;
 		    buf[i++] = c;
 		    --isize;
@@ -393,7 +400,7 @@ decode(FILE *fp)
 		break;
 	    default:
 	    case SLIT_BYTELUT:
-		rc = fread(&val, len = sizeof(val), 1, fp);
+		rc = recscan_get(&p, end, &val, len = sizeof(val));
 		curOff += len;
 		val = be32(val);
 		isize -= 4;
@@ -403,7 +410,8 @@ decode(FILE *fp)
 		    printf("	SLI_0x%x, BYTELUT (len=%d)", ihdr.item, val);
 		if (0) // ihdr.item == SLI_JBIG_BIH && val == 20)
 		{
-		    bihlen = fread(bih, 1, len = sizeof(bih), fp);
+		    bihlen = recscan_skip(&p, end, len = sizeof(bih));
+		    memcpy(bih, p - bihlen, bihlen);
 		    if (bihlen <= 0)
 			isize = 0;
 		    else
@@ -425,10 +433,10 @@ decode(FILE *fp)
 	    printf("\n");
 	    fflush(stdout);
 
-	    while (isize-- > 0)
+	    if (isize > 0)
 	    {
-		fgetc(fp);
-		++curOff;
+		recscan_skip(&p, end, isize);
+		curOff += isize;
 	    }
 
 	    if (size <= 0 && items)
@@ -450,7 +458,8 @@ decode(FILE *fp)
 
 	    if (hdr.type == SLT_JBIG_BIH)
 	    {
-		bihlen = fread(bih, 1, len = sizeof(bih), fp);
+		bihlen = recscan_skip(&p, end, len = sizeof(bih));
+		memcpy(bih, p - bihlen, bihlen);
 		if (bihlen <= 0)
 		    size = 0;
 		else
@@ -489,60 +498,52 @@ decode(FILE *fp)
 			    error(1, "JBIG uses unimplemented feature\n");
 		    }
 		}
-		while (size--)
+		data = p;
+		len = recscan_skip(&p, end, size);
+		curOff += len;
+		if (rfp && len)
+		    fwrite(data, 1, len, rfp);
+		if (DecFile && len)
 		{
-		    int	c;
-		    c = fgetc(fp);
-		    ++curOff;
-		    if (rfp)
-			fputc(c, rfp);
-		    if (DecFile)
-		    {
-			size_t		cnt;
-			unsigned char	ch = c;
+		    size_t	cnt;
 
-			rc = JBG_EAGAIN;
-			rc = jbg_dec_in(&s[pn], &ch, 1, &cnt);
-			if (rc == JBG_EOK)
+		    // Anything after the end of the BIE is ignored
+		    rc = jbg_dec_in(&s[pn], data, len, &cnt);
+		    if (rc == JBG_EOK)
+		    {
+			int	h, w, len;
+			unsigned char *image;
+
+			// debug(1, "JBG_EOK: %d\n", pn);
+			h = jbg_dec_getheight(&s[pn]);
+			w = jbg_dec_getwidth(&s[pn]);
+			image = jbg_dec_getimage(&s[pn], 0);
+			len = jbg_dec_getsize(&s[pn]);
+			if (image)
 			{
-			    int	h, w, len;
-			    unsigned char *image;
-
-			    // debug(1, "JBG_EOK: %d\n", pn);
-			    h = jbg_dec_getheight(&s[pn]);
-			    w = jbg_dec_getwidth(&s[pn]);
-			    image = jbg_dec_getimage(&s[pn], 0);
-			    len = jbg_dec_getsize(&s[pn]);
-			    if (image)
+			    char	buf[512];
+			    sprintf(buf, "%s-%02d-%d.pbm",
+				    DecFile, pageNum, pn);
+			    dfp = fopen(buf,
+					imageCnt[pn] ? "a" : "w");
+			    if (dfp)
 			    {
-				char	buf[512];
-				sprintf(buf, "%s-%02d-%d.pbm",
-					DecFile, pageNum, pn);
-				dfp = fopen(buf,
-					    imageCnt[pn] ? "a" : "w");
-				if (dfp)
-				{
-				    if (imageCnt[pn] == 0)
-					fprintf(dfp, "P4\n%8d %8d\n", w, h);
-				    imageCnt[pn] += incrY;
-				    rc = fwrite(image, 1, len, dfp);
-				    fclose(dfp);
-				}
+				if (imageCnt[pn] == 0)
+				    fprintf(dfp, "P4\n%8d %8d\n", w, h);
+				imageCnt[pn] += incrY;
+				rc = fwrite(image, 1, len, dfp);
+				fclose(dfp);
 			    }
-			    else
-				debug(0, "Missing image %dx%d!\n", h, w);
-			    jbg_dec_free(&s[pn]);
 			}
+			else
+			    debug(0, "Missing image %dx%d!\n", h, w);
+			jbg_dec_free(&s[pn]);
 		    }
 		}
 	    }
 	    else
 	    {
-		while (size--)
-		{
-		    fgetc(fp);
-		    ++curOff;
-		}
+		curOff += recscan_skip(&p, end, size);
 		if (rfp)
 		{
 		    fclose(rfp);
@@ -551,11 +552,7 @@ decode(FILE *fp)
 	    }
 	}
 
-	while (padding--)
-	{
-	    fgetc(fp);
-	    ++curOff;
-	}
+	curOff += padding;
 
 	if (hdr.type == SLT_END_DOC)
 	    break;
@@ -571,6 +568,7 @@ main(int argc, char *argv[])
 	extern int	optind;
 	extern char	*optarg;
 	int		c;
+	RECSCAN		*r;
 
 	while ( (c = getopt(argc, argv, "d:hor:D:?h")) != EOF)
 		switch (c)
@@ -586,13 +584,16 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	r = recscan_open(stdin);
+	if (!r)
+	    error(1, "Can't allocate input buffer\n");
 	for(;;)
 	{
-	    decode(stdin);
-	    c = getc(stdin); ungetc(c, stdin);
-	    if (feof(stdin))
+	    decode(r);
+	    if (recscan_eof(r))
 		break;
 	}
+	recscan_close(r);
 
 	exit(0);
 }
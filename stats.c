@@ -0,0 +1,176 @@
+/*
+ * Per page timing and throughput figures, shared by the foo2* drivers.
+ *
+ * Stages may run on any thread, so the figures of the page are added to
+ * atomically; the start of a stage is kept per thread.  So is where a
+ * thread's figures go while they are held: only that thread adds to the
+ * STATS_HELD, until the PAGEQ hands it over along with its page.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "stats.h"
+
+static const char	*StageName[STATS_NSTAGES] =
+{
+    "read", "split", "dots", "encode", "write", "other"
+};
+
+static int		Enabled;
+static const char	*Driver = "";
+static int		PageNum;
+static uint64_t		PageStart;
+
+// This page so far
+static uint64_t		Ns[STATS_NSTAGES];
+static uint64_t		Allocs[STATS_NSTAGES];
+static uint64_t		Bytes[2];
+static unsigned long	Dots[4];
+
+static __thread uint64_t	Begun[STATS_NSTAGES];
+static __thread int		Current = STATS_OTHER;
+static __thread STATS_HELD	*Held;
+
+static uint64_t
+now(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+stats_init(const char *driver)
+{
+    const char	*env = getenv("FOO2ZJS_STATS");
+
+    Enabled = env && *env && *env != '0';
+    Driver = driver;
+    PageStart = now();
+}
+
+void
+stats_begin(int stage)
+{
+    if (!Enabled)
+	return;
+    Begun[stage] = now();
+    Current = stage;
+}
+
+void
+stats_end(int stage)
+{
+    if (!Enabled)
+	return;
+    if (Held)
+	Held->ns[stage] += now() - Begun[stage];
+    else
+	__atomic_fetch_add(&Ns[stage], now() - Begun[stage], __ATOMIC_RELAXED);
+    Current = STATS_OTHER;
+}
+
+void
+stats_bytes(int dir, size_t n)
+{
+    if (!Enabled)
+	return;
+    if (Held)
+	Held->bytes[dir] += n;
+    else
+	__atomic_fetch_add(&Bytes[dir], n, __ATOMIC_RELAXED);
+}
+
+void
+stats_alloc(void)
+{
+    if (!Enabled)
+	return;
+    if (Held)
+	Held->allocs[Current] += 1;
+    else
+	__atomic_fetch_add(&Allocs[Current], 1, __ATOMIC_RELAXED);
+}
+
+void
+stats_hold(STATS_HELD *held)
+{
+    Held = held;
+}
+
+void
+stats_release(STATS_HELD *held)
+{
+    int		i;
+
+    if (!Enabled)
+	return;
+    for (i = 0; i < STATS_NSTAGES; ++i)
+    {
+	__atomic_fetch_add(&Ns[i], held->ns[i], __ATOMIC_RELAXED);
+	__atomic_fetch_add(&Allocs[i], held->allocs[i], __ATOMIC_RELAXED);
+	held->ns[i] = held->allocs[i] = 0;
+    }
+    for (i = 0; i < 2; ++i)
+    {
+	__atomic_fetch_add(&Bytes[i], held->bytes[i], __ATOMIC_RELAXED);
+	held->bytes[i] = 0;
+    }
+}
+
+void
+stats_dots(const unsigned long dots[4])
+{
+    int		i;
+
+    if (!Enabled)
+	return;
+    for (i = 0; i < 4; ++i)
+	Dots[i] = dots[i];
+}
+
+void
+stats_page(void)
+{
+    char	line[1024];
+    int		n, i;
+    uint64_t	t;
+
+    if (!Enabled)
+	return;
+    t = now();
+
+    n = snprintf(line, sizeof(line), "{\"driver\":\"%s\",\"page\":%d,"
+		"\"wall_ns\":%llu,\"ns\":{",
+		Driver, ++PageNum, (unsigned long long) (t - PageStart));
+    for (i = 0; i < STATS_NSTAGES; ++i)
+	n += snprintf(line + n, sizeof(line) - n, "%s\"%s\":%llu",
+		i ? "," : "", StageName[i], (unsigned long long) Ns[i]);
+    n += snprintf(line + n, sizeof(line) - n, "},\"allocs\":{");
+    for (i = 0; i < STATS_NSTAGES; ++i)
+	n += snprintf(line + n, sizeof(line) - n, "%s\"%s\":%llu",
+		i ? "," : "", StageName[i], (unsigned long long) Allocs[i]);
+    n += snprintf(line + n, sizeof(line) - n,
+		"},\"bytes_in\":%llu,\"bytes_out\":%llu,\"ratio\":%.2f,"
+		"\"dots\":{\"c\":%lu,\"m\":%lu,\"y\":%lu,\"k\":%lu}}\n",
+		(unsigned long long) Bytes[STATS_IN],
+		(unsigned long long) Bytes[STATS_OUT],
+		Bytes[STATS_OUT] ? (double) Bytes[STATS_IN] / Bytes[STATS_OUT]
+				 : 0.0,
+		Dots[0], Dots[1], Dots[2], Dots[3]);
+    fputs(line, stderr);
+
+    for (i = 0; i < STATS_NSTAGES; ++i)
+	Ns[i] = Allocs[i] = 0;
+    Bytes[STATS_IN] = Bytes[STATS_OUT] = 0;
+    Dots[0] = Dots[1] = Dots[2] = Dots[3] = 0;
+    PageStart = t;
+}
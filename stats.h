@@ -0,0 +1,90 @@
+/*
+ * Per page timing and throughput figures, shared by the foo2* drivers.
+ *
+ * When the environment variable FOO2ZJS_STATS is set (to anything but
+ * 0), each driver prints one line of JSON per page on stderr, e.g.
+ *
+ *   {"driver":"foo2zjs","page":1,"wall_ns":48120344,
+ *    "ns":{"read":6100211,"split":0,"dots":0,"encode":39240417,
+ *	"write":1530988,"other":0},
+ *    "allocs":{"read":0,"split":0,"dots":0,"encode":11,"write":0,
+ *	"other":0},
+ *    "bytes_in":1052700,"bytes_out":76523,"ratio":13.76,
+ *    "dots":{"c":0,"m":0,"y":0,"k":1822354}}
+ *
+ * all on one line.  The ns of a stage are summed over the threads that
+ * worked on it, so with -j they can add up to more than wall_ns, the time
+ * since the previous page was finished.  allocs counts the blocks of
+ * compressed data that had to come from malloc rather than from the
+ * pool that biechain keeps.  bytes_in is the raster read, bytes_out the
+ * compressed data produced for the page, and ratio the one over the
+ * other.  dots counts the dots of each color printed on the page.
+ *
+ * Otherwise all of these return right away.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+#define	STATS_READ	0	/* reading the raster */
+#define	STATS_SPLIT	1	/* splitting bitcmyk into planes */
+#define	STATS_DOTS	2	/* counting dots not counted as read or split */
+#define	STATS_ENCODE	3	/* JBIG compression */
+#define	STATS_WRITE	4	/* writing the printer stream */
+#define	STATS_OTHER	5
+#define	STATS_NSTAGES	6
+
+#define	STATS_IN	0
+#define	STATS_OUT	1
+
+/*
+ * Figures held back from the page being timed, for the page they belong
+ * to: the reader thread of a PAGEQ reads the next page while the current
+ * one is being compressed.
+ */
+typedef struct
+{
+    unsigned long long	ns[STATS_NSTAGES];
+    unsigned long long	allocs[STATS_NSTAGES];
+    unsigned long long	bytes[2];
+} STATS_HELD;
+
+/*
+ * Check the environment; driver is the name to print.
+ */
+void	stats_init(const char *driver);
+
+/*
+ * Time a stage on the calling thread, from stats_begin() to stats_end().
+ */
+void	stats_begin(int stage);
+void	stats_end(int stage);
+
+/*
+ * Count n bytes going in (STATS_IN) or out (STATS_OUT), and one fresh
+ * allocation in the stage the calling thread is in.
+ */
+void	stats_bytes(int dir, size_t n);
+void	stats_alloc(void);
+
+/*
+ * From stats_hold(held) until stats_hold(NULL), the figures of the
+ * calling thread go to held rather than to the page.  stats_release()
+ * adds them to the page being timed, and clears held.
+ */
+void	stats_hold(STATS_HELD *held);
+void	stats_release(STATS_HELD *held);
+
+/*
+ * The dots of the page, in the order C, M, Y, K.
+ */
+void	stats_dots(const unsigned long dots[4]);
+
+/*
+ * The page is finished: print its figures and start over.
+ */
+void	stats_page(void);
+
+#endif
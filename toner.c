@@ -0,0 +1,98 @@
+/*
+ * Saving toner in draft mode, shared by the foo2* drivers.
+ *
+ * The mask is ANDed in 32 bytes at a time with AVX2 or 16 with SSE2 when
+ * the compiler targets them, and in 64 bit words otherwise.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "toner.h"
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+/*
+ * A 4x4 ordered dither.  Keeping n 16ths of the dots keeps those whose
+ * entries are below n.
+ */
+static const unsigned char Bayer[4][4] =
+{
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+int
+toner_pattern(unsigned char mask[4], const char *name)
+{
+    char	*end;
+    long	pct;
+    int		y, x, n;
+
+    if (strcmp(name, "checker") == 0)
+    {
+	mask[0] = mask[2] = 0x55;
+	mask[1] = mask[3] = 0xaa;
+	return 0;
+    }
+    if (strcmp(name, "lines") == 0)
+    {
+	mask[0] = mask[2] = 0xff;
+	mask[1] = mask[3] = 0x00;
+	return 0;
+    }
+
+    pct = strtol(name, &end, 10);
+    if (end == name || *end || pct < 1 || pct > 99)
+	return -1;
+    n = (pct * 16 + 50) / 100;
+    for (y = 0; y < 4; ++y)
+    {
+	// Dots are MSB first, so the left one is bit 7
+	mask[y] = 0;
+	for (x = 0; x < 8; ++x)
+	    if (Bayer[y][x & 3] < n)
+		mask[y] |= 0x80 >> x;
+    }
+    return 0;
+}
+
+void
+toner_row(unsigned char *p, size_t len, int mask)
+{
+    unsigned char	*e = p + len;
+    uint64_t		w, m = 0x0101010101010101ULL * (mask & 0xff);
+#if defined(__AVX2__)
+    const __m256i	vm = _mm256_set1_epi8(mask);
+
+    for (; e - p >= 32; p += 32)
+	_mm256_storeu_si256((__m256i *) p, _mm256_and_si256(vm,
+			_mm256_loadu_si256((const __m256i *) p)));
+#elif defined(__SSE2__)
+    const __m128i	vm = _mm_set1_epi8(mask);
+
+    for (; e - p >= 16; p += 16)
+	_mm_storeu_si128((__m128i *) p, _mm_and_si128(vm,
+			_mm_loadu_si128((const __m128i *) p)));
+#endif
+
+    for (; e - p >= 8; p += 8)
+    {
+	memcpy(&w, p, sizeof(w));
+	w &= m;
+	memcpy(p, &w, sizeof(w));
+    }
+    for (; p < e; ++p)
+	*p &= mask;
+}
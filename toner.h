@@ -0,0 +1,28 @@
+/*
+ * Saving toner in draft mode, shared by the foo2* drivers.
+ *
+ * In draft mode (-t, -E) the drivers drop some of the dots of a black and
+ * white page while each row is read, rather than going over the page again
+ * once it is in.  A pattern repeats every byte of a row and every 4 rows,
+ * so it is just the mask for each row, by the row number mod 4.
+ */
+
+#ifndef TONER_H
+#define TONER_H
+
+#include <stddef.h>
+
+/*
+ * Set mask[4] to the pattern named: "checker" (every other dot, the -t
+ * pattern), "lines" (every other row), or a number from 1 to 99, the
+ * percentage of the dots kept by an ordered dither.  Returns -1 if name
+ * is not a pattern.
+ */
+int	toner_pattern(unsigned char mask[4], const char *name);
+
+/*
+ * Keep only the dots of the len bytes at p that are set in mask.
+ */
+void	toner_row(unsigned char *p, size_t len, int mask);
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * A small pool of worker threads, shared by the foo2* drivers for the
+ * -j option.
+ *
+ * The threads are started once and then sleep until the next
+ * batch is posted by workpool_run(), so the per-page cost is a condition
+ * variable broadcast, not a thread creation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "workpool.h"
+
+struct _WORKPOOL
+{
+    int			nthreads;	/* worker threads, not counting caller */
+    pthread_t		*threads;
+    pthread_mutex_t	lock;
+    pthread_cond_t	work;		/* a batch was posted, or quit */
+    pthread_cond_t	idle;		/* the last job of a batch finished */
+    WORKFN		fn;
+    void		*arg;
+    int			njobs;
+    int			next;		/* next job to hand out */
+    int			done;		/* jobs finished in this batch */
+    int			quit;
+};
+
+/*
+ * Hand out jobs of the current batch until there are none left.
+ * Called and returns with the lock held.
+ */
+static void
+run_jobs(WORKPOOL *pool)
+{
+    while (pool->next < pool->njobs)
+    {
+	int	job = pool->next++;
+
+	pthread_mutex_unlock(&pool->lock);
+	pool->fn(pool->arg, job);
+	pthread_mutex_lock(&pool->lock);
+	if (++pool->done == pool->njobs)
+	    pthread_cond_signal(&pool->idle);
+    }
+}
+
+static void *
+worker(void *arg)
+{
+    WORKPOOL	*pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+	while (!pool->quit && pool->next >= pool->njobs)
+	    pthread_cond_wait(&pool->work, &pool->lock);
+	if (pool->quit)
+	    break;
+	run_jobs(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * Create a pool that runs jobs on nthreads threads in total, including
+ * the caller of workpool_run().  Returns NULL if nthreads <= 1, or if no
+ * threads could be started; jobs then simply run on the calling thread.
+ */
+WORKPOOL *
+workpool_create(int nthreads)
+{
+    WORKPOOL	*pool;
+    int		i;
+
+    if (nthreads <= 1)
+	return NULL;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+	return NULL;
+    pool->threads = calloc(nthreads - 1, sizeof(pthread_t));
+    if (!pool->threads)
+    {
+	free(pool);
+	return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (i = 0; i < nthreads - 1; ++i)
+    {
+	if (pthread_create(&pool->threads[i], NULL, worker, pool))
+	    break;
+	pool->nthreads++;
+    }
+    if (pool->nthreads == 0)
+    {
+	workpool_destroy(pool);
+	return NULL;
+    }
+    return pool;
+}
+
+void
+workpool_run(WORKPOOL *pool, int njobs, WORKFN fn, void *arg)
+{
+    int		job;
+
+    if (!pool || njobs <= 1)
+    {
+	for (job = 0; job < njobs; ++job)
+	    fn(arg, job);
+	return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->njobs = njobs;
+    pool->next = 0;
+    pool->done = 0;
+    pthread_cond_broadcast(&pool->work);
+
+    run_jobs(pool);
+    while (pool->done < pool->njobs)
+	pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+workpool_destroy(WORKPOOL *pool)
+{
+    int		i;
+
+    if (!pool)
+	return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; ++i)
+	pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
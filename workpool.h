@@ -0,0 +1,20 @@
+/*
+ * A small pool of worker threads, shared by the foo2* drivers for the
+ * -j option.
+ *
+ * workpool_run() calls fn(arg, job) for job = 0 .. njobs-1, spread over
+ * the pool's threads and the calling thread, and returns when all of them
+ * have finished.  A NULL pool runs the jobs in order on the calling thread.
+ */
+
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+typedef struct _WORKPOOL WORKPOOL;
+typedef void (*WORKFN)(void *arg, int job);
+
+WORKPOOL	*workpool_create(int nthreads);
+void		workpool_run(WORKPOOL *pool, int njobs, WORKFN fn, void *arg);
+void		workpool_destroy(WORKPOOL *pool);
+
+#endif
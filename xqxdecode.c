@@ -31,6 +31,9 @@ b*/
 
 #include "xqx.h"
 #include "jbig.h"
+#include "recscan.h"
+#include "workpool.h"
+#include "biedec.h"
 
 /*
  * Global option flags
@@ -39,6 +42,9 @@ int	Debug = 0;
 char	*DecFile;
 int	PrintOffset = 0;
 int	PrintHexOffset = 0;
+int	Threads = 0;
+WORKPOOL	*Pool;
+BIEDEC	*BieDec;
 
 void
 debug(int level, char *fmt, ...)
@@ -65,7 +71,12 @@ error(int fatal, char *fmt, ...)
 	vfprintf(stderr, fmt, ap);
 	va_end(ap);
 	if (fatal > 0)
+	{
+	    // Write out the planes found so far, as they are queued
+	    if (BieDec)
+		biedec_sync(BieDec, 1);
 	    exit(fatal);
+	}
 	else
 	{
 	    errno = 0;
@@ -90,6 +101,7 @@ usage(void)
 "       -d basename Basename of .pbm file for saving decompressed planes\n"
 "       -o          Print file offsets\n"
 "       -h          Print hex file offsets\n"
+"       -j threads  Decode planes using this many threads [all CPUs]\n"
 "       -D lvl      Set Debug level [%d]\n"
     , Debug
     );
@@ -143,23 +155,24 @@ proff(int curOff)
 }
 
 void
-decode(FILE *fp)
+decode(RECSCAN *r)
 {
     DWORD	magic;
     XQX_HEADER	hdr;
+    RECSCAN_REC	rec;
+    const unsigned char	*p, *end;
     int		c;
     int		rc;
     int		i;
     char	*codestr;
-    FILE	*dfp = NULL;
     int		planeNum = 4;
     int		pageNum = 0;
     int		len;
     int		curOff = 0;
-    struct jbg_dec_state	s[5];
+    BIEDEC_BIE		*bie[5] = {0,0,0,0,0};
     unsigned char	bih[20];
     int			bihlen = 0;
-    int			imageCnt[5] = {0,0,0,0,0};
+    const unsigned char	*data;
     int         	pn = 0;
     int         	incrY = 0;
     int			totSize = 0;
@@ -167,19 +180,21 @@ decode(FILE *fp)
     /*
      * <unknown> XQX format
      */
-    c = getc(fp);
+    c = recscan_getc(r);
     if (c == EOF)
     {
 	printf("EOF on file reading header.\n");
 	return;
     }
-    ungetc(c, fp);
+    recscan_ungetc(r, c);
     if (c == '\033')
     {
 	char	buf[1024];
 
-	while (fgets(buf, sizeof(buf), fp))
+	for (;;)
 	{
+	    if (!recscan_gets(r, buf, sizeof(buf)))
+		return;
 	    proff(curOff);
 	    if (buf[0] == '\033')
 	    {
@@ -192,8 +207,7 @@ decode(FILE *fp)
 	    if (0) {}
 	    else if (strncmp(buf, "@PJL USTATUS TIMED = ", 21) == 0)
 	    {
-		rc = fread(buf, 52, 1, fp);
-		if (rc != 1) return;
+		if (recscan_read(r, buf, 52) != 52) return;
 		debug(2, "buf=%s\n", buf);
 		proff(curOff);
 		buf[51] = 0;
@@ -206,8 +220,7 @@ decode(FILE *fp)
 	    }
 	    else if (strncmp(buf, "@PJL SET JOBATTR=", 17) == 0)
 	    {
-		rc = fread(buf, 9, 1, fp);
-		if (rc != 1) return;
+		if (recscan_read(r, buf, 9) != 9) return;
 		buf[9] = 0;
 		curOff += 9;
 		proff(curOff);
@@ -216,15 +229,13 @@ decode(FILE *fp)
 		break;
 	    }
 	}
-	if (feof(fp))
-	    return;
     }
 
     /*
      * ??? XQX_MAGIC format
      */
-    rc = fread(&magic, len = sizeof(magic), 1, fp);
-    if (rc != 1)
+    len = sizeof(magic);
+    if (recscan_read(r, &magic, len) != len)
     {
 	printf("Missing XQX Magic number\n");
 	return;
@@ -244,9 +255,12 @@ decode(FILE *fp)
     {
 	proff(curOff);
 
-	rc = fread(&hdr, len = sizeof(hdr), 1, fp);
-	if (rc != 1) break;
+	rc = recscan_xqx(r, &rec);
+	if (rc == 0 || rec.headlen < sizeof(hdr)) break;
+	memcpy(&hdr, rec.head, len = sizeof(hdr));
 	curOff += len;
+	p = rec.data;
+	end = rec.data + rec.len;
 
 	hdr.type = be32(hdr.type);
 	hdr.items = be32(hdr.items);
@@ -256,7 +270,10 @@ decode(FILE *fp)
 	{
 	    CODESTR(XQX_START_DOC)	break;
 	    CODESTR(XQX_END_DOC)	break;
-	    CODESTR(XQX_START_PAGE)	++pageNum; break;
+	    CODESTR(XQX_START_PAGE)	++pageNum;
+					memset(bie, 0, sizeof(bie));
+					biedec_sync(BieDec, 0);
+					break;
 	    CODESTR(XQX_END_PAGE)	break;
 	    CODESTR(XQX_START_PLANE)	break;
 	    CODESTR(XQX_END_PLANE)	break;
@@ -276,48 +293,10 @@ decode(FILE *fp)
 
 	if (hdr.type == XQX_JBIG)
 	{
-	    for (i = 0; i < hdr.items; ++i)
-	    {
-		c = fgetc(fp);
-		if (DecFile)
-		{
-		    size_t		cnt;
-		    unsigned char	ch = c;
-
-		    rc = JBG_EAGAIN;
-		    rc = jbg_dec_in(&s[pn], &ch, 1, &cnt);
-		    if (rc == JBG_EOK)
-		    {
-			int	h, w, len;
-			unsigned char *image;
-
-			// debug(0, "JBG_EOK: %d\n", pn);
-			h = jbg_dec_getheight(&s[pn]);
-			w = jbg_dec_getwidth(&s[pn]);
-			image = jbg_dec_getimage(&s[pn], 0);
-			len = jbg_dec_getsize(&s[pn]);
-			if (image)
-			{
-			    char	buf[512];
-			    sprintf(buf, "%s-%02d-%d.pbm",
-				    DecFile, pageNum, planeNum);
-			    dfp = fopen(buf,
-					imageCnt[planeNum] ? "a" : "w");
-			    if (dfp)
-			    {
-				if (imageCnt[planeNum] == 0)
-				    fprintf(dfp, "P4\n%8d %8d\n", w, h);
-				imageCnt[planeNum] += incrY;
-				rc = fwrite(image, 1, len, dfp);
-				fclose(dfp);
-			    }
-			}
-			else
-			    debug(0, "Missing image %dx%d!\n", h, w);
-			jbg_dec_free(&s[pn]);
-		    }
-		}
-	    }
+	    data = p;
+	    len = rec.len;
+	    if (bie[pn] && len && biedec_data(bie[pn], data, len) < 0)
+		error(1, "Can't allocate BIE data\n");
 	    curOff += hdr.items;
 	    totSize += hdr.items;
 	}
@@ -332,7 +311,7 @@ decode(FILE *fp)
 		int		j;
 
 		proff(curOff);
-		rc = fread(&item, len = sizeof(item), 1, fp);
+		rc = recscan_get(&p, end, &item, len = sizeof(item));
 		if (rc != 1) break;
 		curOff += len;
 
@@ -359,7 +338,7 @@ decode(FILE *fp)
 		}
 		if (item.size == 4)
 		{
-		    rc = fread(&val, len = sizeof(val), 1, fp);
+		    rc = recscan_get(&p, end, &val, len = sizeof(val));
 		    if (rc != 1) break;
 		    val = be32(val);
 		    if (codestr)
@@ -371,16 +350,20 @@ decode(FILE *fp)
 		}
 		else if (item.size == 20)
 		{
-		    rc = fread(bih, bihlen = sizeof(bih), 1, fp);
+		    rc = recscan_get(&p, end, bih, bihlen = sizeof(bih));
 		    if (rc != 1) break;
 		    printf("	%s(0x%lx)\n", codestr, (long) item.type);
 		    print_bih(bih);
 		    if (DecFile)
 		    {
-			size_t	cnt;
-
-			jbg_dec_init(&s[pn]);
-			rc = jbg_dec_in(&s[pn], bih, bihlen, &cnt);
+			char	buf[512];
+
+			sprintf(buf, "%s-%02d-%d.pbm",
+				DecFile, pageNum, planeNum);
+			bie[pn] = biedec_start(BieDec, buf, BIEDEC_PBM, incrY,
+					bih, bihlen, &rc);
+			if (!bie[pn])
+			    error(1, "Can't allocate BIE\n");
 			if (rc == JBG_EIMPL)
 			    error(1, "JBIG uses unimplemented feature\n");
 		    }
@@ -392,7 +375,7 @@ decode(FILE *fp)
 
 		    for (j = 0; j < item.size; ++j)
 		    {
-			c = fgetc(fp);
+			c = (p < end) ? *p++ : EOF;
 			printf(" %02x" , c);
 		    }
 		}
@@ -401,6 +384,7 @@ decode(FILE *fp)
 	    }
 	}
     }
+    biedec_sync(BieDec, 1);
     printf("Total size: %d bytes\n", totSize);
 }
 
@@ -410,13 +394,19 @@ main(int argc, char *argv[])
 	extern int	optind;
 	extern char	*optarg;
 	int		c;
+	FILE		*fp;
+	RECSCAN		*r;
 
-	while ( (c = getopt(argc, argv, "d:hoD:?h")) != EOF)
+	while ( (c = getopt(argc, argv, "d:hoj:D:?h")) != EOF)
 		switch (c)
 		{
 		case 'd': DecFile = optarg; break;
 		case 'o': PrintOffset = 1; break;
 		case 'h': PrintHexOffset = 1; break;
+		case 'j': Threads = atoi(optarg);
+			  if (Threads < 1)
+			      error(1, "Illegal value '%s' for -j\n", optarg);
+			  break;
 		case 'D': Debug = atoi(optarg); break;
 		default: usage(); exit(1);
 		}
@@ -425,31 +415,35 @@ main(int argc, char *argv[])
 	argv += optind;
 
 	if (argc > 0)
-        {
-            FILE        *fp;
-
+	{
 	    fp = fopen(argv[0], "r");
 	    if (!fp)
 		error(1, "file '%s' doesn't exist\n", argv[0]);
-	    for (;;)
-	    {
-		decode(fp);
-		c = getc(fp); ungetc(c, fp);
-                if (feof(fp))
-                    break;
-	    }
-	    fclose(fp);
-        }
-        else
+	}
+	else
+	    fp = stdin;
+
+	if (Threads == 0)
+	    Threads = sysconf(_SC_NPROCESSORS_ONLN);
+	Pool = workpool_create(Threads);
+	BieDec = biedec_create(Pool, Threads);
+	if (!BieDec)
+	    error(1, "Can't allocate BIE queue\n");
+
+	r = recscan_open(fp);
+	if (!r)
+	    error(1, "Can't allocate input buffer\n");
+	for (;;)
 	{
-	    for(;;)
-	    {
-		decode(stdin);
-		c = getc(stdin); ungetc(c, stdin);
-		if (feof(stdin))
-		    break;
-	    }
+	    decode(r);
+	    if (recscan_eof(r))
+		break;
 	}
+	recscan_close(r);
+	biedec_destroy(BieDec);
+	workpool_destroy(Pool);
+	if (fp != stdin)
+	    fclose(fp);
 	printf("\n");
 
 	exit(0);
@@ -31,6 +31,9 @@ b*/
 
 #include "zjs.h"
 #include "jbig.h"
+#include "recscan.h"
+#include "workpool.h"
+#include "biedec.h"
 
 /*
  * Global option flags
@@ -41,6 +44,9 @@ char	*DecFile;
 int	PrintOffset = 0;
 int	PrintHexOffset = 0;
 int	DoPad = 1;
+int	Threads = 0;
+WORKPOOL	*Pool;
+BIEDEC	*BieDec;
 
 void
 debug(int level, char *fmt, ...)
@@ -67,7 +73,12 @@ error(int fatal, char *fmt, ...)
 	vfprintf(stderr, fmt, ap);
 	va_end(ap);
 	if (fatal > 0)
+	{
+	    // Write out the planes found so far, as they are queued
+	    if (BieDec)
+		biedec_sync(BieDec, 1);
 	    exit(fatal);
+	}
 	else
 	{
 	    errno = 0;
@@ -97,6 +108,7 @@ usage(void)
 "       -h          Print hex file offsets\n"
 "       -o          Print file offsets\n"
 "       -p          Don't do 4 byte padding\n"
+"       -j threads  Decode planes using this many threads [all CPUs]\n"
 "       -D lvl      Set Debug level [%d]\n"
     , Debug
     );
@@ -140,6 +152,58 @@ print_bih(unsigned char bih[20])
 	bih[1] - bih[0], bih[2]);
 }
 
+/*
+ * Print the first 16 and last 20 bytes of totlen bytes of record data.
+ */
+void
+print_data(const unsigned char *data, int len, int totlen)
+{
+    int	i, size;
+
+    for (i = 0; i < len; ++i)
+    {
+	size = totlen - i - 1;
+	if (i < 16)
+	{
+	    if (i == 0)
+		printf("\t");
+	    printf(" %02x", data[i]);
+	    if (i == 15)
+		printf("\n\t...");
+	}
+	else if (size < 20)
+	{
+	    printf(" %02x", data[i]);
+	    if (size == 0)
+		printf("\n");
+	}
+    }
+}
+
+/*
+ * Queue a BIE to be decoded into the file for a plane of a page
+ */
+BIEDEC_BIE *
+start_bie(int pageNum, int planeNum, int bpp, int incrY,
+		const unsigned char *bih, int bihlen)
+{
+    BIEDEC_BIE	*b;
+    char	buf[512];
+    int		rc;
+
+    if (bpp == 1)
+	sprintf(buf, "%s-%02d-%d.pbm", DecFile, pageNum, planeNum);
+    else
+	sprintf(buf, "%s-%02d-%d.pgm", DecFile, pageNum, planeNum);
+    b = biedec_start(BieDec, buf, (bpp == 1) ? BIEDEC_PBM : BIEDEC_PGM,
+		incrY, bih, bihlen, &rc);
+    if (!b)
+	error(1, "Can't allocate BIE\n");
+    if (rc == JBG_EIMPL)
+	error(1, "JBIG uses unimplemented feature\n");
+    return b;
+}
+
 void
 proff(int curOff)
 {
@@ -150,26 +214,27 @@ proff(int curOff)
 }
 
 void
-decode(FILE *fp)
+decode(RECSCAN *r)
 {
     DWORD	magic;
     ZJ_HEADER	hdr;
+    RECSCAN_REC	rec;
+    const unsigned char	*p, *end;
     int		c;
     int		rc;
     int		size;
     int		items;
     char	*codestr;
-    FILE	*dfp = NULL;
     FILE	*rfp = NULL;
     int		planeNum = 1;
     int		pageNum = 0;
     int		padding;
     int		len;
     int		curOff = 0;
-    struct jbg_dec_state	s[5];
+    BIEDEC_BIE		*bie[5] = {0,0,0,0,0};
     unsigned char	bih[20];
     int			bihlen = 0;
-    int			imageCnt[5] = {0,0,0,0,0};
+    const unsigned char	*data;
     int         	pn = 0;
     int         	incrY = 0;
     int         	bpp = 1;
@@ -260,19 +325,24 @@ decode(FILE *fp)
     /*
      * Zenographics ZX format
      */
-    c = getc(fp);
+    c = recscan_getc(r);
     if (c == EOF)
     {
 	printf("EOF on file reading header.\n");
 	return;
     }
-    ungetc(c, fp);
+    recscan_ungetc(r, c);
     if (c == '\033')
     {
 	char	buf[1024];
 
-	while (fgets(buf, sizeof(buf), fp))
+	for (;;)
 	{
+	    if (!recscan_gets(r, buf, sizeof(buf)))
+	    {
+		printf("\n");
+		return;
+	    }
 	    if (PrintOffset)
 		printf("%d:	", curOff);
 	    else if (PrintHexOffset)
@@ -290,8 +360,7 @@ decode(FILE *fp)
 	    if (0) {}
             else if (strncmp(buf, "@PJL USTATUS TIMED = ", 21) == 0)
             {
-                rc = fread(buf, 52, 1, fp);
-                if (rc != 1) return;
+                if (recscan_read(r, buf, 52) != 52) return;
                 debug(2, "buf=%s\n", buf);
                 proff(curOff);
                 buf[51] = 0;
@@ -304,8 +373,7 @@ decode(FILE *fp)
             }
             else if (strncmp(buf, "@PJL SET JOBATTR=", 17) == 0)
             {
-                rc = fread(buf, 9, 1, fp);
-                if (rc != 1) return;
+                if (recscan_read(r, buf, 9) != 9) return;
                 buf[9] = 0;
                 curOff += 9;
                 proff(curOff);
@@ -314,18 +382,13 @@ decode(FILE *fp)
                 break;
             }
 	}
-	if (feof(fp))
-	{
-	    printf("\n");
-	    return;
-	}
     }
 
     /*
      * Zenographics ZJS_MAGIC format
      */
-    rc = fread(&magic, len = sizeof(magic), 1, fp);
-    if (rc != 1)
+    len = sizeof(magic);
+    if (recscan_read(r, &magic, len) != len)
     {
 	printf("Missing ZJS Magic number\n");
 	return;
@@ -351,9 +414,12 @@ decode(FILE *fp)
 	else if (PrintHexOffset)
 	    printf("%6x:	", curOff);
 
-	rc = fread(&hdr, len = sizeof(hdr), 1, fp);
-	if (rc != 1) break;
+	rc = recscan_zjs(r, &rec, DoPad);
+	if (rc == 0 || rec.headlen < sizeof(hdr)) break;
+	memcpy(&hdr, rec.head, len = sizeof(hdr));
 	curOff += len;
+	p = rec.data;
+	end = rec.data + rec.len;
 
 	hdr.type = be32(hdr.type);
 	hdr.size = be32(hdr.size);
@@ -367,7 +433,8 @@ decode(FILE *fp)
 	    CODESTR(ZJT_START_DOC)	break;
 	    CODESTR(ZJT_END_DOC)	break;
 	    CODESTR(ZJT_START_PAGE)	++pageNum;
-					memset(imageCnt, 0, sizeof(imageCnt));
+					memset(bie, 0, sizeof(bie));
+					biedec_sync(BieDec, 0);
 					totSize = 0;
 					break;
 	    CODESTR(ZJT_END_PAGE)	planeNum = 1;
@@ -428,7 +495,7 @@ decode(FILE *fp)
 	    printf("%s0:\t", (PrintOffset||PrintHexOffset) ? "\t\t" : "\t");
 	    for (i = 0; size--; ++i)
 	    {
-		c = fgetc(fp);
+		c = (p < end) ? *p++ : EOF;
 		++curOff;
 		if (i < 16)
 		    printf("%02x ", c);
@@ -448,7 +515,7 @@ decode(FILE *fp)
 	{
 	    ZJ_ITEM_HEADER	ihdr;
 	    int			isize;
-	    DWORD		val;
+	    DWORD		val = 0;
 	    char		buf[512];
 	    int			c;
 
@@ -459,7 +526,7 @@ decode(FILE *fp)
 
 	    size -= sizeof(ihdr);
 
-	    rc = fread(&ihdr, len = sizeof(ihdr), 1, fp);
+	    rc = recscan_get(&p, end, &ihdr, len = sizeof(ihdr));
 	    if (rc != 1) break;
 	    curOff += len;
 
@@ -529,7 +596,7 @@ decode(FILE *fp)
 	    {
 	    case ZJIT_UINT32:
 	    case ZJIT_INT32:
-		rc = fread(&val, len = sizeof(val), 1, fp);
+		rc = recscan_get(&p, end, &val, len = sizeof(val));
 		curOff += len;
 		val = be32(val);
 		isize -= 4;
@@ -572,8 +639,8 @@ decode(FILE *fp)
 	    case ZJIT_STRING:
 		for (i = 0; i < sizeof(buf) - 1; )
 		{
-		    c = fgetc(fp);
-		    if (c == EOF) break;
+		    if (p == end) break;
+		    c = *p++;
 		    ++curOff;
 		    buf[i++] = c;
 		    --isize;
@@ -587,7 +654,7 @@ decode(FILE *fp)
 		break;
 	    default:
 	    case ZJIT_BYTELUT:
-		rc = fread(&val, len = sizeof(val), 1, fp);
+		rc = recscan_get(&p, end, &val, len = sizeof(val));
 		curOff += len;
 		val = be32(val);
 		isize -= 4;
@@ -597,7 +664,8 @@ decode(FILE *fp)
 		    printf("	ZJI_0x%x, BYTELUT (len=%d)", ihdr.item, val);
 		if (ihdr.item == ZJI_JBIG_BIH && val == 20)
 		{
-		    bihlen = fread(bih, 1, len = sizeof(bih), fp);
+		    bihlen = recscan_skip(&p, end, len = sizeof(bih));
+		    memcpy(bih, p - bihlen, bihlen);
 		    if (bihlen <= 0)
 			isize = 0;
 		    else
@@ -619,10 +687,10 @@ decode(FILE *fp)
 	    printf("\n");
 	    fflush(stdout);
 
-	    while (isize-- > 0)
+	    if (isize > 0)
 	    {
-		fgetc(fp);
-		++curOff;
+		recscan_skip(&p, end, isize);
+		curOff += isize;
 	    }
 
 	    if (size <= 0 && items)
@@ -646,7 +714,8 @@ decode(FILE *fp)
 
 	    if (hdr.type == ZJT_JBIG_BIH)
 	    {
-		bihlen = fread(bih, 1, len = sizeof(bih), fp);
+		bihlen = recscan_skip(&p, end, len = sizeof(bih));
+		memcpy(bih, p - bihlen, bihlen);
 		if (bihlen <= 0)
 		    size = 0;
 		else
@@ -661,10 +730,9 @@ decode(FILE *fp)
 	    if (hdr.type == ZJT_2600N && hdr.items < 6)
 	    {
 		pn = planeNum;
-		jbg_dec_init(&s[pn]);
-		rc = jbg_dec_in(&s[pn], bih, 20, NULL);
-		if (rc == JBG_EIMPL)
-		    error(1, "JBIG uses unimplemented feature\n");
+		if (DecFile)
+		    bie[pn] = start_bie(pageNum, planeNum-1, bpp, incrY,
+					bih, 20);
 	    }
 
 	    if ( (RawFile || DecFile) &&
@@ -684,135 +752,26 @@ decode(FILE *fp)
 		    if (rfp)
 			rc = fwrite(bih, bihlen, 1, rfp);
 		    if (DecFile)
-		    {
-			size_t	cnt;
-
-			jbg_dec_init(&s[pn]);
-			rc = jbg_dec_in(&s[pn], bih, bihlen, &cnt);
-			if (rc == JBG_EIMPL)
-			    error(1, "JBIG uses unimplemented feature\n");
-		    }
-		}
-		while (size--)
-		{
-		    int	c;
-		    c = fgetc(fp);
-		    ++curOff;
-		    if ((totlen-size) <= 16)
-		    {
-			if ((totlen-size) == 1)
-			    printf("\t");
-			printf(" %02x", c);
-			if ((totlen-size) == 16)
-			    printf("\n\t...");
-		    }
-		    else if (size < 20)
-		    {
-			printf(" %02x", c);
-			if (size == 0)
-			    printf("\n");
-		    }
-		    if (rfp)
-			fputc(c, rfp);
-		    if (DecFile)
-		    {
-			size_t		cnt;
-			unsigned char	ch = c;
-
-			rc = JBG_EAGAIN;
-			rc = jbg_dec_in(&s[pn], &ch, 1, &cnt);
-			if (rc == JBG_EOK)
-			{
-			    int	h, w, len;
-			    unsigned char *image;
-			    int i, gray4;
-			    char gray[4];
-
-			    // debug(0, "JBG_EOK: %d\n", pn);
-			    h = jbg_dec_getheight(&s[pn]);
-			    w = jbg_dec_getwidth(&s[pn]);
-			    image = jbg_dec_getimage(&s[pn], 0);
-			    len = jbg_dec_getsize(&s[pn]);
-			    if (image)
-			    {
-				char	buf[512];
-				if (bpp == 1)
-				    sprintf(buf, "%s-%02d-%d.pbm",
-					DecFile, pageNum, planeNum-1);
-				else
-				    sprintf(buf, "%s-%02d-%d.pgm",
-					DecFile, pageNum, planeNum-1);
-				dfp = fopen(buf,
-					    imageCnt[planeNum-1] ? "a" : "w");
-				if (dfp)
-				{
-				    if (bpp == 1)
-				    {
-					if (imageCnt[planeNum-1] == 0)
-					    fprintf(dfp, "P4\n%8d %8d\n", w, h);
-					rc = fwrite(image, 1, len, dfp);
-				    }
-				    else
-				    {
-					if (imageCnt[planeNum-1] == 0)
-					    fprintf(dfp, "P5\n%8d %8d 3\n",
-						w/2, h);
-					for (i = 0; i < len; ++i)
-					{
-					    gray4 = image[i];
-					    gray[0] = ~(gray4 >> 6) & 3;
-					    gray[1] = ~(gray4 >> 4) & 3;
-					    gray[2] = ~(gray4 >> 2) & 3;
-					    gray[3] = ~(gray4 >> 0) & 3;
-					    rc = fwrite(gray, 4, 1, dfp);
-					}
-				    }
-				    imageCnt[planeNum-1] += incrY;
-				    fclose(dfp);
-				}
-			    }
-			    else
-				debug(0, "Missing image %dx%d!\n", h, w);
-			    jbg_dec_free(&s[pn]);
-			}
-		    }
-		}
-		if (hdr.type == ZJT_2600N && hdr.items == 3)
-		{
-		    char	buf[512];
-		    if (bpp == 1)
-			sprintf(buf, "%s-%02d-%d.pbm",
-			    DecFile, pageNum, planeNum-1);
-		    else
-			sprintf(buf, "%s-%02d-%d.pgm",
-			    DecFile, pageNum, planeNum-1);
-		    dfp = fopen(buf, "r+");
-		    fseek(dfp, 12, 0);
-		    fprintf(dfp, "%8d", imageCnt[planeNum-1]);
-		    fclose(dfp);
+			bie[pn] = start_bie(pageNum, planeNum-1, bpp, incrY,
+					    bih, bihlen);
 		}
+		data = p;
+		len = recscan_skip(&p, end, size);
+		curOff += len;
+		print_data(data, len, totlen);
+		if (rfp && len)
+		    fwrite(data, 1, len, rfp);
+		if (bie[pn] && len && biedec_data(bie[pn], data, len) < 0)
+		    error(1, "Can't allocate BIE data\n");
+		if (bie[pn] && hdr.type == ZJT_2600N && hdr.items == 3)
+		    biedec_setheight(bie[pn]);
 	    }
 	    else
 	    {
-		while (size--)
-		{
-		    c = fgetc(fp);
-		    ++curOff;
-		    if ((totlen-size) <= 16)
-		    {
-			if ((totlen-size) == 1)
-			    printf("\t");
-			printf(" %02x", c);
-			if ((totlen-size) == 16)
-			    printf("\n\t...");
-		    }
-		    else if (size < 20)
-		    {
-			printf(" %02x", c);
-			if (size == 0)
-			    printf("\n");
-		    }
-		}
+		data = p;
+		len = recscan_skip(&p, end, size);
+		curOff += len;
+		print_data(data, len, totlen);
 		if (rfp)
 		{
 		    fclose(rfp);
@@ -821,17 +780,14 @@ decode(FILE *fp)
 	    }
 	}
 
-	while (padding--)
-	{
-	    fgetc(fp);
-	    ++curOff;
-	}
+	curOff += padding;
 
 	if (hdr.type == ZJT_END_DOC)
 	    break;
     }
     if (rfp)
 	fclose(rfp);
+    biedec_sync(BieDec, 1);
     printf("Total size: %d bytes\n", totSize);
 }
 
@@ -841,8 +797,10 @@ main(int argc, char *argv[])
 	extern int	optind;
 	extern char	*optarg;
 	int		c;
+	FILE		*fp;
+	RECSCAN		*r;
 
-	while ( (c = getopt(argc, argv, "d:hopr:D:?h")) != EOF)
+	while ( (c = getopt(argc, argv, "d:hoj:pr:D:?h")) != EOF)
 		switch (c)
 		{
 		case 'd': DecFile = optarg; break;
@@ -850,6 +808,10 @@ main(int argc, char *argv[])
 		case 'h': PrintHexOffset = 1; break;
 		case 'o': PrintOffset = 1; break;
 		case 'p': DoPad = 0; break;
+		case 'j': Threads = atoi(optarg);
+			  if (Threads < 1)
+			      error(1, "Illegal value '%s' for -j\n", optarg);
+			  break;
 		case 'D': Debug = atoi(optarg); break;
 		default: usage(); exit(1);
 		}
@@ -857,32 +819,36 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-        if (argc > 0)
-        {
-            FILE        *fp;
-
-            fp = fopen(argv[0], "r");
-            if (!fp)
-                error(1, "file '%s' doesn't exist\n", argv[0]);
-            for (;;)
-            {
-                decode(fp);
-                c = getc(fp); ungetc(c, fp);
-                if (feof(fp))
-                    break;
-            }
-            fclose(fp);
-        }
-        else
-        {
-	    for(;;)
-	    {
-		decode(stdin);
-		c = getc(stdin); ungetc(c, stdin);
-		if (feof(stdin))
-		    break;
-	    }
+	if (argc > 0)
+	{
+	    fp = fopen(argv[0], "r");
+	    if (!fp)
+		error(1, "file '%s' doesn't exist\n", argv[0]);
+	}
+	else
+	    fp = stdin;
+
+	if (Threads == 0)
+	    Threads = sysconf(_SC_NPROCESSORS_ONLN);
+	Pool = workpool_create(Threads);
+	BieDec = biedec_create(Pool, Threads);
+	if (!BieDec)
+	    error(1, "Can't allocate BIE queue\n");
+
+	r = recscan_open(fp);
+	if (!r)
+	    error(1, "Can't allocate input buffer\n");
+	for (;;)
+	{
+	    decode(r);
+	    if (recscan_eof(r))
+		break;
 	}
+	recscan_close(r);
+	biedec_destroy(BieDec);
+	workpool_destroy(Pool);
+	if (fp != stdin)
+	    fclose(fp);
 
 	exit(0);
 }